@@ -6,8 +6,27 @@
 #include "appdriver.hpp"
 #include <string.h>
 #include "image.hpp"
+#include "jpeg.hpp"
+#include "batch.hpp"
+#include "scan.hpp"
+#include "index.hpp"
+#include "cache.hpp"
+#include "phash.hpp"
+#include "dupes.hpp"
+#include "stats.hpp"
+#include "dither.hpp"
+#include "composite.hpp"
+#include "trace.hpp"
+#include "counters.hpp"
+#include "memory.hpp"
+#include "arena.hpp"
+#include "codecs.hpp"
+#include "stream.hpp"
 #include <bflibcpp/bflibcpp.hpp>
 #include <libgen.h>
+#include <atomic>
+#include <sys/stat.h>
+#include <errno.h>
 
 using namespace BF;
 
@@ -17,6 +36,15 @@ AppDriver * APP_DRIVER = 0;
 // Main commands
 const char * const DETAILS_COMMAND = "details";
 const char * const AS_COMMAND = "as";
+const char * const ROTATE_COMMAND = "rotate";
+const char * const FLIP_COMMAND = "flip";
+const char * const CROP_COMMAND = "crop";
+const char * const OPTIMIZE_COMMAND = "optimize";
+const char * const AUTOORIENT_COMMAND = "autoorient";
+const char * const SCAN_COMMAND = "scan";
+const char * const HASH_COMMAND = "hash";
+const char * const DUPES_COMMAND = "dupes";
+const char * const STATS_COMMAND = "stats";
 
 // Conversion argument types
 const char * const PNG_TYPE_ARG = "png";
@@ -25,16 +53,79 @@ const char * const GIF_TYPE_ARG = "gif";
 
 // Sub commands
 const char * const OUTPUT_ARG = "-o";
+const char * const SIZE_ARG = "--size";
+const char * const PREVIEW_ARG = "--preview";
+const char * const JOBS_ARG = "-j";
+const char * const PROGRESSIVE_ARG = "--progressive";
+const char * const STRIP_ARG = "--strip";
+const char * const FORMAT_ARG = "--format";
+const char * const INDEX_ARG = "--index";
+const char * const CHECKSUM_ARG = "--checksum";
+const char * const CACHE_ARG = "--cache";
+const char * const CACHE_SIZE_ARG = "--cache-size";
+const char * const DISTANCE_ARG = "--distance";
+const char * const ALGORITHM_ARG = "--algorithm";
+const char * const HISTOGRAM_ARG = "--histogram";
+const char * const COLORS_ARG = "--colors";
+const char * const DITHER_ARG = "--dither";
+const char * const BACKGROUND_ARG = "--background";
+const char * const TRACE_ARG = "--trace";
+const char * const PERF_COUNTERS_ARG = "--perf-counters";
+const char * const MEMORY_LIMIT_ARG = "--memory-limit";
+const char * const VERBOSE_ARG = "--verbose";
+const char * const HUGE_PAGES_ARG = "--huge-pages";
+
+/// Bits two hashes can differ by and still be duplicates without --distance
+const int DUPES_DEFAULT_DISTANCE = 6;
 
 void AppDriver::help() {
 	printf("usage: %s <path> <commands>\n", basename((char *) this->_args->objectAtIndex(0)));
+	printf("\t<path> can be %s to read from standard input with %s and %s\n", STREAM_STDIO_PATH, AS_COMMAND, DETAILS_COMMAND);
 
 	printf("\n");
 
 	// Commands
 	printf("Commands:\n");
-	printf("\t%s: Prints details for input file\n", DETAILS_COMMAND);
-	printf("\t%s <type> [ %s <output> ]: Converts image to <type>\n", AS_COMMAND, OUTPUT_ARG);
+	printf("\t%s [ %s <dir> [ %s ] ] [ %s ]: Prints details for input file\n", DETAILS_COMMAND, INDEX_ARG, CHECKSUM_ARG, VERBOSE_ARG);
+	printf("\t\t%s <dir>: Keeps metadata in <dir> so unchanged files are not opened again\n", INDEX_ARG);
+	printf("\t\t%s: Also hashes files so ones that were touched but not changed stay indexed\n", CHECKSUM_ARG);
+	printf("\t\t%s: Also decodes the pixels and prints the memory that took\n", VERBOSE_ARG);
+	printf("\t%s <type> [ %s <output> ] [ %s <w>x<h> ]: Converts image to <type>\n", AS_COMMAND, OUTPUT_ARG, SIZE_ARG);
+	printf("\t\t%s: Directory to write to, or %s for standard output (the default for standard input)\n", OUTPUT_ARG, STREAM_STDIO_PATH);
+	printf("\t\t%s: Shrinks the output. Leave out <w> or <h> to keep the aspect ratio\n", SIZE_ARG);
+	printf("\t\t%s <n>: Only decodes the first <n> progressive scans or interlace passes\n", PREVIEW_ARG);
+	printf("\t\t%s <dir> [ %s <n>[K|M|G] ]: Reuses earlier conversions of the same bytes from <dir>\n", CACHE_ARG, CACHE_SIZE_ARG);
+	printf("\t\t%s <n> [ %s <fs|ordered|none> ] [ %s <n> ]: Writes a PNG with at most <n> (2-%d) colors\n",
+		COLORS_ARG, DITHER_ARG, JOBS_ARG, DITHER_MAX_COLORS);
+	printf("\t\t%s: Floyd-Steinberg (default), a Bayer pattern or nearest color only\n", DITHER_ARG);
+	printf("\t\t%s <#rrggbb|checker>: What transparent pixels are flattened onto when <type> has no alpha (default #ffffff)\n", BACKGROUND_ARG);
+	printf("\t%s <90|180|270> [ %s <output> ]: Losslessly rotates a JPEG clockwise\n", ROTATE_COMMAND, OUTPUT_ARG);
+	printf("\t%s <h|v> [ %s <output> ]: Losslessly flips a JPEG\n", FLIP_COMMAND, OUTPUT_ARG);
+	printf("\t%s <w>x<h>+<x>+<y> [ %s <output> ]: Losslessly crops a JPEG on MCU boundaries\n", CROP_COMMAND, OUTPUT_ARG);
+	printf("\t%s [ %s <output> ]: Losslessly rotates a JPEG upright using its EXIF orientation\n", AUTOORIENT_COMMAND, OUTPUT_ARG);
+	printf("\t%s [ %s ] [ %s ] [ %s <n> ] [ %s <output> ]: Losslessly shrinks JPEGs. <path> can be a directory\n",
+		OPTIMIZE_COMMAND, PROGRESSIVE_ARG, STRIP_ARG, JOBS_ARG, OUTPUT_ARG);
+	printf("\t%s [ %s <jsonl|csv> ] [ %s <n> ] [ %s <dir> [ %s ] ]: Prints one metadata record per image under <path>\n",
+		SCAN_COMMAND, FORMAT_ARG, JOBS_ARG, INDEX_ARG, CHECKSUM_ARG);
+	printf("\t%s [ %s <n> ]: Prints the ahash, dhash and phash of each image under <path>\n", HASH_COMMAND, JOBS_ARG);
+	printf("\t%s [ %s <k> ] [ %s <ahash|dhash|phash> ] [ %s <n> ]: Lists groups of near duplicate images under <path>\n",
+		DUPES_COMMAND, DISTANCE_ARG, ALGORITHM_ARG, JOBS_ARG);
+	printf("\t\t%s <k>: Most bits two hashes can differ by (default %d, at most %d)\n", DISTANCE_ARG, DUPES_DEFAULT_DISTANCE, DUPES_MAX_DISTANCE);
+	printf("\t%s [ %s ] [ %s <text|jsonl> ] [ %s <n> ]: Prints per channel pixel statistics of each image under <path>\n",
+		STATS_COMMAND, HISTOGRAM_ARG, FORMAT_ARG, JOBS_ARG);
+	printf("\t\t%s: Also prints the 256 bin histogram of each channel\n", HISTOGRAM_ARG);
+
+	printf("\n");
+
+	// Options
+	printf("Options:\n");
+	printf("\t%s <file>: Writes how long each stage took as Chrome trace event JSON (also %s=<file>)\n",
+		TRACE_ARG, TRACE_ENVIRONMENT_VARIABLE);
+	printf("\t%s: Prints user space cycles, instructions, cache and branch misses and page faults of each conversion stage to stderr\n",
+		PERF_COUNTERS_ARG);
+	printf("\t%s <n>[K|M|G]: Fails images whose decoders and encoders need more than <n> bytes\n", MEMORY_LIMIT_ARG);
+	printf("\t%s: Prints how many allocations were made and the largest peak of any image to stderr\n", VERBOSE_ARG);
+	printf("\t%s: Backs buffers of %luM and up with transparent huge pages\n", HUGE_PAGES_ARG, ARENA_HUGE_PAGE_DEFAULT_THRESHOLD >> 20);
 
 	printf("\n");
 }
@@ -63,6 +154,36 @@ const Array<const char *> * AppDriver::args() {
 	return this->_args;
 }
 
+/**
+ * Totals of every image this run, for --verbose
+ */
+static void PrintMemorySummary() {
+	MemorySummary summary;
+	ArenaStatistics arena;
+	CodecsStatistics codecs;
+
+	MemorySummaryGet(&summary);
+	ArenaStatisticsGet(&arena);
+	CodecsStatisticsGet(&codecs);
+
+	fprintf(stderr, "Memory: %lu allocations over %lu images", summary.allocations, summary.images);
+	if (summary.images) {
+		fprintf(stderr, ", largest peak %lu bytes (%s)", summary.peak, summary.path);
+	}
+	if (summary.refusals) {
+		fprintf(stderr, ", %lu refused over the limit", summary.refusals);
+	}
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "Arena: %lu of %lu buffers reused", arena.reused, arena.allocations);
+	if (arena.hugePages) {
+		fprintf(stderr, ", %lu on huge pages", arena.hugePages);
+	}
+	fprintf(stderr, "\n");
+
+	fprintf(stderr, "Codecs: %lu of %lu jpeg contexts reused\n", codecs.reused, codecs.acquired);
+}
+
 int AppDriver::run() {
 	int result = 0;
 	Image * img = 0;
@@ -70,16 +191,44 @@ int AppDriver::run() {
 	if (this->_args->count() == 1) {
 		this->help();
 		result = 1;
+	} else if (result = this->startProfiling()) {
+		return result;
+
+	// The rest need a path they can open more than once
+	} else if (StreamIsStdio(this->_args->objectAtIndex(1))
+		&& !this->_args->contains((char *) AS_COMMAND)
+		&& !this->_args->contains((char *) DETAILS_COMMAND)) {
+		BFErrorPrint("Standard input only works with %s and %s", AS_COMMAND, DETAILS_COMMAND);
+		result = 1;
+
+	// Batch commands take a file or a directory and create their own images
+	} else if (this->_args->contains((char *) OPTIMIZE_COMMAND)) {
+		result = this->handleOptimizeCommand(this->_args->objectAtIndex(1));
+	} else if (this->_args->contains((char *) SCAN_COMMAND)) {
+		result = this->handleScanCommand(this->_args->objectAtIndex(1));
+	} else if (this->_args->contains((char *) HASH_COMMAND)) {
+		result = this->handleHashCommand(this->_args->objectAtIndex(1));
+	} else if (this->_args->contains((char *) DUPES_COMMAND)) {
+		result = this->handleDupesCommand(this->_args->objectAtIndex(1));
+	} else if (this->_args->contains((char *) STATS_COMMAND)) {
+		result = this->handleStatsCommand(this->_args->objectAtIndex(1));
 	} else {
 		const char * path = this->_args->objectAtIndex(1);
 		img = Image::createImage(path, &result);
 	}
 
-	if (result == 0) {
+	// Batch commands are done by now
+	if ((result == 0) && img) {
 		if (this->_args->contains((char *) AS_COMMAND)) {
 			result = this->handleAsCommand(img);
 		} else if (this->_args->contains((char *) DETAILS_COMMAND)) {
 			result = this->handleDetailsCommand(img);
+		} else if (this->_args->contains((char *) ROTATE_COMMAND)
+				|| this->_args->contains((char *) FLIP_COMMAND)
+				|| this->_args->contains((char *) CROP_COMMAND)) {
+			result = this->handleTransformCommand(img);
+		} else if (this->_args->contains((char *) AUTOORIENT_COMMAND)) {
+			result = this->handleAutoOrientCommand(img);
 		} else {
 			BFErrorPrint("No known commands");
 			result = 1;
@@ -88,9 +237,56 @@ int AppDriver::run() {
 
 	if (img) delete img;
 
+	if (this->_args->contains((char *) VERBOSE_ARG)) {
+		PrintMemorySummary();
+	}
+
 	return result;
 }
 
+int AppDriver::startProfiling() {
+	const char * path = getenv(TRACE_ENVIRONMENT_VARIABLE);
+
+	if (this->_args->contains((char *) TRACE_ARG)) {
+		int index = this->_args->indexForObject((char *) TRACE_ARG);
+
+		if ((path = this->_args->objectAtIndex(index + 1)) == NULL) {
+			BFErrorPrint("%s needs a file", TRACE_ARG);
+			return 1;
+		}
+	}
+
+	if (path && path[0]) {
+		if (TraceStart(path)) {
+			return 1;
+		}
+
+		TraceNameThread("main");
+	}
+
+	if (this->_args->contains((char *) PERF_COUNTERS_ARG) && CountersStart()) {
+		return 1;
+	}
+
+	if (this->_args->contains((char *) MEMORY_LIMIT_ARG)) {
+		int index = this->_args->indexForObject((char *) MEMORY_LIMIT_ARG);
+		size_t limit = 0;
+
+		if (MemoryParseSize(this->_args->objectAtIndex(index + 1), &limit) || (limit == 0)) {
+			BFErrorPrint("%s should be followed by a size like 512M", MEMORY_LIMIT_ARG);
+			return 1;
+		}
+
+		MemorySetDefaultLimit(limit);
+	}
+
+	if (this->_args->contains((char *) HUGE_PAGES_ARG)) {
+		ArenaSetHugePageThreshold(ARENA_HUGE_PAGE_DEFAULT_THRESHOLD);
+	}
+
+	return 0;
+}
+
 AppDriver * AppDriver::shared() {
 	return APP_DRIVER;
 }
@@ -101,6 +297,7 @@ int AppDriver::handleAsCommand(Image * img) {
 	int index = this->_args->indexForObject((char *) AS_COMMAND);
 	ImageType type  = kImageTypeUnknown;
 	const char * outputPath = NULL;
+	ConversionCache * cache = NULL;
 
 	if ((arg = this->_args->objectAtIndex(index+1)) == NULL) {
 		BFErrorPrint("Could not get arg at index %d", index+1);
@@ -132,29 +329,879 @@ int AppDriver::handleAsCommand(Image * img) {
 	}	
 
 	if (result == 0) {
-		if (result = img->load()) {
-			BFErrorPrint("loading: %d", result);
-		} else if (result = img->convertToType(type, outputPath)) {
-			BFErrorPrint("converting to type %d: %d", type, result);
-		} else if (result = img->unload()) {
-			BFErrorPrint("unloading: %d", result);
+		if (this->_args->contains((char *) SIZE_ARG)) {
+			index = this->_args->indexForObject((char *) SIZE_ARG);
+			long w = 0, h = 0;
+
+			if ((arg = this->_args->objectAtIndex(index+1)) == NULL) {
+				BFErrorPrint("Could not get arg at index %d", index+1);
+				result = 5;
+			} else if ((sscanf(arg, "%ldx%ld", &w, &h) < 1) && (sscanf(arg, "x%ld", &h) != 1)) {
+				BFErrorPrint("Size should be <width>x<height>: '%s'", arg);
+				result = 5;
+			} else {
+				img->setTargetSize(w, h);
+			}
 		}
 	}
 
+	if (result == 0) {
+		if (this->_args->contains((char *) PREVIEW_ARG)) {
+			index = this->_args->indexForObject((char *) PREVIEW_ARG);
+			int level = 0;
+
+			if ((arg = this->_args->objectAtIndex(index+1)) == NULL) {
+				BFErrorPrint("Could not get arg at index %d", index+1);
+				result = 6;
+			} else if ((sscanf(arg, "%d", &level) != 1) || (level < 1)) {
+				BFErrorPrint("Preview level should be a positive number: '%s'", arg);
+				result = 6;
+			} else {
+				img->setPreviewLevel(level);
+			}
+		}
+	}
+
+	if (result == 0) {
+		if (this->_args->contains((char *) COLORS_ARG)) {
+			index = this->_args->indexForObject((char *) COLORS_ARG);
+			int colors = 0;
+			ImagineDither dither = kImagineDitherFloydSteinberg;
+
+			if ((arg = this->_args->objectAtIndex(index+1)) == NULL) {
+				BFErrorPrint("Could not get arg at index %d", index+1);
+				result = 7;
+			} else if ((sscanf(arg, "%d", &colors) != 1) || (colors < 2) || (colors > DITHER_MAX_COLORS)) {
+				BFErrorPrint("Colors should be between 2 and %d: '%s'", DITHER_MAX_COLORS, arg);
+				result = 7;
+			} else if (type != kImageTypePNG) {
+				BFErrorPrint("%s only works with %s", COLORS_ARG, PNG_TYPE_ARG);
+				result = 7;
+			}
+
+			if ((result == 0) && this->_args->contains((char *) DITHER_ARG)) {
+				index = this->_args->indexForObject((char *) DITHER_ARG);
+
+				if ((arg = this->_args->objectAtIndex(index+1)) == NULL) {
+					BFErrorPrint("Could not get arg at index %d", index+1);
+					result = 8;
+				} else if ((dither = DitherFromString(arg)) == kImagineDitherUnknown) {
+					BFErrorPrint("Unknown dither '%s'", arg);
+					result = 8;
+				}
+			}
+
+			if (result == 0) {
+				img->setPalette(colors, dither, this->jobCount());
+			}
+		}
+	}
+
+	if (result == 0) {
+		if (this->_args->contains((char *) BACKGROUND_ARG)) {
+			index = this->_args->indexForObject((char *) BACKGROUND_ARG);
+			ImagineBackground background;
+
+			if ((arg = this->_args->objectAtIndex(index+1)) == NULL) {
+				BFErrorPrint("Could not get arg at index %d", index+1);
+				result = 9;
+			} else if (CompositeParseBackground(arg, &background)) {
+				BFErrorPrint("Background should be #rrggbb or checker: '%s'", arg);
+				result = 9;
+			} else {
+				img->setBackground(&background);
+			}
+		}
+	}
+
+	if (result == 0) {
+		result = this->openCache(&cache);
+	}
+
+	if (result == 0) {
+		result = img->convert(type, outputPath, cache);
+	}
+
+	if (cache) delete cache;
+
 	return result;
 }
 
+static int DetailsDecodeRow(const ImagineRow * row, void * context) {
+	return 0;
+}
+
 int AppDriver::handleDetailsCommand(Image * img) {
 	int result = 0;
+	const char * path = this->_args->objectAtIndex(1);
+	MetadataIndex * index = NULL;
+	bool indexed = false;
+	struct stat st;
+	IndexEntry entry;
+	Dictionary<String, String> metadata;
 
-	if (result = img->load()) {
-		return result;
-	} else if (result = img->details()) {
-		return result;
-	} else if (result = img->unload()) {
-		return result;
+	if ((result = this->openIndex(&index)) == 0) {
+		indexed = index && !stat(path, &st);
+	}
+
+	// Probing and then decoding would read it twice
+	if ((result == 0) && StreamIsStdio(path) && this->_args->contains((char *) VERBOSE_ARG)) {
+		BFErrorPrint("%s needs a file, standard input can only be read once", VERBOSE_ARG);
+		result = 1;
+	}
+
+	if (result) {
+		// Already reported
+	} else if (indexed && index->lookup(path, &st, &entry)) {
+		result = IndexEntryCompileMetadata(&entry, &metadata);
+
+	// Only headers are needed so skip decoding entirely
+	} else if ((result = img->probe()) == 0) {
+		result = img->compileMetadata(&metadata);
+
+		if ((result == 0) && indexed) {
+			index->add(path, &st, img, &metadata);
+		}
+	}
+
+	if (result == 0) {
+		result = Image::printMetadata(&metadata);
+	}
+
+	// Metadata never needs the pixels, but what they take to decode
+	// is what --verbose is after
+	if ((result == 0) && this->_args->contains((char *) VERBOSE_ARG)) {
+		if ((result = img->load()) == 0) {
+			result = img->decodeRows(DetailsDecodeRow, NULL);
+			img->unload();
+		}
+
+		if (result == 0) {
+			printf("Memory peak : %lu bytes\n", img->memory()->peak);
+			printf("Memory allocations : %lu\n", img->memory()->allocations);
+			printf("Memory still allocated : %lu bytes\n", img->memory()->current);
+		}
+	}
+
+	if (index) delete index;
+
+	return result;
+}
+
+int AppDriver::handleTransformCommand(Image * img) {
+	int result = 0;
+	const char * arg = NULL;
+	int index = 0;
+	JPEGTransformType type = kJPEGTransformNone;
+	JPEGCrop crop = {0};
+	bool cropping = false;
+	const char * outputPath = NULL;
+
+	if (img->type() != kImageTypeJPEG) {
+		BFErrorPrint("Lossless transforms are only supported for JPEG images");
+		result = 1;
+	}
+
+	if ((result == 0) && this->_args->contains((char *) ROTATE_COMMAND)) {
+		index = this->_args->indexForObject((char *) ROTATE_COMMAND);
+
+		if ((arg = this->_args->objectAtIndex(index+1)) == NULL) {
+			BFErrorPrint("Could not get arg at index %d", index+1);
+			result = 2;
+		} else if (!strcmp(arg, "90")) {
+			type = kJPEGTransformRotate90;
+		} else if (!strcmp(arg, "180")) {
+			type = kJPEGTransformRotate180;
+		} else if (!strcmp(arg, "270")) {
+			type = kJPEGTransformRotate270;
+		} else {
+			BFErrorPrint("Can only rotate by 90, 180 or 270: '%s'", arg);
+			result = 2;
+		}
+	} else if ((result == 0) && this->_args->contains((char *) FLIP_COMMAND)) {
+		index = this->_args->indexForObject((char *) FLIP_COMMAND);
+
+		if ((arg = this->_args->objectAtIndex(index+1)) == NULL) {
+			BFErrorPrint("Could not get arg at index %d", index+1);
+			result = 3;
+		} else if (!strcmp(arg, "h")) {
+			type = kJPEGTransformFlipHorizontal;
+		} else if (!strcmp(arg, "v")) {
+			type = kJPEGTransformFlipVertical;
+		} else {
+			BFErrorPrint("Can only flip 'h' or 'v': '%s'", arg);
+			result = 3;
+		}
+	}
+
+	if ((result == 0) && this->_args->contains((char *) CROP_COMMAND)) {
+		index = this->_args->indexForObject((char *) CROP_COMMAND);
+
+		if ((arg = this->_args->objectAtIndex(index+1)) == NULL) {
+			BFErrorPrint("Could not get arg at index %d", index+1);
+			result = 4;
+		} else if (sscanf(arg, "%ldx%ld+%ld+%ld", &crop.width, &crop.height, &crop.x, &crop.y) != 4) {
+			BFErrorPrint("Crop should be <width>x<height>+<x>+<y>: '%s'", arg);
+			result = 4;
+		} else {
+			cropping = true;
+		}
+	}
+
+	if (result == 0) {
+		if (this->_args->contains((char *) OUTPUT_ARG)) {
+			index = this->_args->indexForObject((char *) OUTPUT_ARG);
+
+			if ((outputPath = this->_args->objectAtIndex(index+1)) == NULL) {
+				BFErrorPrint("Could not get arg at index %d", index+1);
+				result = 5;
+			}
+		}
+	}
+
+	if (result == 0) {
+		if (result = ((JPEG *) img)->transform(type, cropping ? &crop : NULL, outputPath)) {
+			BFErrorPrint("transforming: %d", result);
+		}
+	}
+
+	return result;
+}
+
+int AppDriver::handleAutoOrientCommand(Image * img) {
+	int result = 0;
+	int index = 0;
+	const char * outputPath = NULL;
+
+	if (img->type() != kImageTypeJPEG) {
+		BFErrorPrint("Lossless transforms are only supported for JPEG images");
+		result = 1;
+	}
+
+	if ((result == 0) && this->_args->contains((char *) OUTPUT_ARG)) {
+		index = this->_args->indexForObject((char *) OUTPUT_ARG);
+
+		if ((outputPath = this->_args->objectAtIndex(index+1)) == NULL) {
+			BFErrorPrint("Could not get arg at index %d", index+1);
+			result = 2;
+		}
+	}
+
+	if (result == 0) {
+		if (result = ((JPEG *) img)->autoOrient(outputPath)) {
+			BFErrorPrint("auto orienting: %d", result);
+		}
+	}
+
+	return result;
+}
+
+int AppDriver::openCache(ConversionCache ** cache) {
+	int result = 0;
+	int index = 0;
+	const char * path = NULL;
+	unsigned long long maxSize = CACHE_DEFAULT_MAX_SIZE;
+
+	*cache = NULL;
+
+	if (!this->_args->contains((char *) CACHE_ARG)) {
+		return 0;
+	} else if ((path = this->_args->objectAtIndex(this->_args->indexForObject((char *) CACHE_ARG) + 1)) == NULL) {
+		BFErrorPrint("%s should be followed by a directory", CACHE_ARG);
+		return 1;
+	}
+
+	if (this->_args->contains((char *) CACHE_SIZE_ARG)) {
+		index = this->_args->indexForObject((char *) CACHE_SIZE_ARG);
+		size_t size = 0;
+
+		if (MemoryParseSize(this->_args->objectAtIndex(index+1), &size)) {
+			BFErrorPrint("%s should be followed by a size like 512M", CACHE_SIZE_ARG);
+			return 2;
+		}
+
+		maxSize = size;
+	}
+
+	*cache = new ConversionCache(path, maxSize, &result);
+
+	if (result) {
+		BFErrorPrint("Could not open cache '%s': %d", path, result);
+		delete *cache;
+		*cache = NULL;
+	}
+
+	return result;
+}
+
+int AppDriver::openIndex(MetadataIndex ** index) {
+	int result = 0;
+	const char * path = NULL;
+
+	*index = NULL;
+
+	if (!this->_args->contains((char *) INDEX_ARG)) {
+		return 0;
+	} else if ((path = this->_args->objectAtIndex(this->_args->indexForObject((char *) INDEX_ARG) + 1)) == NULL) {
+		BFErrorPrint("%s should be followed by a directory", INDEX_ARG);
+		return 1;
+	}
+
+	*index = new MetadataIndex(path, this->_args->contains((char *) CHECKSUM_ARG), &result);
+
+	if (result) {
+		BFErrorPrint("Could not open index '%s': %d", path, result);
+		delete *index;
+		*index = NULL;
+	}
+
+	return result;
+}
+
+int AppDriver::jobCount() {
+	int jobs = BatchDefaultThreadCount();
+
+	if (this->_args->contains((char *) JOBS_ARG)) {
+		int index = this->_args->indexForObject((char *) JOBS_ARG);
+		const char * arg = this->_args->objectAtIndex(index+1);
+
+		if (!arg || (sscanf(arg, "%d", &jobs) != 1) || (jobs < 1)) {
+			BFErrorPrint("%s should be followed by a positive number", JOBS_ARG);
+			jobs = 1;
+		}
+	}
+
+	return jobs;
+}
+
+typedef struct {
+	const BatchPaths * paths;
+	const JPEGOptimizeOptions * options;
+	const char * outputPath;
+
+	/// What was walked, without trailing slashes
+	const char * root;
+	size_t rootLength;
+
+	std::atomic<size_t> before;
+	std::atomic<size_t> after;
+} OptimizeContext;
+
+/**
+ * Mirrors the directory `path` is in under the root into the output
+ * path, so files with the same name in different directories do not
+ * land on each other. `dir` is a PATH_MAX buffer that gets the result
+ */
+static int OptimizeOutputDirectory(const OptimizeContext * ctx, const char * path, char * dir) {
+	const char * relative = path;
+	const char * slash = NULL;
+	size_t len = 0;
+
+	if (!strncmp(path, ctx->root, ctx->rootLength) && (path[ctx->rootLength] == '/')) {
+		relative = path + ctx->rootLength + 1;
+	} else {
+		// The root was the file itself
+		relative = "";
+	}
+
+	if ((len = snprintf(dir, PATH_MAX, "%s", ctx->outputPath)) >= PATH_MAX) {
+		return 1;
+	} else if ((slash = strrchr(relative, '/')) == NULL) {
+		return 0;
+	} else if (len + 1 + (slash - relative) >= PATH_MAX) {
+		return 1;
+	}
+
+	snprintf(dir + len, PATH_MAX - len, "/%.*s", (int) (slash - relative), relative);
+
+	// Create each level, other workers may be doing the same
+	for (char * p = dir + len + 1; ; p++) {
+		if ((*p == '/') || (*p == '\0')) {
+			char c = *p;
+
+			*p = '\0';
+			if (mkdir(dir, 0755) && (errno != EEXIST)) {
+				BFErrorPrint("Could not create directory '%s'", dir);
+				return 2;
+			}
+			*p = c;
+
+			if (c == '\0') break;
+		}
 	}
 
 	return 0;
 }
 
+static int OptimizeJob(size_t index, int worker, void * context) {
+	int result = 0;
+	OptimizeContext * ctx = (OptimizeContext *) context;
+	const char * path = ctx->paths->paths[index];
+	size_t before = 0, after = 0;
+	char dir[PATH_MAX];
+	Image * img = Image::createImage(path, &result);
+
+	if (result == 0) {
+		if (img->type() != kImageTypeJPEG) {
+			BFErrorPrint("'%s' is not a JPEG", path);
+			result = 1;
+		} else if (ctx->outputPath && (result = OptimizeOutputDirectory(ctx, path, dir))) {
+			BFErrorPrint("Could not make an output directory for '%s': %d", path, result);
+		} else if (result = ((JPEG *) img)->optimize(ctx->options, &before, &after, ctx->outputPath ? dir : NULL)) {
+			BFErrorPrint("optimizing '%s': %d", path, result);
+		} else {
+			ctx->before += before;
+			ctx->after += after;
+		}
+	}
+
+	if (img) delete img;
+
+	return result;
+}
+
+int AppDriver::handleOptimizeCommand(const char * path) {
+	int result = 0;
+	int index = 0;
+	BatchPaths paths = {0};
+	JPEGOptimizeOptions options = {0};
+	OptimizeContext ctx;
+	size_t failures = 0;
+
+	ctx.paths = &paths;
+	ctx.options = &options;
+	ctx.outputPath = NULL;
+	ctx.root = path;
+	ctx.rootLength = strlen(path);
+	ctx.before = 0;
+	ctx.after = 0;
+
+	options.progressive = this->_args->contains((char *) PROGRESSIVE_ARG);
+	options.strip = this->_args->contains((char *) STRIP_ARG);
+
+	if (this->_args->contains((char *) OUTPUT_ARG)) {
+		index = this->_args->indexForObject((char *) OUTPUT_ARG);
+
+		if ((ctx.outputPath = this->_args->objectAtIndex(index+1)) == NULL) {
+			BFErrorPrint("Could not get arg at index %d", index+1);
+			result = 1;
+		}
+	}
+
+	// Collected paths have the root's trailing slashes trimmed
+	while ((ctx.rootLength > 1) && (path[ctx.rootLength - 1] == '/')) ctx.rootLength--;
+
+	if (result == 0) {
+		result = BatchPathsCollect(&paths, path, JPEG::isType);
+	}
+
+	if (result == 0) {
+		result = BatchRun(paths.count, this->jobCount(), OptimizeJob, &ctx, &failures);
+	}
+
+	if (result == 0) {
+		size_t before = ctx.before, after = ctx.after;
+		// Output written elsewhere is kept even when it is bigger
+		double saved = before ? (100.0 * ((double) before - (double) after)) / (double) before : 0;
+
+		printf("Optimized %lu of %lu files: %lu -> %lu bytes (%.1f%% smaller)\n",
+			paths.count - failures, paths.count, before, after, saved);
+
+		if (failures) result = 2;
+	}
+
+	BatchPathsFree(&paths);
+
+	return result;
+}
+
+typedef struct {
+	const BatchPaths * paths;
+	ScanFormat format;
+	ScanWriter * writer;
+
+	/// NULL without --index
+	MetadataIndex * metadataIndex;
+} ScanContext;
+
+static int ScanJob(size_t index, int worker, void * context) {
+	int result = 0;
+	ScanContext * ctx = (ScanContext *) context;
+	const char * path = ctx->paths->paths[index];
+	char * record = NULL;
+	Image * img = NULL;
+	struct stat st;
+	IndexEntry entry;
+	Dictionary<String, String> metadata;
+	bool indexed = ctx->metadataIndex && !stat(path, &st);
+
+	// Unchanged files are answered without opening them
+	if (indexed && ctx->metadataIndex->lookup(path, &st, &entry)) {
+		if (ScanRecordCreateFromEntry(ctx->format, path, &entry, &record)) {
+			BFErrorPrint("Could not create record for '%s'", path);
+			result = 1;
+		}
+
+		ctx->writer->submit(index, record);
+
+		return result;
+	}
+
+	img = Image::createImage(path, &result);
+
+	if (result == 0) {
+		result = img->probe();
+	}
+
+	// A file we could read the header of but not all of the
+	// metadata is still worth a record with what we did get
+	if (result == 0) {
+		img->compileMetadata(&metadata);
+	}
+
+	// Files we could not read still get a record so they show up
+	// in the catalog
+	if (ScanRecordCreate(ctx->format, path, img, &metadata, result, &record)) {
+		BFErrorPrint("Could not create record for '%s'", path);
+		if (result == 0) result = 1;
+	}
+
+	// Failures are left out so they are retried next time
+	if ((result == 0) && indexed) {
+		ctx->metadataIndex->add(path, &st, img, &metadata);
+	}
+
+	ctx->writer->submit(index, record);
+
+	if (img) delete img;
+
+	return result;
+}
+
+int AppDriver::handleScanCommand(const char * path) {
+	int result = 0;
+	BatchPaths paths = {0};
+	ScanContext ctx = {0};
+	ScanWriter * writer = NULL;
+	size_t failures = 0;
+
+	ctx.paths = &paths;
+	ctx.format = kScanFormatJSONL;
+
+	if (this->_args->contains((char *) FORMAT_ARG)) {
+		int index = this->_args->indexForObject((char *) FORMAT_ARG);
+
+		ctx.format = ScanFormatFromString(this->_args->objectAtIndex(index+1));
+		if (ctx.format == kScanFormatUnknown) {
+			BFErrorPrint("%s should be followed by jsonl or csv", FORMAT_ARG);
+			result = 1;
+		}
+	}
+
+	if (result == 0) {
+		result = this->openIndex(&ctx.metadataIndex);
+	}
+
+	if (result == 0) {
+		result = BatchPathsCollect(&paths, path, ScanPathFilter);
+	}
+
+	if (result == 0) {
+		writer = new ScanWriter(stdout, paths.count, &result);
+		ctx.writer = writer;
+	}
+
+	if (result == 0) {
+		const char * header = ScanFormatHeader(ctx.format);
+		if (header) fputs(header, stdout);
+
+		result = BatchRun(paths.count, this->jobCount(), ScanJob, &ctx, &failures);
+	}
+
+	if (result == 0) {
+		fflush(stdout);
+
+		if (failures) {
+			BFErrorPrint("%lu of %lu files could not be read", failures, paths.count);
+			result = 2;
+		}
+	}
+
+	if (writer) delete writer;
+	if (ctx.metadataIndex) delete ctx.metadataIndex;
+	BatchPathsFree(&paths);
+
+	return result;
+}
+
+typedef struct {
+	const BatchPaths * paths;
+
+	/// Gets a line per image when set
+	ScanWriter * writer;
+
+	/// Filled in per image when set
+	PerceptualHashes * hashes;
+	bool * hashed;
+} HashContext;
+
+static int HashJob(size_t index, int worker, void * context) {
+	int result = 0;
+	HashContext * ctx = (HashContext *) context;
+	const char * path = ctx->paths->paths[index];
+	PerceptualHashes hashes;
+	char * record = NULL;
+	Image * img = Image::createImage(path, &result);
+
+	if (result == 0) {
+		if ((result = PerceptualHashImage(img, &hashes)) != 0) {
+			BFErrorPrint("Could not hash '%s': %d", path, result);
+		}
+	}
+
+	if ((result == 0) && ctx->hashes) {
+		ctx->hashes[index] = hashes;
+		ctx->hashed[index] = true;
+	}
+
+	if ((result == 0) && ctx->writer) {
+		if (asprintf(&record, "%016llx %016llx %016llx %s\n",
+				(unsigned long long) hashes.average,
+				(unsigned long long) hashes.difference,
+				(unsigned long long) hashes.perceptual,
+				path) == -1) {
+			record = NULL;
+			result = 1;
+		}
+	}
+
+	if (ctx->writer) ctx->writer->submit(index, record);
+	if (img) delete img;
+
+	return result;
+}
+
+int AppDriver::handleHashCommand(const char * path) {
+	int result = 0;
+	BatchPaths paths = {0};
+	HashContext ctx = {0};
+	size_t failures = 0;
+
+	ctx.paths = &paths;
+
+	result = BatchPathsCollect(&paths, path, ScanPathFilter);
+
+	if (result == 0) {
+		ctx.writer = new ScanWriter(stdout, paths.count, &result);
+	}
+
+	if (result == 0) {
+		result = BatchRun(paths.count, this->jobCount(), HashJob, &ctx, &failures);
+	}
+
+	if (result == 0) {
+		fflush(stdout);
+
+		if (failures) {
+			BFErrorPrint("%lu of %lu files could not be hashed", failures, paths.count);
+			result = 2;
+		}
+	}
+
+	if (ctx.writer) delete ctx.writer;
+	BatchPathsFree(&paths);
+
+	return result;
+}
+
+int AppDriver::handleDupesCommand(const char * path) {
+	int result = 0;
+	BatchPaths paths = {0};
+	HashContext ctx = {0};
+	PerceptualHashType type = kPerceptualHashPerceptual;
+	int distance = DUPES_DEFAULT_DISTANCE;
+	uint64_t * values = NULL;
+	size_t * clusters = NULL;
+	size_t * next = NULL;
+	size_t * last = NULL;
+	size_t failures = 0;
+
+	ctx.paths = &paths;
+
+	if (this->_args->contains((char *) DISTANCE_ARG)) {
+		int index = this->_args->indexForObject((char *) DISTANCE_ARG);
+		const char * arg = this->_args->objectAtIndex(index+1);
+
+		if (!arg || (sscanf(arg, "%d", &distance) != 1) || (distance < 0) || (distance > DUPES_MAX_DISTANCE)) {
+			BFErrorPrint("%s should be followed by a number from 0 to %d", DISTANCE_ARG, DUPES_MAX_DISTANCE);
+			result = 1;
+		}
+	}
+
+	if ((result == 0) && this->_args->contains((char *) ALGORITHM_ARG)) {
+		int index = this->_args->indexForObject((char *) ALGORITHM_ARG);
+
+		type = PerceptualHashTypeFromString(this->_args->objectAtIndex(index+1));
+		if (type == kPerceptualHashUnknown) {
+			BFErrorPrint("%s should be followed by ahash, dhash or phash", ALGORITHM_ARG);
+			result = 1;
+		}
+	}
+
+	if (result == 0) {
+		result = BatchPathsCollect(&paths, path, ScanPathFilter);
+	}
+
+	if (result == 0) {
+		ctx.hashes = (PerceptualHashes *) calloc(paths.count + 1, sizeof(PerceptualHashes));
+		ctx.hashed = (bool *) calloc(paths.count + 1, sizeof(bool));
+		values = (uint64_t *) calloc(paths.count + 1, sizeof(uint64_t));
+		clusters = (size_t *) calloc(paths.count + 1, sizeof(size_t));
+		next = (size_t *) calloc(paths.count + 1, sizeof(size_t));
+		last = (size_t *) calloc(paths.count + 1, sizeof(size_t));
+
+		if (!ctx.hashes || !ctx.hashed || !values || !clusters || !next || !last) {
+			result = 2;
+		}
+	}
+
+	// Files we cannot hash are reported and left out
+	if (result == 0) {
+		result = BatchRun(paths.count, this->jobCount(), HashJob, &ctx, &failures);
+	}
+
+	if (result == 0) {
+		for (size_t i = 0; i < paths.count; i++) {
+			values[i] = PerceptualHashValue(&ctx.hashes[i], type);
+		}
+
+		result = DupesFindClusters(values, ctx.hashed, paths.count, distance, this->jobCount(), clusters);
+	}
+
+	// Each group's root is its lowest index, so walking up in order
+	// meets it before any of its members
+	if (result == 0) {
+		for (size_t i = 0; i < paths.count; i++) {
+			size_t root = clusters[i];
+
+			next[i] = i;
+			last[i] = i;
+			if (root != i) {
+				next[last[root]] = i;
+				last[root] = i;
+			}
+		}
+
+		// One blank line separated block per group
+		bool first = true;
+		for (size_t i = 0; i < paths.count; i++) {
+			if ((clusters[i] != i) || (next[i] == i)) continue;
+
+			if (!first) printf("\n");
+			first = false;
+
+			for (size_t n = i; ; n = next[n]) {
+				printf("%s\n", paths.paths[n]);
+				if (next[n] == n) break;
+			}
+		}
+
+		fflush(stdout);
+
+		if (failures) {
+			BFErrorPrint("%lu of %lu files could not be hashed", failures, paths.count);
+			result = 3;
+		}
+	}
+
+	BFFree(ctx.hashes);
+	BFFree(ctx.hashed);
+	BFFree(values);
+	BFFree(clusters);
+	BFFree(next);
+	BFFree(last);
+	BatchPathsFree(&paths);
+
+	return result;
+}
+
+typedef struct {
+	const BatchPaths * paths;
+	ScanWriter * writer;
+	bool json;
+	bool histogram;
+} StatsContext;
+
+static int StatsJob(size_t index, int worker, void * context) {
+	int result = 0;
+	StatsContext * ctx = (StatsContext *) context;
+	const char * path = ctx->paths->paths[index];
+	ImageStats stats;
+	char * record = NULL;
+	Image * img = Image::createImage(path, &result);
+
+	if (result == 0) {
+		if ((result = StatsCompute(img, &stats)) != 0) {
+			BFErrorPrint("Could not read pixels of '%s': %d", path, result);
+		}
+	}
+
+	if (result == 0) {
+		result = StatsRecordCreate(path, &stats, ctx->json, ctx->histogram, &record);
+	}
+
+	ctx->writer->submit(index, record);
+	if (img) delete img;
+
+	return result;
+}
+
+int AppDriver::handleStatsCommand(const char * path) {
+	int result = 0;
+	BatchPaths paths = {0};
+	StatsContext ctx = {0};
+	size_t failures = 0;
+
+	ctx.paths = &paths;
+	ctx.histogram = this->_args->contains((char *) HISTOGRAM_ARG);
+
+	if (this->_args->contains((char *) FORMAT_ARG)) {
+		int index = this->_args->indexForObject((char *) FORMAT_ARG);
+		const char * arg = this->_args->objectAtIndex(index+1);
+
+		if (arg && !strcmp(arg, "jsonl")) {
+			ctx.json = true;
+		} else if (!arg || strcmp(arg, "text")) {
+			BFErrorPrint("%s should be followed by text or jsonl", FORMAT_ARG);
+			result = 1;
+		}
+	}
+
+	if (result == 0) {
+		result = BatchPathsCollect(&paths, path, ScanPathFilter);
+	}
+
+	if (result == 0) {
+		ctx.writer = new ScanWriter(stdout, paths.count, &result);
+	}
+
+	// Each worker decodes its own images start to finish, so the
+	// accumulators are never shared
+	if (result == 0) {
+		result = BatchRun(paths.count, this->jobCount(), StatsJob, &ctx, &failures);
+	}
+
+	if (result == 0) {
+		fflush(stdout);
+
+		if (failures) {
+			BFErrorPrint("%lu of %lu files could not be read", failures, paths.count);
+			result = 2;
+		}
+	}
+
+	if (ctx.writer) delete ctx.writer;
+	BatchPathsFree(&paths);
+
+	return result;
+}
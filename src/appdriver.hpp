@@ -9,6 +9,8 @@
 #include <bflibcpp/array.hpp>
 
 class Image;
+class MetadataIndex;
+class ConversionCache;
 
 class AppDriver {
 public:
@@ -23,6 +25,37 @@ public:
 private:
 	int handleAsCommand(Image * img);
 	int handleDetailsCommand(Image * img);
+	int handleTransformCommand(Image * img);
+	int handleAutoOrientCommand(Image * img);
+	int handleOptimizeCommand(const char * path);
+	int handleScanCommand(const char * path);
+	int handleHashCommand(const char * path);
+	int handleDupesCommand(const char * path);
+	int handleStatsCommand(const char * path);
+
+	/**
+	 * Opens the cache named by `--cache`, leaving `cache` NULL
+	 * if there is none
+	 */
+	int openCache(ConversionCache ** cache);
+
+	/**
+	 * Opens the index named by `--index`, leaving `index` NULL
+	 * if there is none
+	 */
+	int openIndex(MetadataIndex ** index);
+
+	/**
+	 * Starts tracing if `--trace` or the trace environment variable
+	 * names a file, and counting with `--perf-counters`. Sets the
+	 * `--memory-limit` of every image and turns on `--huge-pages`
+	 */
+	int startProfiling();
+
+	/**
+	 * Returns the value of `-j` or the number of CPUs
+	 */
+	int jobCount();
 	BF::Array<const char *> * _args;
 };
 
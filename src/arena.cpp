@@ -0,0 +1,262 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "arena.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+}
+
+/// Powers of two from ARENA_SMALL_MIN to ARENA_SMALL_MAX
+#define ARENA_CLASS_COUNT 15
+
+/**
+ * Buffers one thread let go of. Cached small buffers are linked through
+ * their first bytes
+ */
+typedef struct ArenaCache {
+	void * classes[ARENA_CLASS_COUNT];
+	int counts[ARENA_CLASS_COUNT];
+
+	struct {
+		void * buffer;
+		size_t capacity;
+	} large[ARENA_LARGE_SLOTS];
+	int largeCount;
+	size_t largeBytes;
+
+	ArenaStatistics statistics;
+
+	struct ArenaCache * next;
+	struct ArenaCache * previous;
+} ArenaCache;
+
+static size_t ARENA_HUGE_PAGE_THRESHOLD = 0;
+
+/// Guards ARENA_CACHES and ARENA_RETIRED, which are only touched when a
+/// thread first allocates or exits
+static pthread_mutex_t ARENA_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static ArenaCache * ARENA_CACHES = NULL;
+static ArenaStatistics ARENA_RETIRED;
+
+/**
+ * Gives the thread's buffers back when it exits
+ */
+class ArenaThread {
+public:
+	ArenaCache * cache;
+
+	~ArenaThread() {
+		if (!this->cache) return;
+
+		ArenaTrim();
+
+		pthread_mutex_lock(&ARENA_LOCK);
+		ARENA_RETIRED.allocations += this->cache->statistics.allocations;
+		ARENA_RETIRED.reused += this->cache->statistics.reused;
+		ARENA_RETIRED.hugePages += this->cache->statistics.hugePages;
+
+		if (this->cache->previous) this->cache->previous->next = this->cache->next;
+		else ARENA_CACHES = this->cache->next;
+		if (this->cache->next) this->cache->next->previous = this->cache->previous;
+		pthread_mutex_unlock(&ARENA_LOCK);
+
+		free(this->cache);
+		this->cache = NULL;
+	}
+};
+
+static thread_local ArenaThread ARENA_THREAD;
+
+/**
+ * The calling thread's cache, created on first use. NULL if we are out
+ * of memory, in which case nothing is cached
+ */
+static ArenaCache * ArenaThreadCache() {
+	ArenaCache * cache = ARENA_THREAD.cache;
+
+	if (cache) return cache;
+
+	if ((cache = (ArenaCache *) calloc(1, sizeof(ArenaCache))) == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ARENA_LOCK);
+	cache->next = ARENA_CACHES;
+	if (ARENA_CACHES) ARENA_CACHES->previous = cache;
+	ARENA_CACHES = cache;
+	pthread_mutex_unlock(&ARENA_LOCK);
+
+	return ARENA_THREAD.cache = cache;
+}
+
+/**
+ * Index of the smallest class that holds `size`
+ */
+static int ArenaClass(size_t size) {
+	int index = 0;
+
+	for (size_t capacity = ARENA_SMALL_MIN; capacity < size; capacity <<= 1) {
+		index++;
+	}
+
+	return index;
+}
+
+/**
+ * Maps `capacity` bytes. Huge page buffers are mapped with room to spare
+ * and trimmed to a huge page boundary, since the kernel only backs
+ * aligned ranges with huge pages
+ */
+static void * ArenaMap(size_t capacity, bool huge) {
+	size_t length = huge ? capacity + ARENA_HUGE_PAGE_SIZE : capacity;
+	unsigned char * map = (unsigned char *) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	unsigned char * buffer = map;
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	} else if (huge) {
+		buffer = (unsigned char *) (((uintptr_t) map + ARENA_HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (ARENA_HUGE_PAGE_SIZE - 1));
+
+		if (buffer > map) munmap(map, buffer - map);
+		if (map + length > buffer + capacity) munmap(buffer + capacity, map + length - (buffer + capacity));
+
+		// Only advice. Without THP these are plain pages
+		(void) madvise(buffer, capacity, MADV_HUGEPAGE);
+	}
+
+	return buffer;
+}
+
+void * ArenaAllocate(size_t size, size_t * capacity) {
+	ArenaCache * cache = ArenaThreadCache();
+	void * buffer = NULL;
+
+	if (cache) cache->statistics.allocations++;
+
+	if (size <= ARENA_SMALL_MAX) {
+		int index = ArenaClass(size);
+
+		*capacity = ARENA_SMALL_MIN << index;
+
+		if (cache && ((buffer = cache->classes[index]) != NULL)) {
+			memcpy(&cache->classes[index], buffer, sizeof(void *));
+			cache->counts[index]--;
+			cache->statistics.reused++;
+			return buffer;
+		}
+
+		return malloc(*capacity);
+	}
+
+	// The smallest cached buffer that does not waste more than half of itself
+	int best = -1;
+	for (int i = 0; cache && (i < cache->largeCount); i++) {
+		size_t c = cache->large[i].capacity;
+
+		if ((c >= size) && (c / 2 <= size) && ((best == -1) || (c < cache->large[best].capacity))) {
+			best = i;
+		}
+	}
+
+	if (best != -1) {
+		buffer = cache->large[best].buffer;
+		*capacity = cache->large[best].capacity;
+
+		cache->largeBytes -= *capacity;
+		cache->large[best] = cache->large[--cache->largeCount];
+		cache->statistics.reused++;
+
+		return buffer;
+	}
+
+	bool huge = ARENA_HUGE_PAGE_THRESHOLD && (size >= ARENA_HUGE_PAGE_THRESHOLD);
+	size_t granule = huge ? ARENA_HUGE_PAGE_SIZE : ARENA_LARGE_GRANULE;
+
+	if (size > SIZE_MAX - granule) return NULL;
+	*capacity = (size + granule - 1) / granule * granule;
+
+	if ((buffer = ArenaMap(*capacity, huge)) != NULL) {
+		if (huge && cache) cache->statistics.hugePages++;
+	}
+
+	return buffer;
+}
+
+void ArenaRelease(void * buffer, size_t capacity) {
+	ArenaCache * cache = ArenaThreadCache();
+
+	if (!buffer) {
+		return;
+	} else if (capacity <= ARENA_SMALL_MAX) {
+		int index = ArenaClass(capacity);
+
+		if (cache
+			&& (cache->counts[index] < ARENA_CLASS_BUFFERS)
+			&& ((size_t) (cache->counts[index] + 1) * capacity <= ARENA_CLASS_BYTES)) {
+			memcpy(buffer, &cache->classes[index], sizeof(void *));
+			cache->classes[index] = buffer;
+			cache->counts[index]++;
+		} else {
+			free(buffer);
+		}
+	} else if (cache && (cache->largeCount < ARENA_LARGE_SLOTS) && (cache->largeBytes + capacity <= ARENA_LARGE_BYTES)) {
+		cache->large[cache->largeCount].buffer = buffer;
+		cache->large[cache->largeCount].capacity = capacity;
+		cache->largeCount++;
+		cache->largeBytes += capacity;
+	} else {
+		munmap(buffer, capacity);
+	}
+}
+
+void ArenaTrim() {
+	ArenaCache * cache = ARENA_THREAD.cache;
+
+	if (!cache) return;
+
+	for (int index = 0; index < ARENA_CLASS_COUNT; index++) {
+		while (cache->classes[index]) {
+			void * buffer = cache->classes[index];
+			memcpy(&cache->classes[index], buffer, sizeof(void *));
+			free(buffer);
+		}
+
+		cache->counts[index] = 0;
+	}
+
+	for (int i = 0; i < cache->largeCount; i++) {
+		munmap(cache->large[i].buffer, cache->large[i].capacity);
+	}
+
+	cache->largeCount = 0;
+	cache->largeBytes = 0;
+}
+
+void ArenaSetHugePageThreshold(size_t bytes) {
+	ARENA_HUGE_PAGE_THRESHOLD = bytes;
+}
+
+void ArenaStatisticsGet(ArenaStatistics * statistics) {
+	pthread_mutex_lock(&ARENA_LOCK);
+
+	memcpy(statistics, &ARENA_RETIRED, sizeof(ArenaStatistics));
+
+	// Live threads could be counting while we read, which only
+	// makes the totals a little stale
+	for (ArenaCache * cache = ARENA_CACHES; cache; cache = cache->next) {
+		statistics->allocations += cache->statistics.allocations;
+		statistics->reused += cache->statistics.reused;
+		statistics->hugePages += cache->statistics.hugePages;
+	}
+
+	pthread_mutex_unlock(&ARENA_LOCK);
+}
+
@@ -0,0 +1,79 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+extern "C" {
+#include <stddef.h>
+}
+
+/// Smallest and largest size class. Anything bigger is a large buffer
+#define ARENA_SMALL_MIN ((size_t) 64)
+#define ARENA_SMALL_MAX ((size_t) 1 << 20)
+
+/// Most bytes and buffers a thread keeps in one size class
+#define ARENA_CLASS_BYTES ((size_t) 4 << 20)
+#define ARENA_CLASS_BUFFERS 256
+
+/// Large buffers a thread keeps, and at most how many bytes of them
+#define ARENA_LARGE_SLOTS 4
+#define ARENA_LARGE_BYTES ((size_t) 128 << 20)
+
+/// Large buffers are mapped in multiples of this
+#define ARENA_LARGE_GRANULE ((size_t) 64 << 10)
+
+#define ARENA_HUGE_PAGE_SIZE ((size_t) 2 << 20)
+
+/// Default for ArenaSetHugePageThreshold() when huge pages are asked for
+#define ARENA_HUGE_PAGE_DEFAULT_THRESHOLD ((size_t) 8 << 20)
+
+typedef struct {
+	size_t allocations;
+
+	/// Allocations handed a buffer an earlier image let go of
+	size_t reused;
+
+	/// Large buffers backed by transparent huge pages
+	size_t hugePages;
+} ArenaStatistics;
+
+/**
+ * Hands out a buffer of at least `size` bytes from the calling thread's
+ * cache, or a new one. `capacity` gets what it really holds, which
+ * ArenaRelease() needs back
+ *
+ * Small sizes are rounded up to a power of two. Large ones are mapped
+ * straight from the kernel so they never fragment the heap
+ */
+void * ArenaAllocate(size_t size, size_t * capacity);
+
+/**
+ * Keeps the buffer in the calling thread's cache for the next image, or
+ * frees it if the cache is full
+ */
+void ArenaRelease(void * buffer, size_t capacity);
+
+/**
+ * Frees everything the calling thread has cached. Threads do this on
+ * their own when they exit
+ */
+void ArenaTrim();
+
+/**
+ * Large buffers of at least `bytes` are aligned to and advised as
+ * transparent huge pages. 0, the default, turns this off
+ *
+ * Set before any images are created
+ */
+void ArenaSetHugePageThreshold(size_t bytes);
+
+/**
+ * Totals over every thread, including ones that have exited
+ */
+void ArenaStatisticsGet(ArenaStatistics * statistics);
+
+#endif // ARENA_HPP
+
@@ -0,0 +1,229 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "batch.hpp"
+#include "trace.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+#include <atomic>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+}
+
+int BatchPathsAdd(BatchPaths * list, const char * path) {
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * 2 : 64;
+		char ** paths = (char **) realloc(list->paths, sizeof(char *) * capacity);
+
+		if (!paths) {
+			BFErrorPrint("Could not grow path list to %lu", capacity);
+			return 1;
+		}
+
+		list->paths = paths;
+		list->capacity = capacity;
+	}
+
+	if ((list->paths[list->count] = strdup(path)) == NULL) {
+		return 2;
+	}
+
+	list->count++;
+
+	return 0;
+}
+
+void BatchPathsFree(BatchPaths * list) {
+	for (size_t i = 0; i < list->count; i++) {
+		BFFree(list->paths[i]);
+	}
+
+	BFFree(list->paths);
+	list->paths = NULL;
+	list->count = 0;
+	list->capacity = 0;
+}
+
+/**
+ * Walks `dir` depth first. `path` is a PATH_MAX buffer holding dir and
+ * is used as scratch space for the children
+ *
+ * Returns 1 only when `dir` itself cannot be opened. Subdirectories that
+ * cannot be are reported and skipped
+ */
+static int BatchPathsWalk(BatchPaths * list, char * path, BatchPathFilter filter) {
+	int result = 0;
+	DIR * dir = NULL;
+	struct dirent * ent = NULL;
+	size_t len = strlen(path);
+
+	if ((dir = opendir(path)) == NULL) {
+		BFErrorPrint("Could not open directory '%s'", path);
+		return 1;
+	}
+
+	while (!result && ((ent = readdir(dir)) != NULL)) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+
+		if ((len + 1 + strlen(ent->d_name)) >= PATH_MAX) {
+			BFErrorPrint("Path too long under '%s'", path);
+			continue;
+		}
+
+		snprintf(path + len, PATH_MAX - len, "/%s", ent->d_name);
+
+		// d_type saves a stat per entry on most file systems
+		unsigned char type = ent->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (lstat(path, &st) == 0) {
+				if (S_ISDIR(st.st_mode)) type = DT_DIR;
+				else if (S_ISREG(st.st_mode)) type = DT_REG;
+			}
+		}
+
+		if (type == DT_DIR) {
+			// One unreadable directory should not cost the rest of the tree
+			if ((result = BatchPathsWalk(list, path, filter)) == 1) {
+				result = 0;
+			}
+		} else if (type == DT_REG) {
+			if (!filter || filter(path)) {
+				result = BatchPathsAdd(list, path);
+			}
+		}
+
+		path[len] = '\0';
+	}
+
+	closedir(dir);
+
+	return result;
+}
+
+int BatchPathsCollect(BatchPaths * list, const char * root, BatchPathFilter filter) {
+	struct stat st;
+	char path[PATH_MAX];
+
+	if (stat(root, &st)) {
+		BFErrorPrint("Could not find '%s'", root);
+		return 1;
+	} else if (!S_ISDIR(st.st_mode)) {
+		return BatchPathsAdd(list, root);
+	} else if (strlen(root) >= PATH_MAX) {
+		return 2;
+	}
+
+	strcpy(path, root);
+
+	// Avoid '//' in every child path
+	size_t len = strlen(path);
+	while ((len > 1) && (path[len - 1] == '/')) path[--len] = '\0';
+
+	return BatchPathsWalk(list, path, filter);
+}
+
+int BatchDefaultThreadCount() {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
+
+typedef struct {
+	size_t count;
+	BatchJob job;
+	void * context;
+	std::atomic<size_t> next;
+	std::atomic<size_t> failures;
+} BatchState;
+
+typedef struct {
+	BatchState * state;
+	int worker;
+} BatchWorker;
+
+static void * BatchWorkerMain(void * arg) {
+	BatchWorker * w = (BatchWorker *) arg;
+	BatchState * state = w->state;
+
+	// Worker 0 is the calling thread, which already has a name
+	if (w->worker > 0) {
+		char name[32];
+		snprintf(name, sizeof(name), "batch worker %d", w->worker);
+		TraceNameThread(name);
+	}
+
+	while (true) {
+		size_t i = state->next.fetch_add(1, std::memory_order_relaxed);
+		if (i >= state->count) break;
+
+		TraceScope scope("job", NULL, i);
+
+		if (state->job(i, w->worker, state->context)) {
+			state->failures.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	return NULL;
+}
+
+int BatchRun(size_t count, int threads, BatchJob job, void * context, size_t * failures) {
+	int result = 0;
+	BatchState state;
+	BatchWorker * workers = NULL;
+	pthread_t * tids = NULL;
+	int started = 0;
+
+	state.count = count;
+	state.job = job;
+	state.context = context;
+	state.next = 0;
+	state.failures = 0;
+
+	if (threads < 1) threads = 1;
+	if ((size_t) threads > count) threads = count ? (int) count : 1;
+
+	if ((workers = (BatchWorker *) malloc(sizeof(BatchWorker) * threads)) == NULL) {
+		result = 1;
+	} else if ((tids = (pthread_t *) malloc(sizeof(pthread_t) * threads)) == NULL) {
+		result = 2;
+	}
+
+	// Worker 0 runs on the calling thread
+	if (result == 0) {
+		for (int i = 0; i < threads; i++) {
+			workers[i].state = &state;
+			workers[i].worker = i;
+		}
+
+		for (int i = 1; i < threads; i++) {
+			if (pthread_create(&tids[i], NULL, BatchWorkerMain, &workers[i])) {
+				BFErrorPrint("Could only start %d of %d threads", i, threads);
+				break;
+			}
+
+			started++;
+		}
+
+		BatchWorkerMain(&workers[0]);
+
+		for (int i = 1; i <= started; i++) {
+			pthread_join(tids[i], NULL);
+		}
+	}
+
+	if (failures) *failures = state.failures;
+
+	BFFree(workers);
+	BFFree(tids);
+
+	return result;
+}
+
@@ -0,0 +1,63 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+extern "C" {
+#include <stddef.h>
+}
+
+/**
+ * Growable list of file paths. Each path is owned by the list
+ */
+typedef struct {
+	char ** paths;
+	size_t count;
+	size_t capacity;
+} BatchPaths;
+
+/**
+ * Decides whether a file should be added to the list
+ */
+typedef bool (* BatchPathFilter)(const char * path);
+
+/**
+ * Work done for a single item
+ *
+ * `worker` is in [0, threads) so callers can keep per worker state.
+ * A non zero return counts as a failure but does not stop the batch
+ */
+typedef int (* BatchJob)(size_t index, int worker, void * context);
+
+/**
+ * Adds `root` if it is a file, or every regular file under it if it
+ * is a directory. Symbolic links are not followed. `filter` can be NULL
+ */
+int BatchPathsCollect(BatchPaths * list, const char * root, BatchPathFilter filter);
+
+/**
+ * Adds a copy of path to the list
+ */
+int BatchPathsAdd(BatchPaths * list, const char * path);
+
+void BatchPathsFree(BatchPaths * list);
+
+/**
+ * Runs job for every index in [0, count) across `threads` workers
+ *
+ * Items are handed out in order from a shared counter so workers
+ * that get small files do not sit idle. `failures` (optional) gets
+ * the number of jobs that returned non zero
+ */
+int BatchRun(size_t count, int threads, BatchJob job, void * context, size_t * failures);
+
+/**
+ * Number of online CPUs
+ */
+int BatchDefaultThreadCount();
+
+#endif // BATCH_HPP
+
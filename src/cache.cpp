@@ -0,0 +1,439 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "cache.hpp"
+#include "hash.hpp"
+#include "version.h"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/limits.h>
+}
+
+#define CACHE_LOCK_NAME "lock"
+#define CACHE_USAGE_NAME "usage"
+
+/// Temporary files start with this so eviction skips them
+#define CACHE_TEMP_PREFIX ".tmp-"
+
+/// Hits by users who cannot touch an entry are recorded in this file
+/// followed by the key
+#define CACHE_USED_PREFIX ".used-"
+
+/**
+ * Eviction stops at this share of the cap so we do not end up
+ * evicting again on the very next store
+ */
+static const uint64_t CACHE_EVICT_TARGET_PERCENT = 90;
+
+/**
+ * Temporary files older than this were left by a process that died
+ * before renaming them, and last used files older than this whose entry
+ * is gone are left over from an eviction that raced with a hit
+ */
+static const time_t CACHE_STALE_SECONDS = 60 * 60;
+
+typedef struct {
+	char * name;
+	uint64_t size;
+	struct timespec lastUsed;
+
+	/// Last used files that still have their entry
+	bool matched;
+} CacheEntry;
+
+int ConversionCache::keyForInput(const char * input, const char * options, char * key, size_t size) {
+	int result = 0;
+	struct stat st;
+	uint64_t inputHash = 0, optionsHash = 0;
+	char salt[512];
+
+	if (!input || !options || !key) {
+		result = 1;
+	} else if (stat(input, &st)) {
+		result = 2;
+	} else if ((result = HashFile(input, &inputHash)) == 0) {
+		// Chaining keeps the two hashes from being swapped around
+		snprintf(salt, sizeof(salt), "%s\n%s", IMAGINE_VERSION, options);
+		optionsHash = HashXXH64(salt, strlen(salt), inputHash);
+
+		// The size is in there too so a collision would also need
+		// the same length
+		if (snprintf(key, size, "%016llx-%llx-%016llx",
+				(unsigned long long) inputHash,
+				(unsigned long long) st.st_size,
+				(unsigned long long) optionsHash) >= (int) size) {
+			result = 3;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Copies everything in `in` to a temporary file next to `dst` and
+ * renames it into place
+ *
+ * A reflink is tried first. Filesystems without them get a kernel side
+ * copy, and if even that is refused we fall back to read and write
+ */
+static int CacheCopy(int in, const char * dst, mode_t mode) {
+	int result = 0;
+	int out = -1;
+	char tmp[PATH_MAX];
+	const char * slash = strrchr(dst, '/');
+	struct stat st;
+
+	if (fstat(in, &st)) {
+		return 1;
+	} else if (slash) {
+		if (snprintf(tmp, sizeof(tmp), "%.*s/" CACHE_TEMP_PREFIX "XXXXXX", (int) (slash - dst), dst) >= (int) sizeof(tmp)) return 2;
+	} else {
+		snprintf(tmp, sizeof(tmp), CACHE_TEMP_PREFIX "XXXXXX");
+	}
+
+	if ((out = mkstemp(tmp)) == -1) {
+		BFErrorPrint("Could not create a file next to '%s'", dst);
+		return 3;
+	}
+
+	if (ioctl(out, FICLONE, in) == -1) {
+		off_t offset = 0;
+		ssize_t copied = 0;
+
+		while ((offset < st.st_size)
+				&& ((copied = copy_file_range(in, &offset, out, NULL, st.st_size - offset, 0)) > 0));
+
+		if ((offset < st.st_size) && (copied == -1)) {
+			char buf[64 * 1024];
+			ssize_t n = 0;
+
+			// Start over in case some of it made it across
+			offset = 0;
+			if (ftruncate(out, 0) || (lseek(out, 0, SEEK_SET) == -1)) result = 4;
+
+			while (!result && ((n = pread(in, buf, sizeof(buf), offset)) > 0)) {
+				if (write(out, buf, n) != n) result = 5;
+				offset += n;
+			}
+
+			if (n == -1) result = 6;
+		}
+
+		if (!result && (offset != st.st_size)) result = 7;
+	}
+
+	if ((result == 0) && fchmod(out, mode)) {
+		result = 8;
+	}
+
+	if (close(out) && (result == 0)) {
+		result = 9;
+	}
+
+	if ((result == 0) && rename(tmp, dst)) {
+		result = 10;
+	}
+
+	if (result) unlink(tmp);
+
+	return result;
+}
+
+ConversionCache::ConversionCache(const char * path, uint64_t maxSize, int * err) {
+	int error = 0;
+	char lockPath[PATH_MAX];
+	mode_t mask = umask(0);
+
+	umask(mask);
+	this->_outputMode = 0666 & ~mask;
+	this->_path = NULL;
+	this->_maxSize = maxSize;
+	this->_lockFd = -1;
+
+	if (!path) {
+		error = 1;
+	} else if (mkdir(path, 0755) && (errno != EEXIST)) {
+		BFErrorPrint("Could not create cache '%s'", path);
+		error = 2;
+	} else if ((this->_path = strdup(path)) == NULL) {
+		error = 3;
+	} else if (snprintf(lockPath, sizeof(lockPath), "%s/%s", path, CACHE_LOCK_NAME) >= (int) sizeof(lockPath)) {
+		error = 4;
+	} else if ((this->_lockFd = open(lockPath, O_RDWR | O_CREAT, 0644)) == -1) {
+		BFErrorPrint("Could not open '%s'", lockPath);
+		error = 5;
+	}
+
+	if (err) *err = error;
+}
+
+ConversionCache::~ConversionCache() {
+	if (this->_lockFd != -1) close(this->_lockFd);
+	BFFree(this->_path);
+}
+
+/**
+ * Replaces the last used file of `key` with a new one, whose mtime is
+ * now. Only needs write access to the cache directory
+ */
+static int CacheTouchUsed(const char * path, const char * key) {
+	int result = 0;
+	int fd = -1;
+	char tmp[PATH_MAX];
+	char used[PATH_MAX];
+
+	if (snprintf(tmp, sizeof(tmp), "%s/" CACHE_TEMP_PREFIX "XXXXXX", path) >= (int) sizeof(tmp)) {
+		result = 1;
+	} else if (snprintf(used, sizeof(used), "%s/" CACHE_USED_PREFIX "%s", path, key) >= (int) sizeof(used)) {
+		result = 2;
+	} else if ((fd = mkstemp(tmp)) == -1) {
+		result = 3;
+	} else {
+		close(fd);
+
+		if (rename(tmp, used)) {
+			unlink(tmp);
+			result = 4;
+		}
+	}
+
+	return result;
+}
+
+bool ConversionCache::fetch(const char * key, const char * output) {
+	char entry[PATH_MAX];
+	int fd = -1;
+	bool hit = false;
+
+	// Last used time is the entry's mtime. atime is too often
+	// turned off to be useful
+	struct timespec times[2] = {{0, UTIME_OMIT}, {0, UTIME_NOW}};
+
+	if (snprintf(entry, sizeof(entry), "%s/%s", this->_path, key) >= (int) sizeof(entry)) {
+		return false;
+	} else if ((fd = open(entry, O_RDONLY)) == -1) {
+		return false;
+	}
+
+	// Only whoever stored the entry may set its times. Everyone else
+	// sharing the cache leaves a last used file next to it instead
+	if (futimens(fd, times) && CacheTouchUsed(this->_path, key)) {
+		BFErrorPrint("Could not record a hit on '%s', it may be evicted early", entry);
+	}
+
+	hit = CacheCopy(fd, output, this->_outputMode) == 0;
+	close(fd);
+
+	return hit;
+}
+
+int ConversionCache::store(const char * key, const char * output) {
+	int result = 0;
+	char entry[PATH_MAX];
+	int fd = -1;
+	struct stat st;
+
+	if (snprintf(entry, sizeof(entry), "%s/%s", this->_path, key) >= (int) sizeof(entry)) {
+		result = 1;
+	} else if ((fd = open(output, O_RDONLY)) == -1) {
+		result = 2;
+	} else if (fstat(fd, &st)) {
+		result = 3;
+
+	// Never one that could not fit
+	} else if ((uint64_t) st.st_size > this->_maxSize) {
+		result = 0;
+
+	// Read only so nothing edits it in place by accident
+	} else if ((result = CacheCopy(fd, entry, 0444)) == 0) {
+		result = this->account(st.st_size);
+	}
+
+	if (fd != -1) close(fd);
+
+	return result;
+}
+
+/**
+ * Reads the running total. A missing or garbled file reads as 0,
+ * which the next eviction corrects
+ */
+static uint64_t CacheReadUsage(int fd) {
+	char buf[32] = {0};
+	ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+	return (n > 0) ? strtoull(buf, NULL, 10) : 0;
+}
+
+static int CacheWriteUsage(int fd, uint64_t usage) {
+	char buf[32];
+	int size = snprintf(buf, sizeof(buf), "%llu\n", (unsigned long long) usage);
+
+	if (ftruncate(fd, 0) || (pwrite(fd, buf, size, 0) != size)) return 1;
+	return 0;
+}
+
+int ConversionCache::account(uint64_t size) {
+	int result = 0;
+	int fd = -1;
+	char usagePath[PATH_MAX];
+	uint64_t usage = 0;
+
+	snprintf(usagePath, sizeof(usagePath), "%s/%s", this->_path, CACHE_USAGE_NAME);
+
+	if (flock(this->_lockFd, LOCK_EX)) {
+		return 1;
+	} else if ((fd = open(usagePath, O_RDWR | O_CREAT, 0644)) == -1) {
+		result = 2;
+	} else {
+		usage = CacheReadUsage(fd) + size;
+
+		if (usage > this->_maxSize) {
+			result = this->evict(&usage);
+		}
+
+		if (CacheWriteUsage(fd, usage) && (result == 0)) {
+			result = 3;
+		}
+
+		close(fd);
+	}
+
+	flock(this->_lockFd, LOCK_UN);
+
+	return result;
+}
+
+static int CacheEntryNameCompare(const void * a, const void * b) {
+	return strcmp(((const CacheEntry *) a)->name, ((const CacheEntry *) b)->name);
+}
+
+static int CacheEntryCompare(const void * a, const void * b) {
+	const CacheEntry * x = (const CacheEntry *) a;
+	const CacheEntry * y = (const CacheEntry *) b;
+
+	if (x->lastUsed.tv_sec != y->lastUsed.tv_sec) return (x->lastUsed.tv_sec < y->lastUsed.tv_sec) ? -1 : 1;
+	else if (x->lastUsed.tv_nsec != y->lastUsed.tv_nsec) return (x->lastUsed.tv_nsec < y->lastUsed.tv_nsec) ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Appends a copy of `name` to `entries`
+ */
+static int CacheEntryAdd(CacheEntry ** entries, size_t * count, size_t * capacity, const char * name, const struct stat * st) {
+	if (*count == *capacity) {
+		size_t grownCapacity = *capacity ? *capacity * 2 : 64;
+		CacheEntry * grown = (CacheEntry *) realloc(*entries, grownCapacity * sizeof(CacheEntry));
+
+		if (!grown) return 1;
+
+		*entries = grown;
+		*capacity = grownCapacity;
+	}
+
+	if (((*entries)[*count].name = strdup(name)) == NULL) {
+		return 2;
+	}
+
+	(*entries)[*count].size = st->st_size;
+	(*entries)[*count].lastUsed = st->st_mtim;
+	(*entries)[*count].matched = false;
+	(*count)++;
+
+	return 0;
+}
+
+int ConversionCache::evict(uint64_t * usage) {
+	int result = 0;
+	DIR * d = NULL;
+	struct dirent * ent = NULL;
+	CacheEntry * entries = NULL, * used = NULL;
+	size_t count = 0, capacity = 0;
+	size_t usedCount = 0, usedCapacity = 0;
+	uint64_t total = 0;
+	uint64_t target = (this->_maxSize / 100) * CACHE_EVICT_TARGET_PERCENT;
+	time_t stale = time(NULL) - CACHE_STALE_SECONDS;
+	char name[PATH_MAX];
+
+	if ((d = opendir(this->_path)) == NULL) {
+		return 1;
+	}
+
+	// The running total drifts when stores race on the same key, so
+	// this recounts from scratch
+	while (!result && ((ent = readdir(d)) != NULL)) {
+		struct stat st;
+
+		if (!strcmp(ent->d_name, CACHE_LOCK_NAME) || !strcmp(ent->d_name, CACHE_USAGE_NAME)) {
+			continue;
+		} else if (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode)) {
+			continue;
+		} else if (!strncmp(ent->d_name, CACHE_TEMP_PREFIX, strlen(CACHE_TEMP_PREFIX))) {
+			// Nobody is going to rename these into place any more
+			if (st.st_mtime < stale) unlinkat(dirfd(d), ent->d_name, 0);
+		} else if (!strncmp(ent->d_name, CACHE_USED_PREFIX, strlen(CACHE_USED_PREFIX))) {
+			result = CacheEntryAdd(&used, &usedCount, &usedCapacity, ent->d_name + strlen(CACHE_USED_PREFIX), &st);
+		} else if (ent->d_name[0] != '.') {
+			if ((result = CacheEntryAdd(&entries, &count, &capacity, ent->d_name, &st)) == 0) {
+				total += st.st_size;
+			}
+		}
+	}
+
+	if (result == 0) {
+		// A hit recorded in a last used file counts when it is newer
+		qsort(used, usedCount, sizeof(CacheEntry), CacheEntryNameCompare);
+
+		for (size_t i = 0; i < count; i++) {
+			CacheEntry * u = (CacheEntry *) bsearch(&entries[i], used, usedCount, sizeof(CacheEntry), CacheEntryNameCompare);
+
+			if (u) {
+				if (CacheEntryCompare(u, &entries[i]) > 0) entries[i].lastUsed = u->lastUsed;
+				u->matched = true;
+			}
+		}
+
+		// Ones whose entry is gone
+		for (size_t i = 0; i < usedCount; i++) {
+			if (!used[i].matched && (used[i].lastUsed.tv_sec < stale)) {
+				snprintf(name, sizeof(name), CACHE_USED_PREFIX "%s", used[i].name);
+				unlinkat(dirfd(d), name, 0);
+			}
+		}
+
+		qsort(entries, count, sizeof(CacheEntry), CacheEntryCompare);
+
+		for (size_t i = 0; (i < count) && (total > target); i++) {
+			if (!unlinkat(dirfd(d), entries[i].name, 0)) {
+				total -= entries[i].size;
+
+				snprintf(name, sizeof(name), CACHE_USED_PREFIX "%s", entries[i].name);
+				unlinkat(dirfd(d), name, 0);
+			}
+		}
+
+		*usage = total;
+	}
+
+	for (size_t i = 0; i < count; i++) BFFree(entries[i].name);
+	for (size_t i = 0; i < usedCount; i++) BFFree(used[i].name);
+	BFFree(entries);
+	BFFree(used);
+	closedir(d);
+
+	return result;
+}
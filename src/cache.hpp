@@ -0,0 +1,87 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+extern "C" {
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+}
+
+/// Room for a key from ConversionCache::keyForInput()
+#define CACHE_KEY_SIZE 64
+
+/// Used when no size is given
+#define CACHE_DEFAULT_MAX_SIZE (1024ULL * 1024 * 1024)
+
+/**
+ * Directory of finished conversions keyed by what produced them
+ *
+ * A key covers the input's bytes, the conversion options and
+ * IMAGINE_VERSION, so the same source converted the same way is only
+ * ever encoded once. Hits are reflinked where the filesystem allows it
+ * and copied otherwise.
+ *
+ * Entries are evicted least recently used first once their total size
+ * goes over the cap. Any number of processes can share a cache. Users
+ * who cannot touch an entry someone else stored record their hits in a
+ * last used file next to it
+ */
+class ConversionCache {
+public:
+	/**
+	 * Opens or creates the cache at `path`, holding at most `maxSize` bytes
+	 */
+	ConversionCache(const char * path, uint64_t maxSize, int * err);
+	virtual ~ConversionCache();
+
+	/**
+	 * Writes the key for converting the file at `input` with `options`
+	 *
+	 * The input is hashed with XXH64 straight from a mapping of the file
+	 */
+	static int keyForInput(const char * input, const char * options, char * key, size_t size);
+
+	/**
+	 * Puts the output cached under key at `output`
+	 *
+	 * Returns true on a hit. `output` is replaced atomically so readers
+	 * never see a partial file
+	 */
+	bool fetch(const char * key, const char * output);
+
+	/**
+	 * Adds a copy of `output` under key, then evicts entries until the
+	 * cache is back under its cap
+	 */
+	int store(const char * key, const char * output);
+
+private:
+	/**
+	 * Adds `size` to the usage total and evicts if it went over
+	 */
+	int account(uint64_t size);
+
+	/**
+	 * Removes the least recently used entries until we are comfortably
+	 * under the cap, along with temporary files crashed processes left
+	 * behind. Needs the lock
+	 */
+	int evict(uint64_t * usage);
+
+	char * _path;
+	uint64_t _maxSize;
+
+	/// flock()ed while the usage total is updated
+	int _lockFd;
+
+	/// Permissions fetched outputs get, same as fopen() would give
+	mode_t _outputMode;
+};
+
+#endif // CACHE_HPP
+
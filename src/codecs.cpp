@@ -0,0 +1,196 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "codecs.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+#include <atomic>
+
+extern "C" {
+#include <stdlib.h>
+}
+
+static std::atomic<size_t> CODECS_ACQUIRED(0);
+static std::atomic<size_t> CODECS_REUSED(0);
+
+/**
+ * The calling thread's idle contexts
+ */
+class CodecsThread {
+public:
+	CodecJPEGDecompress * decompressors;
+	int decompressorCount;
+
+	CodecJPEGCompress * compressors;
+	int compressorCount;
+
+	~CodecsThread() {
+		CodecsTrim();
+	}
+};
+
+static thread_local CodecsThread CODECS_THREAD;
+
+/**
+ * libjpeg's default error_exit calls exit(), so we print the message and
+ * jump back to whoever is using the context
+ */
+static void CodecsJPEGErrorExit(j_common_ptr cinfo) {
+	char msg[JMSG_LENGTH_MAX];
+
+	(*cinfo->err->format_message)(cinfo, msg);
+	BFErrorPrint("libjpeg: %s", msg);
+
+	if (cinfo->is_decompressor) {
+		longjmp(((CodecJPEGDecompress *) cinfo)->jmp, 1);
+	} else {
+		longjmp(((CodecJPEGCompress *) cinfo)->jmp, 1);
+	}
+}
+
+/**
+ * Corrupt data warnings are not worth a line per image, whether we are
+ * reading or writing
+ */
+static void CodecsJPEGEmitMessage(j_common_ptr cinfo, int level) {
+
+}
+
+CodecJPEGDecompress * CodecsAcquireJPEGDecompress(MemoryAccount * account) {
+	CodecJPEGDecompress * context = CODECS_THREAD.decompressors;
+
+	CODECS_ACQUIRED++;
+
+	if (context) {
+		CODECS_THREAD.decompressors = context->next;
+		CODECS_THREAD.decompressorCount--;
+		CODECS_REUSED++;
+	} else if ((context = (CodecJPEGDecompress *) malloc(sizeof(CodecJPEGDecompress))) == NULL) {
+		return NULL;
+	} else {
+		context->cinfo.err = jpeg_std_error(&context->err);
+		context->err.error_exit = CodecsJPEGErrorExit;
+		context->err.emit_message = CodecsJPEGEmitMessage;
+
+		// Can only fail on a version mismatch or when out of memory
+		if (setjmp(context->jmp)) {
+			free(context);
+			return NULL;
+		}
+
+		jpeg_create_decompress(&context->cinfo);
+		context->stdioSource = NULL;
+		context->memorySource = NULL;
+	}
+
+	context->next = NULL;
+	MemoryAttachJPEG((j_common_ptr) &context->cinfo, account);
+
+	return context;
+}
+
+void CodecsReleaseJPEGDecompress(CodecJPEGDecompress * context) {
+	if (!context) return;
+
+	// Frees the image pool and leaves the permanent one alone
+	jpeg_abort_decompress(&context->cinfo);
+	MemoryDetachJPEG((j_common_ptr) &context->cinfo);
+
+	if (CODECS_THREAD.decompressorCount < CODECS_POOL_SIZE) {
+		context->next = CODECS_THREAD.decompressors;
+		CODECS_THREAD.decompressors = context;
+		CODECS_THREAD.decompressorCount++;
+	} else {
+		jpeg_destroy_decompress(&context->cinfo);
+		free(context);
+	}
+}
+
+void CodecsJPEGSource(CodecJPEGDecompress * context, FILE * file, const unsigned char * data, size_t size) {
+	struct jpeg_decompress_struct * cinfo = &context->cinfo;
+
+	if (file) {
+		cinfo->src = context->stdioSource;
+		jpeg_stdio_src(cinfo, file);
+		context->stdioSource = cinfo->src;
+	} else {
+		cinfo->src = context->memorySource;
+		jpeg_mem_src(cinfo, (unsigned char *) data, size);
+		context->memorySource = cinfo->src;
+	}
+}
+
+CodecJPEGCompress * CodecsAcquireJPEGCompress(MemoryAccount * account) {
+	CodecJPEGCompress * context = CODECS_THREAD.compressors;
+
+	CODECS_ACQUIRED++;
+
+	if (context) {
+		CODECS_THREAD.compressors = context->next;
+		CODECS_THREAD.compressorCount--;
+		CODECS_REUSED++;
+	} else if ((context = (CodecJPEGCompress *) malloc(sizeof(CodecJPEGCompress))) == NULL) {
+		return NULL;
+	} else {
+		context->cinfo.err = jpeg_std_error(&context->err);
+		context->err.error_exit = CodecsJPEGErrorExit;
+		context->err.emit_message = CodecsJPEGEmitMessage;
+
+		if (setjmp(context->jmp)) {
+			free(context);
+			return NULL;
+		}
+
+		jpeg_create_compress(&context->cinfo);
+	}
+
+	context->next = NULL;
+	MemoryAttachJPEG((j_common_ptr) &context->cinfo, account);
+
+	return context;
+}
+
+void CodecsReleaseJPEGCompress(CodecJPEGCompress * context) {
+	if (!context) return;
+
+	// jpeg_set_defaults() fills the kept tables in place next time
+	jpeg_abort_compress(&context->cinfo);
+	MemoryDetachJPEG((j_common_ptr) &context->cinfo);
+
+	if (CODECS_THREAD.compressorCount < CODECS_POOL_SIZE) {
+		context->next = CODECS_THREAD.compressors;
+		CODECS_THREAD.compressors = context;
+		CODECS_THREAD.compressorCount++;
+	} else {
+		jpeg_destroy_compress(&context->cinfo);
+		free(context);
+	}
+}
+
+void CodecsTrim() {
+	while (CODECS_THREAD.decompressors) {
+		CodecJPEGDecompress * context = CODECS_THREAD.decompressors;
+		CODECS_THREAD.decompressors = context->next;
+
+		jpeg_destroy_decompress(&context->cinfo);
+		free(context);
+	}
+
+	while (CODECS_THREAD.compressors) {
+		CodecJPEGCompress * context = CODECS_THREAD.compressors;
+		CODECS_THREAD.compressors = context->next;
+
+		jpeg_destroy_compress(&context->cinfo);
+		free(context);
+	}
+
+	CODECS_THREAD.decompressorCount = 0;
+	CODECS_THREAD.compressorCount = 0;
+}
+
+void CodecsStatisticsGet(CodecsStatistics * statistics) {
+	statistics->acquired = CODECS_ACQUIRED;
+	statistics->reused = CODECS_REUSED;
+}
+
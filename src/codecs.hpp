@@ -0,0 +1,93 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef CODECS_HPP
+#define CODECS_HPP
+
+#include "memory.hpp"
+
+extern "C" {
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+}
+
+/// Idle contexts of each kind a thread keeps
+#define CODECS_POOL_SIZE 4
+
+/**
+ * A libjpeg decompressor with its own error manager. libjpeg errors
+ * are printed and longjmp to `jmp`, so set it before every call
+ */
+typedef struct CodecJPEGDecompress {
+	struct jpeg_decompress_struct cinfo; // must be first
+	struct jpeg_error_mgr err;
+	jmp_buf jmp;
+
+	/// See CodecsJPEGSource()
+	struct jpeg_source_mgr * stdioSource;
+	struct jpeg_source_mgr * memorySource;
+
+	struct CodecJPEGDecompress * next;
+} CodecJPEGDecompress;
+
+/// Same as above for compressing
+typedef struct CodecJPEGCompress {
+	struct jpeg_compress_struct cinfo; // must be first
+	struct jpeg_error_mgr err;
+	jmp_buf jmp;
+
+	struct CodecJPEGCompress * next;
+} CodecJPEGCompress;
+
+typedef struct {
+	/// Contexts handed out
+	size_t acquired;
+
+	/// ... of which an earlier image had used
+	size_t reused;
+} CodecsStatistics;
+
+/**
+ * Hands out an idle decompressor from the calling thread's pool, or a
+ * new one. Its memory is charged to `account` until it is released.
+ * NULL if we are out of memory
+ *
+ * Reused contexts keep their permanent pool: the source manager, the
+ * marker reader and the quantization and Huffman tables
+ */
+CodecJPEGDecompress * CodecsAcquireJPEGDecompress(MemoryAccount * account);
+
+/**
+ * Aborts whatever the context was doing and puts it back in the calling
+ * thread's pool. Safe to call after libjpeg has raised an error
+ */
+void CodecsReleaseJPEGDecompress(CodecJPEGDecompress * context);
+
+/**
+ * Points the decompressor at `file`, or at the `size` bytes at `data`
+ * when `file` is NULL. Call inside the context's setjmp
+ *
+ * libjpeg will not reuse one kind of source manager as the other, so a
+ * context keeps one of each kind it has needed
+ */
+void CodecsJPEGSource(CodecJPEGDecompress * context, FILE * file, const unsigned char * data, size_t size);
+
+CodecJPEGCompress * CodecsAcquireJPEGCompress(MemoryAccount * account);
+void CodecsReleaseJPEGCompress(CodecJPEGCompress * context);
+
+/**
+ * Destroys the calling thread's idle contexts. Threads do this on
+ * their own when they exit
+ */
+void CodecsTrim();
+
+/**
+ * Totals over every thread
+ */
+void CodecsStatisticsGet(CodecsStatistics * statistics);
+
+#endif // CODECS_HPP
+
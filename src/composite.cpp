@@ -0,0 +1,165 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "composite.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern "C" {
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+}
+
+/// Light and dark squares of the checkerboard
+static const unsigned char COMPOSITE_CHECKER_LIGHT = 0xff;
+static const unsigned char COMPOSITE_CHECKER_DARK = 0xcc;
+
+int CompositeParseBackground(const char * string, ImagineBackground * background) {
+	unsigned int r = 0, g = 0, b = 0;
+	int length = 0;
+
+	if (!string || !background) {
+		return 1;
+	}
+
+	memset(background, 0, sizeof(ImagineBackground));
+
+	if (!strcmp(string, "checker")) {
+		memset(background->color, COMPOSITE_CHECKER_LIGHT, 3);
+		memset(background->second, COMPOSITE_CHECKER_DARK, 3);
+		background->checker = true;
+	} else if ((sscanf(string, "#%2x%2x%2x%n", &r, &g, &b, &length) == 3) && (length == 7) && (string[7] == '\0')) {
+		background->color[0] = r;
+		background->color[1] = g;
+		background->color[2] = b;
+	} else {
+		return 2;
+	}
+
+	return 0;
+}
+
+bool CompositeBackgroundIsGray(const ImagineBackground * background) {
+	const unsigned char * c = background->color;
+	const unsigned char * s = background->second;
+
+	return (c[0] == c[1]) && (c[0] == c[2]) && (!background->checker || ((s[0] == s[1]) && (s[0] == s[2])));
+}
+
+int CompositeBegin(Compositor * compositor, const ImagineBackground * background, int components, ImaginePixels width) {
+	if (!compositor || !background || (width < 1)) {
+		return 1;
+	} else if ((components != 2) && (components != 4)) {
+		return 2;
+	}
+
+	memset(compositor, 0, sizeof(Compositor));
+	compositor->components = components;
+	compositor->width = width;
+
+	for (int k = 0; k < (background->checker ? 2 : 1); k++) {
+		uint16_t * row = (uint16_t *) malloc(width * components * sizeof(uint16_t));
+
+		if ((compositor->backgrounds[k] = row) == NULL) {
+			CompositeEnd(compositor);
+			return 3;
+		}
+
+		for (ImaginePixels x = 0; x < width; x++) {
+			const bool dark = background->checker && (((x / COMPOSITE_CHECKER_SIZE) + k) & 1);
+			const unsigned char * color = dark ? background->second : background->color;
+
+			for (int c = 0; c < components - 1; c++) row[x * components + c] = color[c];
+			row[x * components + components - 1] = 0;
+		}
+	}
+
+	if (!background->checker) {
+		compositor->backgrounds[1] = compositor->backgrounds[0];
+	}
+
+	if ((compositor->scratch = (unsigned char *) malloc(width * components)) == NULL) {
+		CompositeEnd(compositor);
+		return 3;
+	}
+
+	return 0;
+}
+
+/**
+ * x / 255 rounded, for x up to 255 * 255
+ */
+static inline unsigned int CompositeDivide255(unsigned int x) {
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+void CompositeRow(Compositor * compositor, const unsigned char * in, ImaginePixels y, unsigned char * out, int outComponents) {
+	const int components = compositor->components;
+	const size_t length = compositor->width * components;
+	const uint16_t * background = compositor->backgrounds[(y / COMPOSITE_CHECKER_SIZE) & 1];
+	unsigned char * blended = compositor->scratch;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// Each sample becomes sample * alpha + background * (255 - alpha) in
+	// 16 bit lanes, which never overflows, then is divided by 255. The
+	// shuffles copy every pixel's alpha over its own lanes
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi16(255);
+	const __m128i half = _mm_set1_epi16(128);
+
+	for (; i + 16 <= length; i += 16) {
+		__m128i p = _mm_loadu_si128((const __m128i *) (in + i));
+		__m128i halves[2] = {_mm_unpacklo_epi8(p, zero), _mm_unpackhi_epi8(p, zero)};
+
+		for (int h = 0; h < 2; h++) {
+			__m128i v = halves[h];
+			__m128i a = components == 4
+				? _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff)
+				: _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xf5), 0xf5);
+			__m128i b = _mm_loadu_si128((const __m128i *) (background + i + h * 8));
+
+			v = _mm_add_epi16(_mm_mullo_epi16(v, a), _mm_mullo_epi16(b, _mm_sub_epi16(full, a)));
+			v = _mm_add_epi16(v, half);
+			halves[h] = _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+		}
+
+		_mm_storeu_si128((__m128i *) (blended + i), _mm_packus_epi16(halves[0], halves[1]));
+	}
+#endif
+
+	for (; i < length; i += components) {
+		const unsigned int a = in[i + components - 1];
+
+		for (int c = 0; c < components - 1; c++) {
+			blended[i + c] = CompositeDivide255(in[i + c] * a + background[i + c] * (255 - a));
+		}
+	}
+
+	// Samples only ever move towards the start of the row
+	for (ImaginePixels x = 0; x < compositor->width; x++) {
+		for (int c = 0; c < outComponents; c++) {
+			out[x * outComponents + c] = blended[x * components + c];
+		}
+	}
+}
+
+void CompositeEnd(Compositor * compositor) {
+	if (compositor) {
+		if (compositor->backgrounds[1] != compositor->backgrounds[0]) {
+			BFFree(compositor->backgrounds[1]);
+		}
+
+		BFFree(compositor->backgrounds[0]);
+		BFFree(compositor->scratch);
+		memset(compositor, 0, sizeof(Compositor));
+	}
+}
+
@@ -0,0 +1,67 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef COMPOSITE_HPP
+#define COMPOSITE_HPP
+
+#include "image.hpp"
+
+extern "C" {
+#include <stdint.h>
+}
+
+/// Side of a checkerboard square in pixels
+#define COMPOSITE_CHECKER_SIZE 8
+
+/**
+ * Lays rows with alpha over an ImagineBackground
+ *
+ * The background is laid out like the input rows once in CompositeBegin()
+ * so each row is a straight multiply and add
+ */
+typedef struct {
+	/// 2 for gray and alpha, 4 for RGBA
+	int components;
+	ImaginePixels width;
+
+	/// Background samples for rows starting on a light and on a dark
+	/// square, in the input layout with 16 bit samples. Both are the same
+	/// for a solid color
+	uint16_t * backgrounds[2];
+
+	/// Blended pixels before alpha is dropped
+	unsigned char * scratch;
+} Compositor;
+
+/**
+ * Reads "#rrggbb" or "checker"
+ */
+int CompositeParseBackground(const char * string, ImagineBackground * background);
+
+/**
+ * Every color of the background has R = G = B
+ */
+bool CompositeBackgroundIsGray(const ImagineBackground * background);
+
+/**
+ * Sets up for `width` pixel rows of `components` (2 or 4) samples. Gray
+ * and alpha rows only use the red of the background
+ *
+ * Free with CompositeEnd()
+ */
+int CompositeBegin(Compositor * compositor, const ImagineBackground * background, int components, ImaginePixels width);
+
+/**
+ * Blends row `y` over the background and writes it without alpha
+ *
+ * `outComponents` is components - 1, or 1 to keep only red of RGBA rows
+ * that are known to be gray. `out` can be `in`
+ */
+void CompositeRow(Compositor * compositor, const unsigned char * in, ImaginePixels y, unsigned char * out, int outComponents);
+
+void CompositeEnd(Compositor * compositor);
+
+#endif // COMPOSITE_HPP
+
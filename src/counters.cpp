@@ -0,0 +1,350 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "counters.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+#include <atomic>
+
+extern "C" {
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+}
+
+#define COUNTERS_EVENT_COUNT 5
+
+static const struct {
+	const char * name;
+	uint32_t type;
+	uint64_t config;
+} COUNTERS_EVENTS[COUNTERS_EVENT_COUNT] = {
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	{"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+static const char * const COUNTERS_STAGE_NAMES[kCountersStageCount] = {"open", "decode", "convert", "encode"};
+
+/**
+ * Counts of one image, per stage
+ */
+typedef struct {
+	char * path;
+	char format[16];
+	uint64_t stages[kCountersStageCount][COUNTERS_EVENT_COUNT];
+} CountersRecord;
+
+/**
+ * The image being counted on a thread. The events are one group so they
+ * are read together with one read()
+ */
+typedef struct {
+	bool active;
+	int leader;
+	int fds[COUNTERS_EVENT_COUNT];
+
+	/// Event of each group member, in the order read() gives them
+	int events[COUNTERS_EVENT_COUNT];
+	int members;
+
+	CountersStage stage;
+	uint64_t last[COUNTERS_EVENT_COUNT];
+	uint64_t stages[kCountersStageCount][COUNTERS_EVENT_COUNT];
+} CountersThread;
+
+static std::atomic<bool> COUNTERS_ENABLED(false);
+
+/// Events that could be opened when counting started
+static bool COUNTERS_AVAILABLE[COUNTERS_EVENT_COUNT];
+
+static pthread_mutex_t COUNTERS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static CountersRecord * COUNTERS_RECORDS = NULL;
+static size_t COUNTERS_RECORD_COUNT = 0;
+static size_t COUNTERS_RECORD_CAPACITY = 0;
+
+static thread_local CountersThread COUNTERS_THREAD;
+
+static void CountersClose(CountersThread * t) {
+	for (int i = 0; i < t->members; i++) {
+		close(t->fds[i]);
+	}
+
+	t->members = 0;
+	t->leader = -1;
+}
+
+/**
+ * Opens every available event on the calling thread. `errors` (optional)
+ * gets the errno of each event that could not be opened
+ */
+static int CountersOpen(CountersThread * t, int * errors) {
+	t->leader = -1;
+	t->members = 0;
+
+	for (int e = 0; e < COUNTERS_EVENT_COUNT; e++) {
+		struct perf_event_attr attr;
+		int fd = -1;
+
+		if (!COUNTERS_AVAILABLE[e]) continue;
+
+		// Only our own user space code is counted, which is what
+		// perf_event_paranoid 2 lets anybody do
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = COUNTERS_EVENTS[e].type;
+		attr.config = COUNTERS_EVENTS[e].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		if ((fd = syscall(SYS_perf_event_open, &attr, 0, -1, t->leader, 0)) == -1) {
+			if (errors) errors[e] = errno;
+			continue;
+		}
+
+		if (t->leader == -1) t->leader = fd;
+		t->fds[t->members] = fd;
+		t->events[t->members++] = e;
+	}
+
+	return t->leader == -1 ? 1 : 0;
+}
+
+/**
+ * Current values of the group, scaled up if the kernel had to share the
+ * counters with other groups
+ */
+static void CountersRead(CountersThread * t, uint64_t * values) {
+	uint64_t buffer[3 + COUNTERS_EVENT_COUNT];
+	ssize_t size = read(t->leader, buffer, sizeof(buffer));
+
+	memset(values, 0, sizeof(uint64_t) * COUNTERS_EVENT_COUNT);
+
+	if (size < (ssize_t) (sizeof(uint64_t) * 3)) return;
+
+	for (uint64_t i = 0; (i < buffer[0]) && (i < (uint64_t) t->members); i++) {
+		uint64_t value = buffer[3 + i];
+
+		if (buffer[2] && (buffer[2] < buffer[1])) {
+			value = (uint64_t) (value * ((double) buffer[1] / buffer[2]));
+		}
+
+		values[t->events[i]] = value;
+	}
+}
+
+/**
+ * Prints a row of counts, with "-" for events we do not have
+ */
+static void CountersPrintRow(const char * format, const char * stage, const uint64_t * values, const char * what) {
+	char columns[COUNTERS_EVENT_COUNT][24];
+	char ipc[16] = "-";
+
+	for (int e = 0; e < COUNTERS_EVENT_COUNT; e++) {
+		if (COUNTERS_AVAILABLE[e]) snprintf(columns[e], sizeof(columns[e]), "%lu", values[e]);
+		else strcpy(columns[e], "-");
+	}
+
+	if (COUNTERS_AVAILABLE[0] && COUNTERS_AVAILABLE[1] && values[0]) {
+		snprintf(ipc, sizeof(ipc), "%.2f", (double) values[1] / values[0]);
+	}
+
+	fprintf(stderr, "%-6s %-8s %14s %14s %5s %13s %13s %11s  %s\n",
+		format, stage, columns[0], columns[1], ipc, columns[2], columns[3], columns[4], what);
+}
+
+static void CountersPrintHeader(const char * what) {
+	fprintf(stderr, "%-6s %-8s %14s %14s %5s %13s %13s %11s  %s\n",
+		"format", "stage", "cycles", "instructions", "ipc", "cache-misses", "branch-misses", "page-faults", what);
+}
+
+/**
+ * Prints every image, then the totals of each format
+ */
+static void CountersReport() {
+	bool * printed = NULL;
+
+	if (!COUNTERS_ENABLED.exchange(false)) return;
+
+	pthread_mutex_lock(&COUNTERS_LOCK);
+
+	fprintf(stderr, "\nUser space counters per image\n");
+	CountersPrintHeader("path");
+	for (size_t i = 0; i < COUNTERS_RECORD_COUNT; i++) {
+		const CountersRecord * r = &COUNTERS_RECORDS[i];
+
+		for (int s = 0; s < kCountersStageCount; s++) {
+			CountersPrintRow(r->format, COUNTERS_STAGE_NAMES[s], r->stages[s], r->path);
+		}
+	}
+
+	fprintf(stderr, "\nUser space counters per format\n");
+	CountersPrintHeader("images");
+	printed = (bool *) calloc(COUNTERS_RECORD_COUNT + 1, sizeof(bool));
+	for (size_t i = 0; printed && (i < COUNTERS_RECORD_COUNT); i++) {
+		uint64_t totals[kCountersStageCount][COUNTERS_EVENT_COUNT];
+		char images[24];
+		size_t count = 0;
+
+		if (printed[i]) continue;
+
+		memset(totals, 0, sizeof(totals));
+		for (size_t j = i; j < COUNTERS_RECORD_COUNT; j++) {
+			const CountersRecord * r = &COUNTERS_RECORDS[j];
+
+			if (strcmp(r->format, COUNTERS_RECORDS[i].format)) continue;
+
+			for (int s = 0; s < kCountersStageCount; s++) {
+				for (int e = 0; e < COUNTERS_EVENT_COUNT; e++) totals[s][e] += r->stages[s][e];
+			}
+
+			printed[j] = true;
+			count++;
+		}
+
+		snprintf(images, sizeof(images), "%lu", count);
+		for (int s = 0; s < kCountersStageCount; s++) {
+			CountersPrintRow(COUNTERS_RECORDS[i].format, COUNTERS_STAGE_NAMES[s], totals[s], images);
+		}
+	}
+
+	for (size_t i = 0; i < COUNTERS_RECORD_COUNT; i++) {
+		BFFree(COUNTERS_RECORDS[i].path);
+	}
+
+	BFFree(printed);
+	BFFree(COUNTERS_RECORDS);
+	COUNTERS_RECORD_COUNT = 0;
+	COUNTERS_RECORD_CAPACITY = 0;
+
+	pthread_mutex_unlock(&COUNTERS_LOCK);
+}
+
+int CountersStart() {
+	CountersThread probe;
+	int errors[COUNTERS_EVENT_COUNT];
+	bool denied = false, hardware = true;
+	int opened = 0;
+
+	if (COUNTERS_ENABLED) return 0;
+
+	memset(&probe, 0, sizeof(probe));
+	memset(errors, 0, sizeof(errors));
+	for (int e = 0; e < COUNTERS_EVENT_COUNT; e++) COUNTERS_AVAILABLE[e] = true;
+
+	// Whatever opens here is what every image will get
+	CountersOpen(&probe, errors);
+	for (int e = 0; e < COUNTERS_EVENT_COUNT; e++) COUNTERS_AVAILABLE[e] = false;
+	for (int i = 0; i < probe.members; i++) COUNTERS_AVAILABLE[probe.events[i]] = true;
+	opened = probe.members;
+	CountersClose(&probe);
+
+	for (int e = 0; e < COUNTERS_EVENT_COUNT; e++) {
+		if ((errors[e] == EACCES) || (errors[e] == EPERM)) denied = true;
+		if (errors[e] && (COUNTERS_EVENTS[e].type == PERF_TYPE_HARDWARE)) hardware = false;
+	}
+
+	if (!opened && denied) {
+		BFErrorPrint("Not allowed to use performance counters, perf_event_paranoid has to be 2 or lower");
+		return 1;
+	} else if (!opened) {
+		BFErrorPrint("Could not open any performance counters");
+		return 2;
+	} else if (!hardware) {
+		BFErrorPrint("Some hardware counters are not available here and are left out");
+	}
+
+	COUNTERS_ENABLED = true;
+	atexit(CountersReport);
+
+	return 0;
+}
+
+bool CountersEnabled() {
+	return COUNTERS_ENABLED.load(std::memory_order_relaxed);
+}
+
+void CountersImageBegin() {
+	CountersThread * t = &COUNTERS_THREAD;
+
+	if (!CountersEnabled() || t->active) return;
+
+	memset(t, 0, sizeof(CountersThread));
+
+	if (CountersOpen(t, NULL) == 0) {
+		CountersRead(t, t->last);
+		t->stage = kCountersStageOpen;
+		t->active = true;
+	}
+}
+
+CountersStage CountersEnter(CountersStage stage) {
+	CountersThread * t = &COUNTERS_THREAD;
+	CountersStage previous = t->stage;
+	uint64_t now[COUNTERS_EVENT_COUNT];
+
+	if (!t->active) return previous;
+
+	CountersRead(t, now);
+
+	// Scaled counts can step back a little
+	for (int e = 0; e < COUNTERS_EVENT_COUNT; e++) {
+		if (now[e] > t->last[e]) t->stages[previous][e] += now[e] - t->last[e];
+		t->last[e] = now[e];
+	}
+
+	t->stage = stage;
+
+	return previous;
+}
+
+void CountersImageEnd(const char * path, const char * format) {
+	CountersThread * t = &COUNTERS_THREAD;
+	CountersRecord * record = NULL;
+
+	if (!t->active) return;
+
+	CountersEnter(t->stage);
+	CountersClose(t);
+	t->active = false;
+
+	pthread_mutex_lock(&COUNTERS_LOCK);
+
+	if (COUNTERS_RECORD_COUNT == COUNTERS_RECORD_CAPACITY) {
+		size_t capacity = COUNTERS_RECORD_CAPACITY ? COUNTERS_RECORD_CAPACITY * 2 : 16;
+		CountersRecord * records = (CountersRecord *) realloc(COUNTERS_RECORDS, sizeof(CountersRecord) * capacity);
+
+		if (records) {
+			COUNTERS_RECORDS = records;
+			COUNTERS_RECORD_CAPACITY = capacity;
+		}
+	}
+
+	if (COUNTERS_RECORD_COUNT < COUNTERS_RECORD_CAPACITY) {
+		record = &COUNTERS_RECORDS[COUNTERS_RECORD_COUNT++];
+		record->path = strdup(path ? path : "");
+		snprintf(record->format, sizeof(record->format), "%s", format ? format : "?");
+		memcpy(record->stages, t->stages, sizeof(record->stages));
+	}
+
+	pthread_mutex_unlock(&COUNTERS_LOCK);
+}
+
+CountersScope::CountersScope(CountersStage stage) {
+	this->_previous = CountersEnter(stage);
+}
+
+CountersScope::~CountersScope() {
+	CountersEnter(this->_previous);
+}
+
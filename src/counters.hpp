@@ -0,0 +1,72 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef COUNTERS_HPP
+#define COUNTERS_HPP
+
+/**
+ * Parts of a conversion the counters are split across
+ */
+typedef enum {
+	/// Opening, parsing headers, setting up and tearing down
+	kCountersStageOpen = 0,
+
+	/// Getting pixels out of the source format
+	kCountersStageDecode,
+
+	/// Everything done to pixels between decoding and encoding
+	kCountersStageConvert,
+
+	/// Packing pixels into the output format
+	kCountersStageEncode,
+
+	kCountersStageCount
+} CountersStage;
+
+/**
+ * Starts counting user space cycles, instructions, cache misses, branch
+ * misses and page faults per conversion stage with perf_event_open
+ *
+ * The counts of each image and the totals of each format are printed
+ * to stderr when the process exits. Hardware counters that the machine
+ * or perf_event_paranoid do not allow are left out
+ */
+int CountersStart();
+
+bool CountersEnabled();
+
+/**
+ * Starts counting for one image on the calling thread, in the open stage
+ */
+void CountersImageBegin();
+
+/**
+ * Gives what was counted since the last switch to the current stage and
+ * makes `stage` current. Returns the stage that was current
+ *
+ * Does nothing outside of CountersImageBegin() and CountersImageEnd()
+ */
+CountersStage CountersEnter(CountersStage stage);
+
+/**
+ * Stops counting on the calling thread and keeps what was counted for
+ * the report. `format` is usually the image's description()
+ */
+void CountersImageEnd(const char * path, const char * format);
+
+/**
+ * Enters a stage and goes back to the one before when it goes out of scope
+ */
+class CountersScope {
+public:
+	CountersScope(CountersStage stage);
+	~CountersScope();
+
+private:
+	CountersStage _previous;
+};
+
+#endif // COUNTERS_HPP
+
@@ -0,0 +1,450 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "dither.hpp"
+#include "batch.hpp"
+#include "trace.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+#include <atomic>
+#include <algorithm>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+}
+
+/// Bits per channel of the histogram and the nearest color cache
+#define DITHER_CELL_BITS 5
+#define DITHER_CELLS (1 << (3 * DITHER_CELL_BITS))
+
+/// How often a diffusing row tells the one below how far it got
+#define DITHER_PUBLISH_PIXELS 64
+
+static const unsigned char DITHER_BAYER[8][8] = {
+	{ 0, 32,  8, 40,  2, 34, 10, 42},
+	{48, 16, 56, 24, 50, 18, 58, 26},
+	{12, 44,  4, 36, 14, 46,  6, 38},
+	{60, 28, 52, 20, 62, 30, 54, 22},
+	{ 3, 35, 11, 43,  1, 33,  9, 41},
+	{51, 19, 59, 27, 49, 17, 57, 25},
+	{15, 47,  7, 39, 13, 45,  5, 37},
+	{63, 31, 55, 23, 61, 29, 53, 21}
+};
+
+ImagineDither DitherFromString(const char * string) {
+	if (!string) return kImagineDitherUnknown;
+	else if (!strcmp(string, "none")) return kImagineDitherNone;
+	else if (!strcmp(string, "fs")) return kImagineDitherFloydSteinberg;
+	else if (!strcmp(string, "ordered")) return kImagineDitherOrdered;
+	else return kImagineDitherUnknown;
+}
+
+static uint32_t DitherCell(int r, int g, int b) {
+	const int shift = 8 - DITHER_CELL_BITS;
+	return ((r >> shift) << (2 * DITHER_CELL_BITS)) | ((g >> shift) << DITHER_CELL_BITS) | (b >> shift);
+}
+
+/**
+ * Index of the palette color nearest to r, g, b
+ *
+ * Looks at the middle of the color's cell, and remembers the answer.
+ * Workers can race to fill the same cell but always write the same value
+ */
+static int DitherNearest(DitherPalette * palette, int r, int g, int b) {
+	const uint32_t cell = DitherCell(r, g, b);
+	uint16_t entry = __atomic_load_n(&palette->lookup[cell], __ATOMIC_RELAXED);
+
+	if (entry == 0) {
+		const int shift = 8 - DITHER_CELL_BITS;
+		const int half = 1 << (shift - 1);
+		int cr = ((cell >> (2 * DITHER_CELL_BITS)) << shift) + half;
+		int cg = (((cell >> DITHER_CELL_BITS) & ((1 << DITHER_CELL_BITS) - 1)) << shift) + half;
+		int cb = ((cell & ((1 << DITHER_CELL_BITS) - 1)) << shift) + half;
+		int best = 0, bestDistance = -1;
+
+		for (int i = 0; i < palette->count; i++) {
+			int dr = cr - palette->colors[i][0], dg = cg - palette->colors[i][1], db = cb - palette->colors[i][2];
+			int distance = dr * dr + dg * dg + db * db;
+
+			if ((bestDistance < 0) || (distance < bestDistance)) {
+				best = i;
+				bestDistance = distance;
+			}
+		}
+
+		entry = best + 1;
+		__atomic_store_n(&palette->lookup[cell], entry, __ATOMIC_RELAXED);
+	}
+
+	return entry - 1;
+}
+
+int DitherPaletteInit(DitherPalette * palette) {
+	if (!palette || (palette->count < 1) || (palette->count > DITHER_MAX_COLORS)) {
+		return 1;
+	} else if ((palette->lookup = (uint16_t *) calloc(DITHER_CELLS, sizeof(uint16_t))) == NULL) {
+		return 2;
+	}
+
+	return 0;
+}
+
+void DitherPaletteFree(DitherPalette * palette) {
+	if (palette) {
+		BFFree(palette->lookup);
+		palette->lookup = NULL;
+	}
+}
+
+/**
+ * A range of histogram cells in median cut
+ */
+typedef struct {
+	uint32_t start;
+	uint32_t end;
+	uint64_t pixels;
+
+	/// Channel with the widest spread and how wide it is
+	int channel;
+	int range;
+} DitherBox;
+
+static int DitherCellChannel(uint32_t cell, int channel) {
+	return (cell >> ((2 - channel) * DITHER_CELL_BITS)) & ((1 << DITHER_CELL_BITS) - 1);
+}
+
+static void DitherBoxMeasure(DitherBox * box, const uint32_t * cells, const uint32_t * counts) {
+	int low[3] = {255, 255, 255}, high[3] = {0, 0, 0};
+
+	box->pixels = 0;
+	for (uint32_t i = box->start; i < box->end; i++) {
+		box->pixels += counts[cells[i]];
+
+		for (int c = 0; c < 3; c++) {
+			int v = DitherCellChannel(cells[i], c);
+			if (v < low[c]) low[c] = v;
+			if (v > high[c]) high[c] = v;
+		}
+	}
+
+	box->channel = 0;
+	box->range = 0;
+	for (int c = 0; c < 3; c++) {
+		if (high[c] - low[c] > box->range) {
+			box->channel = c;
+			box->range = high[c] - low[c];
+		}
+	}
+}
+
+int DitherPaletteCreate(const unsigned char * rgb, ImaginePixels width, ImaginePixels height, int colors, DitherPalette * palette) {
+	int result = 0;
+	uint32_t * counts = NULL;
+	TraceScope scope("DitherPaletteCreate");
+	uint64_t (* sums)[3] = NULL;
+	uint32_t * cells = NULL;
+	uint32_t used = 0;
+	DitherBox boxes[DITHER_MAX_COLORS];
+	int boxCount = 0;
+
+	if (!rgb || !palette || (colors < 2) || (colors > DITHER_MAX_COLORS)) {
+		return 1;
+	}
+
+	memset(palette, 0, sizeof(DitherPalette));
+
+	counts = (uint32_t *) calloc(DITHER_CELLS, sizeof(uint32_t));
+	sums = (uint64_t (*)[3]) calloc(DITHER_CELLS, sizeof(uint64_t[3]));
+	cells = (uint32_t *) malloc(DITHER_CELLS * sizeof(uint32_t));
+
+	if (!counts || !sums || !cells) {
+		result = 2;
+	}
+
+	if (result == 0) {
+		const size_t pixels = (size_t) width * height;
+
+		for (size_t i = 0; i < pixels; i++) {
+			const unsigned char * p = rgb + i * 3;
+			uint32_t cell = DitherCell(p[0], p[1], p[2]);
+
+			// Counts saturate rather than wrap on enormous images
+			if (counts[cell] != UINT32_MAX) counts[cell]++;
+			sums[cell][0] += p[0];
+			sums[cell][1] += p[1];
+			sums[cell][2] += p[2];
+		}
+
+		for (uint32_t cell = 0; cell < DITHER_CELLS; cell++) {
+			if (counts[cell]) cells[used++] = cell;
+		}
+
+		boxes[0].start = 0;
+		boxes[0].end = used;
+		DitherBoxMeasure(&boxes[0], cells, counts);
+		boxCount = used ? 1 : 0;
+	}
+
+	// Keep splitting the box where a split matters most, at the median
+	// pixel along its widest channel
+	while ((result == 0) && (boxCount < colors)) {
+		DitherBox * box = NULL;
+		uint64_t best = 0;
+
+		for (int i = 0; i < boxCount; i++) {
+			uint64_t score = boxes[i].pixels * boxes[i].range;
+			if ((boxes[i].end - boxes[i].start > 1) && (score > best)) {
+				box = &boxes[i];
+				best = score;
+			}
+		}
+
+		if (!box) break;
+
+		const int channel = box->channel;
+		std::sort(cells + box->start, cells + box->end, [channel](uint32_t a, uint32_t b) {
+			return DitherCellChannel(a, channel) < DitherCellChannel(b, channel);
+		});
+
+		uint64_t seen = 0;
+		uint32_t split = box->start;
+		while ((split < box->end - 1) && (seen + counts[cells[split]] <= box->pixels / 2)) {
+			seen += counts[cells[split++]];
+		}
+		if (split == box->start) split++;
+
+		DitherBox * upper = &boxes[boxCount++];
+		upper->start = split;
+		upper->end = box->end;
+		box->end = split;
+
+		DitherBoxMeasure(box, cells, counts);
+		DitherBoxMeasure(upper, cells, counts);
+	}
+
+	// Each color is the mean of the pixels in its box
+	for (int i = 0; (result == 0) && (i < boxCount); i++) {
+		uint64_t total[3] = {0, 0, 0}, pixels = 0;
+
+		for (uint32_t n = boxes[i].start; n < boxes[i].end; n++) {
+			pixels += counts[cells[n]];
+			for (int c = 0; c < 3; c++) total[c] += sums[cells[n]][c];
+		}
+
+		for (int c = 0; c < 3; c++) {
+			palette->colors[i][c] = (total[c] + pixels / 2) / pixels;
+		}
+	}
+
+	if (result == 0) {
+		palette->count = boxCount;
+		result = DitherPaletteInit(palette);
+	}
+
+	BFFree(counts);
+	BFFree(sums);
+	BFFree(cells);
+
+	return result;
+}
+
+typedef struct {
+	const unsigned char * rgb;
+	ImaginePixels width;
+	DitherPalette * palette;
+	unsigned char * indexes;
+
+	/// Floyd-Steinberg: error for the next row, in sixteenths, for rows
+	/// of even and odd y. Each has a pixel of padding on both ends
+	int * errors[2];
+
+	/// Pixels of each row that are done
+	std::atomic<ImaginePixels> * progress;
+
+	/// Ordered: thresholds to add and subtract for each of 8 rows, and
+	/// a scratch row per worker
+	unsigned char * plus;
+	unsigned char * minus;
+	unsigned char ** scratch;
+} DitherContext;
+
+/**
+ * Waits until row y - 1 has finished `pixels` pixels
+ */
+static ImaginePixels DitherWait(std::atomic<ImaginePixels> * above, ImaginePixels known, ImaginePixels pixels) {
+	while (known < pixels) {
+		known = above->load(std::memory_order_acquire);
+		if (known < pixels) sched_yield();
+	}
+
+	return known;
+}
+
+static int DitherDiffuseRow(size_t y, int worker, void * context) {
+	DitherContext * ctx = (DitherContext *) context;
+	const ImaginePixels width = ctx->width;
+	const unsigned char * p = ctx->rgb + y * width * 3;
+	unsigned char * out = ctx->indexes + y * width;
+	int * current = ctx->errors[y & 1] + 3;
+	int * next = ctx->errors[(y + 1) & 1] + 3;
+	std::atomic<ImaginePixels> * above = y ? &ctx->progress[y - 1] : NULL;
+	ImaginePixels ready = y ? 0 : width;
+	int right[3] = {0, 0, 0};
+
+	// The row above is done with the start of what becomes our next row
+	ready = DitherWait(above, ready, width < 2 ? width : 2);
+	memset(next - 3, 0, 6 * sizeof(int));
+
+	for (ImaginePixels x = 0; x < width; x++) {
+		int value[3];
+
+		// Error for this pixel is final once the row above has done the
+		// pixel down and to the right of us
+		ready = DitherWait(above, ready, x + 2 < width ? x + 2 : width);
+
+		for (int c = 0; c < 3; c++) {
+			int v = p[x * 3 + c] + ((current[x * 3 + c] + right[c] + 8) >> 4);
+			value[c] = v < 0 ? 0 : (v > 255 ? 255 : v);
+		}
+
+		int index = DitherNearest(ctx->palette, value[0], value[1], value[2]);
+		const uint8_t * chosen = ctx->palette->colors[index];
+		out[x] = index;
+
+		for (int c = 0; c < 3; c++) {
+			int e = value[c] - chosen[c];
+
+			right[c] = 7 * e;
+			next[(x - 1) * 3 + c] += 3 * e;
+			next[x * 3 + c] += 5 * e;
+			next[(x + 1) * 3 + c] = e;
+		}
+
+		if ((x % DITHER_PUBLISH_PIXELS) == DITHER_PUBLISH_PIXELS - 1) {
+			ctx->progress[y].store(x + 1, std::memory_order_release);
+		}
+	}
+
+	ctx->progress[y].store(width, std::memory_order_release);
+
+	return 0;
+}
+
+static int DitherOrderedRow(size_t y, int worker, void * context) {
+	DitherContext * ctx = (DitherContext *) context;
+	const size_t bytes = ctx->width * 3;
+	const unsigned char * p = ctx->rgb + y * bytes;
+	const unsigned char * plus = ctx->plus + (y & 7) * bytes;
+	const unsigned char * minus = ctx->minus + (y & 7) * bytes;
+	unsigned char * biased = ctx->scratch[worker];
+	unsigned char * out = ctx->indexes + y * ctx->width;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= bytes; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+		v = _mm_adds_epu8(v, _mm_loadu_si128((const __m128i *) (plus + i)));
+		v = _mm_subs_epu8(v, _mm_loadu_si128((const __m128i *) (minus + i)));
+		_mm_storeu_si128((__m128i *) (biased + i), v);
+	}
+#endif
+
+	for (; i < bytes; i++) {
+		int v = p[i] + plus[i] - minus[i];
+		biased[i] = v < 0 ? 0 : (v > 255 ? 255 : v);
+	}
+
+	for (ImaginePixels x = 0; x < ctx->width; x++) {
+		out[x] = DitherNearest(ctx->palette, biased[x * 3], biased[x * 3 + 1], biased[x * 3 + 2]);
+	}
+
+	return 0;
+}
+
+int DitherImage(const unsigned char * rgb, ImaginePixels width, ImaginePixels height, DitherPalette * palette, ImagineDither mode, int threads, unsigned char * indexes) {
+	int result = 0;
+	DitherContext ctx;
+	const size_t bytes = width * 3;
+	TraceScope scope("DitherImage");
+
+	if (!rgb || !palette || !palette->lookup || !indexes || (width < 1) || (height < 1)) {
+		return 1;
+	} else if (threads < 1) {
+		threads = 1;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.rgb = rgb;
+	ctx.width = width;
+	ctx.palette = palette;
+	ctx.indexes = indexes;
+
+	if (mode == kImagineDitherFloydSteinberg) {
+		ctx.errors[0] = (int *) calloc((width + 2) * 3, sizeof(int));
+		ctx.errors[1] = (int *) calloc((width + 2) * 3, sizeof(int));
+		ctx.progress = new std::atomic<ImaginePixels>[height];
+
+		if (!ctx.errors[0] || !ctx.errors[1] || !ctx.progress) {
+			result = 2;
+		}
+
+		for (ImaginePixels y = 0; (result == 0) && (y < height); y++) {
+			ctx.progress[y] = 0;
+		}
+
+		// Rows are handed out in order, so the row each one waits on
+		// has always been started
+		if (result == 0) {
+			result = BatchRun(height, threads, DitherDiffuseRow, &ctx, NULL);
+		}
+	} else if ((mode == kImagineDitherOrdered) || (mode == kImagineDitherNone)) {
+		// Thresholds span about the gap between neighbouring colors
+		const double spread = mode == kImagineDitherOrdered ? 256.0 / cbrt(palette->count) : 0;
+
+		ctx.plus = (unsigned char *) calloc(8, bytes);
+		ctx.minus = (unsigned char *) calloc(8, bytes);
+		ctx.scratch = (unsigned char **) calloc(threads, sizeof(unsigned char *));
+
+		if (!ctx.plus || !ctx.minus || !ctx.scratch) {
+			result = 2;
+		}
+
+		for (int i = 0; (result == 0) && (i < threads); i++) {
+			if ((ctx.scratch[i] = (unsigned char *) malloc(bytes)) == NULL) result = 2;
+		}
+
+		for (int y = 0; (result == 0) && (y < 8); y++) {
+			for (ImaginePixels x = 0; x < width; x++) {
+				int offset = lround(((DITHER_BAYER[y][x & 7] + 0.5) / 64 - 0.5) * spread);
+
+				memset(ctx.plus + y * bytes + x * 3, offset > 0 ? offset : 0, 3);
+				memset(ctx.minus + y * bytes + x * 3, offset < 0 ? -offset : 0, 3);
+			}
+		}
+
+		if (result == 0) {
+			result = BatchRun(height, threads, DitherOrderedRow, &ctx, NULL);
+		}
+	} else {
+		result = 3;
+	}
+
+	BFFree(ctx.errors[0]);
+	BFFree(ctx.errors[1]);
+	delete [] ctx.progress;
+	BFFree(ctx.plus);
+	BFFree(ctx.minus);
+	for (int i = 0; ctx.scratch && (i < threads); i++) BFFree(ctx.scratch[i]);
+	BFFree(ctx.scratch);
+
+	return result;
+}
+
@@ -0,0 +1,64 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef DITHER_HPP
+#define DITHER_HPP
+
+#include "image.hpp"
+
+extern "C" {
+#include <stdint.h>
+}
+
+/// Most colors a palette can hold
+#define DITHER_MAX_COLORS 256
+
+/**
+ * Colors picked for an image and a cache of which one is nearest to
+ * any color
+ */
+typedef struct {
+	int count;
+	uint8_t colors[DITHER_MAX_COLORS][3];
+
+	/// One entry per color with 5 bits per channel, filled in as colors
+	/// are looked up. 0 is unfilled, otherwise the index plus one
+	uint16_t * lookup;
+} DitherPalette;
+
+/**
+ * Maps none, fs and ordered to their mode
+ */
+ImagineDither DitherFromString(const char * string);
+
+/**
+ * Picks up to `colors` colors for `width` x `height` RGB pixels with
+ * median cut
+ *
+ * Free with DitherPaletteFree()
+ */
+int DitherPaletteCreate(const unsigned char * rgb, ImaginePixels width, ImaginePixels height, int colors, DitherPalette * palette);
+
+/**
+ * Sets up `palette` for the `count` colors already in it, for callers
+ * that bring their own
+ */
+int DitherPaletteInit(DitherPalette * palette);
+
+void DitherPaletteFree(DitherPalette * palette);
+
+/**
+ * Writes the palette index of each pixel to `indexes`
+ *
+ * Floyd-Steinberg runs as a wavefront: row y can go as far as row y - 1
+ * is minus two pixels, so `threads` workers each take a row and follow
+ * each other down the image. The output is the same for any number of
+ * threads. Ordered dithering adds an 8x8 Bayer threshold with SSE2 and
+ * every row is independent
+ */
+int DitherImage(const unsigned char * rgb, ImaginePixels width, ImaginePixels height, DitherPalette * palette, ImagineDither mode, int threads, unsigned char * indexes);
+
+#endif // DITHER_HPP
+
@@ -0,0 +1,259 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "dupes.hpp"
+#include "batch.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+#include <atomic>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+}
+
+/// Chunks never get more bits than this so a table's slots fit in 64 MiB
+static const int DUPES_MAX_CHUNK_BITS = 24;
+
+/**
+ * What looking up a slot costs next to checking one hash in it
+ *
+ * Slots are all over a table that is far bigger than the cache, while
+ * a slot's hashes sit next to each other, so a lookup is about one
+ * cache miss
+ */
+static const double DUPES_LOOKUP_COST = 50;
+
+/**
+ * Hashes grouped by the value of bits [shift, shift + bits)
+ *
+ * Hashes with chunk value v are values[offsets[v]] up to
+ * values[offsets[v + 1]], and items has their indexes. The hashes are
+ * copied in so a slot is read straight through
+ */
+typedef struct {
+	int shift;
+	int bits;
+	uint32_t * offsets;
+	uint64_t * values;
+	uint32_t * items;
+} DupesTable;
+
+typedef struct {
+	const uint64_t * hashes;
+	const bool * valid;
+	int distance;
+
+	DupesTable * tables;
+	int tableCount;
+
+	/// Bits a chunk can be off by while its hash is still in reach
+	int radius;
+
+	/// Union-find forest. Roots are always the lowest index in their set
+	std::atomic<size_t> * parents;
+} DupesContext;
+
+static uint32_t DupesChunk(const DupesTable * table, uint64_t hash) {
+	return (uint32_t) ((hash >> table->shift) & ((1ULL << table->bits) - 1));
+}
+
+static int DupesTableBuild(DupesTable * table, const uint64_t * hashes, const bool * valid, size_t count) {
+	size_t slots = (size_t) 1 << table->bits;
+	uint32_t * next = NULL;
+
+	table->offsets = (uint32_t *) calloc(slots + 1, sizeof(uint32_t));
+	table->values = (uint64_t *) malloc(count * sizeof(uint64_t) + 1);
+	table->items = (uint32_t *) malloc(count * sizeof(uint32_t) + 1);
+	next = (uint32_t *) malloc(slots * sizeof(uint32_t));
+
+	if (!table->offsets || !table->values || !table->items || !next) {
+		BFFree(next);
+		return 1;
+	}
+
+	// Counting sort on the chunk value
+	for (size_t i = 0; i < count; i++) {
+		if (!valid || valid[i]) table->offsets[DupesChunk(table, hashes[i]) + 1]++;
+	}
+
+	for (size_t v = 0; v < slots; v++) {
+		table->offsets[v + 1] += table->offsets[v];
+	}
+
+	memcpy(next, table->offsets, slots * sizeof(uint32_t));
+	for (size_t i = 0; i < count; i++) {
+		if (!valid || valid[i]) {
+			uint32_t n = next[DupesChunk(table, hashes[i])]++;
+			table->values[n] = hashes[i];
+			table->items[n] = i;
+		}
+	}
+
+	BFFree(next);
+
+	return 0;
+}
+
+static size_t DupesFind(std::atomic<size_t> * parents, size_t i) {
+	while (true) {
+		size_t parent = parents[i].load();
+		if (parent == i) return i;
+
+		// Path halving. Losing the race only means a longer path
+		size_t grandparent = parents[parent].load();
+		if (parent != grandparent) parents[i].compare_exchange_weak(parent, grandparent);
+
+		i = grandparent;
+	}
+}
+
+static void DupesUnion(std::atomic<size_t> * parents, size_t a, size_t b) {
+	while (true) {
+		a = DupesFind(parents, a);
+		b = DupesFind(parents, b);
+
+		if (a == b) {
+			return;
+		} else if (a < b) {
+			size_t t = a;
+			a = b;
+			b = t;
+		}
+
+		// Only a root can be linked, so if someone linked `a` since
+		// we found it we go around again
+		size_t expected = a;
+		if (parents[a].compare_exchange_strong(expected, b)) return;
+	}
+}
+
+/**
+ * Checks the hashes in chunk slot `value` against hash i
+ */
+static void DupesVisit(DupesContext * ctx, const DupesTable * table, uint32_t value, size_t i) {
+	const uint64_t hash = ctx->hashes[i];
+
+	for (uint32_t n = table->offsets[value]; n < table->offsets[value + 1]; n++) {
+		// Every pair is found from both ends, the lower index is enough
+		if ((table->items[n] > i) && (__builtin_popcountll(hash ^ table->values[n]) <= ctx->distance)) {
+			DupesUnion(ctx->parents, i, table->items[n]);
+		}
+	}
+}
+
+/**
+ * Visits every chunk value within `radius` bits of `value`, flipping
+ * bits from `first` up so each is reached once
+ */
+static void DupesProbe(DupesContext * ctx, const DupesTable * table, uint32_t value, int first, int radius, size_t i) {
+	DupesVisit(ctx, table, value, i);
+
+	for (int bit = first; (radius > 0) && (bit < table->bits); bit++) {
+		DupesProbe(ctx, table, value ^ (1U << bit), bit + 1, radius - 1, i);
+	}
+}
+
+static int DupesJob(size_t index, int worker, void * context) {
+	DupesContext * ctx = (DupesContext *) context;
+
+	if (!ctx->valid || ctx->valid[index]) {
+		for (int t = 0; t < ctx->tableCount; t++) {
+			const DupesTable * table = &ctx->tables[t];
+			DupesProbe(ctx, table, DupesChunk(table, ctx->hashes[index]), 0, ctx->radius, index);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Picks the number of chunks that makes a search cheapest
+ *
+ * More chunks mean narrower ones, so fewer slots to look up around each
+ * chunk but more hashes in every slot
+ */
+static int DupesTableCount(size_t count, int distance) {
+	int best = 0;
+	double bestCost = 0;
+
+	for (int tables = (64 + DUPES_MAX_CHUNK_BITS - 1) / DUPES_MAX_CHUNK_BITS; tables <= 16; tables++) {
+		int bits = 64 / tables;
+		int radius = distance / tables;
+		double slots = 0, binomial = 1;
+
+		// Slots within radius bits of a chunk
+		for (int r = 0; r <= radius; r++) {
+			slots += binomial;
+			binomial = binomial * (bits - r) / (r + 1);
+		}
+
+		double cost = tables * slots * (DUPES_LOOKUP_COST + (double) count / (1ULL << bits));
+		if (!best || (cost < bestCost)) {
+			best = tables;
+			bestCost = cost;
+		}
+	}
+
+	return best;
+}
+
+int DupesFindClusters(const uint64_t * hashes, const bool * valid, size_t count, int distance, int threads, size_t * clusters) {
+	int result = 0;
+	DupesContext ctx;
+
+	if (!hashes || !clusters) {
+		return 1;
+	} else if ((distance < 0) || (distance > DUPES_MAX_DISTANCE)) {
+		return 2;
+	} else if (count >= UINT32_MAX) {
+		return 3;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.hashes = hashes;
+	ctx.valid = valid;
+	ctx.distance = distance;
+
+	ctx.tableCount = DupesTableCount(count, distance);
+	ctx.radius = distance / ctx.tableCount;
+
+	ctx.tables = (DupesTable *) calloc(ctx.tableCount, sizeof(DupesTable));
+	ctx.parents = new std::atomic<size_t>[count ? count : 1];
+
+	if (!ctx.tables || !ctx.parents) {
+		result = 4;
+	}
+
+	// Spread the 64 bits as evenly as we can
+	for (int t = 0, shift = 0; (result == 0) && (t < ctx.tableCount); t++) {
+		ctx.tables[t].shift = shift;
+		ctx.tables[t].bits = 64 / ctx.tableCount + (t < (64 % ctx.tableCount));
+		shift += ctx.tables[t].bits;
+
+		result = DupesTableBuild(&ctx.tables[t], hashes, valid, count);
+	}
+
+	if (result == 0) {
+		for (size_t i = 0; i < count; i++) ctx.parents[i] = i;
+
+		result = BatchRun(count, threads, DupesJob, &ctx, NULL);
+	}
+
+	if (result == 0) {
+		for (size_t i = 0; i < count; i++) clusters[i] = DupesFind(ctx.parents, i);
+	}
+
+	for (int t = 0; ctx.tables && (t < ctx.tableCount); t++) {
+		BFFree(ctx.tables[t].offsets);
+		BFFree(ctx.tables[t].values);
+		BFFree(ctx.tables[t].items);
+	}
+
+	BFFree(ctx.tables);
+	delete [] ctx.parents;
+
+	return result;
+}
+
@@ -0,0 +1,37 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef DUPES_HPP
+#define DUPES_HPP
+
+extern "C" {
+#include <stddef.h>
+#include <stdint.h>
+}
+
+/// Largest hamming distance DupesFindClusters() accepts
+#define DUPES_MAX_DISTANCE 16
+
+/**
+ * Groups 64 bit hashes that are within `distance` bits of another
+ * hash in the group
+ *
+ * Uses multi-index hashing: the hashes are split into m chunks and each
+ * chunk gets a table of which hashes have which value there. Two hashes
+ * within distance k must have some chunk within k / m bits of each
+ * other, so each hash only has to look at the table entries within that
+ * many bits of its own chunks. m is picked from the number of hashes so
+ * that the tables stay small enough to index directly and the entries
+ * per slot stay low.
+ *
+ * `clusters[i]` gets the lowest index in i's group, which is i for a
+ * hash without near duplicates. Entries with `valid[i]` false (`valid`
+ * can be NULL) are left in groups of their own. The search runs on
+ * `threads` workers
+ */
+int DupesFindClusters(const uint64_t * hashes, const bool * valid, size_t count, int distance, int threads, size_t * clusters);
+
+#endif // DUPES_HPP
+
@@ -0,0 +1,450 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ *
+ * References: https://www.cipa.jp/std/documents/e/DC-X008-Translation-2019-E.pdf
+ */
+
+#include "exif.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+}
+
+using namespace BF;
+
+// Field types from the TIFF spec
+const uint16_t EXIF_TYPE_BYTE = 1;
+const uint16_t EXIF_TYPE_ASCII = 2;
+const uint16_t EXIF_TYPE_SHORT = 3;
+const uint16_t EXIF_TYPE_LONG = 4;
+const uint16_t EXIF_TYPE_RATIONAL = 5;
+const uint16_t EXIF_TYPE_UNDEFINED = 7;
+const uint16_t EXIF_TYPE_SRATIONAL = 10;
+
+/// Bytes per value for each type, indexed by type
+const int EXIF_TYPE_SIZES[] = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8};
+
+// IFD0 tags
+const uint16_t EXIF_TAG_MAKE = 0x010F;
+const uint16_t EXIF_TAG_MODEL = 0x0110;
+const uint16_t EXIF_TAG_ORIENTATION = 0x0112;
+const uint16_t EXIF_TAG_SOFTWARE = 0x0131;
+const uint16_t EXIF_TAG_DATE_TIME = 0x0132;
+const uint16_t EXIF_TAG_EXIF_IFD = 0x8769;
+const uint16_t EXIF_TAG_GPS_IFD = 0x8825;
+
+// EXIF IFD tags
+const uint16_t EXIF_TAG_EXPOSURE_TIME = 0x829A;
+const uint16_t EXIF_TAG_F_NUMBER = 0x829D;
+const uint16_t EXIF_TAG_ISO = 0x8827;
+const uint16_t EXIF_TAG_DATE_TIME_ORIGINAL = 0x9003;
+const uint16_t EXIF_TAG_DATE_TIME_DIGITIZED = 0x9004;
+const uint16_t EXIF_TAG_EXPOSURE_BIAS = 0x9204;
+const uint16_t EXIF_TAG_FOCAL_LENGTH = 0x920A;
+const uint16_t EXIF_TAG_PIXEL_X_DIMENSION = 0xA002;
+const uint16_t EXIF_TAG_PIXEL_Y_DIMENSION = 0xA003;
+const uint16_t EXIF_TAG_LENS_MAKE = 0xA433;
+const uint16_t EXIF_TAG_LENS_MODEL = 0xA434;
+
+// GPS IFD tags
+const uint16_t EXIF_TAG_GPS_LATITUDE_REF = 0x0001;
+const uint16_t EXIF_TAG_GPS_LATITUDE = 0x0002;
+const uint16_t EXIF_TAG_GPS_LONGITUDE_REF = 0x0003;
+const uint16_t EXIF_TAG_GPS_LONGITUDE = 0x0004;
+const uint16_t EXIF_TAG_GPS_ALTITUDE_REF = 0x0005;
+const uint16_t EXIF_TAG_GPS_ALTITUDE = 0x0006;
+
+/// Size of one IFD entry: tag, type, count, value/offset
+const size_t EXIF_ENTRY_SIZE = 12;
+
+typedef enum {
+	kEXIFDirectoryIFD0,
+	kEXIFDirectoryEXIF,
+	kEXIFDirectoryGPS,
+} EXIFDirectory;
+
+typedef struct {
+	const unsigned char * data;
+	size_t size;
+	bool bigEndian;
+} EXIFReader;
+
+/**
+ * An IFD entry whose values are known to be inside the buffer
+ */
+typedef struct {
+	uint16_t tag;
+	uint16_t type;
+	uint32_t count;
+
+	/// Where the first value starts
+	size_t offset;
+} EXIFEntry;
+
+static uint16_t EXIFRead16(const EXIFReader * r, size_t offset) {
+	const unsigned char * b = r->data + offset;
+	return r->bigEndian ? (b[0] << 8) | b[1] : (b[1] << 8) | b[0];
+}
+
+static uint32_t EXIFRead32(const EXIFReader * r, size_t offset) {
+	const unsigned char * b = r->data + offset;
+	if (r->bigEndian) return ((uint32_t) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+	else return ((uint32_t) b[3] << 24) | (b[2] << 16) | (b[1] << 8) | b[0];
+}
+
+static void EXIFWrite16(unsigned char * b, bool bigEndian, uint16_t value) {
+	b[bigEndian ? 0 : 1] = value >> 8;
+	b[bigEndian ? 1 : 0] = value & 0xFF;
+}
+
+static void EXIFWrite32(unsigned char * b, bool bigEndian, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		b[bigEndian ? 3 - i : i] = (value >> (i * 8)) & 0xFF;
+	}
+}
+
+/**
+ * Reads the entry at `offset`. Returns false if its type is unknown
+ * or its values are not all inside the buffer
+ */
+static bool EXIFEntryRead(const EXIFReader * r, size_t offset, EXIFEntry * entry) {
+	uint64_t total;
+
+	entry->tag = EXIFRead16(r, offset);
+	entry->type = EXIFRead16(r, offset + 2);
+	entry->count = EXIFRead32(r, offset + 4);
+
+	if ((entry->type == 0) || (entry->type >= sizeof(EXIF_TYPE_SIZES) / sizeof(int))) return false;
+
+	total = (uint64_t) entry->count * EXIF_TYPE_SIZES[entry->type];
+
+	// Values that fit in 4 bytes are stored in the entry itself
+	entry->offset = total <= 4 ? offset + 8 : EXIFRead32(r, offset + 8);
+
+	return (total <= r->size) && (entry->offset <= r->size - total);
+}
+
+static uint32_t EXIFEntryInteger(const EXIFReader * r, const EXIFEntry * entry) {
+	if (entry->count == 0) return 0;
+
+	switch (entry->type) {
+		case EXIF_TYPE_BYTE: return r->data[entry->offset];
+		case EXIF_TYPE_SHORT: return EXIFRead16(r, entry->offset);
+		case EXIF_TYPE_LONG: return EXIFRead32(r, entry->offset);
+		default: return 0;
+	}
+}
+
+static EXIFRational EXIFEntryRational(const EXIFReader * r, const EXIFEntry * entry, uint32_t index) {
+	EXIFRational result = {0, 0};
+	size_t offset = entry->offset + index * 8;
+
+	if (index >= entry->count) {
+		return result;
+	} else if (entry->type == EXIF_TYPE_RATIONAL) {
+		result.numerator = EXIFRead32(r, offset);
+		result.denominator = EXIFRead32(r, offset + 4);
+	} else if (entry->type == EXIF_TYPE_SRATIONAL) {
+		result.numerator = (int32_t) EXIFRead32(r, offset);
+		result.denominator = (int32_t) EXIFRead32(r, offset + 4);
+	}
+
+	return result;
+}
+
+/**
+ * Points at the entry's text, without the trailing nulls and padding
+ */
+static EXIFString EXIFEntryString(const EXIFReader * r, const EXIFEntry * entry) {
+	EXIFString result = {NULL, 0};
+
+	if ((entry->type != EXIF_TYPE_ASCII) && (entry->type != EXIF_TYPE_UNDEFINED)) return result;
+
+	const char * value = (const char *) r->data + entry->offset;
+	const char * nul = (const char *) memchr(value, '\0', entry->count);
+	size_t size = nul ? nul - value : entry->count;
+
+	while ((size > 0) && (value[size - 1] == ' ')) size--;
+
+	result.value = value;
+	result.size = size;
+
+	return result;
+}
+
+static void EXIFEntryHandle(
+	const EXIFReader * r,
+	EXIFDirectory directory,
+	const EXIFEntry * e,
+	EXIFInfo * info,
+	size_t * exifIFD,
+	size_t * gpsIFD
+) {
+	if (directory == kEXIFDirectoryIFD0) {
+		switch (e->tag) {
+			case EXIF_TAG_MAKE: info->make = EXIFEntryString(r, e); break;
+			case EXIF_TAG_MODEL: info->model = EXIFEntryString(r, e); break;
+			case EXIF_TAG_SOFTWARE: info->software = EXIFEntryString(r, e); break;
+			case EXIF_TAG_DATE_TIME: info->dateTime = EXIFEntryString(r, e); break;
+			case EXIF_TAG_EXIF_IFD: *exifIFD = EXIFEntryInteger(r, e); break;
+			case EXIF_TAG_GPS_IFD: *gpsIFD = EXIFEntryInteger(r, e); break;
+			case EXIF_TAG_ORIENTATION:
+				if ((e->type == EXIF_TYPE_SHORT) && (e->count >= 1)) {
+					info->orientation = EXIFEntryInteger(r, e);
+					info->orientationOffset = e->offset;
+				}
+				break;
+		}
+	} else if (directory == kEXIFDirectoryEXIF) {
+		switch (e->tag) {
+			case EXIF_TAG_EXPOSURE_TIME: info->exposureTime = EXIFEntryRational(r, e, 0); break;
+			case EXIF_TAG_F_NUMBER: info->fNumber = EXIFEntryRational(r, e, 0); break;
+			case EXIF_TAG_FOCAL_LENGTH: info->focalLength = EXIFEntryRational(r, e, 0); break;
+			case EXIF_TAG_EXPOSURE_BIAS: info->exposureBias = EXIFEntryRational(r, e, 0); break;
+			case EXIF_TAG_ISO: info->iso = EXIFEntryInteger(r, e); break;
+			case EXIF_TAG_DATE_TIME_ORIGINAL: info->dateTimeOriginal = EXIFEntryString(r, e); break;
+			case EXIF_TAG_DATE_TIME_DIGITIZED: info->dateTimeDigitized = EXIFEntryString(r, e); break;
+			case EXIF_TAG_LENS_MAKE: info->lensMake = EXIFEntryString(r, e); break;
+			case EXIF_TAG_LENS_MODEL: info->lensModel = EXIFEntryString(r, e); break;
+			case EXIF_TAG_PIXEL_X_DIMENSION:
+				info->pixelWidthOffset = e->offset;
+				info->pixelWidthType = e->type;
+				break;
+			case EXIF_TAG_PIXEL_Y_DIMENSION:
+				info->pixelHeightOffset = e->offset;
+				info->pixelHeightType = e->type;
+				break;
+		}
+	} else if (directory == kEXIFDirectoryGPS) {
+		info->hasGPS = true;
+
+		switch (e->tag) {
+			case EXIF_TAG_GPS_LATITUDE_REF:
+				if (e->count >= 1) info->latitudeRef = r->data[e->offset];
+				break;
+			case EXIF_TAG_GPS_LONGITUDE_REF:
+				if (e->count >= 1) info->longitudeRef = r->data[e->offset];
+				break;
+			case EXIF_TAG_GPS_ALTITUDE_REF:
+				info->altitudeRef = EXIFEntryInteger(r, e);
+				break;
+			case EXIF_TAG_GPS_ALTITUDE:
+				info->altitude = EXIFEntryRational(r, e, 0);
+				break;
+			case EXIF_TAG_GPS_LATITUDE:
+				for (int i = 0; i < 3; i++) info->latitude[i] = EXIFEntryRational(r, e, i);
+				break;
+			case EXIF_TAG_GPS_LONGITUDE:
+				for (int i = 0; i < 3; i++) info->longitude[i] = EXIFEntryRational(r, e, i);
+				break;
+		}
+	}
+}
+
+/**
+ * Reads every entry of the IFD at `offset`
+ */
+static int EXIFParseDirectory(
+	const EXIFReader * r,
+	size_t offset,
+	EXIFDirectory directory,
+	EXIFInfo * info,
+	size_t * exifIFD,
+	size_t * gpsIFD
+) {
+	uint16_t count;
+
+	if ((offset < 8) || (offset > r->size - 2)) return 1;
+
+	count = EXIFRead16(r, offset);
+	offset += 2;
+
+	if ((size_t) count * EXIF_ENTRY_SIZE > r->size - offset) return 2;
+
+	for (uint16_t i = 0; i < count; i++) {
+		EXIFEntry entry;
+
+		// Bad entries are skipped so the rest can still be read
+		if (EXIFEntryRead(r, offset + i * EXIF_ENTRY_SIZE, &entry)) {
+			EXIFEntryHandle(r, directory, &entry, info, exifIFD, gpsIFD);
+		}
+	}
+
+	return 0;
+}
+
+int EXIFParse(const unsigned char * data, size_t size, EXIFInfo * info) {
+	int result = 0;
+	EXIFReader r = {data, size, false};
+	size_t exifIFD = 0, gpsIFD = 0;
+
+	if (!data || !info) return 1;
+
+	memset(info, 0, sizeof(EXIFInfo));
+
+	if (size < 8) {
+		result = 2;
+	} else if ((data[0] == 'M') && (data[1] == 'M')) {
+		r.bigEndian = true;
+	} else if ((data[0] != 'I') || (data[1] != 'I')) {
+		result = 3;
+	}
+
+	if ((result == 0) && (EXIFRead16(&r, 2) != 42)) {
+		result = 4;
+	}
+
+	if (result == 0) {
+		info->bigEndian = r.bigEndian;
+		result = EXIFParseDirectory(&r, EXIFRead32(&r, 4), kEXIFDirectoryIFD0, info, &exifIFD, &gpsIFD);
+	}
+
+	// Pointers in the sub IFDs are ignored so nothing can loop
+	if ((result == 0) && exifIFD) {
+		EXIFParseDirectory(&r, exifIFD, kEXIFDirectoryEXIF, info, NULL, NULL);
+	}
+
+	if ((result == 0) && gpsIFD) {
+		EXIFParseDirectory(&r, gpsIFD, kEXIFDirectoryGPS, info, NULL, NULL);
+	}
+
+	return result;
+}
+
+static bool EXIFRationalValid(const EXIFRational * r) {
+	return r->denominator != 0;
+}
+
+static double EXIFRationalValue(const EXIFRational * r) {
+	return (double) r->numerator / (double) r->denominator;
+}
+
+static int EXIFSetString(Dictionary<String, String> * metadata, const char * key, const EXIFString * str) {
+	char buf[0xff];
+
+	if (!str->value || !str->size) return 0;
+
+	snprintf(buf, sizeof(buf), "%.*s", (int) str->size, str->value);
+	return metadata->setValueForKey(key, buf);
+}
+
+/**
+ * Formats like XMP does (DDD,MM.mmk) so both sources agree
+ */
+static int EXIFSetCoordinate(Dictionary<String, String> * metadata, const char * key, const EXIFRational * dms, char ref) {
+	char buf[0xff];
+	double degrees = 0;
+
+	for (int i = 0; i < 3; i++) {
+		if (!EXIFRationalValid(&dms[i])) return 0;
+	}
+
+	degrees = EXIFRationalValue(&dms[0]) + EXIFRationalValue(&dms[1]) / 60.0 + EXIFRationalValue(&dms[2]) / 3600.0;
+
+	int whole = (int) degrees;
+	snprintf(buf, sizeof(buf), "%d,%g%c", whole, (degrees - whole) * 60.0, ref ? ref : '?');
+
+	return metadata->setValueForKey(key, buf);
+}
+
+int EXIFCompileMetadata(const EXIFInfo * info, Dictionary<String, String> * metadata) {
+	int result = 0;
+	char buf[0xff];
+
+	if (info->orientation) {
+		sprintf(buf, "%d", info->orientation);
+		result = metadata->setValueForKey("Orientation", buf);
+	}
+
+	if (result == 0) result = EXIFSetString(metadata, "Make", &info->make);
+	if (result == 0) result = EXIFSetString(metadata, "Model", &info->model);
+	if (result == 0) result = EXIFSetString(metadata, "Software", &info->software);
+	if (result == 0) result = EXIFSetString(metadata, "Lens Make", &info->lensMake);
+	if (result == 0) result = EXIFSetString(metadata, "Lens Model", &info->lensModel);
+	if (result == 0) result = EXIFSetString(metadata, "Date Time", &info->dateTime);
+	if (result == 0) result = EXIFSetString(metadata, "Date Time Original", &info->dateTimeOriginal);
+	if (result == 0) result = EXIFSetString(metadata, "Date Time Digitized", &info->dateTimeDigitized);
+
+	if ((result == 0) && EXIFRationalValid(&info->exposureTime)) {
+		const EXIFRational * t = &info->exposureTime;
+
+		// Shutter speeds read better as 1/n
+		if ((t->numerator > 0) && (t->numerator < t->denominator)) {
+			sprintf(buf, "1/%g s", round((double) t->denominator / (double) t->numerator));
+		} else {
+			sprintf(buf, "%g s", EXIFRationalValue(t));
+		}
+
+		result = metadata->setValueForKey("Exposure Time", buf);
+	}
+
+	if ((result == 0) && EXIFRationalValid(&info->fNumber)) {
+		sprintf(buf, "f/%.1f", EXIFRationalValue(&info->fNumber));
+		result = metadata->setValueForKey("F Number", buf);
+	}
+
+	if ((result == 0) && EXIFRationalValid(&info->focalLength)) {
+		sprintf(buf, "%g mm", EXIFRationalValue(&info->focalLength));
+		result = metadata->setValueForKey("Focal Length", buf);
+	}
+
+	if ((result == 0) && EXIFRationalValid(&info->exposureBias)) {
+		sprintf(buf, "%+.1f EV", EXIFRationalValue(&info->exposureBias));
+		result = metadata->setValueForKey("Exposure Bias", buf);
+	}
+
+	if ((result == 0) && info->iso) {
+		sprintf(buf, "%d", info->iso);
+		result = metadata->setValueForKey("ISO", buf);
+	}
+
+	if ((result == 0) && info->hasGPS) {
+		result = EXIFSetCoordinate(metadata, "Latitude", info->latitude, info->latitudeRef);
+
+		if (result == 0) {
+			result = EXIFSetCoordinate(metadata, "Longitude", info->longitude, info->longitudeRef);
+		}
+
+		if ((result == 0) && EXIFRationalValid(&info->altitude)) {
+			double altitude = EXIFRationalValue(&info->altitude);
+			sprintf(buf, "%g m", info->altitudeRef == 1 ? -altitude : altitude);
+			result = metadata->setValueForKey("Altitude", buf);
+		}
+	}
+
+	return result;
+}
+
+int EXIFSetOrientation(unsigned char * data, size_t size, const EXIFInfo * info, int orientation) {
+	if (!info->orientationOffset || (info->orientationOffset > size - 2)) return 1;
+	else if ((orientation < 1) || (orientation > 8)) return 2;
+
+	EXIFWrite16(data + info->orientationOffset, info->bigEndian, orientation);
+
+	return 0;
+}
+
+/**
+ * Writes one SHORT or LONG dimension tag
+ */
+static void EXIFSetDimension(unsigned char * data, size_t size, bool bigEndian, size_t offset, int type, uint32_t value) {
+	if (!offset) return;
+
+	if ((type == EXIF_TYPE_SHORT) && (offset <= size - 2) && (value <= 0xFFFF)) {
+		EXIFWrite16(data + offset, bigEndian, value);
+	} else if ((type == EXIF_TYPE_LONG) && (offset <= size - 4)) {
+		EXIFWrite32(data + offset, bigEndian, value);
+	}
+}
+
+int EXIFSetPixelDimensions(unsigned char * data, size_t size, const EXIFInfo * info, uint32_t width, uint32_t height) {
+	EXIFSetDimension(data, size, info->bigEndian, info->pixelWidthOffset, info->pixelWidthType, width);
+	EXIFSetDimension(data, size, info->bigEndian, info->pixelHeightOffset, info->pixelHeightType, height);
+
+	return 0;
+}
+
@@ -0,0 +1,107 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef EXIF_HPP
+#define EXIF_HPP
+
+#include <bflibcpp/dictionary.hpp>
+#include <bflibcpp/string.hpp>
+
+extern "C" {
+#include <stddef.h>
+#include <stdint.h>
+}
+
+/**
+ * Header that starts a JPEG APP1 segment holding EXIF. The TIFF
+ * structure follows it. PNG eXIf chunks have no header
+ */
+#define EXIF_JPEG_APP1_SIGNATURE "Exif\0"
+#define EXIF_JPEG_APP1_SIGNATURE_SIZE 6
+
+/**
+ * Points into the buffer given to EXIFParse(). Not null terminated
+ */
+typedef struct {
+	const char * value;
+	size_t size;
+} EXIFString;
+
+typedef struct {
+	int64_t numerator;
+	int64_t denominator;
+} EXIFRational;
+
+/**
+ * The tags we report. Anything missing is left zeroed
+ *
+ * Nothing is copied out of the buffer so it has to outlive this
+ */
+typedef struct {
+	/// 1-8 as in the TIFF spec, 0 when missing
+	int orientation;
+
+	EXIFString make;
+	EXIFString model;
+	EXIFString software;
+	EXIFString lensMake;
+	EXIFString lensModel;
+
+	EXIFString dateTime;
+	EXIFString dateTimeOriginal;
+	EXIFString dateTimeDigitized;
+
+	EXIFRational exposureTime;
+	EXIFRational fNumber;
+	EXIFRational focalLength;
+	EXIFRational exposureBias;
+	int iso;
+
+	/// Degrees, minutes and seconds
+	EXIFRational latitude[3];
+	EXIFRational longitude[3];
+	EXIFRational altitude;
+	char latitudeRef;
+	char longitudeRef;
+	int altitudeRef;
+	bool hasGPS;
+
+	// Where the patchable values live, 0 when missing. See EXIFSetOrientation()
+	size_t orientationOffset;
+	size_t pixelWidthOffset;
+	size_t pixelHeightOffset;
+	int pixelWidthType;
+	int pixelHeightType;
+
+	bool bigEndian;
+} EXIFInfo;
+
+/**
+ * Reads the TIFF structure in data: IFD0, the EXIF IFD and the GPS IFD
+ *
+ * Every offset is checked against `size`, so a corrupt or malicious
+ * block can make tags go missing but never reads out of bounds.
+ * Nothing is allocated
+ */
+int EXIFParse(const unsigned char * data, size_t size, EXIFInfo * info);
+
+/**
+ * Adds the tags found in info to metadata
+ */
+int EXIFCompileMetadata(const EXIFInfo * info, BF::Dictionary<BF::String, BF::String> * metadata);
+
+/**
+ * Rewrites the orientation tag in place. `data` must be the buffer
+ * info was parsed from, or a copy of it
+ */
+int EXIFSetOrientation(unsigned char * data, size_t size, const EXIFInfo * info, int orientation);
+
+/**
+ * Rewrites PixelXDimension and PixelYDimension in place, if present
+ */
+int EXIFSetPixelDimensions(unsigned char * data, size_t size, const EXIFInfo * info, uint32_t width, uint32_t height);
+
+#endif // EXIF_HPP
+
@@ -4,6 +4,8 @@
  */
 
 #include "gif.hpp"
+#include "trace.hpp"
+#include "stream.hpp"
 #include <bflibcpp/bflibcpp.hpp>
 
 extern "C" {
@@ -53,8 +55,9 @@ GIF::~GIF() {
 
 int GIF::load() {
 	int result = 0;
+	TraceScope scope("load", this->path());
 	
-	if ((this->_fileHandler = fopen(this->path(), "rb")) == NULL) {
+	if ((this->_fileHandler = this->openInput()) == NULL) {
 		BFErrorPrint("Could not open file '%s' for reading", this->path());
 		result = 1;
 	}
@@ -149,24 +152,17 @@ int GIF::readImageData(List<ImageData *> * idList, FILE * fs, const ColorTable *
 		img = (ImageData *) malloc(sizeof(ImageData));
 		if (!img) result = 1;
 
-		// Read descriptor
+		// Read the rest of the descriptor. readBlocks() already took
+		// the separator to know this is an image
 		else {
-			size_t size = sizeof(ImageDescriptor);
-			rsize = fread(&img->descriptor, 1, size, fs);
+			size_t size = sizeof(ImageDescriptor) - 1;
+			img->descriptor.separator = idSep;
+			rsize = fread((unsigned char *) &img->descriptor + 1, 1, size, fs);
 
 			if (size != rsize) {
 				BFErrorPrint("Could not read img descriptor");
-				result = 1;
-
-			// Should I assume there are no more images
-			// in the data stream if I find no more 
-			// separators?
-			} else if (img->descriptor.separator != idSep) {
-				done = true;
-				fseek(fs, -1 * size, SEEK_CUR);
-
-				// Free unused memory
 				BFFree(img);
+				result = 1;
 			}
 		}
 
@@ -217,48 +213,40 @@ int GIF::readImageData(List<ImageData *> * idList, FILE * fs, const ColorTable *
 
 int GIF::readSubBlockSequence(FILE * fs, DataBlock * dataSequence) {
 	int result = 0;
-	DataBlock subBlock = {0};
-	size_t rsize = 0;
-	const unsigned char blockTerm = 0x00;
+	unsigned char size = 0;
+	size_t capacity = 0;
+	unsigned char * buf = NULL;
 
 	// Make sure it is initialized
 	dataSequence->size = 0;
 	dataSequence->buf = 0;
 
+	// Sub blocks are at most 255 bytes, so they are read straight into
+	// the sequence instead of a buffer each. The sequence doubles as it
+	// grows
 	do {
-		// Read next subblock
-		result = GIF::readSubBlocks(fs, &subBlock);
-		
-		if (result) {
-			BFErrorPrint("Reading image data: %d", result);
-		} 
-		
-		// see if we have a block terminator
-		if (result == 0) {
-			char t;
-			rsize = fread(&t, 1, 1, fs);
-			if (rsize != 1) {
-				BFErrorPrint("Could not read");
-				result = 8;
-			} else if (t == blockTerm) {
-				// End sequence
-				break; // Get out of loop
+		if (fread(&size, 1, 1, fs) != 1) {
+			BFErrorPrint("Reading sub block size");
+			result = 6;
+		} else if (size == 0) {
+			break; // block terminator
+		} else if (dataSequence->size + size > capacity) {
+			capacity = capacity ? capacity * 2 : 4096;
+
+			if ((buf = (unsigned char *) realloc(dataSequence->buf, capacity)) == NULL) {
+				BFErrorPrint("Could not get more bytes for buffer");
+				result = 10;
+			} else {
+				dataSequence->buf = buf;
 			}
 		}
 
-		// If we are still here then we have more work to do
 		if (result == 0) {
-			fseek(fs, -1, SEEK_CUR); // reset reader
-			size_t offset = dataSequence->size;
-			dataSequence->size += subBlock.size;
-			if ((dataSequence->buf = (unsigned char *) realloc(dataSequence->buf, dataSequence->size)) == NULL) {
-				result = 10;
-				BFErrorPrint("Could not get more bytes for buffer");
+			if (fread(dataSequence->buf + dataSequence->size, 1, size, fs) != size) {
+				BFErrorPrint("Could not read raw data of size %d", size);
+				result = 8;
 			} else {
-				if (memcpy(dataSequence->buf + offset, subBlock.buf, subBlock.size) == NULL) {
-					result = 11;
-					BFErrorPrint("Could not copy subblock data");
-				}
+				dataSequence->size += size;
 			}
 		}
 	} while (!result);
@@ -304,6 +292,112 @@ int GIF::readSubBlocks(FILE * fs, DataBlock * subBlock) {
 	return result;
 }
 
+int GIF::skipSubBlocks(FILE * fs) {
+	int c;
+
+	// Each sub block is a size byte followed by that many bytes. A
+	// zero size is the terminator
+	while ((c = fgetc(fs)) != EOF) {
+		if (c == 0) return 0;
+		else if (StreamSkip(fs, c)) break;
+	}
+
+	BFErrorPrint("Unexpected end of sub blocks");
+	return 1;
+}
+
+/**
+ * Same walk as load() but nothing past the headers is kept. Color
+ * tables and image data are seeked over so the only reads are the
+ * block headers. Streams that cannot seek read them instead
+ */
+int GIF::probe() {
+	int result = 0;
+	FILE * fs = NULL;
+	unsigned char buf[13];
+	bool done = false;
+	int frames = 0;
+	const unsigned char extIntro = 0x21;
+	const unsigned char trailer = 0x3B;
+	const unsigned char idSep = 0x2c;
+
+	if ((fs = this->openInput()) == NULL) {
+		BFErrorPrint("Could not open file '%s' for reading", this->path());
+		result = 1;
+	} else if (fread(&this->_header, 1, sizeof(GIF::Header), fs) != sizeof(GIF::Header)) {
+		BFErrorPrint("Could not read the header of '%s'", this->path());
+		result = 2;
+	} else if (memcmp(this->_header.signature, GIF_FILE_SIGNATURE, 3)) {
+		BFErrorPrint("'%s' does not have a gif signature", this->path());
+		result = 3;
+	}
+
+	// Global color table
+	if ((result == 0) && (this->_header.packedFields & 0x80)) {
+		if (StreamSkip(fs, 3 * (1 << ((this->_header.packedFields & 0x07) + 1)))) {
+			result = 4;
+		}
+	}
+
+	while (!result && !done) {
+		int c = fgetc(fs);
+
+		if ((c == EOF) || (c == trailer)) {
+			done = true;
+		} else if (c == idSep) {
+			// Rest of the descriptor, then the local color table and
+			// lzw code size before the data sub blocks
+			if (fread(buf, 1, 9, fs) != 9) {
+				result = 5;
+			} else if ((buf[8] & 0x80) && StreamSkip(fs, 3 * (1 << ((buf[8] & 0x07) + 1)))) {
+				result = 6;
+			} else if (fgetc(fs) == EOF) {
+				result = 7;
+			} else {
+				result = GIF::skipSubBlocks(fs);
+				frames++;
+			}
+		} else if (c == extIntro) {
+			if ((c = fgetc(fs)) == EOF) {
+				result = 8;
+			} else if (c == this->_extApplication.label) {
+				if (fread(&this->_extApplication.blockSize, 1, 12, fs) != 12) {
+					result = 9;
+				} else if (this->_extApplication.blockSize != 11) {
+					BFErrorPrint("Block size is %d", this->_extApplication.blockSize);
+					result = 10;
+				} else {
+					result = GIF::skipSubBlocks(fs);
+				}
+			} else {
+				// Every other extension is a run of sub blocks
+				result = GIF::skipSubBlocks(fs);
+			}
+		} else {
+			BFErrorPrint("Unknown block 0x%x in '%s'", c, this->path());
+			result = 11;
+		}
+	}
+
+	if (result == 0) {
+		this->_probeInfo.width = this->width();
+		this->_probeInfo.height = this->height();
+		this->_probeInfo.bitsPerComponent = this->bitsPerComponent();
+		this->_probeInfo.components = 1;
+		this->_probeInfo.colorspace = this->colorspace();
+		this->_probeInfo.frameCount = frames;
+	}
+
+	if (fs) fclose(fs);
+
+	return result;
+}
+
+int GIF::frameCount() {
+	if (this->_imageData.count()) return this->_imageData.count();
+	else return this->_probeInfo.frameCount;
+}
+
 int GIF::readBlocks() {
 	int result = 0;
 	unsigned char buf;
@@ -322,7 +416,6 @@ int GIF::readBlocks() {
 		} else {
 			// Image
 			if (buf == idSep) {
-				fseek(this->_fileHandler, -1, SEEK_CUR); // TODO: get rid of the separator in image struct
 				result = GIF::readImageData(&this->_imageData, this->_fileHandler, &this->_colorTableGlobal);
 
 			// Extensions
@@ -469,11 +562,11 @@ int GIF::compileMetadata(Dictionary<String, String> * metadata) {
 	sprintf(buf, "%d", this->height());
 	metadata->setValueForKey("Height", buf);
 	metadata->setValueForKey("Version", this->version());
-	strncpy(buf, this->_extApplication.id, 8);
+	snprintf(buf, sizeof(buf), "%.8s", this->_extApplication.id);
 	metadata->setValueForKey("App ID", buf);
-	strncpy(buf, (char *) this->_extApplication.authCode, 3);
+	snprintf(buf, sizeof(buf), "%.3s", (char *) this->_extApplication.authCode);
 	metadata->setValueForKey("Auth Code", buf);
-	sprintf(buf, "%d", this->_imageData.count());
+	sprintf(buf, "%d", this->frameCount());
 	metadata->setValueForKey("Image Count", buf);
 
 	return result;
@@ -15,6 +15,9 @@
  * 	https://www.w3.org/Graphics/GIF/spec-gif89a.txt
  */
 class GIF : public Image {
+	/// Times the parsing routines on their own
+	friend class GIFMicrobench;
+
 
 // Types
 private:
@@ -164,8 +167,11 @@ private:
 	static int colorTableRead(FILE * fs, ColorTable * table, size_t pixelSize);
 
 	/**
-	 * Finds all the image data from fs' current stream position and adds them to idList
-	 */	
+	 * Reads the image that starts at fs' current stream position and adds it to idList
+	 *
+	 * The separator has already been read. Nothing is ever read twice so
+	 * fs does not have to be seekable
+	 */
 	static int readImageData(BF::List<ImageData *> * idList, FILE * fs, const ColorTable * colorTableGlobal);
 
 	int readBlocks();
@@ -180,6 +186,11 @@ private:
 	 */
 	static int readSubBlockSequence(FILE * fs, DataBlock * blockSequence);
 
+	/**
+	 * Moves past a sub block sequence, including its terminator
+	 */
+	static int skipSubBlocks(FILE * fs);
+
 	/**
 	 * Holds the header data from gif file
 	 *
@@ -212,6 +223,8 @@ public:
 	ImagineColorSpace colorspace();
 	int load();
 	int unload();
+	int probe();
+	int frameCount();
 	ImageType type();
 	int toGIF();
 	const char * description();
@@ -0,0 +1,139 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "hash.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+}
+
+static const uint64_t HASH_PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t HASH_PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t HASH_PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t HASH_PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t HASH_PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t HashRotateLeft(uint64_t x, int bits) {
+	return (x << bits) | (x >> (64 - bits));
+}
+
+// The spec reads input as little endian no matter the host
+static inline uint64_t HashRead64(const unsigned char * p) {
+	return ((uint64_t) p[0]) | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)
+		| ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static inline uint32_t HashRead32(const unsigned char * p) {
+	return ((uint32_t) p[0]) | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint64_t HashRound(uint64_t acc, uint64_t input) {
+	acc += input * HASH_PRIME2;
+	acc = HashRotateLeft(acc, 31);
+	return acc * HASH_PRIME1;
+}
+
+static inline uint64_t HashMergeRound(uint64_t acc, uint64_t value) {
+	acc ^= HashRound(0, value);
+	return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+uint64_t HashXXH64(const void * data, size_t size, uint64_t seed) {
+	const unsigned char * p = (const unsigned char *) data;
+	const unsigned char * end = p + size;
+	uint64_t h = 0;
+
+	if (size >= 32) {
+		// Four independent lanes keep the multiplier busy
+		uint64_t v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+		uint64_t v2 = seed + HASH_PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - HASH_PRIME1;
+
+		do {
+			v1 = HashRound(v1, HashRead64(p));
+			v2 = HashRound(v2, HashRead64(p + 8));
+			v3 = HashRound(v3, HashRead64(p + 16));
+			v4 = HashRound(v4, HashRead64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+
+		h = HashRotateLeft(v1, 1) + HashRotateLeft(v2, 7) + HashRotateLeft(v3, 12) + HashRotateLeft(v4, 18);
+		h = HashMergeRound(h, v1);
+		h = HashMergeRound(h, v2);
+		h = HashMergeRound(h, v3);
+		h = HashMergeRound(h, v4);
+	} else {
+		h = seed + HASH_PRIME5;
+	}
+
+	h += (uint64_t) size;
+
+	while (end - p >= 8) {
+		h ^= HashRound(0, HashRead64(p));
+		h = HashRotateLeft(h, 27) * HASH_PRIME1 + HASH_PRIME4;
+		p += 8;
+	}
+
+	if (end - p >= 4) {
+		h ^= (uint64_t) HashRead32(p) * HASH_PRIME1;
+		h = HashRotateLeft(h, 23) * HASH_PRIME2 + HASH_PRIME3;
+		p += 4;
+	}
+
+	while (p < end) {
+		h ^= (*p) * HASH_PRIME5;
+		h = HashRotateLeft(h, 11) * HASH_PRIME1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+int HashFile(const char * path, uint64_t * hash) {
+	int result = 0;
+	int fd = -1;
+	struct stat st;
+	void * data = MAP_FAILED;
+
+	if (!path || !hash) {
+		result = 1;
+	} else if ((fd = open(path, O_RDONLY)) == -1) {
+		BFErrorPrint("Could not open '%s'", path);
+		result = 2;
+	} else if (fstat(fd, &st)) {
+		result = 3;
+	}
+
+	if (result == 0) {
+		// mmap refuses empty files
+		if (st.st_size == 0) {
+			*hash = HashXXH64(NULL, 0, 0);
+		} else if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+			BFErrorPrint("Could not map '%s'", path);
+			result = 4;
+		} else {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			*hash = HashXXH64(data, st.st_size, 0);
+			munmap(data, st.st_size);
+		}
+	}
+
+	if (fd != -1) close(fd);
+
+	return result;
+}
+
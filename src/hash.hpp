@@ -0,0 +1,31 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef HASH_HPP
+#define HASH_HPP
+
+extern "C" {
+#include <stddef.h>
+#include <stdint.h>
+}
+
+/**
+ * XXH64 of [data, data + size)
+ *
+ * Matches the reference implementation bit for bit, so values can be
+ * compared against other tools. Not cryptographic
+ */
+uint64_t HashXXH64(const void * data, size_t size, uint64_t seed);
+
+/**
+ * XXH64 of the contents of the file at path
+ *
+ * The file is mapped rather than read so large files do not need a
+ * buffer of their own
+ */
+int HashFile(const char * path, uint64_t * hash);
+
+#endif // HASH_HPP
+
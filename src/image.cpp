@@ -8,10 +8,20 @@
 #include "jpeg.hpp"
 #include "gif.hpp"
 #include "tiff.hpp"
+#include "xmp.hpp"
+#include "exif.hpp"
+#include "cache.hpp"
+#include "dither.hpp"
+#include "resize.hpp"
+#include "composite.hpp"
+#include "trace.hpp"
+#include "counters.hpp"
+#include "stream.hpp"
 #include <bflibcpp/bflibcpp.hpp>
 
 extern "C" {
 #include <string.h>
+#include <stdlib.h>
 #include <libgen.h>
 }
 
@@ -20,14 +30,26 @@ using namespace BF;
 Image * Image::createImage(const char * path, int * err) {
 	Image * result = 0;
 	int error = 0;
+	TraceScope scope("createImage", path);
+	ImageType type = kImageTypeUnknown;
 
-	if (PNG::isType(path)) {
+	// Standard input has no extension, so we go by its first bytes
+	if (StreamIsStdio(path)) {
+		unsigned char signature[STREAM_PEEK_SIZE];
+		size_t length = 0;
+
+		if (StreamPeek(path, signature, sizeof(signature), &length) == 0) {
+			type = StreamTypeForSignature(signature, length);
+		}
+	}
+
+	if ((type == kImageTypePNG) || PNG::isType(path)) {
 		result = new PNG(path, &error);
-	} else if (JPEG::isType(path)) {
+	} else if ((type == kImageTypeJPEG) || JPEG::isType(path)) {
 		result = new JPEG(path, &error);
-	} else if (GIF::isType(path)) {
+	} else if ((type == kImageTypeGIF) || GIF::isType(path)) {
 		result = new GIF(path, &error);
-	} else if (Tiff::isType(path)) {
+	} else if ((type == kImageTypeTIFF) || Tiff::isType(path)) {
 		result = new Tiff(path, &error);
 	} else {
 		BFErrorPrint("Unsupported file type for path '%s'", path);
@@ -39,28 +61,151 @@ Image * Image::createImage(const char * path, int * err) {
 	return result;
 }
 
+Image * Image::createImageFromBuffer(const void * data, size_t size, int * err) {
+	Image * result = 0;
+	int error = 0;
+	TraceScope scope("createImageFromBuffer", IMAGE_BUFFER_PATH);
+
+	if (!data || (size == 0)) {
+		error = 1;
+	} else {
+		switch (StreamTypeForSignature((const unsigned char *) data, size)) {
+			case kImageTypePNG:
+				result = new PNG(IMAGE_BUFFER_PATH, &error);
+				break;
+			case kImageTypeJPEG:
+				result = new JPEG(IMAGE_BUFFER_PATH, &error);
+				break;
+			case kImageTypeGIF:
+				result = new GIF(IMAGE_BUFFER_PATH, &error);
+				break;
+			case kImageTypeTIFF:
+				result = new Tiff(IMAGE_BUFFER_PATH, &error);
+				break;
+			default:
+				BFErrorPrint("Unsupported file type in buffer");
+				error = 2;
+				break;
+		}
+	}
+
+	if (result) {
+		result->_input.data = (const unsigned char *) data;
+		result->_input.size = size;
+	}
+
+	if (err) *err = error;
+
+	return result;
+}
+
 Image::Image(const char * path, int * err) : File(path, err) {
 	int error = err ? *err : 1;
 
 	this->_imageReserved[0] = '\0';
+	this->_targetWidth = 0;
+	this->_targetHeight = 0;
+	this->_previewLevel = 0;
+	this->_paletteColors = 0;
+	this->_dither = kImagineDitherFloydSteinberg;
+	this->_ditherThreads = 1;
+	memset(&this->_background, 0, sizeof(this->_background));
+	memset(this->_background.color, 0xff, 3);
+	memset(&this->_probeInfo, 0, sizeof(this->_probeInfo));
+	this->_probeInfo.colorspace = kImagineColorSpaceUnknown;
+	memset(this->_metadataBlocks, 0, sizeof(this->_metadataBlocks));
+	memset(&this->_input, 0, sizeof(this->_input));
+	memset(&this->_output, 0, sizeof(this->_output));
+	MemoryAccountInit(&this->_memory);
 
 	if (err) *err = error;
 }
 
 Image::~Image() {
+	this->releaseMetadataBlocks();
+	free(this->_output.data);
+	MemoryAccountFinish(&this->_memory, this->path());
+}
+
+MemoryAccount * Image::memory() {
+	return &this->_memory;
+}
 
+void Image::setMetadataBlock(ImagineMetadataType type, const void * data, size_t size, bool owned) {
+	if (this->_metadataBlocks[type].owned) {
+		free((void *) this->_metadataBlocks[type].data);
+	}
+
+	this->_metadataBlocks[type].data = (const unsigned char *) data;
+	this->_metadataBlocks[type].size = data ? size : 0;
+	this->_metadataBlocks[type].owned = data && owned;
+}
+
+const unsigned char * Image::metadataBlock(ImagineMetadataType type, size_t * size) {
+	if (size) *size = this->_metadataBlocks[type].size;
+	return this->_metadataBlocks[type].data;
+}
+
+void Image::releaseMetadataBlocks() {
+	for (int i = 0; i < kImagineMetadataCount; i++) {
+		this->setMetadataBlock((ImagineMetadataType) i, NULL, 0, false);
+	}
+}
+
+int Image::compileEmbeddedMetadata(Dictionary<String, String> * metadata) {
+	int result = 0;
+	size_t size = 0;
+	const unsigned char * block = NULL;
+
+	if ((block = this->metadataBlock(kImagineMetadataXMP, &size)) != NULL) {
+		result = XMPExtract(
+			(const char *) block,
+			size,
+			XMP_DEFAULT_PROPERTIES,
+			XMP_DEFAULT_PROPERTIES_COUNT,
+			metadata
+		);
+	}
+
+	// A bad EXIF block only costs us its keys
+	if ((result == 0) && ((block = this->metadataBlock(kImagineMetadataEXIF, &size)) != NULL)) {
+		EXIFInfo info;
+
+		if (EXIFParse(block, size, &info) == 0) {
+			result = EXIFCompileMetadata(&info, metadata);
+		}
+	}
+
+	return result;
+}
+
+int Image::orientation() {
+	size_t size = 0;
+	const unsigned char * block = this->metadataBlock(kImagineMetadataEXIF, &size);
+	EXIFInfo info;
+
+	if (!block || EXIFParse(block, size, &info)) return 0;
+
+	return info.orientation;
 }
 
 int Image::details() {
 	Dictionary<String, String> metadata;
-	Dictionary<String, String>::Iterator * itr = 0;
 
 	int result = this->compileMetadata(&metadata);
 
 	if (!result) {
-		result = metadata.createIterator(&itr);
+		result = Image::printMetadata(&metadata);
 	}
 
+	return result;
+}
+
+int Image::printMetadata(Dictionary<String, String> * metadata) {
+	Dictionary<String, String>::Iterator * itr = 0;
+
+	int result = metadata->createIterator(&itr);
+
 	while (!result && !itr->finished()) {
 		Dictionary<String, String>::Entry * e = itr->current();
 
@@ -73,16 +218,51 @@ int Image::details() {
 	return result;
 }
 
+int Image::probe() {
+	int result = this->load();
+
+	if (result == 0) {
+		this->_probeInfo.width = this->width();
+		this->_probeInfo.height = this->height();
+		this->_probeInfo.bitsPerComponent = this->bitsPerComponent();
+		this->_probeInfo.colorspace = this->colorspace();
+		this->_probeInfo.frameCount = this->frameCount();
+		result = this->unload();
+	}
+
+	return result;
+}
+
+int Image::decodeRows(ImagineRowHandler handler, void * context) {
+	BFErrorPrint("Cannot decode '%s' image pixels", this->description());
+	return 1;
+}
+
+int Image::frameCount() {
+	return 1;
+}
+
 int Image::convertToType(ImageType type) {
+	// Encoders split this further into decode and encode where they can
+	CountersScope stage(kCountersStageConvert);
+
 	switch (type) {
-		case kImageTypePNG:
-			return this->toPNG();
-		case kImageTypeJPEG:
+		case kImageTypePNG: {
+			TraceScope scope(this->_paletteColors ? "toPalettePNG" : "toPNG", this->path());
+			return this->_paletteColors ? this->toPalettePNG() : this->toPNG();
+		}
+		case kImageTypeJPEG: {
+			TraceScope scope("toJPEG", this->path());
 			return this->toJPEG();
-		case kImageTypeGIF:
+		}
+		case kImageTypeGIF: {
+			TraceScope scope("toGIF", this->path());
 			return this->toGIF();
-		case kImageTypeTIFF:
+		}
+		case kImageTypeTIFF: {
+			TraceScope scope("toTIFF", this->path());
 			return this->toTIFF();
+		}
 		default:
 			BFErrorPrint("Unknown type: %d", type);
 			return 1;
@@ -90,8 +270,176 @@ int Image::convertToType(ImageType type) {
 }
 
 int Image::convertToType(ImageType type, const char * path) {
+	this->setConversionOutputPath(path);
+	return this->convertToType(type);
+}
+
+int Image::convert(ImageType type, const char * path, ConversionCache * cache) {
+	int result = 0;
+	char options[192];
+	char key[CACHE_KEY_SIZE];
+	char output[PATH_MAX];
+	bool cacheable = false;
+
+	this->setConversionOutputPath(path);
+
+	// Streams can only be read once and have no file to cache
+	if (cache && !this->_input.data && !StreamIsStdio(this->path()) && !StreamIsStdio(this->conversionOutputPath())) {
+		// Everything that can change what the encoders write
+		const ImagineBackground * bg = &this->_background;
+		snprintf(options, sizeof(options), "type=%d size=%ldx%ld preview=%d colors=%d dither=%d background=%02x%02x%02x%s",
+			type, this->_targetWidth, this->_targetHeight, this->_previewLevel,
+			this->_paletteColors, this->_paletteColors ? this->_dither : 0,
+			bg->color[0], bg->color[1], bg->color[2], bg->checker ? "+checker" : "");
+
+		TraceScope scope("cache lookup", this->path());
+
+		cacheable = !ConversionCache::keyForInput(this->path(), options, key, sizeof(key))
+			&& !this->conversionOutputFile(type, output, sizeof(output));
+
+		if (cacheable && cache->fetch(key, output)) {
+			return 0;
+		}
+	}
+
+	result = this->loadAndConvert(type);
+
+	// The output is already there so a cache that could not take it
+	// is not worth failing over
+	if ((result == 0) && cacheable) {
+		TraceScope scope("cache store", output);
+
+		if (cache->store(key, output)) {
+			BFErrorPrint("Could not cache '%s'", output);
+		}
+	}
+
+	return result;
+}
+
+int Image::convertToBuffer(ImageType type, const ImagineConvertOptions * options, void ** data, size_t * size) {
+	int result = 0;
+
+	if (!data || !size) {
+		return 1;
+	} else if (options) {
+		this->setTargetSize(options->width, options->height);
+		this->setPreviewLevel(options->previewLevel);
+		this->setPalette(options->colors, options->dither, 1);
+		this->setBackground(options->background);
+	}
+
+	this->_output.active = true;
+	result = this->loadAndConvert(type);
+	this->_output.active = false;
+
+	// Converting to a type we cannot write fails before anything is opened
+	if ((result == 0) && !this->_output.data) {
+		BFErrorPrint("Converting %s wrote nothing", this->path());
+		result = 2;
+	}
+
+	if (result == 0) {
+		*data = this->_output.data;
+		*size = this->_output.size;
+	} else {
+		free(this->_output.data);
+	}
+
+	this->_output.data = NULL;
+	this->_output.size = 0;
+
+	return result;
+}
+
+int Image::convertToFile(ImageType type, const char * filename) {
+	int result = 0;
+	int written = 0;
+
+	if (!filename) {
+		return 1;
+	}
+
+	written = snprintf(this->_output.file, sizeof(this->_output.file), "%s", filename);
+	if ((written < 0) || ((size_t) written >= sizeof(this->_output.file))) {
+		result = 2;
+	} else {
+		result = this->loadAndConvert(type);
+	}
+
+	this->_output.file[0] = '\0';
+
+	return result;
+}
+
+int Image::loadAndConvert(ImageType type) {
+	int result = 0;
+
+	CountersImageBegin();
+
+	if (result = this->load()) {
+		BFErrorPrint("loading: %d", result);
+	} else {
+		int error = 0;
+
+		if (result = this->convertToType(type)) {
+			BFErrorPrint("converting to type %d: %d", type, result);
+		}
+
+		// A failed conversion still has to let go of the decoder
+		if ((error = this->unload()) && (result == 0)) {
+			BFErrorPrint("unloading: %d", error);
+			result = error;
+		}
+	}
+
+	CountersImageEnd(this->path(), this->description());
+
+	return result;
+}
+
+FILE * Image::openInput() {
+	if (this->_input.data) {
+		return StreamOpenMemoryInput(this->_input.data, this->_input.size);
+	} else {
+		return StreamOpenInput(this->path());
+	}
+}
+
+const unsigned char * Image::inputBuffer(size_t * size) {
+	if (size) *size = this->_input.size;
+	return this->_input.data;
+}
+
+FILE * Image::openConversionOutput(ImageType type, char * filename, size_t size) {
+	if (!this->_output.active) {
+		if (this->conversionOutputFile(type, filename, size)) {
+			BFErrorPrint("Could not name the output for %s", this->path());
+			return NULL;
+		}
+
+		return StreamOpenOutput(filename);
+	}
+
+	snprintf(filename, size, "%s", IMAGE_BUFFER_PATH);
+
+	// Only the last output of a conversion is kept
+	free(this->_output.data);
+	this->_output.data = NULL;
+	this->_output.size = 0;
+
+	return StreamOpenMemoryOutput(&this->_output.data, &this->_output.size);
+}
+
+bool Image::convertingToBuffer() {
+	return this->_output.active;
+}
+
+void Image::setConversionOutputPath(const char * path) {
 	// Saves the path to our reserved buffer
-	if (path) {
+	if (StreamIsStdio(path)) {
+		strcpy(this->_imageReserved, STREAM_STDIO_PATH);
+	} else if (path) {
 		if (!realpath(path, this->_imageReserved)) {
 			BFErrorPrint("Error with finding real path for %s", path);
 			strcpy(this->_imageReserved, "");
@@ -99,8 +447,57 @@ int Image::convertToType(ImageType type, const char * path) {
 	} else {
 		strcpy(this->_imageReserved, "");
 	}
-	
-	return this->convertToType(type);
+}
+
+void Image::setTargetSize(ImaginePixels width, ImaginePixels height) {
+	this->_targetWidth = width > 0 ? width : 0;
+	this->_targetHeight = height > 0 ? height : 0;
+}
+
+void Image::setPreviewLevel(int level) {
+	this->_previewLevel = level > 0 ? level : 0;
+}
+
+void Image::setPalette(int colors, ImagineDither dither, int threads) {
+	this->_paletteColors = colors > 0 ? colors : 0;
+	this->_dither = dither;
+	this->_ditherThreads = threads > 0 ? threads : 1;
+}
+
+void Image::setBackground(const ImagineBackground * background) {
+	if (background) memcpy(&this->_background, background, sizeof(this->_background));
+}
+
+const ImagineBackground * Image::background() {
+	return &this->_background;
+}
+
+int Image::previewLevel() {
+	return this->_previewLevel;
+}
+
+bool Image::targetSizeForSource(ImaginePixels srcWidth, ImaginePixels srcHeight, ImaginePixels * width, ImaginePixels * height) {
+	ImaginePixels w = this->_targetWidth, h = this->_targetHeight;
+
+	if ((srcWidth <= 0) || (srcHeight <= 0)) return false;
+	else if (!w && !h) return false;
+
+	// Fill in whichever side was left out using the source's aspect ratio
+	if (!w) w = ((srcWidth * h) + (srcHeight / 2)) / srcHeight;
+	else if (!h) h = ((srcHeight * w) + (srcWidth / 2)) / srcWidth;
+
+	if (w < 1) w = 1;
+	if (h < 1) h = 1;
+
+	// We only shrink
+	if ((w >= srcWidth) && (h >= srcHeight)) return false;
+	if (w > srcWidth) w = srcWidth;
+	if (h > srcHeight) h = srcHeight;
+
+	if (width) *width = w;
+	if (height) *height = h;
+
+	return true;
 }
 
 const char * Image::colorspaceString() {
@@ -109,6 +506,8 @@ const char * Image::colorspaceString() {
 			return "RGB";
 		case kImagineColorSpaceRGBA:
 			return "RGBA";
+		case kImagineColorSpaceGray:
+			return "Gray";
 		default:
 			return "<unknown color space>";
 	}
@@ -116,8 +515,12 @@ const char * Image::colorspaceString() {
 
 const char * Image::conversionOutputPath() {
 	// If we don't have a string, then we will 
-	// return our directory
-	if (strlen(this->_imageReserved) == 0) {
+	// return our directory. Standard input goes
+	// to standard output
+	if ((strlen(this->_imageReserved) == 0) && StreamIsStdio(this->path())) {
+		strcpy(this->_imageReserved, STREAM_STDIO_PATH);
+		return this->_imageReserved;
+	} else if (strlen(this->_imageReserved) == 0) {
 		strcpy(this->_imageReserved, this->directory());
 		return this->_imageReserved;
 	} else {
@@ -125,6 +528,43 @@ const char * Image::conversionOutputPath() {
 	}
 }
 
+/**
+ * Extension of the files we write for type, or NULL
+ */
+static const char * ImageTypeExtension(ImageType type) {
+	switch (type) {
+		case kImageTypePNG:
+			return "png";
+		case kImageTypeJPEG:
+			return "jpg";
+		case kImageTypeGIF:
+			return "gif";
+		case kImageTypeTIFF:
+			return "tif";
+		default:
+			return NULL;
+	}
+}
+
+int Image::conversionOutputFile(ImageType type, char * filename, size_t size) {
+	const char * extension = ImageTypeExtension(type);
+	int written = 0;
+
+	if (!extension) {
+		return 1;
+	} else if (this->_output.file[0]) {
+		written = snprintf(filename, size, "%s", this->_output.file);
+		return ((written < 0) || ((size_t) written >= size)) ? 2 : 0;
+	} else if (StreamIsStdio(this->conversionOutputPath())) {
+		written = snprintf(filename, size, "%s", STREAM_STDIO_PATH);
+		return ((written < 0) || ((size_t) written >= size)) ? 2 : 0;
+	}
+
+	written = snprintf(filename, size, "%s/%s.%s", this->conversionOutputPath(), this->name(), extension);
+
+	return ((written < 0) || ((size_t) written >= size)) ? 2 : 0;
+}
+
 int Image::toPNG() {
 	BFErrorPrint("Cannot convert '%s' image to PNG", this->description());
 	return 1;
@@ -145,3 +585,149 @@ int Image::toTIFF() {
 	return 1;
 }
 
+/**
+ * Gathers decoded rows as RGB for toPalettePNG()
+ */
+typedef struct {
+	Image * image;
+	Resizer * resizer;
+	unsigned char * rgb;
+	unsigned char * row;
+
+	/// Rows with alpha are flattened here first
+	Compositor compositor;
+	unsigned char * flat;
+
+	ImaginePixels width;
+	ImaginePixels height;
+	ImaginePixels rows;
+} ImagePaletteContext;
+
+int Image::toPalettePNG() {
+	int result = 0;
+	char filename[PATH_MAX];
+	char resolved[2][PATH_MAX];
+	FILE * file = NULL;
+	ImagePaletteContext ctx;
+	DitherPalette palette;
+	unsigned char * indexes = NULL;
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&palette, 0, sizeof(palette));
+	ctx.image = this;
+
+	// Buffers have no file to write over
+	if (!this->convertingToBuffer() && (result = this->conversionOutputFile(kImageTypePNG, filename, sizeof(filename)))) {
+		BFErrorPrint("Could not name the output for %s", this->path());
+	} else if (!this->convertingToBuffer() && realpath(filename, resolved[0]) && realpath(this->path(), resolved[1]) && !strcmp(resolved[0], resolved[1])) {
+		BFErrorPrint("Path %s would be written over", this->path());
+		result = 1;
+	} else if (result = this->decodeRows(Image::paletteAddRow, &ctx)) {
+		BFErrorPrint("Could not decode %s: %d", this->path(), result);
+	} else if (!ctx.rgb || (ctx.rows != ctx.height)) {
+		BFErrorPrint("Decoding %s ended early", this->path());
+		result = 1;
+	} else if (result = DitherPaletteCreate(ctx.rgb, ctx.width, ctx.height, this->_paletteColors, &palette)) {
+		BFErrorPrint("Could not pick colors: %d", result);
+	} else if ((indexes = (unsigned char *) MemoryAllocate(this->memory(), ctx.width * ctx.height)) == NULL) {
+		result = 1;
+	} else if (result = DitherImage(ctx.rgb, ctx.width, ctx.height, &palette, this->_dither, this->_ditherThreads, indexes)) {
+		BFErrorPrint("Could not dither: %d", result);
+	} else if ((file = this->openConversionOutput(kImageTypePNG, filename, sizeof(filename))) == NULL) {
+		BFErrorPrint("Could not open file %s", filename);
+		result = 1;
+	} else {
+		TraceScope scope("write", filename);
+
+		if (result = PNG::writePalette(file, indexes, ctx.width, ctx.height, palette.colors, palette.count, this->memory())) {
+			BFErrorPrint("Could not write %s: %d", filename, result);
+		}
+	}
+
+	if (file) fclose(file);
+
+	DitherPaletteFree(&palette);
+	MemoryFree(this->memory(), indexes);
+	MemoryFree(this->memory(), ctx.rgb);
+	BFFree(ctx.row);
+	BFFree(ctx.flat);
+	CompositeEnd(&ctx.compositor);
+	Delete(ctx.resizer);
+
+	return result;
+}
+
+int Image::paletteAddRow(const ImagineRow * row, void * context) {
+	ImagePaletteContext * ctx = (ImagePaletteContext *) context;
+	const ImagineBackground * background = &ctx->image->_background;
+	const unsigned char * p = row->data;
+	int components = row->components;
+	int result = 0;
+
+	// Gray and alpha over a colored background has to be blended in color
+	const bool colorize = (components == 2) && !CompositeBackgroundIsGray(background);
+
+	if (row->y == 0) {
+		ImaginePixels tw = 0, th = 0;
+
+		ctx->width = row->width;
+		ctx->height = row->height;
+
+		if (ctx->image->targetSizeForSource(row->width, row->height, &tw, &th)) {
+			ctx->resizer = new Resizer(row->width, row->height, tw, th, 3, &result);
+			ctx->width = tw;
+			ctx->height = th;
+		}
+
+		if ((result == 0) && ((components == 2) || (components == 4))) {
+			result = CompositeBegin(&ctx->compositor, background, colorize ? 4 : components, row->width);
+		}
+
+		if (result == 0) {
+			ctx->row = (unsigned char *) malloc(row->width * 3);
+			ctx->flat = (unsigned char *) malloc(row->width * 4);
+			ctx->rgb = (unsigned char *) MemoryAllocate(ctx->image->memory(), ctx->width * ctx->height * 3);
+			if (!ctx->row || !ctx->flat || !ctx->rgb) result = 2;
+		}
+	}
+
+	if (result) {
+		return result;
+	} else if (colorize) {
+		for (ImaginePixels x = 0; x < row->width; x++) {
+			memset(ctx->flat + x * 4, p[x * 2], 3);
+			ctx->flat[x * 4 + 3] = p[x * 2 + 1];
+		}
+
+		p = ctx->flat;
+		components = 4;
+	}
+
+	// Alpha is flattened onto the background
+	if ((components == 2) || (components == 4)) {
+		CompositeRow(&ctx->compositor, p, row->y, ctx->flat, components - 1);
+		p = ctx->flat;
+		components--;
+	}
+
+	// Gray is spread over R, G and B
+	for (ImaginePixels x = 0; x < row->width; x++, p += components) {
+		unsigned char * q = ctx->row + x * 3;
+
+		if (components == 1) q[0] = q[1] = q[2] = p[0];
+		else memcpy(q, p, 3);
+	}
+
+	if (ctx->resizer) {
+		bool ready = false;
+
+		if ((result = ctx->resizer->pushRow(ctx->row, &ready)) == 0 && ready && (ctx->rows < ctx->height)) {
+			memcpy(ctx->rgb + ctx->rows++ * ctx->width * 3, ctx->resizer->outputRow(), ctx->width * 3);
+		}
+	} else if (ctx->rows < ctx->height) {
+		memcpy(ctx->rgb + ctx->rows++ * ctx->width * 3, ctx->row, ctx->width * 3);
+	}
+
+	return result;
+}
+
@@ -7,6 +7,7 @@
 #define IMAGE_H
 
 #include "imagetypes.h"
+#include "memory.hpp"
 #include <bflibcpp/file.hpp>
 #include <bflibcpp/dictionary.hpp>
 #include <bflibcpp/string.hpp>
@@ -16,13 +17,41 @@ extern "C" {
 #include <bflibc/filesystem.h>
 }
 
-typedef long ImaginePixels;
+class ConversionCache;
 
+/// What images made by Image::createImageFromBuffer() call their path
+#define IMAGE_BUFFER_PATH "<memory>"
+
+/**
+ * Metadata blocks embedded in image files
+ */
 typedef enum {
-	kImagineColorSpaceUnknown = -1,
-	kImagineColorSpaceRGB = 0,
-	kImagineColorSpaceRGBA = 1,
-} ImagineColorSpace;
+	kImagineMetadataXMP = 0,
+	kImagineMetadataEXIF = 1,
+	kImagineMetadataCount,
+} ImagineMetadataType;
+
+/**
+ * A row handed out by Image::decodeRows()
+ */
+typedef struct {
+	/// `width` pixels of `components` 8 bit samples: gray, gray and
+	/// alpha, RGB or RGBA
+	const unsigned char * data;
+	ImaginePixels width;
+	int components;
+
+	/// Row number and the number of rows this decode produces. Can be
+	/// smaller than the image when the decoder took a shortcut
+	ImaginePixels y;
+	ImaginePixels height;
+} ImagineRow;
+
+/**
+ * Gets each row from Image::decodeRows(), top to bottom. Returning non
+ * zero stops the decode
+ */
+typedef int (* ImagineRowHandler)(const ImagineRow * row, void * context);
 
 class Image : public BF::File {
 public:
@@ -31,8 +60,19 @@ public:
 	 *
 	 * This function will determine what dervied class
 	 * will be created to support the input image
+	 *
+	 * `-` reads standard input, whose type comes from its first bytes
 	 */
 	static Image * createImage(const char * path, int * err);
+
+	/**
+	 * Creates an image object for `size` bytes of an image file at `data`,
+	 * whose type comes from its first bytes
+	 *
+	 * Nothing is copied, so `data` has to outlive the image. Loading and
+	 * converting never touch the filesystem. path() is IMAGE_BUFFER_PATH
+	 */
+	static Image * createImageFromBuffer(const void * data, size_t size, int * err);
 	virtual ~Image();
 
 	/** Details
@@ -41,11 +81,73 @@ public:
 	 */
 	virtual int details();
 
+	/**
+	 * Prints metadata the way details() does
+	 */
+	static int printMetadata(BF::Dictionary<BF::String, BF::String> * metadata);
+
 	// Tells the Image object to convert to a specific
 	// type of image
 	int convertToType(ImageType type); // this outputs file at relative dir
 	int convertToType(ImageType type, const char * path);
 
+	/**
+	 * Loads, converts to `type` and unloads
+	 *
+	 * If `cache` is set it is checked first, and on a hit the image
+	 * is never decoded. Conversions that are not in it yet get added
+	 */
+	int convert(ImageType type, const char * path, ConversionCache * cache);
+
+	/**
+	 * Loads, converts to `type` and unloads like convert(), but the
+	 * output goes to memory instead of a file
+	 *
+	 * `options` can be NULL to keep the current settings. On success
+	 * `data` gets `size` bytes from malloc() that the caller frees
+	 */
+	int convertToBuffer(ImageType type, const ImagineConvertOptions * options, void ** data, size_t * size);
+
+	/**
+	 * Loads, converts to `type` and unloads like convert(), but writes
+	 * `filename` itself instead of a file named after the image. `-` is
+	 * standard output
+	 */
+	int convertToFile(ImageType type, const char * filename);
+
+	/**
+	 * Sets the dimensions we want the converted image to have
+	 *
+	 * Either value can be 0 to keep the source's aspect ratio. Only
+	 * downscaling is supported; a target larger than the source is
+	 * ignored. Call before load() so decoders can use it as a hint
+	 */
+	void setTargetSize(ImaginePixels width, ImaginePixels height);
+
+	/**
+	 * Asks decoders for a coarse preview instead of the full image
+	 *
+	 * `level` is the number of progressive JPEG scans or Adam7 PNG
+	 * passes to decode. 0 decodes everything. Images that are not
+	 * progressive/interlaced are decoded normally. Call before load()
+	 */
+	void setPreviewLevel(int level);
+
+	/**
+	 * Makes PNG conversions write at most `colors` palette colors,
+	 * picked from the image and dithered with `dither` on `threads`
+	 * threads. 0 colors writes PNGs as usual
+	 *
+	 * Works for any image decodeRows() supports
+	 */
+	void setPalette(int colors, ImagineDither dither, int threads);
+
+	/**
+	 * Sets what transparent pixels are flattened onto when the output
+	 * has no alpha. White if never set
+	 */
+	void setBackground(const ImagineBackground * background);
+
 	// Image dimensions in pixels
 	virtual ImaginePixels width() = 0;
 	virtual ImaginePixels height() = 0;
@@ -54,10 +156,48 @@ public:
 	// Color space of the pixels
 	virtual ImagineColorSpace colorspace() = 0;
 
+	// Number of frames (GIF) or pages (TIFF)
+	virtual int frameCount();
+
+	/**
+	 * EXIF orientation (1-8) or 0 if the file does not have one
+	 *
+	 * Needs load() or probe()
+	 */
+	int orientation();
+
+	// Prints the color space type as a string
+	const char * colorspaceString();
+
+	/**
+	 * Derived classes should return a brief description of the image type
+	 *
+	 * Example would be spelling out the acronym
+	 */
+	virtual const char * description() = 0;
+
 	// Processing
 	virtual int load() = 0;
 	virtual int unload() = 0;
 
+	/**
+	 * Reads just enough of the file for width(), height(), colorspace(),
+	 * bitsPerComponent(), frameCount() and compileMetadata() to work
+	 *
+	 * Use this instead of load() when no pixels are needed. Nothing
+	 * stays open afterwards so there is no need to call unload()
+	 */
+	virtual int probe();
+
+	/**
+	 * Decodes the loaded image one row at a time
+	 *
+	 * Works once per load(). A target size set before load() lets
+	 * decoders that can skip work (JPEG scaling, TIFF reduced resolution
+	 * pages) hand out fewer rows, never fewer than the target
+	 */
+	virtual int decodeRows(ImagineRowHandler handler, void * context);
+
 	/**
 	 * Requires derived classes to compile its own metadata
 	 *
@@ -65,18 +205,16 @@ public:
 	 */
 	virtual int compileMetadata(BF::Dictionary<BF::String, BF::String> * metadata) = 0;
 
-protected:
-	Image(const char * path, int * err);
-
 	// Returns type represented as an enum value
 	virtual ImageType type() = 0;
-	
+
 	/**
-	 * Derived classes should return a brief description of the image type
-	 *
-	 * Example would be spelling out the acronym
+	 * What this image's decoders and encoders have allocated so far
 	 */
-	virtual const char * description() = 0;
+	MemoryAccount * memory();
+
+protected:
+	Image(const char * path, int * err);
 	
 	// Specific conversions
 	virtual int toPNG();
@@ -84,8 +222,59 @@ protected:
 	virtual int toGIF();
 	virtual int toTIFF();
 
-	// Prints the color space type as a string
-	const char * colorspaceString();
+	/**
+	 * Decodes the image and writes it as a palette PNG. See setPalette()
+	 */
+	int toPalettePNG();
+
+	/// Row handler for toPalettePNG()
+	static int paletteAddRow(const ImagineRow * row, void * context);
+
+	/**
+	 * Filled by probe(). Derived classes fall back to this when
+	 * they have not been loaded
+	 */
+	ImagineProbeInfo _probeInfo;
+
+	/**
+	 * Points at an embedded XMP packet or EXIF (TIFF structured) block
+	 *
+	 * If `owned` the block came from malloc and is freed when it is
+	 * replaced or the image is deleted. Otherwise it belongs to a
+	 * decoder and unload() must call releaseMetadataBlocks() before
+	 * freeing the decoder
+	 */
+	void setMetadataBlock(ImagineMetadataType type, const void * data, size_t size, bool owned);
+	const unsigned char * metadataBlock(ImagineMetadataType type, size_t * size);
+	void releaseMetadataBlocks();
+
+	/**
+	 * Adds what we know how to read from the XMP and EXIF blocks.
+	 * EXIF wins where both have the same key
+	 */
+	int compileEmbeddedMetadata(BF::Dictionary<BF::String, BF::String> * metadata);
+
+	/**
+	 * Opens the image for reading: its file, standard input or the
+	 * buffer it was created from. Close with fclose()
+	 */
+	FILE * openInput();
+
+	/**
+	 * The bytes the image was created from, or NULL when it has a file.
+	 * Decoders with their own memory readers use this over openInput()
+	 */
+	const unsigned char * inputBuffer(size_t * size);
+
+	/**
+	 * Opens what a conversion to `type` writes: conversionOutputFile(),
+	 * or the buffer convertToBuffer() is filling. `filename` gets a name
+	 * for messages. Close with fclose(), even after a failed conversion
+	 */
+	FILE * openConversionOutput(ImageType type, char * filename, size_t size);
+
+	/// Whether openConversionOutput() writes to memory
+	bool convertingToBuffer();
 
 	/**
 	 * Will return the path we will write to when 
@@ -96,8 +285,44 @@ protected:
 	 */
 	const char * conversionOutputPath();
 
+	/**
+	 * Writes the file a conversion to `type` creates:
+	 * `<conversionOutputPath()>/<name>.<extension>`, the file given to
+	 * convertToFile(), or `-` when converting to standard output.
+	 * openConversionOutput() opens it
+	 */
+	int conversionOutputFile(ImageType type, char * filename, size_t size);
+
+	/**
+	 * Sets the directory conversionOutputPath() returns
+	 *
+	 * NULL resets it to the image's own directory, or to standard
+	 * output for images read from standard input. `-` is standard output
+	 */
+	void setConversionOutputPath(const char * path);
+
+	/**
+	 * Resolves the target size against the source dimensions
+	 *
+	 * Returns true if a smaller output was requested, writing
+	 * the final dimensions into `width` and `height`
+	 */
+	bool targetSizeForSource(ImaginePixels srcWidth, ImaginePixels srcHeight, ImaginePixels * width, ImaginePixels * height);
+
+	// Number of scans/passes to decode. 0 means full decode
+	int previewLevel();
+
+	// See setBackground()
+	const ImagineBackground * background();
+
 private:
 
+	/**
+	 * The part of convert() and convertToBuffer() that decodes and
+	 * encodes, counted as one image
+	 */
+	int loadAndConvert(ImageType type);
+
 	/** 
 	 * Used when converting image to a type
 	 *
@@ -106,6 +331,48 @@ private:
 	 * variable will be reset after the function is finished.
 	 */
 	char _imageReserved[PATH_MAX];
+
+	/// Requested output dimensions. 0 means unset
+	ImaginePixels _targetWidth;
+	ImaginePixels _targetHeight;
+
+	/// See setPreviewLevel()
+	int _previewLevel;
+
+	/// See setPalette()
+	int _paletteColors;
+	ImagineDither _dither;
+	int _ditherThreads;
+
+	/// See setBackground()
+	ImagineBackground _background;
+
+	/// See memory()
+	MemoryAccount _memory;
+
+	/// See createImageFromBuffer()
+	struct {
+		const unsigned char * data;
+		size_t size;
+	} _input;
+
+	/// Filled by the stream openConversionOutput() hands out while
+	/// convertToBuffer() runs
+	struct {
+		char * data;
+		size_t size;
+		bool active;
+
+		/// Set while convertToFile() runs
+		char file[PATH_MAX];
+	} _output;
+
+	/// See setMetadataBlock()
+	struct {
+		const unsigned char * data;
+		size_t size;
+		bool owned;
+	} _metadataBlocks[kImagineMetadataCount];
 };
 
 #endif
@@ -10,5 +10,79 @@ typedef enum {
 	kImageTypeTIFF = 3
 } ImageType;
 
+/*
+ * Shared with the C API in libimagine.hpp, so keep these plain C
+ */
+
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+typedef long ImaginePixels;
+
+typedef enum {
+	kImagineColorSpaceUnknown = -1,
+	kImagineColorSpaceRGB = 0,
+	kImagineColorSpaceRGBA = 1,
+	kImagineColorSpaceGray = 2,
+} ImagineColorSpace;
+
+/**
+ * How colors that are not in a palette get made up
+ */
+typedef enum {
+	kImagineDitherUnknown = -1,
+	kImagineDitherNone = 0,
+	kImagineDitherFloydSteinberg = 1,
+	kImagineDitherOrdered = 2,
+} ImagineDither;
+
+/**
+ * What transparent pixels are laid over when writing a format, or a
+ * palette, without alpha
+ */
+typedef struct {
+	/// The color, or the light squares of a checkerboard
+	unsigned char color[3];
+
+	/// The dark squares of a checkerboard
+	unsigned char second[3];
+	bool checker;
+} ImagineBackground;
+
+/**
+ * Header fields gathered by Image::probe() without decoding pixels
+ */
+typedef struct {
+	ImaginePixels width;
+	ImaginePixels height;
+	int bitsPerComponent;
+	int components;
+	ImagineColorSpace colorspace;
+
+	/// Frames for GIF, pages for TIFF, otherwise 1
+	int frameCount;
+} ImagineProbeInfo;
+
+/**
+ * Settings Image::convertToBuffer() and the C API apply with the
+ * setters before they convert. Zero everything for a plain conversion
+ */
+typedef struct {
+	/// See setTargetSize()
+	ImaginePixels width;
+	ImaginePixels height;
+
+	/// See setPreviewLevel()
+	int previewLevel;
+
+	/// See setPalette(). Dithering runs on the calling thread
+	int colors;
+	ImagineDither dither;
+
+	/// See setBackground(). NULL keeps the current one
+	const ImagineBackground * background;
+} ImagineConvertOptions;
+
 #endif
 
@@ -0,0 +1,907 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "index.hpp"
+#include "image.hpp"
+#include "hash.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <linux/limits.h>
+}
+
+using namespace BF;
+
+#define INDEX_SEGMENT_MAGIC "IMGINDEX"
+#define INDEX_SEGMENT_SUFFIX ".seg"
+#define INDEX_TEMP_SUFFIX ".tmp"
+#define INDEX_LOCK_NAME "lock"
+
+/// Bump whenever the record layout or what goes into a record changes
+static const uint32_t INDEX_FORMAT_VERSION = 1;
+
+/// Segments on disk before closing the index compacts it
+static const size_t INDEX_COMPACT_SEGMENT_COUNT = 8;
+
+typedef enum {
+	/// Ends in a hash table and a footer
+	kIndexSegmentCompacted = 1,
+} IndexSegmentFlags;
+
+typedef struct {
+	char magic[8];
+
+	/// Written in host order, so this also rejects foreign byte orders
+	uint32_t version;
+	uint32_t flags;
+} IndexSegmentHeader;
+
+/**
+ * Last bytes of a compacted segment
+ */
+typedef struct {
+	uint64_t recordsEnd;
+	uint64_t tableOffset;
+
+	/// Power of two
+	uint64_t tableCapacity;
+	char magic[8];
+} IndexSegmentFooter;
+
+typedef struct {
+	uint64_t pathHash;
+
+	/// 0 marks an empty slot
+	uint64_t offset;
+} IndexTableSlot;
+
+/**
+ * Followed by the null terminated path, description and colorspace,
+ * then `key\0value\0` pairs, then zeros up to a multiple of 8
+ */
+struct IndexRecord {
+	/// Whole record including padding
+	uint32_t size;
+
+	/// Low bits of the XXH64 of everything after this field
+	uint32_t checksum;
+
+	uint64_t pathHash;
+	uint64_t device;
+	uint64_t inode;
+	uint64_t fileSize;
+	int64_t mtimeSeconds;
+	int64_t mtimeNanoseconds;
+
+	/// 0 when the index was not hashing contents
+	uint64_t contentHash;
+
+	/// When the record was written. The latest one for a path wins
+	int64_t indexedAt;
+
+	int64_t width;
+	int64_t height;
+	int32_t bitsPerComponent;
+	int32_t frameCount;
+
+	// String sizes include the null
+	uint32_t pathSize;
+	uint32_t descriptionSize;
+	uint32_t colorspaceSize;
+	uint32_t metadataSize;
+};
+
+struct IndexSegment {
+	/// Full path of the file
+	char * name;
+
+	/// NULL if the segment could not be used
+	const unsigned char * data;
+	size_t size;
+	size_t recordsEnd;
+
+	/// Only for compacted segments
+	const IndexTableSlot * table;
+	uint64_t tableCapacity;
+};
+
+static uint32_t IndexRecordChecksum(const IndexRecord * r) {
+	size_t skip = offsetof(IndexRecord, pathHash);
+	return (uint32_t) HashXXH64(((const unsigned char *) r) + skip, r->size - skip, 0);
+}
+
+static const char * IndexRecordPath(const IndexRecord * r) {
+	return (const char *) (r + 1);
+}
+
+/**
+ * The record at offset, or NULL if it is torn, corrupt or out of bounds
+ */
+static const IndexRecord * IndexRecordAt(const IndexSegment * seg, size_t offset) {
+	const IndexRecord * r = NULL;
+	const char * strings = NULL;
+	uint64_t stringsSize = 0;
+
+	if ((offset % 8) || (offset >= seg->recordsEnd) || (seg->recordsEnd - offset < sizeof(IndexRecord))) return NULL;
+
+	r = (const IndexRecord *) (seg->data + offset);
+	if ((r->size < sizeof(IndexRecord)) || (r->size % 8) || (r->size > seg->recordsEnd - offset)) return NULL;
+
+	stringsSize = (uint64_t) r->pathSize + r->descriptionSize + r->colorspaceSize + r->metadataSize;
+	if (!r->pathSize || !r->descriptionSize || !r->colorspaceSize) return NULL;
+	else if (stringsSize > r->size - sizeof(IndexRecord)) return NULL;
+	else if (r->checksum != IndexRecordChecksum(r)) return NULL;
+
+	strings = IndexRecordPath(r);
+	if (strings[r->pathSize - 1]) return NULL;
+	strings += r->pathSize;
+	if (strings[r->descriptionSize - 1]) return NULL;
+	strings += r->descriptionSize;
+	if (strings[r->colorspaceSize - 1]) return NULL;
+	strings += r->colorspaceSize;
+	if (r->metadataSize && strings[r->metadataSize - 1]) return NULL;
+
+	return r;
+}
+
+/**
+ * Steps through a segment's records. Stops at the end or at the
+ * first bad record, which is usually a write that never finished
+ */
+static const IndexRecord * IndexSegmentNext(const IndexSegment * seg, size_t * offset) {
+	const IndexRecord * r = seg->data ? IndexRecordAt(seg, *offset) : NULL;
+	if (r) *offset += r->size;
+	return r;
+}
+
+static bool IndexRecordNewer(const IndexRecord * a, const IndexRecord * b) {
+	return a->indexedAt > b->indexedAt;
+}
+
+static bool IndexRecordMatchesStat(const IndexRecord * r, const struct stat * st) {
+	return (r->device == (uint64_t) st->st_dev)
+		&& (r->inode == (uint64_t) st->st_ino)
+		&& (r->fileSize == (uint64_t) st->st_size)
+		&& (r->mtimeSeconds == (int64_t) st->st_mtim.tv_sec)
+		&& (r->mtimeNanoseconds == (int64_t) st->st_mtim.tv_nsec);
+}
+
+/**
+ * Wall clock in nanoseconds. Records are compared across processes
+ * so a monotonic clock would not do
+ */
+static int64_t IndexNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((int64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static void IndexEntryFromRecord(const IndexRecord * r, IndexEntry * entry) {
+	entry->description = IndexRecordPath(r) + r->pathSize;
+	entry->colorspace = entry->description + r->descriptionSize;
+	entry->metadata = entry->colorspace + r->colorspaceSize;
+	entry->metadataSize = r->metadataSize;
+	entry->width = r->width;
+	entry->height = r->height;
+	entry->bitsPerComponent = r->bitsPerComponent;
+	entry->frameCount = r->frameCount;
+}
+
+int IndexEntryCompileMetadata(const IndexEntry * entry, Dictionary<String, String> * metadata) {
+	int result = 0;
+	const char * p = entry->metadata;
+	const char * end = p + entry->metadataSize;
+
+	while (!result && (p < end)) {
+		const char * key = p;
+		const char * keyEnd = (const char *) memchr(key, '\0', end - key);
+		if (!keyEnd || (keyEnd + 1 >= end)) break;
+
+		const char * value = keyEnd + 1;
+		const char * valueEnd = (const char *) memchr(value, '\0', end - value);
+		if (!valueEnd) break;
+
+		result = metadata->setValueForKey(key, value);
+		p = valueEnd + 1;
+	}
+
+	return result;
+}
+
+/**
+ * Smallest power of two that keeps the table at most half full
+ */
+static size_t IndexTableCapacity(size_t count) {
+	size_t capacity = 16;
+	while (capacity < count * 2) capacity *= 2;
+	return capacity;
+}
+
+/**
+ * Adds r to an open addressed table, replacing an older record for
+ * the same path
+ */
+static void IndexTableInsert(const IndexRecord ** table, size_t capacity, const IndexRecord * r) {
+	size_t mask = capacity - 1;
+
+	for (size_t i = r->pathHash & mask; ; i = (i + 1) & mask) {
+		if (!table[i]) {
+			table[i] = r;
+			return;
+		} else if ((table[i]->pathHash == r->pathHash) && !strcmp(IndexRecordPath(table[i]), IndexRecordPath(r))) {
+			if (IndexRecordNewer(r, table[i])) table[i] = r;
+			return;
+		}
+	}
+}
+
+static const IndexRecord * IndexTableFind(const IndexRecord ** table, size_t capacity, uint64_t hash, const char * key) {
+	size_t mask = capacity - 1;
+
+	if (!table) return NULL;
+
+	for (size_t i = hash & mask; table[i]; i = (i + 1) & mask) {
+		if ((table[i]->pathHash == hash) && !strcmp(IndexRecordPath(table[i]), key)) return table[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * Looks key up in a compacted segment's own table
+ */
+static const IndexRecord * IndexSegmentFind(const IndexSegment * seg, uint64_t hash, const char * key) {
+	uint64_t mask = seg->tableCapacity - 1;
+
+	if (!seg->data || !seg->table) return NULL;
+
+	for (uint64_t i = hash & mask, n = 0; n < seg->tableCapacity; i = (i + 1) & mask, n++) {
+		const IndexTableSlot * slot = &seg->table[i];
+
+		if (!slot->offset) break;
+		else if (slot->pathHash != hash) continue;
+
+		const IndexRecord * r = IndexRecordAt(seg, slot->offset);
+		if (r && (r->pathHash == hash) && !strcmp(IndexRecordPath(r), key)) return r;
+	}
+
+	return NULL;
+}
+
+/**
+ * Maps the segment at seg->name. Leaves seg->data NULL if it is not
+ * one we can read
+ */
+static void IndexSegmentMap(IndexSegment * seg) {
+	int fd = -1;
+	struct stat st;
+	void * data = MAP_FAILED;
+	const IndexSegmentHeader * header = NULL;
+
+	if ((fd = open(seg->name, O_RDONLY)) == -1) return;
+
+	// Too small for a header means it is still being created
+	if (!fstat(fd, &st) && ((size_t) st.st_size >= sizeof(IndexSegmentHeader))) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+
+	close(fd);
+	if (data == MAP_FAILED) return;
+
+	seg->data = (const unsigned char *) data;
+	seg->size = st.st_size;
+	seg->recordsEnd = st.st_size;
+	header = (const IndexSegmentHeader *) seg->data;
+
+	if (memcmp(header->magic, INDEX_SEGMENT_MAGIC, sizeof(header->magic))
+			|| (header->version != INDEX_FORMAT_VERSION)) {
+		munmap(data, seg->size);
+		seg->data = NULL;
+	} else if ((header->flags & kIndexSegmentCompacted)
+			&& (seg->size < sizeof(IndexSegmentHeader) + sizeof(IndexSegmentFooter))) {
+		munmap(data, seg->size);
+		seg->data = NULL;
+	} else if (header->flags & kIndexSegmentCompacted) {
+		size_t tableEnd = seg->size - sizeof(IndexSegmentFooter);
+		const IndexSegmentFooter * footer = (const IndexSegmentFooter *) (seg->data + tableEnd);
+
+		if (memcmp(footer->magic, INDEX_SEGMENT_MAGIC, sizeof(footer->magic))
+				|| (footer->recordsEnd > footer->tableOffset)
+				|| (footer->tableOffset % 8)
+				|| (footer->tableOffset > tableEnd)
+				|| !footer->tableCapacity
+				|| (footer->tableCapacity & (footer->tableCapacity - 1))
+				|| (footer->tableCapacity > (tableEnd - footer->tableOffset) / sizeof(IndexTableSlot))) {
+			munmap(data, seg->size);
+			seg->data = NULL;
+		} else {
+			seg->recordsEnd = footer->recordsEnd;
+			seg->table = (const IndexTableSlot *) (seg->data + footer->tableOffset);
+			seg->tableCapacity = footer->tableCapacity;
+
+			// Lookups jump around
+			madvise(data, seg->size, MADV_RANDOM);
+		}
+	} else {
+		// Append segments are walked once, front to back
+		madvise(data, seg->size, MADV_SEQUENTIAL);
+	}
+}
+
+static void IndexSegmentsFree(IndexSegment * segments, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		if (segments[i].data) munmap((void *) segments[i].data, segments[i].size);
+		BFFree(segments[i].name);
+	}
+
+	BFFree(segments);
+}
+
+static bool IndexHasSuffix(const char * name, const char * suffix) {
+	size_t size = strlen(name), suffixSize = strlen(suffix);
+	return (size > suffixSize) && !strcmp(name + size - suffixSize, suffix);
+}
+
+/**
+ * Maps every segment in dir
+ *
+ * Leftover temporary files from a compaction that never finished are
+ * listed too, unmapped, so the next compaction removes them
+ */
+static int IndexSegmentsLoad(const char * dir, IndexSegment ** segments, size_t * count) {
+	int result = 0;
+	DIR * d = NULL;
+	struct dirent * ent = NULL;
+	size_t capacity = 0;
+
+	*segments = NULL;
+	*count = 0;
+
+	if ((d = opendir(dir)) == NULL) {
+		BFErrorPrint("Could not open index '%s'", dir);
+		return 1;
+	}
+
+	while (!result && ((ent = readdir(d)) != NULL)) {
+		bool segment = IndexHasSuffix(ent->d_name, INDEX_SEGMENT_SUFFIX);
+		if (!segment && !IndexHasSuffix(ent->d_name, INDEX_TEMP_SUFFIX)) continue;
+
+		if (*count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			IndexSegment * grown = (IndexSegment *) realloc(*segments, capacity * sizeof(IndexSegment));
+
+			if (!grown) {
+				result = 2;
+				break;
+			}
+
+			*segments = grown;
+		}
+
+		IndexSegment * seg = &(*segments)[*count];
+		memset(seg, 0, sizeof(IndexSegment));
+
+		if ((seg->name = (char *) malloc(strlen(dir) + strlen(ent->d_name) + 2)) == NULL) {
+			result = 3;
+			break;
+		}
+
+		sprintf(seg->name, "%s/%s", dir, ent->d_name);
+		(*count)++;
+
+		if (segment) IndexSegmentMap(seg);
+	}
+
+	closedir(d);
+
+	if (result) {
+		IndexSegmentsFree(*segments, *count);
+		*segments = NULL;
+		*count = 0;
+	}
+
+	return result;
+}
+
+/**
+ * Creates a uniquely named file in dir and writes a segment header
+ *
+ * `name` gets the malloc'd path of the new file. mkstemps() makes it
+ * 0600, so it is given `mode` for others sharing the index to read
+ */
+static int IndexSegmentCreate(const char * dir, const char * suffix, uint32_t flags, mode_t mode, int * fd, char ** name) {
+	int result = 0;
+	IndexSegmentHeader header;
+
+	*fd = -1;
+
+	if ((*name = (char *) malloc(strlen(dir) + strlen(suffix) + 8)) == NULL) {
+		return 1;
+	}
+
+	sprintf(*name, "%s/XXXXXX%s", dir, suffix);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_SEGMENT_MAGIC, sizeof(header.magic));
+	header.version = INDEX_FORMAT_VERSION;
+	header.flags = flags;
+
+	if ((*fd = mkstemps(*name, strlen(suffix))) == -1) {
+		BFErrorPrint("Could not create a segment in '%s'", dir);
+		result = 2;
+	} else if (fchmod(*fd, mode)) {
+		BFErrorPrint("Could not set the permissions of '%s'", *name);
+		result = 3;
+	} else if (write(*fd, &header, sizeof(header)) != sizeof(header)) {
+		BFErrorPrint("Could not write '%s'", *name);
+		result = 4;
+	}
+
+	if (result) {
+		if (*fd != -1) {
+			close(*fd);
+			unlink(*name);
+			*fd = -1;
+		}
+
+		BFFree(*name);
+	}
+
+	return result;
+}
+
+MetadataIndex::MetadataIndex(const char * path, bool hashContents, int * err) {
+	int error = 0;
+	char lockPath[PATH_MAX];
+	mode_t mask = umask(0);
+
+	umask(mask);
+	this->_segmentMode = 0666 & ~mask;
+	this->_path = NULL;
+	this->_cwd = NULL;
+	this->_hashContents = hashContents;
+	this->_lockFd = -1;
+	this->_segments = NULL;
+	this->_segmentCount = 0;
+	this->_table = NULL;
+	this->_tableCapacity = 0;
+	this->_appendFd = -1;
+	this->_appendPath = NULL;
+	this->_added = 0;
+
+	if (!path) {
+		error = 1;
+	} else if (mkdir(path, 0755) && (errno != EEXIST)) {
+		BFErrorPrint("Could not create index '%s'", path);
+		error = 2;
+	} else if (((this->_path = strdup(path)) == NULL) || ((this->_cwd = getcwd(NULL, 0)) == NULL)) {
+		error = 3;
+	} else if (snprintf(lockPath, sizeof(lockPath), "%s/%s", path, INDEX_LOCK_NAME) >= (int) sizeof(lockPath)) {
+		error = 4;
+	} else if ((this->_lockFd = open(lockPath, O_RDWR | O_CREAT, 0644)) == -1) {
+		BFErrorPrint("Could not open '%s'", lockPath);
+		error = 5;
+
+	// Held for as long as we are open so no one compacts our segments away
+	} else if (flock(this->_lockFd, LOCK_SH)) {
+		error = 6;
+	} else {
+		error = IndexSegmentsLoad(path, &this->_segments, &this->_segmentCount);
+	}
+
+	// Append segments have no table of their own so we build one
+	if (error == 0) {
+		size_t records = 0, offset = 0;
+
+		for (size_t i = 0; i < this->_segmentCount; i++) {
+			if (this->_segments[i].table) continue;
+			offset = sizeof(IndexSegmentHeader);
+			while (IndexSegmentNext(&this->_segments[i], &offset)) records++;
+		}
+
+		if (records) {
+			this->_tableCapacity = IndexTableCapacity(records);
+			this->_table = (const IndexRecord **) calloc(this->_tableCapacity, sizeof(IndexRecord *));
+
+			if (!this->_table) error = 7;
+		}
+
+		for (size_t i = 0; !error && records && (i < this->_segmentCount); i++) {
+			const IndexRecord * r = NULL;
+
+			if (this->_segments[i].table) continue;
+			offset = sizeof(IndexSegmentHeader);
+			while ((r = IndexSegmentNext(&this->_segments[i], &offset)) != NULL) {
+				IndexTableInsert(this->_table, this->_tableCapacity, r);
+			}
+		}
+	}
+
+	if (error == 0) {
+		error = IndexSegmentCreate(path, INDEX_SEGMENT_SUFFIX, 0, this->_segmentMode, &this->_appendFd, &this->_appendPath);
+	}
+
+	// Every record goes out in a single write() so concurrent adds
+	// never interleave
+	if ((error == 0) && (fcntl(this->_appendFd, F_SETFL, O_APPEND) == -1)) {
+		error = 8;
+	}
+
+	if (err) *err = error;
+}
+
+MetadataIndex::~MetadataIndex() {
+	size_t segments = this->_segmentCount;
+
+	if (this->_appendFd != -1) {
+		close(this->_appendFd);
+
+		if (this->_added == 0) unlink(this->_appendPath);
+		else segments++;
+	}
+
+	BFFree(this->_appendPath);
+	IndexSegmentsFree(this->_segments, this->_segmentCount);
+	BFFree(this->_table);
+
+	if (this->_lockFd != -1) {
+		// Only compact if no one else has the index open. Failing to
+		// convert can drop our shared lock, which is fine since we are
+		// done with it
+		if ((segments >= INDEX_COMPACT_SEGMENT_COUNT) && !flock(this->_lockFd, LOCK_EX | LOCK_NB)) {
+			this->compact();
+		}
+
+		close(this->_lockFd);
+	}
+
+	BFFree(this->_path);
+	BFFree(this->_cwd);
+}
+
+int MetadataIndex::keyForPath(const char * path, char * key, size_t size) {
+	int written = 0;
+
+	if (path[0] == '/') {
+		written = snprintf(key, size, "%s", path);
+	} else {
+		// So './photos' and 'photos' share entries
+		while ((path[0] == '.') && (path[1] == '/')) {
+			path += 2;
+			while (path[0] == '/') path++;
+		}
+
+		written = snprintf(key, size, "%s/%s", this->_cwd, path);
+	}
+
+	return ((written < 0) || ((size_t) written >= size)) ? 1 : 0;
+}
+
+bool MetadataIndex::lookup(const char * path, const struct stat * st, IndexEntry * entry) {
+	char key[PATH_MAX];
+	uint64_t hash = 0;
+	uint64_t contentHash = 0;
+	const IndexRecord * r = NULL;
+	const IndexRecord * sameSize = NULL;
+
+	if (this->keyForPath(path, key, sizeof(key))) return false;
+	hash = HashXXH64(key, strlen(key), 0);
+
+	// Newer append segments first, then the compacted ones
+	for (size_t i = 0; i <= this->_segmentCount; i++) {
+		r = (i == 0)
+			? IndexTableFind(this->_table, this->_tableCapacity, hash, key)
+			: IndexSegmentFind(&this->_segments[i - 1], hash, key);
+
+		if (!r) {
+			continue;
+		} else if (IndexRecordMatchesStat(r, st)) {
+			IndexEntryFromRecord(r, entry);
+			return true;
+		} else if (r->contentHash && (r->fileSize == (uint64_t) st->st_size)) {
+			sameSize = r;
+		}
+	}
+
+	// Touched or copied but maybe not changed. Reading the bytes is
+	// still far cheaper than decoding
+	if (this->_hashContents && sameSize && !HashFile(path, &contentHash)
+			&& (contentHash == sameSize->contentHash)) {
+		IndexEntryFromRecord(sameSize, entry);
+
+		// Saves hashing it again next time
+		this->refresh(sameSize, st);
+
+		return true;
+	}
+
+	return false;
+}
+
+int MetadataIndex::refresh(const IndexRecord * record, const struct stat * st) {
+	int result = 0;
+	IndexRecord * r = NULL;
+
+	if (this->_appendFd == -1) {
+		result = 1;
+	} else if ((r = (IndexRecord *) malloc(record->size)) == NULL) {
+		result = 2;
+	} else {
+		memcpy(r, record, record->size);
+		r->device = st->st_dev;
+		r->inode = st->st_ino;
+		r->fileSize = st->st_size;
+		r->mtimeSeconds = st->st_mtim.tv_sec;
+		r->mtimeNanoseconds = st->st_mtim.tv_nsec;
+		r->indexedAt = IndexNow();
+		r->checksum = IndexRecordChecksum(r);
+
+		if (write(this->_appendFd, r, r->size) != (ssize_t) r->size) {
+			result = 3;
+		} else {
+			this->_added++;
+		}
+	}
+
+	BFFree(r);
+
+	return result;
+}
+
+int MetadataIndex::add(const char * path, const struct stat * st, Image * img, Dictionary<String, String> * metadata) {
+	int result = 0;
+	char key[PATH_MAX];
+	const char * description = img->description();
+	const char * colorspace = img->colorspaceString();
+	uint64_t contentHash = 0;
+	size_t metadataSize = 0, size = 0;
+	unsigned char * buf = NULL;
+	IndexRecord * r = NULL;
+	Dictionary<String, String>::Iterator * itr = 0;
+
+	if (this->_appendFd == -1) {
+		result = 1;
+	} else if (this->keyForPath(path, key, sizeof(key))) {
+		result = 2;
+	} else if (this->_hashContents && HashFile(path, &contentHash)) {
+		result = 3;
+	} else if ((result = metadata->createIterator(&itr)) == 0) {
+		// Size the pairs first so the record is a single allocation
+		while (!itr->finished()) {
+			String k = itr->current()->key();
+			String v = itr->current()->value();
+
+			metadataSize += strlen(k.cString()) + strlen(v.cString()) + 2;
+			if (itr->next()) break;
+		}
+	}
+
+	Delete(itr);
+	itr = 0;
+
+	if (result == 0) {
+		size = sizeof(IndexRecord) + strlen(key) + strlen(description) + strlen(colorspace) + 3 + metadataSize;
+		size = (size + 7) & ~((size_t) 7);
+
+		if (size > UINT32_MAX) {
+			result = 4;
+		} else if ((buf = (unsigned char *) calloc(1, size)) == NULL) {
+			result = 5;
+		}
+	}
+
+	if (result == 0) {
+		r = (IndexRecord *) buf;
+		r->size = size;
+		r->pathHash = HashXXH64(key, strlen(key), 0);
+		r->device = st->st_dev;
+		r->inode = st->st_ino;
+		r->fileSize = st->st_size;
+		r->mtimeSeconds = st->st_mtim.tv_sec;
+		r->mtimeNanoseconds = st->st_mtim.tv_nsec;
+		r->contentHash = contentHash;
+		r->indexedAt = IndexNow();
+		r->width = img->width();
+		r->height = img->height();
+		r->bitsPerComponent = img->bitsPerComponent();
+		r->frameCount = img->frameCount();
+		r->pathSize = strlen(key) + 1;
+		r->descriptionSize = strlen(description) + 1;
+		r->colorspaceSize = strlen(colorspace) + 1;
+		r->metadataSize = metadataSize;
+
+		char * p = (char *) (r + 1);
+		memcpy(p, key, r->pathSize);
+		p += r->pathSize;
+		memcpy(p, description, r->descriptionSize);
+		p += r->descriptionSize;
+		memcpy(p, colorspace, r->colorspaceSize);
+		p += r->colorspaceSize;
+
+		char * end = p + metadataSize;
+		if ((result = metadata->createIterator(&itr)) == 0) {
+			while (!itr->finished()) {
+				String k = itr->current()->key();
+				String v = itr->current()->value();
+				size_t keySize = strlen(k.cString()) + 1;
+				size_t valueSize = strlen(v.cString()) + 1;
+
+				if (keySize + valueSize > (size_t) (end - p)) {
+					result = 6;
+					break;
+				}
+
+				memcpy(p, k.cString(), keySize);
+				p += keySize;
+				memcpy(p, v.cString(), valueSize);
+				p += valueSize;
+
+				if (itr->next()) break;
+			}
+		}
+
+		Delete(itr);
+	}
+
+	if (result == 0) {
+		r->checksum = IndexRecordChecksum(r);
+
+		if (write(this->_appendFd, buf, size) != (ssize_t) size) {
+			BFErrorPrint("Could not add '%s' to the index", path);
+			result = 7;
+		} else {
+			this->_added++;
+		}
+	}
+
+	BFFree(buf);
+
+	return result;
+}
+
+int MetadataIndex::compact() {
+	int result = 0;
+	IndexSegment * segments = NULL;
+	size_t count = 0, records = 0, kept = 0, capacity = 0, offset = 0;
+	const IndexRecord ** table = NULL;
+	IndexTableSlot * slots = NULL;
+	uint64_t slotCapacity = 0;
+	int fd = -1;
+	char * tmpPath = NULL;
+	char * segPath = NULL;
+	FILE * file = NULL;
+	IndexSegmentFooter footer;
+
+	// Reload since others may have added segments since we opened
+	result = IndexSegmentsLoad(this->_path, &segments, &count);
+
+	if (result == 0) {
+		for (size_t i = 0; i < count; i++) {
+			offset = sizeof(IndexSegmentHeader);
+			while (IndexSegmentNext(&segments[i], &offset)) records++;
+		}
+
+		capacity = IndexTableCapacity(records);
+		if ((table = (const IndexRecord **) calloc(capacity, sizeof(IndexRecord *))) == NULL) {
+			result = 1;
+		}
+	}
+
+	if (result == 0) {
+		const IndexRecord * r = NULL;
+
+		for (size_t i = 0; i < count; i++) {
+			offset = sizeof(IndexSegmentHeader);
+			while ((r = IndexSegmentNext(&segments[i], &offset)) != NULL) {
+				IndexTableInsert(table, capacity, r);
+			}
+		}
+
+		// Forget files that are gone
+		for (size_t i = 0; i < capacity; i++) {
+			struct stat st;
+
+			if (!table[i]) continue;
+			else if (stat(IndexRecordPath(table[i]), &st) && (errno == ENOENT)) table[i] = NULL;
+			else kept++;
+		}
+
+		slotCapacity = IndexTableCapacity(kept);
+		if ((slots = (IndexTableSlot *) calloc(slotCapacity, sizeof(IndexTableSlot))) == NULL) {
+			result = 2;
+		}
+	}
+
+	if (result == 0) {
+		result = IndexSegmentCreate(this->_path, INDEX_TEMP_SUFFIX, kIndexSegmentCompacted, this->_segmentMode, &fd, &tmpPath);
+	}
+
+	if ((result == 0) && ((file = fdopen(fd, "w")) == NULL)) {
+		close(fd);
+		result = 3;
+	}
+
+	if (result == 0) {
+		uint64_t mask = slotCapacity - 1;
+		offset = sizeof(IndexSegmentHeader);
+
+		for (size_t i = 0; !result && (i < capacity); i++) {
+			const IndexRecord * r = table[i];
+			uint64_t s = 0;
+
+			if (!r) continue;
+
+			for (s = r->pathHash & mask; slots[s].offset; s = (s + 1) & mask);
+			slots[s].pathHash = r->pathHash;
+			slots[s].offset = offset;
+
+			if (fwrite(r, r->size, 1, file) != 1) result = 4;
+			offset += r->size;
+		}
+
+		memset(&footer, 0, sizeof(footer));
+		footer.recordsEnd = offset;
+		footer.tableOffset = offset;
+		footer.tableCapacity = slotCapacity;
+		memcpy(footer.magic, INDEX_SEGMENT_MAGIC, sizeof(footer.magic));
+
+		if (result) {
+			// Already set
+		} else if (fwrite(slots, sizeof(IndexTableSlot), slotCapacity, file) != slotCapacity) {
+			result = 5;
+		} else if (fwrite(&footer, sizeof(footer), 1, file) != 1) {
+			result = 6;
+		} else if (fflush(file) || fsync(fileno(file))) {
+			result = 7;
+		}
+	}
+
+	if (file && fclose(file) && (result == 0)) {
+		result = 8;
+	}
+
+	// Swap the new segment in, then drop everything it replaces.
+	// Dying in between leaves duplicates, which lookups tolerate
+	if (result == 0) {
+		size_t size = strlen(tmpPath);
+
+		if ((segPath = strdup(tmpPath)) == NULL) {
+			result = 9;
+		} else {
+			strcpy(segPath + size - strlen(INDEX_TEMP_SUFFIX), INDEX_SEGMENT_SUFFIX);
+
+			if (rename(tmpPath, segPath)) {
+				result = 10;
+			}
+		}
+	}
+
+	if (result == 0) {
+		for (size_t i = 0; i < count; i++) unlink(segments[i].name);
+	} else {
+		BFErrorPrint("Could not compact index '%s': %d", this->_path, result);
+		if (tmpPath) unlink(tmpPath);
+	}
+
+	BFFree(segPath);
+	BFFree(tmpPath);
+	BFFree(slots);
+	BFFree(table);
+	IndexSegmentsFree(segments, count);
+
+	return result;
+}
+
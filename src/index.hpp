@@ -0,0 +1,133 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef INDEX_HPP
+#define INDEX_HPP
+
+#include <bflibcpp/dictionary.hpp>
+#include <bflibcpp/string.hpp>
+#include <atomic>
+
+extern "C" {
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+}
+
+class Image;
+struct IndexSegment;
+struct IndexRecord;
+
+/**
+ * What the index remembers about a file
+ *
+ * Strings point into the index's mapped segments and stay valid
+ * until the index is deleted
+ */
+typedef struct {
+	const char * description;
+	const char * colorspace;
+	int64_t width;
+	int64_t height;
+	int bitsPerComponent;
+	int frameCount;
+
+	/// Packed key/value pairs. See IndexEntryCompileMetadata()
+	const char * metadata;
+	size_t metadataSize;
+} IndexEntry;
+
+/**
+ * Adds the metadata dictionary that was stored with entry
+ */
+int IndexEntryCompileMetadata(const IndexEntry * entry, BF::Dictionary<BF::String, BF::String> * metadata);
+
+/**
+ * On disk cache of compiled metadata, keyed by absolute path
+ *
+ * The index is a directory of segments. Every MetadataIndex appends
+ * to a segment of its own, so any number of processes can scan into
+ * the same index at once. Segments are mapped rather than read:
+ * compacted segments carry a hash table so lookups only touch the
+ * pages they need, while the handful of newer append segments are
+ * walked once when the index is opened.
+ *
+ * An entry is only returned if the file's device, inode, size and
+ * mtime still match. When content hashing is on, a file whose mtime
+ * moved but whose bytes did not is still a hit.
+ *
+ * Once enough segments pile up, whoever closes the index last merges
+ * them into one, dropping stale entries and files that are gone
+ */
+class MetadataIndex {
+public:
+	/**
+	 * Opens or creates the index at `path`
+	 *
+	 * `hashContents` stores an XXH64 of every file added and uses it
+	 * to revalidate files whose mtime changed
+	 */
+	MetadataIndex(const char * path, bool hashContents, int * err);
+	virtual ~MetadataIndex();
+
+	/**
+	 * Finds path's entry. `st` is path's current stat
+	 *
+	 * Returns false if the file is not indexed or has changed since.
+	 * Safe to call from many threads
+	 */
+	bool lookup(const char * path, const struct stat * st, IndexEntry * entry);
+
+	/**
+	 * Stores what we know about `img`, which must have been probed
+	 *
+	 * `metadata` is what img->compileMetadata() gave. The entry is not
+	 * visible to lookup() until the index is opened again. Safe to call
+	 * from many threads
+	 */
+	int add(const char * path, const struct stat * st, Image * img, BF::Dictionary<BF::String, BF::String> * metadata);
+
+private:
+	/**
+	 * Writes the absolute version of path into key
+	 */
+	int keyForPath(const char * path, char * key, size_t size);
+
+	/**
+	 * Appends a copy of record with st's file state
+	 */
+	int refresh(const IndexRecord * record, const struct stat * st);
+
+	/**
+	 * Merges every segment into one. Needs the exclusive lock
+	 */
+	int compact();
+
+	char * _path;
+	char * _cwd;
+	bool _hashContents;
+
+	/// flock()ed shared while open, exclusive while compacting
+	int _lockFd;
+
+	/// Permissions new segments get, same as fopen() would give
+	mode_t _segmentMode;
+
+	/// Segments that were on disk when we opened
+	IndexSegment * _segments;
+	size_t _segmentCount;
+
+	/// Records from the uncompacted segments
+	const IndexRecord ** _table;
+	size_t _tableCapacity;
+
+	/// Our own segment, opened with O_APPEND
+	int _appendFd;
+	char * _appendPath;
+	std::atomic<size_t> _added;
+};
+
+#endif // INDEX_HPP
+
@@ -6,6 +6,14 @@
  */
 
 #include "jpeg.hpp"
+#include "resize.hpp"
+#include "xmp.hpp"
+#include "exif.hpp"
+#include "trace.hpp"
+#include "counters.hpp"
+#include "memory.hpp"
+#include "stream.hpp"
+#include "codecs.hpp"
 #include <bflibcpp/bflibcpp.hpp>
 
 extern "C" {
@@ -13,6 +21,7 @@ extern "C" {
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <setjmp.h>
 
 #include <jpeglib.h>
 #include <png.h>
@@ -53,6 +62,30 @@ int JPEG::imagineColorSpaceToJPEGColorSpace(ImagineColorSpace cs) {
 	}
 }
 
+int JPEG::scaleDenominatorForTarget(
+	ImaginePixels srcWidth,
+	ImaginePixels srcHeight,
+	ImaginePixels dstWidth,
+	ImaginePixels dstHeight
+) {
+	int result = 1;
+
+	if ((dstWidth > 0) && (dstHeight > 0)) {
+		for (int denom = 8; denom > 1; denom /= 2) {
+			// libjpeg rounds scaled dimensions up
+			ImaginePixels w = (srcWidth + denom - 1) / denom;
+			ImaginePixels h = (srcHeight + denom - 1) / denom;
+
+			if ((w >= dstWidth) && (h >= dstHeight)) {
+				result = denom;
+				break;
+			}
+		}
+	}
+
+	return result;
+}
+
 JPEG::JPEG(const char * path, int * err) : Image(path, err) {
 	int error = err ? *err : 1;
 
@@ -62,81 +95,255 @@ JPEG::JPEG(const char * path, int * err) : Image(path, err) {
 }
 
 JPEG::~JPEG() {
-
+	// Gives the decompressor back if we were never unloaded
+	if (this->_decompressionInfo) this->unload();
 }
 
 ImaginePixels JPEG::width() {
 	if (this->_decompressionInfo) {
 		return ((struct jpeg_decompress_struct *) this->_decompressionInfo)->output_width;
-	} else return 0;
+	} else return this->_probeInfo.width;
 }
 
 ImaginePixels JPEG::height() {
 	if (this->_decompressionInfo) {
 		return ((struct jpeg_decompress_struct *) this->_decompressionInfo)->output_height;
-	} else return 0;
+	} else return this->_probeInfo.height;
 }
 
 int JPEG::bitsPerComponent() {
 	if (this->_decompressionInfo) {
 		return ((struct jpeg_decompress_struct *) this->_decompressionInfo)->data_precision;
-	} else return 0;
+	} else return this->_probeInfo.bitsPerComponent;
 }
 
 ImagineColorSpace JPEG::colorspace() {
+	// What the file holds, like probe() reports, not the RGB load()
+	// decodes everything to
 	if (this->_decompressionInfo) {
-		switch (((struct jpeg_decompress_struct *) this->_decompressionInfo)->out_color_space) {
+		switch (((struct jpeg_decompress_struct *) this->_decompressionInfo)->jpeg_color_space) {
+			case JCS_GRAYSCALE:
+				return kImagineColorSpaceGray;
 			case JCS_RGB:
-			case JCS_EXT_RGB:
+			case JCS_YCbCr:
 				return kImagineColorSpaceRGB;
 			default:
 				return kImagineColorSpaceUnknown;
 		}
 	}
 
-	return kImagineColorSpaceUnknown;
+	return this->_probeInfo.colorspace;
 }
 
-void JPEGErrorExit(j_common_ptr cinfo) {
-	printf("Error");
+// Markers from the JPEG spec (ITU T.81 table B.1)
+const unsigned char JPEG_MARKER_SOI = 0xD8;
+const unsigned char JPEG_MARKER_EOI = 0xD9;
+const unsigned char JPEG_MARKER_SOS = 0xDA;
+const unsigned char JPEG_MARKER_TEM = 0x01;
+const unsigned char JPEG_MARKER_RST0 = 0xD0;
+const unsigned char JPEG_MARKER_RST7 = 0xD7;
+const unsigned char JPEG_MARKER_DHT = 0xC4;
+const unsigned char JPEG_MARKER_JPG = 0xC8;
+const unsigned char JPEG_MARKER_DAC = 0xCC;
+const unsigned char JPEG_MARKER_APP1 = 0xE1;
+
+/**
+ * Returns the XMP packet inside an APP1 segment's data or NULL if the
+ * segment holds something else (usually EXIF)
+ */
+static const char * JPEGXMPPacket(const unsigned char * data, size_t size, size_t * packetSize) {
+	if ((size <= XMP_JPEG_APP1_SIGNATURE_SIZE)
+			|| memcmp(data, XMP_JPEG_APP1_SIGNATURE, XMP_JPEG_APP1_SIGNATURE_SIZE)) {
+		return NULL;
+	}
+
+	*packetSize = size - XMP_JPEG_APP1_SIGNATURE_SIZE;
+	return (const char *) data + XMP_JPEG_APP1_SIGNATURE_SIZE;
 }
 
-void JPEGErrorMessage(j_common_ptr cinfo, int msg_level) {
+/**
+ * Same as above for the TIFF structure of an EXIF APP1 segment
+ */
+static const unsigned char * JPEGEXIFBlock(const unsigned char * data, size_t size, size_t * blockSize) {
+	if ((size <= EXIF_JPEG_APP1_SIGNATURE_SIZE)
+			|| memcmp(data, EXIF_JPEG_APP1_SIGNATURE, EXIF_JPEG_APP1_SIGNATURE_SIZE)) {
+		return NULL;
+	}
+
+	*blockSize = size - EXIF_JPEG_APP1_SIGNATURE_SIZE;
+	return data + EXIF_JPEG_APP1_SIGNATURE_SIZE;
+}
+
+int JPEG::probe() {
+	int result = 0;
+	FILE * fs = NULL;
+	unsigned char buf[6];
+	bool done = false;
+
+	if ((fs = this->openInput()) == NULL) {
+		BFErrorPrint("can't open %s\n", this->path());
+		result = 1;
+	} else if ((fread(buf, 1, 2, fs) != 2) || (buf[0] != 0xFF) || (buf[1] != JPEG_MARKER_SOI)) {
+		BFErrorPrint("'%s' does not start with a JPEG SOI marker", this->path());
+		result = 2;
+	}
+
+	// Walk the marker segments until we find the frame header
+	while (!result && !done) {
+		int c = fgetc(fs);
+
+		if (c != 0xFF) {
+			BFErrorPrint("Expected a marker in '%s' but found 0x%x", this->path(), c);
+			result = 3;
+			break;
+		}
+
+		// Any number of fill bytes can come before the marker code
+		while ((c = fgetc(fs)) == 0xFF);
+
+		if (c == EOF) {
+			result = 4;
+		} else if ((c == JPEG_MARKER_TEM) || ((c >= JPEG_MARKER_RST0) && (c <= JPEG_MARKER_RST7))) {
+			// Standalone, nothing to skip
+		} else if ((c == JPEG_MARKER_EOI) || (c == JPEG_MARKER_SOS)) {
+			BFErrorPrint("No frame header found in '%s'", this->path());
+			result = 5;
+		} else if (fread(buf, 1, 2, fs) != 2) {
+			result = 6;
+		} else {
+			long length = (buf[0] << 8) | buf[1];
+
+			// SOF0 - SOF15, except the ones that share the range
+			if ((c >= 0xC0) && (c <= 0xCF) && (c != JPEG_MARKER_DHT) && (c != JPEG_MARKER_JPG) && (c != JPEG_MARKER_DAC)) {
+				if (fread(buf, 1, 6, fs) != 6) {
+					result = 7;
+				} else {
+					this->_probeInfo.bitsPerComponent = buf[0];
+					this->_probeInfo.height = (buf[1] << 8) | buf[2];
+					this->_probeInfo.width = (buf[3] << 8) | buf[4];
+					this->_probeInfo.components = buf[5];
+					this->_probeInfo.frameCount = 1;
+
+					switch (this->_probeInfo.components) {
+						case 1:
+							this->_probeInfo.colorspace = kImagineColorSpaceGray;
+							break;
+						case 3:
+							this->_probeInfo.colorspace = kImagineColorSpaceRGB;
+							break;
+						default:
+							this->_probeInfo.colorspace = kImagineColorSpaceUnknown;
+							break;
+					}
+
+					done = true;
+				}
+			} else if ((c == JPEG_MARKER_APP1) && (length > 2)) {
+				unsigned char * data = (unsigned char *) malloc(length - 2);
+				const void * block = NULL;
+				size_t blockSize = 0;
+				ImagineMetadataType type = kImagineMetadataXMP;
+
+				if (!data) {
+					result = 9;
+				} else if (fread(data, 1, length - 2, fs) != (size_t) (length - 2)) {
+					result = 10;
+				} else if ((block = JPEGXMPPacket(data, length - 2, &blockSize)) != NULL) {
+					type = kImagineMetadataXMP;
+				} else if ((block = JPEGEXIFBlock(data, length - 2, &blockSize)) != NULL) {
+					type = kImagineMetadataEXIF;
+				}
+
+				// Keep the block at the start of the buffer so it can be freed
+				if (block) {
+					memmove(data, block, blockSize);
+					this->setMetadataBlock(type, data, blockSize, true);
+					data = NULL;
+				}
+
+				BFFree(data);
+			} else if ((length < 2) || StreamSkip(fs, length - 2)) {
+				result = 8;
+			}
+		}
+	}
+
+	if (fs) fclose(fs);
 
+	return result;
 }
 
 int JPEG::load() {
 	int result = 0;
+	TraceScope scope("load", this->path());
 	struct jpeg_decompress_struct * cinfo = NULL;
 	JSAMPARRAY buffer = NULL;
 	int row_stride;
-	struct jpeg_error_mgr pub;
 
-	// Open the file
-	if ((this->_fileHandler = fopen(this->path(), "rb")) == NULL) {
+	// Open the file. Buffers are read in place
+	if (!this->inputBuffer(NULL) && ((this->_fileHandler = StreamOpenInput(this->path())) == NULL)) {
 		BFErrorPrint("can't open %s\n", this->path());
 		result = 1;
 	}
 
-	// Get memory for the jpeg structure 
+	// The decompressor stays ours until unload(). The error manager has
+	// to live as long, libjpeg can raise errors while we read scanlines
 	if (result == 0) {
-		cinfo = (struct jpeg_decompress_struct *) malloc(sizeof(struct jpeg_decompress_struct));
+		cinfo = (struct jpeg_decompress_struct *) CodecsAcquireJPEGDecompress(this->memory());
 		result = cinfo != NULL ? 0 : 2;
 	}
 
 	// Init the reading of the jpeg file with reading the header first
-	if (result == 0) {
-		cinfo->err = jpeg_std_error(&pub);
-		cinfo->err->error_exit = JPEGErrorExit;
-		cinfo->err->emit_message = JPEGErrorMessage;
-		jpeg_create_decompress(cinfo);
-		jpeg_stdio_src(cinfo, this->_fileHandler);
+	if ((result == 0) && setjmp(((CodecJPEGDecompress *) cinfo)->jmp)) {
+		result = 6;
+	} else if (result == 0) {
+		size_t size = 0;
+		const unsigned char * data = this->inputBuffer(&size);
+
+		CodecsJPEGSource((CodecJPEGDecompress *) cinfo, this->_fileHandler, data, size);
+
+		// Keep APP1 so we can find XMP and EXIF
+		jpeg_save_markers(cinfo, JPEG_APP0 + 1, 0xFFFF);
+
 		if (jpeg_read_header(cinfo, true) != JPEG_HEADER_OK) {
 			result = 3;
 			BFErrorPrint("Error reading header");
 		}
 	}
 
+	// Saved markers belong to cinfo so the blocks are only borrowed
+	if (result == 0) {
+		for (jpeg_saved_marker_ptr m = cinfo->marker_list; m; m = m->next) {
+			const void * block = NULL;
+			size_t blockSize = 0;
+
+			if (m->marker != JPEG_APP0 + 1) {
+				continue;
+			} else if ((block = JPEGXMPPacket(m->data, m->data_length, &blockSize)) != NULL) {
+				this->setMetadataBlock(kImagineMetadataXMP, block, blockSize, false);
+			} else if ((block = JPEGEXIFBlock(m->data, m->data_length, &blockSize)) != NULL) {
+				this->setMetadataBlock(kImagineMetadataEXIF, block, blockSize, false);
+			}
+		}
+	}
+
+	// Decode at a reduced size if we were only asked for a smaller image
+	if (result == 0) {
+		ImaginePixels tw = 0, th = 0;
+		if (this->targetSizeForSource(cinfo->image_width, cinfo->image_height, &tw, &th)) {
+			cinfo->scale_num = 1;
+			cinfo->scale_denom = JPEG::scaleDenominatorForTarget(cinfo->image_width, cinfo->image_height, tw, th);
+		}
+	}
+
+	// Previews of progressive files only need the first few scans.  Buffered
+	// image mode lets us pick which scan the output is produced from
+	if (result == 0) {
+		if ((this->previewLevel() > 0) && jpeg_has_multiple_scans(cinfo)) {
+			cinfo->buffered_image = TRUE;
+		}
+	}
+
 	// Get all the image data
 	if (result == 0) {
 		cinfo->out_color_space = JCS_RGB;
@@ -146,12 +353,30 @@ int JPEG::load() {
 		}
 	}
 
+	// Output will come from the requested scan.  libjpeg only absorbs input
+	// up to that scan, and stops at the last one if there are fewer
+	if (result == 0) {
+		if (cinfo->buffered_image) {
+			if (!jpeg_start_output(cinfo, this->previewLevel())) {
+				result = 5;
+				BFErrorPrint("Error starting output for scan %d", this->previewLevel());
+			}
+		}
+	}
+
 	// Save the decompressed data
 	if (result == 0) {
 		this->_decompressionInfo = cinfo;
 	} else {
 		BFErrorPrint("Error loading image '%s': %d", this->path(), result);
-		BFFree(cinfo);
+
+		if (cinfo) {
+			this->releaseMetadataBlocks();
+			CodecsReleaseJPEGDecompress((CodecJPEGDecompress *) cinfo);
+		}
+
+		if (this->_fileHandler) fclose(this->_fileHandler);
+		this->_fileHandler = NULL;
 	}
 
 	return result;
@@ -166,12 +391,16 @@ int JPEG::unload() {
 		// we get a segmentation fault
 		//jpeg_finish_decompress(cinfo);
 		
-		jpeg_destroy_decompress(cinfo);
+		// May point into the saved markers
+		this->releaseMetadataBlocks();
+
+		// Back to this thread's pool for the next image
+		CodecsReleaseJPEGDecompress((CodecJPEGDecompress *) cinfo);
 
 		// Close the file
 		if (this->_fileHandler) fclose(this->_fileHandler);
+		this->_fileHandler = NULL;
 
-		BFFree(this->_decompressionInfo);
 		this->_decompressionInfo = NULL;
 
 		return result;
@@ -197,18 +426,35 @@ int JPEG::toPNG() {
 	int number_of_passes = 0;
 	char file_name[PATH_MAX];
 	JSAMPARRAY buffer = NULL; // char **
-	
-	strcpy(file_name, this->conversionOutputPath());
-	sprintf(file_name, "%s/%s.png", file_name, this->name());
+	Resizer * resizer = NULL;
+	ImaginePixels tw = 0, th = 0;
 
-	FILE * pngFile = fopen(file_name, "wb");
-	if (!pngFile) {
-		BFErrorPrint("[write_png_file] File %s could not be opened for writing", file_name);
-		result = 1;
+	cinfo = (struct jpeg_decompress_struct *) this->_decompressionInfo;
+
+	// libjpeg already got us close to the target, the resizer does the rest
+	if (this->targetSizeForSource(cinfo->image_width, cinfo->image_height, &tw, &th)
+		&& ((tw != width) || (th != height))) {
+		resizer = new Resizer(width, height, tw, th, cinfo->output_components, &result);
+
+		if (result) {
+			BFErrorPrint("Could not create resizer: %d", result);
+		} else {
+			width = tw;
+			height = th;
+		}
+	}
+	
+	FILE * pngFile = NULL;
+	if (result == 0) {
+		pngFile = this->openConversionOutput(kImageTypePNG, file_name, sizeof(file_name));
+		if (!pngFile) {
+			BFErrorPrint("[write_png_file] File %s could not be opened for writing", file_name);
+			result = 1;
+		}
 	}
 
 	if (result == 0) {
-		png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, this->memory(), MemoryPNGAllocate, MemoryPNGFree);
 
 		if (!png_ptr) {
 			BFErrorPrint("Could not create png struct");
@@ -262,7 +508,13 @@ int JPEG::toPNG() {
 	}
 
 	if (result == 0) {
-		cinfo = (struct jpeg_decompress_struct *) this->_decompressionInfo;
+		if (setjmp(((CodecJPEGDecompress *) cinfo)->jmp)) {
+			BFErrorPrint("Could not decode '%s'", this->path());
+			result = 9;
+		}
+	}
+
+	if (result == 0) {
 		int row_stride = cinfo->output_width * cinfo->output_components;
 		buffer = (*cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE, row_stride, 1);
 
@@ -274,8 +526,19 @@ int JPEG::toPNG() {
 
 	if (result == 0) {
 		while(cinfo->output_scanline < cinfo->output_height) {
+			CountersEnter(kCountersStageDecode);
 			jpeg_read_scanlines(cinfo, buffer, 1);
-			png_write_row(png_ptr, buffer[0]);
+
+			if (resizer) {
+				bool ready = false;
+				CountersEnter(kCountersStageConvert);
+				resizer->pushRow(buffer[0], &ready);
+				CountersEnter(kCountersStageEncode);
+				if (ready) png_write_row(png_ptr, (png_bytep) resizer->outputRow());
+			} else {
+				CountersEnter(kCountersStageEncode);
+				png_write_row(png_ptr, buffer[0]);
+			}
 		}
 
 		if (setjmp(png_jmpbuf(png_ptr))) {
@@ -286,7 +549,50 @@ int JPEG::toPNG() {
 		png_write_end(png_ptr, NULL);
 	}
 
+	png_destroy_write_struct(&png_ptr, &info_ptr);
 	if (pngFile) fclose(pngFile);
+	Delete(resizer);
+
+	return result;
+}
+
+int JPEG::decodeRows(ImagineRowHandler handler, void * context) {
+	int result = 0;
+	TraceScope scope("decodeRows", this->path());
+	CountersScope stage(kCountersStageDecode);
+	struct jpeg_decompress_struct * cinfo = (struct jpeg_decompress_struct *) this->_decompressionInfo;
+	JSAMPARRAY buffer = NULL;
+	ImagineRow row;
+
+	if (!cinfo) {
+		return 1;
+	}
+
+	// load() already picked the scale, so these are the reduced rows
+	if (setjmp(((CodecJPEGDecompress *) cinfo)->jmp)) {
+		BFErrorPrint("Could not decode '%s'", this->path());
+		result = 4;
+	} else if ((buffer = (*cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE, cinfo->output_width * cinfo->output_components, 1)) == NULL) {
+		BFErrorPrint("Could not create buffer");
+		result = 2;
+	}
+
+	row.width = cinfo->output_width;
+	row.height = cinfo->output_height;
+	row.components = cinfo->output_components;
+
+	while ((result == 0) && (cinfo->output_scanline < cinfo->output_height)) {
+		row.y = cinfo->output_scanline;
+
+		CountersEnter(kCountersStageDecode);
+		if (jpeg_read_scanlines(cinfo, buffer, 1) != 1) {
+			result = 3;
+		} else {
+			row.data = buffer[0];
+			CountersEnter(kCountersStageConvert);
+			result = handler(&row, context);
+		}
+	}
 
 	return result;
 }
@@ -301,11 +607,6 @@ ImageType JPEG::type() {
 }
 
 int JPEG::compileMetadata(Dictionary<String, String> * metadata) {
-	//printf("Width: %d\n", this->width());
-	//printf("Height: %d\n", this->height());
-	//printf("Color space: %s\n", this->colorspaceString());
-	//printf("Bits per component: %d\n", this->bitsPerComponent());
-	
 	char buf[0xff];
 
 	sprintf(buf, "%d", this->width());
@@ -320,6 +621,6 @@ int JPEG::compileMetadata(Dictionary<String, String> * metadata) {
 	sprintf(buf, "%d", this->bitsPerComponent());
 	metadata->setValueForKey("Bits per component", buf);
 
-	return 0;
+	return this->compileEmbeddedMetadata(metadata);
 }
 
@@ -7,6 +7,7 @@
 #define JPEG_HPP
 
 #include "image.hpp"
+#include "jpegtransform.hpp"
 
 class JPEG : public Image {
 public:
@@ -23,6 +24,20 @@ public:
 	 */
 	static int imagineColorSpaceToJPEGColorSpace(ImagineColorSpace cs);
 
+	/**
+	 * Returns the largest libjpeg scale denominator (1, 2, 4 or 8)
+	 * whose scaled output is still at least the target size
+	 *
+	 * Decoding at 1/denominator lets libjpeg skip most of the IDCT
+	 * and upsampling work. The resizer covers the remaining step
+	 */
+	static int scaleDenominatorForTarget(
+		ImaginePixels srcWidth,
+		ImaginePixels srcHeight,
+		ImaginePixels dstWidth,
+		ImaginePixels dstHeight
+	);
+
 	JPEG(const char * path, int * err);
 	virtual ~JPEG();
 
@@ -34,12 +49,48 @@ public:
 	ImaginePixels height();
 	int load();
 	int unload();
+	int probe();
+	int decodeRows(ImagineRowHandler handler, void * context);
 	ImagineColorSpace colorspace();
 	int bitsPerComponent();
 	const char * description();
 	int compileMetadata(BF::Dictionary<BF::String, BF::String> * metadata);
 
+	/**
+	 * Losslessly transforms the image and writes it to the output path
+	 *
+	 * Does not need load(). `crop` can be NULL. See jpegtransform.hpp
+	 */
+	int transform(JPEGTransformType type, const JPEGCrop * crop);
+
+	// Same as above but writes to the directory at `path`
+	int transform(JPEGTransformType type, const JPEGCrop * crop, const char * path);
+
+	/**
+	 * Applies the transform for the EXIF orientation and resets the
+	 * tag to 1 so viewers do not rotate the result again
+	 *
+	 * Writes <output path>/<name>-upright.jpg. Does nothing if the
+	 * image is already upright
+	 */
+	int autoOrient();
+	int autoOrient(const char * path);
+
+	/**
+	 * Losslessly rewrites the coefficients with optimized Huffman
+	 * tables, or as progressive scans
+	 *
+	 * Writes <output path>/<file name>, keeping the input's extension.
+	 * When that is the input file it is only replaced if the result is
+	 * smaller. `sizeBefore` and `sizeAfter` (optional) get the file
+	 * sizes in bytes
+	 */
+	int optimize(const JPEGOptimizeOptions * options, size_t * sizeBefore, size_t * sizeAfter);
+	int optimize(const JPEGOptimizeOptions * options, size_t * sizeBefore, size_t * sizeAfter, const char * path);
+
 private:
+	int transformImage(JPEGTransformType type, const JPEGCrop * crop, bool resetOrientation);
+
 	// Holds the jpeg decompressed data
 	void * _decompressionInfo;
 };
@@ -0,0 +1,696 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ *
+ * Reference: jpegtran's transupp.c from the IJG libjpeg distribution
+ */
+
+#include "jpeg.hpp"
+#include "jpegtransform.hpp"
+#include "exif.hpp"
+#include "memory.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <jpeglib.h>
+}
+
+using namespace BF;
+
+/**
+ * libjpeg's default error_exit calls exit(), so we jump back
+ * to the caller instead
+ */
+typedef struct {
+	struct jpeg_error_mgr pub; // must be first
+	jmp_buf jmp;
+} JPEGTransformError;
+
+/**
+ * Describes where every output block comes from
+ */
+typedef struct {
+	/// Output x/y come from source y/x
+	bool swap;
+
+	/// Source is read right to left / bottom to top
+	bool mirrorX;
+	bool mirrorY;
+
+	/// Source pixels we use. Mirrored axes are trimmed to whole iMCUs
+	JDIMENSION srcWidth;
+	JDIMENSION srcHeight;
+
+	/// Output iMCU size in pixels
+	JDIMENSION mcuWidth;
+	JDIMENSION mcuHeight;
+
+	/// Crop origin in output pixels, always on an iMCU boundary
+	JDIMENSION offsetX;
+	JDIMENSION offsetY;
+
+	/// Final output size in pixels
+	JDIMENSION dstWidth;
+	JDIMENSION dstHeight;
+
+	/// Per coefficient source index and sign for the block transform
+	int coefIndex[DCTSIZE2];
+	int coefSign[DCTSIZE2];
+} JPEGTransformGeometry;
+
+static void JPEGTransformErrorExit(j_common_ptr cinfo) {
+	JPEGTransformError * err = (JPEGTransformError *) cinfo->err;
+	char msg[JMSG_LENGTH_MAX];
+
+	(*cinfo->err->format_message)(cinfo, msg);
+	BFErrorPrint("libjpeg: %s", msg);
+
+	longjmp(err->jmp, 1);
+}
+
+static void JPEGTransformEmitMessage(j_common_ptr cinfo, int msg_level) {
+
+}
+
+JPEGTransformType JPEGTransformForOrientation(int orientation) {
+	switch (orientation) {
+		case 2:
+			return kJPEGTransformFlipHorizontal;
+		case 3:
+			return kJPEGTransformRotate180;
+		case 4:
+			return kJPEGTransformFlipVertical;
+		case 5:
+			return kJPEGTransformTranspose;
+		case 6:
+			return kJPEGTransformRotate90;
+		case 7:
+			return kJPEGTransformTransverse;
+		case 8:
+			return kJPEGTransformRotate270;
+		case 1:
+		default:
+			return kJPEGTransformNone;
+	}
+}
+
+const char * JPEGTransformName(JPEGTransformType type) {
+	switch (type) {
+		case kJPEGTransformFlipHorizontal:
+			return "fliph";
+		case kJPEGTransformFlipVertical:
+			return "flipv";
+		case kJPEGTransformTranspose:
+			return "transpose";
+		case kJPEGTransformTransverse:
+			return "transverse";
+		case kJPEGTransformRotate90:
+			return "rotate90";
+		case kJPEGTransformRotate180:
+			return "rotate180";
+		case kJPEGTransformRotate270:
+			return "rotate270";
+		case kJPEGTransformNone:
+		default:
+			return "none";
+	}
+}
+
+/**
+ * Every transform is a transpose (or not) followed by mirroring
+ * the source axes
+ */
+static void JPEGTransformAxes(JPEGTransformType type, JPEGTransformGeometry * geo) {
+	geo->swap = (type == kJPEGTransformTranspose)
+		|| (type == kJPEGTransformTransverse)
+		|| (type == kJPEGTransformRotate90)
+		|| (type == kJPEGTransformRotate270);
+	geo->mirrorX = (type == kJPEGTransformFlipHorizontal)
+		|| (type == kJPEGTransformTransverse)
+		|| (type == kJPEGTransformRotate180)
+		|| (type == kJPEGTransformRotate270);
+	geo->mirrorY = (type == kJPEGTransformFlipVertical)
+		|| (type == kJPEGTransformTransverse)
+		|| (type == kJPEGTransformRotate90)
+		|| (type == kJPEGTransformRotate180);
+
+	// Mirroring a block negates its odd frequencies along that axis.
+	// Transposing swaps the horizontal and vertical frequencies
+	for (int r = 0; r < DCTSIZE; r++) {
+		for (int c = 0; c < DCTSIZE; c++) {
+			int sr = geo->swap ? c : r;
+			int sc = geo->swap ? r : c;
+			bool negate = (geo->mirrorX && (sc & 1)) != (geo->mirrorY && (sr & 1));
+
+			geo->coefIndex[(r * DCTSIZE) + c] = (sr * DCTSIZE) + sc;
+			geo->coefSign[(r * DCTSIZE) + c] = negate ? -1 : 1;
+		}
+	}
+}
+
+/**
+ * Works out the output geometry. Must be called after jpeg_read_header
+ */
+static int JPEGTransformGeometrySetup(
+	j_decompress_ptr src,
+	JPEGTransformType type,
+	const JPEGCrop * crop,
+	JPEGTransformGeometry * geo
+) {
+	JDIMENSION srcMcuWidth = src->max_h_samp_factor * DCTSIZE;
+	JDIMENSION srcMcuHeight = src->max_v_samp_factor * DCTSIZE;
+	JDIMENSION outWidth, outHeight;
+
+	JPEGTransformAxes(type, geo);
+
+	geo->srcWidth = src->image_width;
+	geo->srcHeight = src->image_height;
+
+	// Partial iMCUs on the far edge can't be moved to the near edge
+	if (geo->mirrorX) geo->srcWidth = (src->image_width / srcMcuWidth) * srcMcuWidth;
+	if (geo->mirrorY) geo->srcHeight = (src->image_height / srcMcuHeight) * srcMcuHeight;
+
+	if ((geo->srcWidth == 0) || (geo->srcHeight == 0)) {
+		BFErrorPrint("Image is smaller than one MCU and cannot be %s", JPEGTransformName(type));
+		return 1;
+	}
+
+	outWidth = geo->swap ? geo->srcHeight : geo->srcWidth;
+	outHeight = geo->swap ? geo->srcWidth : geo->srcHeight;
+	geo->mcuWidth = geo->swap ? srcMcuHeight : srcMcuWidth;
+	geo->mcuHeight = geo->swap ? srcMcuWidth : srcMcuHeight;
+
+	geo->offsetX = 0;
+	geo->offsetY = 0;
+	geo->dstWidth = outWidth;
+	geo->dstHeight = outHeight;
+
+	if (crop) {
+		if ((crop->x < 0) || (crop->y < 0) || (crop->width < 0) || (crop->height < 0)
+			|| ((JDIMENSION) crop->x >= outWidth) || ((JDIMENSION) crop->y >= outHeight)) {
+			BFErrorPrint("Crop origin %ld,%ld is outside of the %ux%u image", crop->x, crop->y, outWidth, outHeight);
+			return 2;
+		}
+
+		geo->offsetX = (crop->x / geo->mcuWidth) * geo->mcuWidth;
+		geo->offsetY = (crop->y / geo->mcuHeight) * geo->mcuHeight;
+
+		// Width or height of 0 runs to the edge
+		JDIMENSION w = crop->width ? crop->width + (crop->x - geo->offsetX) : outWidth;
+		JDIMENSION h = crop->height ? crop->height + (crop->y - geo->offsetY) : outHeight;
+
+		geo->dstWidth = (w < (outWidth - geo->offsetX)) ? w : (outWidth - geo->offsetX);
+		geo->dstHeight = (h < (outHeight - geo->offsetY)) ? h : (outHeight - geo->offsetY);
+	}
+
+	return 0;
+}
+
+/**
+ * Asks the source's memory manager for the output coefficient arrays.
+ * Has to happen before jpeg_read_coefficients realizes the arrays
+ */
+static void JPEGTransformRequestArrays(
+	j_decompress_ptr src,
+	const JPEGTransformGeometry * geo,
+	jvirt_barray_ptr * dstCoefs
+) {
+	JDIMENSION mcuCols = (geo->dstWidth + geo->mcuWidth - 1) / geo->mcuWidth;
+	JDIMENSION mcuRows = (geo->dstHeight + geo->mcuHeight - 1) / geo->mcuHeight;
+
+	for (int ci = 0; ci < src->num_components; ci++) {
+		jpeg_component_info * comp = src->comp_info + ci;
+		int hs = geo->swap ? comp->v_samp_factor : comp->h_samp_factor;
+		int vs = geo->swap ? comp->h_samp_factor : comp->v_samp_factor;
+
+		dstCoefs[ci] = (*src->mem->request_virt_barray)(
+			(j_common_ptr) src,
+			JPOOL_IMAGE,
+			FALSE,
+			mcuCols * hs,
+			mcuRows * vs,
+			(JDIMENSION) vs
+		);
+	}
+}
+
+/**
+ * Sets the output size and, for transposes, swaps the sampling
+ * factors and transposes the quantization tables
+ */
+static void JPEGTransformAdjustParameters(j_compress_ptr dst, const JPEGTransformGeometry * geo) {
+	dst->image_width = geo->dstWidth;
+	dst->image_height = geo->dstHeight;
+
+	if (geo->swap) {
+		for (int ci = 0; ci < dst->num_components; ci++) {
+			jpeg_component_info * comp = dst->comp_info + ci;
+			int tmp = comp->h_samp_factor;
+			comp->h_samp_factor = comp->v_samp_factor;
+			comp->v_samp_factor = tmp;
+		}
+
+		for (int t = 0; t < NUM_QUANT_TBLS; t++) {
+			JQUANT_TBL * qtbl = dst->quant_tbl_ptrs[t];
+			if (!qtbl) continue;
+
+			for (int r = 0; r < DCTSIZE; r++) {
+				for (int c = r + 1; c < DCTSIZE; c++) {
+					UINT16 tmp = qtbl->quantval[(r * DCTSIZE) + c];
+					qtbl->quantval[(r * DCTSIZE) + c] = qtbl->quantval[(c * DCTSIZE) + r];
+					qtbl->quantval[(c * DCTSIZE) + r] = tmp;
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Fills every output block from its source block
+ */
+static void JPEGTransformCoefficients(
+	j_decompress_ptr src,
+	jvirt_barray_ptr * srcCoefs,
+	jvirt_barray_ptr * dstCoefs,
+	const JPEGTransformGeometry * geo
+) {
+	JDIMENSION mcuCols = (geo->dstWidth + geo->mcuWidth - 1) / geo->mcuWidth;
+	JDIMENSION mcuRows = (geo->dstHeight + geo->mcuHeight - 1) / geo->mcuHeight;
+
+	for (int ci = 0; ci < src->num_components; ci++) {
+		jpeg_component_info * comp = src->comp_info + ci;
+		long hs = geo->swap ? comp->v_samp_factor : comp->h_samp_factor;
+		long vs = geo->swap ? comp->h_samp_factor : comp->v_samp_factor;
+
+		// Output blocks in this component
+		long dstCols = mcuCols * hs;
+		long dstRows = mcuRows * vs;
+
+		// Crop offset in this component's blocks
+		long offCol = (geo->offsetX / geo->mcuWidth) * hs;
+		long offRow = (geo->offsetY / geo->mcuHeight) * vs;
+
+		// Source blocks we may read from (the virtual arrays are padded to whole iMCUs)
+		long srcCols = (long) ((comp->width_in_blocks + comp->h_samp_factor - 1) / comp->h_samp_factor) * comp->h_samp_factor;
+		long srcRows = (long) ((comp->height_in_blocks + comp->v_samp_factor - 1) / comp->v_samp_factor) * comp->v_samp_factor;
+
+		// Source blocks along the mirrored axes after trimming
+		long mirrorCols = (geo->srcWidth / (src->max_h_samp_factor * DCTSIZE)) * comp->h_samp_factor;
+		long mirrorRows = (geo->srcHeight / (src->max_v_samp_factor * DCTSIZE)) * comp->v_samp_factor;
+
+		for (long dr = 0; dr < dstRows; dr++) {
+			JBLOCKROW dstRow = (*src->mem->access_virt_barray)(
+				(j_common_ptr) src, dstCoefs[ci], (JDIMENSION) dr, 1, TRUE
+			)[0];
+			JBLOCKROW srcRow = NULL;
+			long lastSrcRow = -1;
+
+			for (long dc = 0; dc < dstCols; dc++) {
+				long u = geo->swap ? dr + offRow : dc + offCol;
+				long v = geo->swap ? dc + offCol : dr + offRow;
+				long sc = geo->mirrorX ? (mirrorCols - 1 - u) : u;
+				long sr = geo->mirrorY ? (mirrorRows - 1 - v) : v;
+				JCOEFPTR out = dstRow[dc];
+
+				if ((sc < 0) || (sr < 0) || (sc >= srcCols) || (sr >= srcRows)) {
+					memset(out, 0, sizeof(JBLOCK));
+					continue;
+				}
+
+				// Without a transpose the whole output row comes from one source row
+				if (sr != lastSrcRow) {
+					srcRow = (*src->mem->access_virt_barray)(
+						(j_common_ptr) src, srcCoefs[ci], (JDIMENSION) sr, 1, FALSE
+					)[0];
+					lastSrcRow = sr;
+				}
+
+				JCOEFPTR in = srcRow[sc];
+				for (int k = 0; k < DCTSIZE2; k++) {
+					out[k] = (JCOEF) (in[geo->coefIndex[k]] * geo->coefSign[k]);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Keeps comments and application markers (EXIF, XMP, ICC) in memory
+ * so they can be copied to the output
+ */
+static void JPEGTransformSaveMarkers(j_decompress_ptr src) {
+	jpeg_save_markers(src, JPEG_COM, 0xFFFF);
+	for (int m = 0; m < 16; m++) {
+		jpeg_save_markers(src, JPEG_APP0 + m, 0xFFFF);
+	}
+}
+
+/**
+ * Writes a copy of an EXIF segment with its pixel dimensions set to the
+ * transformed size and, if asked, its orientation reset to upright
+ *
+ * Returns false if the segment is not EXIF so it gets copied as is
+ */
+static bool JPEGTransformWriteEXIF(
+	j_compress_ptr dst,
+	jpeg_saved_marker_ptr marker,
+	const JPEGTransformGeometry * geo,
+	bool resetOrientation
+) {
+	unsigned char * data = NULL;
+	EXIFInfo info;
+
+	if ((marker->marker != JPEG_APP0 + 1)
+		|| (marker->data_length <= EXIF_JPEG_APP1_SIGNATURE_SIZE)
+		|| memcmp(marker->data, EXIF_JPEG_APP1_SIGNATURE, EXIF_JPEG_APP1_SIGNATURE_SIZE)) {
+		return false;
+	} else if ((data = (unsigned char *) malloc(marker->data_length)) == NULL) {
+		return false;
+	}
+
+	memcpy(data, marker->data, marker->data_length);
+
+	unsigned char * tiff = data + EXIF_JPEG_APP1_SIGNATURE_SIZE;
+	size_t size = marker->data_length - EXIF_JPEG_APP1_SIGNATURE_SIZE;
+
+	if (EXIFParse(tiff, size, &info) == 0) {
+		EXIFSetPixelDimensions(tiff, size, &info, geo->dstWidth, geo->dstHeight);
+		if (resetOrientation) EXIFSetOrientation(tiff, size, &info, 1);
+	}
+
+	jpeg_write_marker(dst, marker->marker, data, marker->data_length);
+	free(data);
+
+	return true;
+}
+
+/**
+ * `geo` is NULL when the geometry did not change
+ */
+static void JPEGTransformCopyMarkers(
+	j_decompress_ptr src,
+	j_compress_ptr dst,
+	const JPEGTransformGeometry * geo,
+	bool resetOrientation
+) {
+	for (jpeg_saved_marker_ptr marker = src->marker_list; marker; marker = marker->next) {
+		// libjpeg writes its own JFIF and Adobe markers
+		if (dst->write_JFIF_header && (marker->marker == JPEG_APP0)
+			&& (marker->data_length >= 5) && !memcmp(marker->data, "JFIF", 5)) {
+			continue;
+		} else if (dst->write_Adobe_marker && (marker->marker == (JPEG_APP0 + 14))
+			&& (marker->data_length >= 5) && !memcmp(marker->data, "Adobe", 5)) {
+			continue;
+		} else if (geo && JPEGTransformWriteEXIF(dst, marker, geo, resetOrientation)) {
+			continue;
+		}
+
+		jpeg_write_marker(dst, marker->marker, marker->data, marker->data_length);
+	}
+}
+
+int JPEG::transform(JPEGTransformType type, const JPEGCrop * crop, const char * path) {
+	this->setConversionOutputPath(path);
+	return this->transform(type, crop);
+}
+
+int JPEG::transform(JPEGTransformType type, const JPEGCrop * crop) {
+	return this->transformImage(type, crop, false);
+}
+
+int JPEG::autoOrient(const char * path) {
+	this->setConversionOutputPath(path);
+	return this->autoOrient();
+}
+
+int JPEG::autoOrient() {
+	int result = this->probe();
+	int orientation = 0;
+
+	if (result == 0) {
+		orientation = this->orientation();
+
+		if (orientation <= 1) {
+			printf("'%s' is already upright\n", this->path());
+		} else {
+			result = this->transformImage(JPEGTransformForOrientation(orientation), NULL, true);
+		}
+	}
+
+	return result;
+}
+
+int JPEG::transformImage(JPEGTransformType type, const JPEGCrop * crop, bool resetOrientation) {
+	int result = 0;
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	JPEGTransformError jerr;
+	JPEGTransformGeometry geo;
+	MemoryAccount * account = this->memory();
+	jvirt_barray_ptr dstCoefs[MAX_COMPONENTS];
+	jvirt_barray_ptr * srcCoefs = NULL;
+	struct stat st;
+	FILE * in = NULL;
+	FILE * volatile out = NULL;
+	char filename[PATH_MAX];
+	char tmpname[PATH_MAX];
+
+	snprintf(filename, PATH_MAX, "%s/%s-%s.jpg",
+		this->conversionOutputPath(),
+		this->name(),
+		resetOrientation ? "upright" : (type == kJPEGTransformNone) ? "crop" : JPEGTransformName(type));
+	snprintf(tmpname, PATH_MAX, "%s/.%s.XXXXXX", this->conversionOutputPath(), this->name());
+
+	if ((in = fopen(this->path(), "rb")) == NULL) {
+		BFErrorPrint("Could not open file %s", this->path());
+		return 1;
+	} else if (fstat(fileno(in), &st)) {
+		fclose(in);
+		return 1;
+	}
+
+	// Both structs share the error manager
+	src.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = JPEGTransformErrorExit;
+	jerr.pub.emit_message = JPEGTransformEmitMessage;
+	jpeg_create_decompress(&src);
+	MemoryAttachJPEG((j_common_ptr) &src, account);
+
+	dst.err = &jerr.pub;
+	jpeg_create_compress(&dst);
+	MemoryAttachJPEG((j_common_ptr) &dst, account);
+
+	if (setjmp(jerr.jmp)) {
+		BFErrorPrint("Could not transform '%s'", this->path());
+		result = 2;
+	} else {
+		jpeg_stdio_src(&src, in);
+		JPEGTransformSaveMarkers(&src);
+		(void) jpeg_read_header(&src, TRUE);
+
+		result = JPEGTransformGeometrySetup(&src, type, crop, &geo);
+
+		if (result == 0) {
+			int fd = -1;
+
+			JPEGTransformRequestArrays(&src, &geo, dstCoefs);
+			srcCoefs = jpeg_read_coefficients(&src);
+
+			jpeg_copy_critical_parameters(&src, &dst);
+			JPEGTransformAdjustParameters(&dst, &geo);
+			JPEGTransformCoefficients(&src, srcCoefs, dstCoefs, &geo);
+
+			// Write next to the destination so a failure part way never
+			// leaves a truncated file under the final name
+			if ((fd = mkstemp(tmpname)) == -1) {
+				BFErrorPrint("Could not create temporary file %s", tmpname);
+				result = 3;
+			} else if ((out = fdopen(fd, "wb")) == NULL) {
+				close(fd);
+				unlink(tmpname);
+				result = 4;
+			}
+		}
+
+		if (result == 0) {
+			jpeg_stdio_dest(&dst, out);
+			jpeg_write_coefficients(&dst, dstCoefs);
+			JPEGTransformCopyMarkers(&src, &dst, &geo, resetOrientation);
+
+			jpeg_finish_compress(&dst);
+			(void) jpeg_finish_decompress(&src);
+		}
+	}
+
+	jpeg_destroy_compress(&dst);
+	jpeg_destroy_decompress(&src);
+
+	fclose(in);
+
+	if (out) {
+		if (fclose(out) && (result == 0)) {
+			result = 5;
+		}
+
+		// Keep the original permissions
+		(void) chmod(tmpname, st.st_mode & 07777);
+
+		if (result) {
+			unlink(tmpname);
+		} else if (rename(tmpname, filename)) {
+			BFErrorPrint("Could not move %s to %s", tmpname, filename);
+			unlink(tmpname);
+			result = 6;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Copies the coefficients from `in` to `out`, letting libjpeg build
+ * optimal Huffman tables for this image. libjpeg's memory is charged
+ * to `account`
+ */
+static int JPEGOptimizeStream(FILE * in, FILE * out, const JPEGOptimizeOptions * options, MemoryAccount * account) {
+	int result = 0;
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	JPEGTransformError jerr;
+	jvirt_barray_ptr * coefs = NULL;
+
+	src.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = JPEGTransformErrorExit;
+	jerr.pub.emit_message = JPEGTransformEmitMessage;
+	jpeg_create_decompress(&src);
+	MemoryAttachJPEG((j_common_ptr) &src, account);
+
+	dst.err = &jerr.pub;
+	jpeg_create_compress(&dst);
+	MemoryAttachJPEG((j_common_ptr) &dst, account);
+
+	if (setjmp(jerr.jmp)) {
+		result = 1;
+	} else {
+		jpeg_stdio_src(&src, in);
+		if (!options || !options->strip) {
+			JPEGTransformSaveMarkers(&src);
+		}
+
+		(void) jpeg_read_header(&src, TRUE);
+		coefs = jpeg_read_coefficients(&src);
+
+		jpeg_copy_critical_parameters(&src, &dst);
+		dst.optimize_coding = TRUE;
+		if (options && options->progressive) {
+			jpeg_simple_progression(&dst);
+		}
+
+		jpeg_stdio_dest(&dst, out);
+		jpeg_write_coefficients(&dst, coefs);
+
+		if (!options || !options->strip) {
+			JPEGTransformCopyMarkers(&src, &dst, NULL, false);
+		}
+
+		jpeg_finish_compress(&dst);
+		(void) jpeg_finish_decompress(&src);
+	}
+
+	jpeg_destroy_compress(&dst);
+	jpeg_destroy_decompress(&src);
+
+	return result;
+}
+
+int JPEG::optimize(const JPEGOptimizeOptions * options, size_t * sizeBefore, size_t * sizeAfter, const char * path) {
+	this->setConversionOutputPath(path);
+	return this->optimize(options, sizeBefore, sizeAfter);
+}
+
+int JPEG::optimize(const JPEGOptimizeOptions * options, size_t * sizeBefore, size_t * sizeAfter) {
+	int result = 0;
+	char filename[PATH_MAX];
+	char tmpname[PATH_MAX];
+	char realIn[PATH_MAX];
+	char realOut[PATH_MAX];
+	struct stat st;
+	size_t before = 0, after = 0;
+	bool inPlace = false;
+	FILE * in = NULL, * out = NULL;
+	int fd = -1;
+
+	const char * base = strrchr(this->path(), '/');
+
+	// Keep the input's file name, so .jpeg and .JPG are replaced rather
+	// than joined by a .jpg copy
+	base = base ? base + 1 : this->path();
+	snprintf(filename, PATH_MAX, "%s/%s", this->conversionOutputPath(), base);
+	snprintf(tmpname, PATH_MAX, "%s/.%s.XXXXXX", this->conversionOutputPath(), this->name());
+
+	if ((in = fopen(this->path(), "rb")) == NULL) {
+		BFErrorPrint("Could not open file %s", this->path());
+		result = 1;
+	} else if (fstat(fileno(in), &st)) {
+		result = 2;
+	} else {
+		before = st.st_size;
+
+		// Writing over ourselves means we only keep the result if it is smaller
+		inPlace = realpath(this->path(), realIn)
+			&& realpath(filename, realOut)
+			&& !strcmp(realIn, realOut);
+	}
+
+	// Write next to the destination so the rename is atomic
+	if (result == 0) {
+		if ((fd = mkstemp(tmpname)) == -1) {
+			BFErrorPrint("Could not create temporary file %s", tmpname);
+			result = 3;
+		} else if ((out = fdopen(fd, "wb")) == NULL) {
+			close(fd);
+			unlink(tmpname);
+			result = 4;
+		}
+	}
+
+	if (result == 0) {
+		if (JPEGOptimizeStream(in, out, options, this->memory())) {
+			BFErrorPrint("Could not optimize '%s'", this->path());
+			result = 5;
+		}
+
+		after = ftell(out);
+
+		if (fclose(out)) {
+			result = result ? result : 6;
+		}
+
+		// Keep the original permissions
+		(void) chmod(tmpname, st.st_mode & 07777);
+
+		if (result) {
+			unlink(tmpname);
+		} else if (inPlace && (after >= before)) {
+			unlink(tmpname);
+			after = before;
+		} else if (rename(tmpname, filename)) {
+			BFErrorPrint("Could not move %s to %s", tmpname, filename);
+			unlink(tmpname);
+			result = 7;
+		}
+	}
+
+	if (in) fclose(in);
+
+	if (sizeBefore) *sizeBefore = before;
+	if (sizeAfter) *sizeAfter = after;
+
+	return result;
+}
@@ -0,0 +1,68 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef JPEGTRANSFORM_HPP
+#define JPEGTRANSFORM_HPP
+
+#include "image.hpp"
+
+/**
+ * Lossless transforms done directly on the DCT coefficients
+ *
+ * Works like jpegtran: coefficients are read with jpeg_read_coefficients,
+ * rearranged block by block, and written back with jpeg_write_coefficients.
+ * Nothing is decoded so there is no generation loss.
+ *
+ * Edges that do not fill a whole MCU cannot be mirrored, so they are
+ * trimmed for any transform that flips that axis (jpegtran's -trim)
+ */
+typedef enum {
+	kJPEGTransformNone = 0,
+	kJPEGTransformFlipHorizontal = 1,
+	kJPEGTransformFlipVertical = 2,
+	kJPEGTransformTranspose = 3,
+	kJPEGTransformTransverse = 4,
+	kJPEGTransformRotate90 = 5,
+	kJPEGTransformRotate180 = 6,
+	kJPEGTransformRotate270 = 7,
+} JPEGTransformType;
+
+/**
+ * Crop region in output pixels
+ *
+ * The origin is moved up and left onto an MCU boundary, growing
+ * the region so the right and bottom edges stay where they were
+ */
+typedef struct {
+	ImaginePixels x;
+	ImaginePixels y;
+	ImaginePixels width;
+	ImaginePixels height;
+} JPEGCrop;
+
+/**
+ * Options for JPEG::optimize
+ */
+typedef struct {
+	/// Write progressive scans instead of sequential ones
+	bool progressive;
+
+	/// Drop APPn and COM markers (EXIF, XMP, ICC, comments)
+	bool strip;
+} JPEGOptimizeOptions;
+
+/**
+ * Returns the transform that puts an image with the given EXIF
+ * orientation (1-8) upright
+ */
+JPEGTransformType JPEGTransformForOrientation(int orientation);
+
+/**
+ * Short name used for output file names and messages
+ */
+const char * JPEGTransformName(JPEGTransformType type);
+
+#endif // JPEGTRANSFORM_HPP
+
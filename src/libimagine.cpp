@@ -0,0 +1,317 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "libimagine.hpp"
+#include "image.hpp"
+#include "arena.hpp"
+#include "codecs.hpp"
+#include "stream.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+}
+
+/**
+ * What a handle points at. The lock keeps callers sharing a handle out
+ * of each other's way, Image objects are only safe on one thread
+ */
+struct ImagineImage {
+	Image * image;
+	pthread_mutex_t lock;
+};
+
+/**
+ * Holds the handle's lock for a scope
+ */
+class ImagineLock {
+public:
+	ImagineLock(ImagineImage * image) : _image(image) {
+		pthread_mutex_lock(&this->_image->lock);
+	}
+
+	~ImagineLock() {
+		pthread_mutex_unlock(&this->_image->lock);
+	}
+
+private:
+	ImagineImage * _image;
+};
+
+/**
+ * Wraps `image`, or deletes it if that fails
+ */
+static ImagineImage * ImagineWrap(Image * image, int * err) {
+	ImagineImage * result = NULL;
+
+	if (!image) {
+		return NULL;
+	} else if ((result = (ImagineImage *) malloc(sizeof(ImagineImage))) == NULL) {
+		Delete(image);
+		if (err) *err = -1;
+		return NULL;
+	}
+
+	result->image = image;
+	pthread_mutex_init(&result->lock, NULL);
+
+	return result;
+}
+
+/**
+ * Settings only last for one call, so what an earlier call asked for
+ * never leaks into the next
+ */
+static void ImagineApplyOptions(Image * image, const ImagineConvertOptions * options) {
+	ImagineBackground white;
+
+	memset(&white, 0, sizeof(white));
+	memset(white.color, 0xff, 3);
+
+	image->setTargetSize(options ? options->width : 0, options ? options->height : 0);
+	image->setPreviewLevel(options ? options->previewLevel : 0);
+
+	if (options && options->colors) {
+		image->setPalette(options->colors, options->dither, 1);
+	} else {
+		image->setPalette(0, kImagineDitherFloydSteinberg, 1);
+	}
+
+	image->setBackground(options && options->background ? options->background : &white);
+}
+
+int ImagineAPIVersion(void) {
+	return IMAGINE_API_VERSION;
+}
+
+ImagineImage * ImagineCreateFromPath(const char * path, int * err) {
+	int error = 0;
+	Image * image = NULL;
+
+	if (!path) {
+		if (err) *err = 1;
+		return NULL;
+	} else if (StreamIsStdio(path)) {
+		// Standard input belongs to the host process, not to us
+		BFErrorPrint("'%s' is not an image file, pass the bytes to ImagineCreateFromBuffer()", path);
+		if (err) *err = 2;
+		return NULL;
+	}
+
+	image = Image::createImage(path, &error);
+	if (err) *err = error;
+
+	if (error) {
+		Delete(image);
+		return NULL;
+	}
+
+	return ImagineWrap(image, err);
+}
+
+ImagineImage * ImagineCreateFromBuffer(const void * data, size_t size, int * err) {
+	int error = 0;
+	Image * image = Image::createImageFromBuffer(data, size, &error);
+
+	if (err) *err = error;
+
+	if (error) {
+		Delete(image);
+		return NULL;
+	}
+
+	return ImagineWrap(image, err);
+}
+
+void ImagineFree(ImagineImage * image) {
+	if (!image) return;
+
+	Delete(image->image);
+	pthread_mutex_destroy(&image->lock);
+	free(image);
+}
+
+ImageType ImagineGetType(ImagineImage * image) {
+	if (!image) return kImageTypeUnknown;
+
+	ImagineLock lock(image);
+	return image->image->type();
+}
+
+int ImagineProbe(ImagineImage * image, ImagineProbeInfo * info) {
+	int result = 0;
+
+	if (!image || !info) return 1;
+
+	ImagineLock lock(image);
+	Image * img = image->image;
+
+	if ((result = img->probe()) == 0) {
+		memset(info, 0, sizeof(ImagineProbeInfo));
+		info->width = img->width();
+		info->height = img->height();
+		info->bitsPerComponent = img->bitsPerComponent();
+		info->colorspace = img->colorspace();
+		info->frameCount = img->frameCount();
+
+		switch (info->colorspace) {
+			case kImagineColorSpaceGray: info->components = 1; break;
+			case kImagineColorSpaceRGB: info->components = 3; break;
+			case kImagineColorSpaceRGBA: info->components = 4; break;
+			default: info->components = 0; break;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Where ImagineDecodeRow() puts rows
+ */
+typedef struct {
+	unsigned char * pixels;
+	size_t stride;
+	size_t size;
+	ImaginePixels width;
+	ImaginePixels height;
+} ImagineDecodeContext;
+
+/**
+ * Expands each row to RGBA in the caller's buffer
+ */
+static int ImagineDecodeRow(const ImagineRow * row, void * context) {
+	ImagineDecodeContext * ctx = (ImagineDecodeContext *) context;
+	const unsigned char * p = row->data;
+	unsigned char * q = NULL;
+	size_t bytes = row->width * 4;
+
+	if ((bytes > ctx->stride) || ((row->y * ctx->stride) + bytes > ctx->size)) {
+		BFErrorPrint("%ld x %ld RGBA does not fit the decode buffer", row->width, row->height);
+		return 1;
+	}
+
+	q = ctx->pixels + (row->y * ctx->stride);
+
+	switch (row->components) {
+		case 1:
+			for (ImaginePixels x = 0; x < row->width; x++, p++, q += 4) {
+				q[0] = q[1] = q[2] = p[0];
+				q[3] = 0xff;
+			}
+			break;
+		case 2:
+			for (ImaginePixels x = 0; x < row->width; x++, p += 2, q += 4) {
+				q[0] = q[1] = q[2] = p[0];
+				q[3] = p[1];
+			}
+			break;
+		case 3:
+			for (ImaginePixels x = 0; x < row->width; x++, p += 3, q += 4) {
+				q[0] = p[0];
+				q[1] = p[1];
+				q[2] = p[2];
+				q[3] = 0xff;
+			}
+			break;
+		case 4:
+			memcpy(q, p, bytes);
+			break;
+		default:
+			return 2;
+	}
+
+	ctx->width = row->width;
+	ctx->height = row->y + 1;
+
+	return 0;
+}
+
+int ImagineDecode(ImagineImage * image, unsigned char * pixels, size_t stride, size_t size, ImaginePixels * width, ImaginePixels * height) {
+	int result = 0;
+	ImagineDecodeContext ctx;
+
+	if (!image || !pixels) return 1;
+
+	ImagineLock lock(image);
+	Image * img = image->image;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.pixels = pixels;
+	ctx.stride = stride;
+	ctx.size = size;
+
+	// Every pixel at full size
+	ImagineApplyOptions(img, NULL);
+
+	if ((result = img->load()) == 0) {
+		int error = 0;
+
+		result = img->decodeRows(ImagineDecodeRow, &ctx);
+
+		if ((error = img->unload()) && (result == 0)) {
+			result = error;
+		}
+	}
+
+	if (result == 0) {
+		if (width) *width = ctx.width;
+		if (height) *height = ctx.height;
+	}
+
+	return result;
+}
+
+int ImagineConvertToBuffer(ImagineImage * image, ImageType type, const ImagineConvertOptions * options, void ** data, size_t * size) {
+	if (!image || !data || !size) return 1;
+
+	ImagineLock lock(image);
+
+	ImagineApplyOptions(image->image, options);
+	return image->image->convertToBuffer(type, NULL, data, size);
+}
+
+int ImagineConvertToPath(ImagineImage * image, ImageType type, const ImagineConvertOptions * options, const char * path) {
+	if (!image || !path) return 1;
+	else if (StreamIsStdio(path)) {
+		BFErrorPrint("'%s' is not a file, use ImagineConvertToBuffer()", path);
+		return 2;
+	}
+
+	ImagineLock lock(image);
+
+	ImagineApplyOptions(image->image, options);
+	return image->image->convertToFile(type, path);
+}
+
+void ImagineFreeBuffer(void * data) {
+	free(data);
+}
+
+int ImagineMemoryUsage(ImagineImage * image, size_t * current, size_t * peak) {
+	if (!image) return 1;
+
+	ImagineLock lock(image);
+
+	if (current) *current = image->image->memory()->current;
+	if (peak) *peak = image->image->memory()->peak;
+
+	return 0;
+}
+
+int ImagineSetMemoryLimit(ImagineImage * image, size_t bytes) {
+	if (!image) return 1;
+
+	ImagineLock lock(image);
+	image->image->memory()->limit = bytes;
+
+	return 0;
+}
+
+void ImagineTrimThread(void) {
+	CodecsTrim();
+	ArenaTrim();
+}
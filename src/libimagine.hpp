@@ -0,0 +1,121 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef LIBIMAGINE_HPP
+#define LIBIMAGINE_HPP
+
+/*
+ * The C API libimagine.so exports. This header is plain C
+ *
+ * Images are opaque handles. Calls on different handles can run on any
+ * number of threads at once, and calls on one handle are serialized.
+ * Functions returning int return 0 on success. Details of a failure go
+ * to stderr
+ */
+
+#include "imagetypes.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Bumped when a function or struct here changes incompatibly
+#define IMAGINE_API_VERSION 1
+
+#define IMAGINE_API __attribute__((visibility("default")))
+
+typedef struct ImagineImage ImagineImage;
+
+/**
+ * IMAGINE_API_VERSION of the library that was loaded
+ */
+IMAGINE_API int ImagineAPIVersion(void);
+
+/**
+ * Creates a handle for the image file at `path`. NULL on failure, with
+ * `err` set if it is not NULL
+ *
+ * "-" is refused rather than read from the process's standard input,
+ * use ImagineCreateFromBuffer() for bytes you already hold
+ */
+IMAGINE_API ImagineImage * ImagineCreateFromPath(const char * path, int * err);
+
+/**
+ * Creates a handle for `size` bytes of an image file at `data`. Nothing
+ * is copied, so `data` has to outlive the handle. The filesystem is
+ * never touched
+ */
+IMAGINE_API ImagineImage * ImagineCreateFromBuffer(const void * data, size_t size, int * err);
+
+/**
+ * Frees the handle and everything it still holds. NULL is ignored
+ */
+IMAGINE_API void ImagineFree(ImagineImage * image);
+
+/**
+ * The format of the image
+ */
+IMAGINE_API ImageType ImagineGetType(ImagineImage * image);
+
+/**
+ * Reads the header into `info` without decoding pixels. `components`
+ * is the number of samples in `colorspace`, or 0 if it is unknown
+ */
+IMAGINE_API int ImagineProbe(ImagineImage * image, ImagineProbeInfo * info);
+
+/**
+ * Decodes the image as 8 bit RGBA into `pixels`, `stride` bytes apart
+ *
+ * `size` is the size of `pixels`, which needs room for ImagineProbe()'s
+ * height rows of width * 4 bytes. `width` and `height` get what was
+ * written and can be NULL
+ */
+IMAGINE_API int ImagineDecode(ImagineImage * image, unsigned char * pixels, size_t stride, size_t size, ImaginePixels * width, ImaginePixels * height);
+
+/**
+ * Converts to `type` in memory. On success `data` gets `size` bytes
+ * that the caller frees with ImagineFreeBuffer()
+ *
+ * `options` can be NULL. They only apply to this call, so whatever is
+ * left zero or NULL gets the defaults: full size, no palette, white
+ * background
+ */
+IMAGINE_API int ImagineConvertToBuffer(ImagineImage * image, ImageType type, const ImagineConvertOptions * options, void ** data, size_t * size);
+
+/**
+ * Converts to `type` and writes the result to `path`. "-" is refused
+ * rather than written to the process's standard output
+ */
+IMAGINE_API int ImagineConvertToPath(ImagineImage * image, ImageType type, const ImagineConvertOptions * options, const char * path);
+
+/**
+ * Frees what ImagineConvertToBuffer() returned. NULL is ignored
+ */
+IMAGINE_API void ImagineFreeBuffer(void * data);
+
+/**
+ * Bytes the handle's decoders and encoders hold now and held at most.
+ * Buffers the caller passes in are not counted
+ */
+IMAGINE_API int ImagineMemoryUsage(ImagineImage * image, size_t * current, size_t * peak);
+
+/**
+ * Caps what the handle's decoders and encoders can hold. Work that
+ * needs more fails. 0 is no limit
+ */
+IMAGINE_API int ImagineSetMemoryLimit(ImagineImage * image, size_t bytes);
+
+/**
+ * Frees the calling thread's idle decoder buffers and codec contexts,
+ * which are otherwise kept for its next image until the thread exits
+ */
+IMAGINE_API void ImagineTrimThread(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBIMAGINE_HPP
@@ -0,0 +1,335 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "memory.hpp"
+#include "arena.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <png.h>
+#include <jpeglib.h>
+#include <jerror.h>
+}
+
+/// Room in front of every MemoryAllocate() block for its size and the
+/// capacity of the arena buffer under it. Keeps the block as aligned as
+/// malloc()'s
+#define MEMORY_HEADER_SIZE 16
+
+static size_t MEMORY_DEFAULT_LIMIT = 0;
+
+static pthread_mutex_t MEMORY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static MemorySummary MEMORY_SUMMARY;
+
+void MemorySetDefaultLimit(size_t bytes) {
+	MEMORY_DEFAULT_LIMIT = bytes;
+}
+
+void MemoryAccountInit(MemoryAccount * account) {
+	memset(account, 0, sizeof(MemoryAccount));
+	account->limit = MEMORY_DEFAULT_LIMIT;
+}
+
+void MemoryAccountFinish(const MemoryAccount * account, const char * path) {
+	if (!account || (account->allocations == 0)) return;
+
+	pthread_mutex_lock(&MEMORY_LOCK);
+
+	MEMORY_SUMMARY.images++;
+	MEMORY_SUMMARY.allocations += account->allocations;
+	MEMORY_SUMMARY.refusals += account->refusals;
+
+	if (account->peak > MEMORY_SUMMARY.peak) {
+		MEMORY_SUMMARY.peak = account->peak;
+		snprintf(MEMORY_SUMMARY.path, sizeof(MEMORY_SUMMARY.path), "%s", path ? path : "");
+	}
+
+	pthread_mutex_unlock(&MEMORY_LOCK);
+}
+
+void MemorySummaryGet(MemorySummary * summary) {
+	pthread_mutex_lock(&MEMORY_LOCK);
+	memcpy(summary, &MEMORY_SUMMARY, sizeof(MemorySummary));
+	pthread_mutex_unlock(&MEMORY_LOCK);
+}
+
+bool MemoryCharge(MemoryAccount * account, size_t size) {
+	if (!account) {
+		return true;
+	} else if (account->limit && ((size > account->limit) || (account->current > account->limit - size))) {
+		// One message per image is enough, the decoders report the rest
+		if (account->refusals++ == 0) {
+			BFErrorPrint("Memory limit of %lu bytes reached", account->limit);
+		}
+
+		return false;
+	}
+
+	account->current += size;
+	account->allocations++;
+	if (account->current > account->peak) account->peak = account->current;
+
+	return true;
+}
+
+void MemoryCredit(MemoryAccount * account, size_t size) {
+	if (!account) return;
+	account->current = size < account->current ? account->current - size : 0;
+}
+
+void * MemoryAllocate(MemoryAccount * account, size_t size) {
+	unsigned char * block = NULL;
+	size_t capacity = 0;
+
+	if (size > SIZE_MAX - MEMORY_HEADER_SIZE) {
+		return NULL;
+	} else if (!MemoryCharge(account, size)) {
+		return NULL;
+	} else if ((block = (unsigned char *) ArenaAllocate(size + MEMORY_HEADER_SIZE, &capacity)) == NULL) {
+		MemoryCredit(account, size);
+		return NULL;
+	}
+
+	memcpy(block, &size, sizeof(size));
+	memcpy(block + sizeof(size), &capacity, sizeof(capacity));
+
+	return block + MEMORY_HEADER_SIZE;
+}
+
+void MemoryFree(MemoryAccount * account, void * pointer) {
+	unsigned char * block = (unsigned char *) pointer;
+	size_t size = 0, capacity = 0;
+
+	if (!block) return;
+
+	block -= MEMORY_HEADER_SIZE;
+	memcpy(&size, block, sizeof(size));
+	memcpy(&capacity, block + sizeof(size), sizeof(capacity));
+	MemoryCredit(account, size);
+
+	ArenaRelease(block, capacity);
+}
+
+void * MemoryPNGAllocate(struct png_struct_def * png, size_t size) {
+	return MemoryAllocate((MemoryAccount *) png_get_mem_ptr(png), size);
+}
+
+void MemoryPNGFree(struct png_struct_def * png, void * pointer) {
+	MemoryFree((MemoryAccount *) png_get_mem_ptr(png), pointer);
+}
+
+/**
+ * What we keep in `client_data` to follow libjpeg's pools
+ *
+ * libjpeg frees whole pools at a time, so we count the bytes handed
+ * out from each pool and give them back when the pool goes
+ */
+typedef struct {
+	MemoryAccount * account;
+	size_t pools[JPOOL_NUMPOOLS];
+
+	/// libjpeg's own methods, which do the work
+	struct jpeg_memory_mgr methods;
+} MemoryJPEG;
+
+/**
+ * Charges `size` bytes to `pool` or stops libjpeg with an out of memory
+ * error, same as when its own allocation fails
+ */
+static void MemoryJPEGCharge(j_common_ptr cinfo, int pool, size_t size) {
+	MemoryJPEG * jpeg = (MemoryJPEG *) cinfo->client_data;
+
+	if ((pool < 0) || (pool >= JPOOL_NUMPOOLS)) {
+		return; // libjpeg reports the bad pool itself
+	} else if (!MemoryCharge(jpeg->account, size)) {
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	}
+
+	jpeg->pools[pool] += size;
+}
+
+static void * MemoryJPEGAllocSmall(j_common_ptr cinfo, int pool, size_t size) {
+	MemoryJPEGCharge(cinfo, pool, size);
+	return ((MemoryJPEG *) cinfo->client_data)->methods.alloc_small(cinfo, pool, size);
+}
+
+static void * MemoryJPEGAllocLarge(j_common_ptr cinfo, int pool, size_t size) {
+	MemoryJPEGCharge(cinfo, pool, size);
+	return ((MemoryJPEG *) cinfo->client_data)->methods.alloc_large(cinfo, pool, size);
+}
+
+static JSAMPARRAY MemoryJPEGAllocSarray(j_common_ptr cinfo, int pool, JDIMENSION samplesPerRow, JDIMENSION rows) {
+	MemoryJPEGCharge(cinfo, pool, (size_t) rows * (samplesPerRow * sizeof(JSAMPLE) + sizeof(JSAMPROW)));
+	return ((MemoryJPEG *) cinfo->client_data)->methods.alloc_sarray(cinfo, pool, samplesPerRow, rows);
+}
+
+static JBLOCKARRAY MemoryJPEGAllocBarray(j_common_ptr cinfo, int pool, JDIMENSION blocksPerRow, JDIMENSION rows) {
+	MemoryJPEGCharge(cinfo, pool, (size_t) rows * (blocksPerRow * sizeof(JBLOCK) + sizeof(JBLOCKROW)));
+	return ((MemoryJPEG *) cinfo->client_data)->methods.alloc_barray(cinfo, pool, blocksPerRow, rows);
+}
+
+/**
+ * Virtual arrays are only allocated when libjpeg realizes them, but they
+ * are counted in full up front. Coefficient arrays for lossless
+ * transforms and buffered image mode are the bulk of libjpeg's memory
+ */
+static jvirt_sarray_ptr MemoryJPEGRequestVirtSarray(
+	j_common_ptr cinfo,
+	int pool,
+	boolean preZero,
+	JDIMENSION samplesPerRow,
+	JDIMENSION rows,
+	JDIMENSION maxAccess
+) {
+	MemoryJPEGCharge(cinfo, pool, (size_t) rows * samplesPerRow * sizeof(JSAMPLE));
+	return ((MemoryJPEG *) cinfo->client_data)->methods.request_virt_sarray(cinfo, pool, preZero, samplesPerRow, rows, maxAccess);
+}
+
+static jvirt_barray_ptr MemoryJPEGRequestVirtBarray(
+	j_common_ptr cinfo,
+	int pool,
+	boolean preZero,
+	JDIMENSION blocksPerRow,
+	JDIMENSION rows,
+	JDIMENSION maxAccess
+) {
+	MemoryJPEGCharge(cinfo, pool, (size_t) rows * blocksPerRow * sizeof(JBLOCK));
+	return ((MemoryJPEG *) cinfo->client_data)->methods.request_virt_barray(cinfo, pool, preZero, blocksPerRow, rows, maxAccess);
+}
+
+static void MemoryJPEGFreePool(j_common_ptr cinfo, int pool) {
+	MemoryJPEG * jpeg = (MemoryJPEG *) cinfo->client_data;
+
+	if ((pool >= 0) && (pool < JPOOL_NUMPOOLS)) {
+		MemoryCredit(jpeg->account, jpeg->pools[pool]);
+		jpeg->pools[pool] = 0;
+	}
+
+	jpeg->methods.free_pool(cinfo, pool);
+}
+
+/**
+ * Our state lives in the permanent pool, so it goes with everything else
+ */
+static void MemoryJPEGSelfDestruct(j_common_ptr cinfo) {
+	MemoryJPEG * jpeg = (MemoryJPEG *) cinfo->client_data;
+	void (* selfDestruct)(j_common_ptr) = jpeg->methods.self_destruct;
+
+	for (int pool = 0; pool < JPOOL_NUMPOOLS; pool++) {
+		MemoryCredit(jpeg->account, jpeg->pools[pool]);
+	}
+
+	cinfo->client_data = NULL;
+	selfDestruct(cinfo);
+}
+
+/**
+ * Whether `client_data` is ours
+ */
+static bool MemoryJPEGIsAttached(j_common_ptr cinfo) {
+	return cinfo->client_data && (cinfo->mem->alloc_small == MemoryJPEGAllocSmall);
+}
+
+void MemoryAttachJPEG(struct jpeg_common_struct * cinfo, MemoryAccount * account) {
+	MemoryJPEG * jpeg = NULL;
+
+	if (!cinfo || !cinfo->mem || !account) {
+		return;
+	} else if (MemoryJPEGIsAttached(cinfo)) {
+		// A reused struct, which only needs to know who pays now
+		jpeg = (MemoryJPEG *) cinfo->client_data;
+		memset(jpeg->pools, 0, sizeof(jpeg->pools));
+		jpeg->account = account;
+		cinfo->mem->max_memory_to_use = jpeg->methods.max_memory_to_use;
+
+		if (account->limit) {
+			cinfo->mem->max_memory_to_use = account->limit > account->current ? account->limit - account->current : 1;
+		}
+
+		return;
+	}
+
+	jpeg = (MemoryJPEG *) cinfo->mem->alloc_small(cinfo, JPOOL_PERMANENT, sizeof(MemoryJPEG));
+	memset(jpeg, 0, sizeof(MemoryJPEG));
+	jpeg->account = account;
+	memcpy(&jpeg->methods, cinfo->mem, sizeof(struct jpeg_memory_mgr));
+	cinfo->client_data = jpeg;
+
+	cinfo->mem->alloc_small = MemoryJPEGAllocSmall;
+	cinfo->mem->alloc_large = MemoryJPEGAllocLarge;
+	cinfo->mem->alloc_sarray = MemoryJPEGAllocSarray;
+	cinfo->mem->alloc_barray = MemoryJPEGAllocBarray;
+	cinfo->mem->request_virt_sarray = MemoryJPEGRequestVirtSarray;
+	cinfo->mem->request_virt_barray = MemoryJPEGRequestVirtBarray;
+	cinfo->mem->free_pool = MemoryJPEGFreePool;
+	cinfo->mem->self_destruct = MemoryJPEGSelfDestruct;
+
+	// Also keeps libjpeg from realizing virtual arrays past what is left
+	if (account->limit) {
+		cinfo->mem->max_memory_to_use = account->limit > account->current ? account->limit - account->current : 1;
+	}
+}
+
+void MemoryDetachJPEG(struct jpeg_common_struct * cinfo) {
+	MemoryJPEG * jpeg = NULL;
+
+	if (!cinfo || !cinfo->mem || !MemoryJPEGIsAttached(cinfo)) return;
+
+	jpeg = (MemoryJPEG *) cinfo->client_data;
+	for (int pool = 0; pool < JPOOL_NUMPOOLS; pool++) {
+		MemoryCredit(jpeg->account, jpeg->pools[pool]);
+		jpeg->pools[pool] = 0;
+	}
+
+	jpeg->account = NULL;
+}
+
+int MemoryParseSize(const char * string, size_t * bytes) {
+	unsigned long long size = 0;
+	char * end = NULL;
+	int shift = 0;
+
+	// strtoull() would take a sign or leading spaces, "-1" becoming huge
+	if (!string || !bytes || (*string < '0') || (*string > '9')) {
+		return 1;
+	}
+
+	errno = 0;
+	size = strtoull(string, &end, 10);
+	if ((errno == ERANGE) || (size > SIZE_MAX)) {
+		return 3;
+	}
+
+	switch (*end) {
+		case 'G': case 'g': shift = 3; end++; break;
+		case 'M': case 'm': shift = 2; end++; break;
+		case 'K': case 'k': shift = 1; end++; break;
+		default: break;
+	}
+
+	// Nothing may follow the unit
+	if (*end != '\0') {
+		return 2;
+	}
+
+	for (; shift > 0; shift--) {
+		if (size > SIZE_MAX / 1024) {
+			return 3;
+		}
+
+		size *= 1024;
+	}
+
+	*bytes = size;
+
+	return 0;
+}
+
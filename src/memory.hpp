@@ -0,0 +1,118 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+extern "C" {
+#include <stddef.h>
+#include <linux/limits.h>
+}
+
+struct png_struct_def;
+struct jpeg_common_struct;
+
+/**
+ * Bytes one image has allocated through its decoders and encoders
+ *
+ * Only touched by the thread working on the image
+ */
+typedef struct {
+	size_t current;
+	size_t peak;
+	size_t allocations;
+
+	/// Most bytes `current` can reach. 0 for no limit
+	size_t limit;
+
+	/// Allocations turned down because of the limit
+	size_t refusals;
+} MemoryAccount;
+
+/**
+ * Totals over every image accounted so far
+ */
+typedef struct {
+	size_t images;
+	size_t allocations;
+	size_t refusals;
+
+	/// The largest peak of a single image and which one it was
+	size_t peak;
+	char path[PATH_MAX];
+} MemorySummary;
+
+/**
+ * Limit new accounts start with. 0, the default, is no limit
+ *
+ * Set before any images are created
+ */
+void MemorySetDefaultLimit(size_t bytes);
+
+/**
+ * Empties the account and gives it the default limit
+ */
+void MemoryAccountInit(MemoryAccount * account);
+
+/**
+ * Adds the account to the summary. Does nothing for accounts that were
+ * never used
+ */
+void MemoryAccountFinish(const MemoryAccount * account, const char * path);
+
+void MemorySummaryGet(MemorySummary * summary);
+
+/**
+ * Counts `size` more bytes, or returns false and counts nothing if that
+ * would go over the limit
+ */
+bool MemoryCharge(MemoryAccount * account, size_t size);
+void MemoryCredit(MemoryAccount * account, size_t size);
+
+/**
+ * malloc() and free() that keep the account up to date. NULL when out
+ * of memory or over the limit
+ *
+ * Buffers come from and go back to the calling thread's arena, so the
+ * next image on the thread can reuse them
+ */
+void * MemoryAllocate(MemoryAccount * account, size_t size);
+void MemoryFree(MemoryAccount * account, void * pointer);
+
+/**
+ * libpng allocators. Pass the account as the `mem_ptr` of
+ * png_create_read_struct_2() and png_create_write_struct_2()
+ */
+void * MemoryPNGAllocate(struct png_struct_def * png, size_t size);
+void MemoryPNGFree(struct png_struct_def * png, void * pointer);
+
+/**
+ * Counts libjpeg's pool allocations against the account, right after
+ * jpeg_create_compress() or jpeg_create_decompress()
+ *
+ * Takes `client_data`. Going over the limit calls the error manager's
+ * error_exit, so it has to longjmp out
+ *
+ * Calling it again after MemoryDetachJPEG() moves the struct over to
+ * another account
+ */
+void MemoryAttachJPEG(struct jpeg_common_struct * cinfo, MemoryAccount * account);
+
+/**
+ * Gives back everything still charged for the struct, which stays alive
+ * for the next image. Nothing is counted until it is attached again
+ */
+void MemoryDetachJPEG(struct jpeg_common_struct * cinfo);
+
+/**
+ * Parses a byte count like 512, 64K, 512M or 2G
+ *
+ * Signs, anything after the unit and counts that do not fit in a
+ * size_t are refused
+ */
+int MemoryParseSize(const char * string, size_t * bytes);
+
+#endif // MEMORY_HPP
+
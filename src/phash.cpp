@@ -0,0 +1,373 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "phash.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+#include <math.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+}
+
+/**
+ * Area averaged luma at one grid size
+ *
+ * Every source pixel lands in the cell it falls in. Sources smaller
+ * than the grid spread each pixel over the cells nearest to it instead,
+ * so no cell is ever empty
+ */
+typedef struct {
+	int width;
+	int height;
+	uint64_t sums[PHASH_DCT_SIZE * PHASH_DCT_SIZE];
+	uint32_t counts[PHASH_DCT_SIZE * PHASH_DCT_SIZE];
+
+	/// First and last cell for every source column
+	int * columnFirst;
+	int * columnLast;
+} PerceptualGrid;
+
+typedef enum {
+	kPerceptualGridAverage = 0,
+	kPerceptualGridDifference,
+	kPerceptualGridDCT,
+	kPerceptualGridCount,
+} PerceptualGridIndex;
+
+typedef struct {
+	PerceptualGrid grids[kPerceptualGridCount];
+
+	/// The current row as luma
+	unsigned char * luma;
+	ImaginePixels width;
+	ImaginePixels height;
+} PerceptualAccumulator;
+
+PerceptualHashType PerceptualHashTypeFromString(const char * name) {
+	if (!name) return kPerceptualHashUnknown;
+	else if (!strcmp(name, "ahash")) return kPerceptualHashAverage;
+	else if (!strcmp(name, "dhash")) return kPerceptualHashDifference;
+	else if (!strcmp(name, "phash")) return kPerceptualHashPerceptual;
+	else return kPerceptualHashUnknown;
+}
+
+uint64_t PerceptualHashValue(const PerceptualHashes * hashes, PerceptualHashType type) {
+	switch (type) {
+		case kPerceptualHashAverage:
+			return hashes->average;
+		case kPerceptualHashDifference:
+			return hashes->difference;
+		default:
+			return hashes->perceptual;
+	}
+}
+
+int PerceptualHashDistance(uint64_t a, uint64_t b) {
+	return __builtin_popcountll(a ^ b);
+}
+
+/**
+ * Cells of `cells` that source coordinate i of n covers
+ */
+static void PerceptualCellRange(ImaginePixels i, ImaginePixels n, int cells, int * first, int * last) {
+	if (n >= cells) {
+		*first = *last = (i * cells) / n;
+	} else {
+		*first = (i * cells + n - 1) / n;
+		*last = ((i + 1) * cells + n - 1) / n - 1;
+	}
+}
+
+static void PerceptualAccumulatorInit(PerceptualAccumulator * acc) {
+	memset(acc, 0, sizeof(PerceptualAccumulator));
+
+	acc->grids[kPerceptualGridAverage].width = PHASH_HASH_SIZE;
+	acc->grids[kPerceptualGridAverage].height = PHASH_HASH_SIZE;
+	acc->grids[kPerceptualGridDifference].width = PHASH_HASH_SIZE + 1;
+	acc->grids[kPerceptualGridDifference].height = PHASH_HASH_SIZE;
+	acc->grids[kPerceptualGridDCT].width = PHASH_DCT_SIZE;
+	acc->grids[kPerceptualGridDCT].height = PHASH_DCT_SIZE;
+}
+
+static void PerceptualAccumulatorFree(PerceptualAccumulator * acc) {
+	for (int g = 0; g < kPerceptualGridCount; g++) {
+		BFFree(acc->grids[g].columnFirst);
+		BFFree(acc->grids[g].columnLast);
+	}
+
+	BFFree(acc->luma);
+}
+
+/**
+ * Sets up the column tables on the first row
+ */
+static int PerceptualAccumulatorStart(PerceptualAccumulator * acc, ImaginePixels width, ImaginePixels height) {
+	acc->width = width;
+	acc->height = height;
+
+	if ((acc->luma = (unsigned char *) malloc(width)) == NULL) {
+		return 1;
+	}
+
+	for (int g = 0; g < kPerceptualGridCount; g++) {
+		PerceptualGrid * grid = &acc->grids[g];
+
+		grid->columnFirst = (int *) malloc(width * sizeof(int));
+		grid->columnLast = (int *) malloc(width * sizeof(int));
+		if (!grid->columnFirst || !grid->columnLast) {
+			return 1;
+		}
+
+		for (ImaginePixels x = 0; x < width; x++) {
+			PerceptualCellRange(x, width, grid->width, &grid->columnFirst[x], &grid->columnLast[x]);
+		}
+	}
+
+	return 0;
+}
+
+static void PerceptualGridAddRow(PerceptualGrid * grid, const unsigned char * luma, ImaginePixels width, ImaginePixels y, ImaginePixels height) {
+	uint64_t sums[PHASH_DCT_SIZE] = {0};
+	uint32_t counts[PHASH_DCT_SIZE] = {0};
+	int firstRow = 0, lastRow = 0;
+
+	for (ImaginePixels x = 0; x < width; x++) {
+		for (int c = grid->columnFirst[x]; c <= grid->columnLast[x]; c++) {
+			sums[c] += luma[x];
+			counts[c]++;
+		}
+	}
+
+	PerceptualCellRange(y, height, grid->height, &firstRow, &lastRow);
+	for (int r = firstRow; r <= lastRow; r++) {
+		for (int c = 0; c < grid->width; c++) {
+			grid->sums[r * grid->width + c] += sums[c];
+			grid->counts[r * grid->width + c] += counts[c];
+		}
+	}
+}
+
+/**
+ * Rec. 601 luma for every pixel of a decoded row
+ */
+static void PerceptualLumaRow(const ImagineRow * row, unsigned char * luma) {
+	const unsigned char * p = row->data;
+
+	if (row->components < 3) {
+		// Gray, or gray and alpha
+		for (ImaginePixels x = 0; x < row->width; x++, p += row->components) {
+			luma[x] = p[0];
+		}
+	} else {
+		for (ImaginePixels x = 0; x < row->width; x++, p += row->components) {
+			luma[x] = (77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8;
+		}
+	}
+}
+
+static int PerceptualAccumulatorAddRow(const ImagineRow * row, void * context) {
+	PerceptualAccumulator * acc = (PerceptualAccumulator *) context;
+
+	if (!acc->luma && PerceptualAccumulatorStart(acc, row->width, row->height)) {
+		return 1;
+	} else if ((row->width != acc->width) || (row->y >= acc->height)) {
+		return 2;
+	}
+
+	PerceptualLumaRow(row, acc->luma);
+
+	for (int g = 0; g < kPerceptualGridCount; g++) {
+		PerceptualGridAddRow(&acc->grids[g], acc->luma, row->width, row->y, row->height);
+	}
+
+	return 0;
+}
+
+static void PerceptualGridValues(const PerceptualGrid * grid, float * values) {
+	for (int i = 0; i < grid->width * grid->height; i++) {
+		values[i] = grid->counts[i] ? (float) grid->sums[i] / grid->counts[i] : 0;
+	}
+}
+
+/**
+ * y += a * x
+ */
+static void PerceptualScaleAdd(float a, const float * x, float * y, int n) {
+	int i = 0;
+
+#ifdef __SSE__
+	__m128 va = _mm_set1_ps(a);
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(va, _mm_loadu_ps(x + i))));
+	}
+#endif
+
+	for (; i < n; i++) {
+		y[i] += a * x[i];
+	}
+}
+
+/**
+ * DCT-II basis for the lowest frequencies, both ways around
+ */
+typedef struct {
+	/// [u][x] = cos((2x + 1) u pi / 2N)
+	float rows[PHASH_HASH_SIZE][PHASH_DCT_SIZE];
+
+	/// [x][u], same values
+	float columns[PHASH_DCT_SIZE][PHASH_HASH_SIZE];
+} PerceptualDCTBasis;
+
+static const PerceptualDCTBasis * PerceptualDCTBasisGet() {
+	static PerceptualDCTBasis basis;
+	static bool ready = [] {
+		for (int u = 0; u < PHASH_HASH_SIZE; u++) {
+			for (int x = 0; x < PHASH_DCT_SIZE; x++) {
+				basis.rows[u][x] = cos(((2 * x + 1) * u * M_PI) / (2 * PHASH_DCT_SIZE));
+				basis.columns[x][u] = basis.rows[u][x];
+			}
+		}
+		return true;
+	}();
+
+	(void) ready;
+	return &basis;
+}
+
+/**
+ * Lowest 8x8 coefficients of the unnormalized 2D DCT-II of a 32x32 plane
+ *
+ * Only those 64 are needed, so rather than a full transform this is two
+ * small matrix products written as runs of scale-and-add over whole
+ * rows, which map straight onto SSE
+ */
+static void PerceptualDCT(const float * plane, float * coefficients) {
+	const PerceptualDCTBasis * basis = PerceptualDCTBasisGet();
+	float partial[PHASH_HASH_SIZE * PHASH_DCT_SIZE] = {0};
+
+	// Down the columns: partial[u][x] = sum over y of basis[u][y] * plane[y][x]
+	for (int u = 0; u < PHASH_HASH_SIZE; u++) {
+		for (int y = 0; y < PHASH_DCT_SIZE; y++) {
+			PerceptualScaleAdd(basis->rows[u][y], plane + y * PHASH_DCT_SIZE, partial + u * PHASH_DCT_SIZE, PHASH_DCT_SIZE);
+		}
+	}
+
+	// Then across: coefficients[u][v] = sum over x of partial[u][x] * basis[v][x]
+	memset(coefficients, 0, PHASH_HASH_SIZE * PHASH_HASH_SIZE * sizeof(float));
+	for (int u = 0; u < PHASH_HASH_SIZE; u++) {
+		for (int x = 0; x < PHASH_DCT_SIZE; x++) {
+			PerceptualScaleAdd(partial[u * PHASH_DCT_SIZE + x], basis->columns[x], coefficients + u * PHASH_HASH_SIZE, PHASH_HASH_SIZE);
+		}
+	}
+}
+
+static int PerceptualFloatCompare(const void * a, const void * b) {
+	float x = *(const float *) a, y = *(const float *) b;
+	return (x < y) ? -1 : (x > y);
+}
+
+static void PerceptualAccumulatorFinish(const PerceptualAccumulator * acc, PerceptualHashes * hashes) {
+	float values[PHASH_DCT_SIZE * PHASH_DCT_SIZE];
+	float coefficients[PHASH_HASH_SIZE * PHASH_HASH_SIZE];
+	float sorted[PHASH_HASH_SIZE * PHASH_HASH_SIZE];
+	float mean = 0, median = 0;
+	const int bits = PHASH_HASH_SIZE * PHASH_HASH_SIZE;
+
+	memset(hashes, 0, sizeof(PerceptualHashes));
+
+	PerceptualGridValues(&acc->grids[kPerceptualGridAverage], values);
+	for (int i = 0; i < bits; i++) mean += values[i];
+	mean /= bits;
+
+	for (int i = 0; i < bits; i++) {
+		if (values[i] > mean) hashes->average |= 1ULL << (bits - 1 - i);
+	}
+
+	PerceptualGridValues(&acc->grids[kPerceptualGridDifference], values);
+	for (int r = 0; r < PHASH_HASH_SIZE; r++) {
+		for (int c = 0; c < PHASH_HASH_SIZE; c++) {
+			const float * cell = values + r * (PHASH_HASH_SIZE + 1) + c;
+			if (cell[1] > cell[0]) hashes->difference |= 1ULL << (bits - 1 - (r * PHASH_HASH_SIZE + c));
+		}
+	}
+
+	PerceptualGridValues(&acc->grids[kPerceptualGridDCT], values);
+	PerceptualDCT(values, coefficients);
+
+	memcpy(sorted, coefficients, sizeof(sorted));
+	qsort(sorted, bits, sizeof(float), PerceptualFloatCompare);
+	median = (sorted[bits / 2 - 1] + sorted[bits / 2]) / 2;
+
+	for (int i = 0; i < bits; i++) {
+		if (coefficients[i] > median) hashes->perceptual |= 1ULL << (bits - 1 - i);
+	}
+}
+
+int PerceptualHashImage(Image * img, PerceptualHashes * hashes) {
+	int result = 0;
+	PerceptualAccumulator acc;
+
+	if (!img || !hashes) {
+		return 1;
+	}
+
+	PerceptualAccumulatorInit(&acc);
+
+	// Nothing finer than the DCT grid ever makes it into a hash
+	img->setTargetSize(PHASH_DCT_SIZE, PHASH_DCT_SIZE);
+
+	if ((result = img->load()) == 0) {
+		result = img->decodeRows(PerceptualAccumulatorAddRow, &acc);
+		img->unload();
+	}
+
+	// Not a single row
+	if ((result == 0) && !acc.luma) {
+		result = 2;
+	}
+
+	if (result == 0) {
+		PerceptualAccumulatorFinish(&acc, hashes);
+	}
+
+	PerceptualAccumulatorFree(&acc);
+
+	return result;
+}
+
+int PerceptualHashGray(const unsigned char * pixels, ImaginePixels width, ImaginePixels height, PerceptualHashes * hashes) {
+	int result = 0;
+	PerceptualAccumulator acc;
+	ImagineRow row;
+
+	if (!pixels || !hashes || (width < 1) || (height < 1)) {
+		return 1;
+	}
+
+	PerceptualAccumulatorInit(&acc);
+
+	row.width = width;
+	row.height = height;
+	row.components = 1;
+
+	for (row.y = 0; (result == 0) && (row.y < height); row.y++) {
+		row.data = pixels + row.y * width;
+		result = PerceptualAccumulatorAddRow(&row, &acc);
+	}
+
+	if (result == 0) {
+		PerceptualAccumulatorFinish(&acc, hashes);
+	}
+
+	PerceptualAccumulatorFree(&acc);
+
+	return result;
+}
+
@@ -0,0 +1,76 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef PHASH_HPP
+#define PHASH_HPP
+
+#include "image.hpp"
+
+extern "C" {
+#include <stdint.h>
+}
+
+/// Side of the luma grid the DCT for the perceptual hash runs on
+#define PHASH_DCT_SIZE 32
+
+/// Side of the grids the 64 bit hashes come from
+#define PHASH_HASH_SIZE 8
+
+typedef enum {
+	kPerceptualHashUnknown = -1,
+
+	/// Cells of an 8x8 grid brighter than the grid's mean
+	kPerceptualHashAverage = 0,
+
+	/// Cells of a 9x8 grid brighter than their left neighbour
+	kPerceptualHashDifference = 1,
+
+	/// Lowest 8x8 DCT coefficients of a 32x32 grid above their median
+	kPerceptualHashPerceptual = 2,
+} PerceptualHashType;
+
+/**
+ * Fingerprints that stay within a few bits of each other when an image
+ * is resized, recompressed or lightly edited
+ *
+ * Bits are in row major order starting from the most significant bit
+ */
+typedef struct {
+	uint64_t average;
+	uint64_t difference;
+	uint64_t perceptual;
+} PerceptualHashes;
+
+/**
+ * Returns the type named by `name` ("ahash", "dhash" or "phash")
+ */
+PerceptualHashType PerceptualHashTypeFromString(const char * name);
+
+/**
+ * Returns the hash of `type` out of `hashes`
+ */
+uint64_t PerceptualHashValue(const PerceptualHashes * hashes, PerceptualHashType type);
+
+/**
+ * Hashes `img`, which must not be loaded yet
+ *
+ * The image is loaded with a 32x32 target so decoders skip what they
+ * can: JPEG decodes at 1/8 scale and TIFF reads a reduced resolution
+ * page when there is one. It is unloaded before returning
+ */
+int PerceptualHashImage(Image * img, PerceptualHashes * hashes);
+
+/**
+ * Hashes an 8 bit gray plane with rows `width` bytes apart
+ */
+int PerceptualHashGray(const unsigned char * pixels, ImaginePixels width, ImaginePixels height, PerceptualHashes * hashes);
+
+/**
+ * Number of bits that differ between two hashes
+ */
+int PerceptualHashDistance(uint64_t a, uint64_t b);
+
+#endif // PHASH_HPP
+
@@ -5,18 +5,26 @@
 
 #include "png.hpp"
 #include <bflibcpp/bflibcpp.hpp>
-#include <rapidxml/rapidxml.hpp>
 #include "jpeg.hpp"
+#include "resize.hpp"
+#include "xmp.hpp"
+#include "reduce.hpp"
+#include "composite.hpp"
+#include "trace.hpp"
+#include "counters.hpp"
+#include "memory.hpp"
+#include "stream.hpp"
+#include "codecs.hpp"
 
 extern "C" {
 #include <stdio.h>
 #include <string.h>
+#include <setjmp.h>
 #include <png.h>
 #include <jpeglib.h>
 }
 
 using namespace BF;
-using namespace rapidxml;
 
 bool PNG::isType(const char * path) {
 	char buf[10];
@@ -38,7 +46,6 @@ const char * PNG::description() {
 PNG::PNG(const char * path, int * err) : Image(path, err) {
 	this->_pngStruct = NULL;
 	this->_pngInfo = NULL;
-	this->_xmpBuf = NULL;
 }
 
 PNG::~PNG() {
@@ -52,130 +59,503 @@ ImageType PNG::type() {
 ImaginePixels PNG::width() {
 	if (this->_pngStruct && this->_pngInfo)
 		return png_get_image_width((png_structp) this->_pngStruct, (png_infop) this->_pngInfo);
-	else return 0;
+	else return this->_probeInfo.width;
 }
 
 ImaginePixels PNG::height() {
 	if (this->_pngStruct && this->_pngInfo)
 		return png_get_image_height((png_structp) this->_pngStruct, (png_infop) this->_pngInfo);
-	else return 0;
+	else return this->_probeInfo.height;
 }
 
 int PNG::bitsPerComponent() {
-	return -1;
+	if (this->_pngStruct && this->_pngInfo)
+		return png_get_bit_depth((png_structp) this->_pngStruct, (png_infop) this->_pngInfo);
+	else return this->_probeInfo.bitsPerComponent;
+}
+
+/**
+ * Maps the IHDR color type to our color space
+ */
+static ImagineColorSpace PNGColorTypeToColorSpace(int colorType) {
+	switch (colorType) {
+		case PNG_COLOR_TYPE_RGBA:
+			return kImagineColorSpaceRGBA;
+		case PNG_COLOR_TYPE_RGB:
+			return kImagineColorSpaceRGB;
+		case PNG_COLOR_TYPE_GRAY:
+			return kImagineColorSpaceGray;
+		default:
+			return kImagineColorSpaceUnknown;
+	}
 }
 
 ImagineColorSpace PNG::colorspace() {
 	if (this->_pngStruct && this->_pngInfo) {
-		switch (png_get_color_type((png_structp) this->_pngStruct, (png_infop) this->_pngInfo)) {
-			case PNG_COLOR_TYPE_RGBA:
-				return kImagineColorSpaceRGBA;
-			case PNG_COLOR_TYPE_RGB:
-				return kImagineColorSpaceRGB;
-			default:
-				kImagineColorSpaceUnknown;
-		}
+		return PNGColorTypeToColorSpace(png_get_color_type((png_structp) this->_pngStruct, (png_infop) this->_pngInfo));
 	}
 	
-	return kImagineColorSpaceUnknown;
+	return this->_probeInfo.colorspace;
 }
 
-int PNG::toPNG() {
-	BFErrorPrint("Path %s is already a PNG file!", this->path());
-	return 1;
-}
+/// We won't hold text chunks larger than this in memory
+const unsigned long PNG_PROBE_MAX_TEXT_SIZE = 16 * 1024 * 1024;
 
-int ColorComponentCount(ImagineColorSpace cs) {
-	switch (cs) {
-		case kImagineColorSpaceRGBA:
-			return 4;
-			break;
-		case kImagineColorSpaceRGB:
-		default:
-			return 3;
+/**
+ * Reads the chunk headers directly instead of going through libpng
+ *
+ * Stops at the first IDAT like png_read_info() does in load(), so the
+ * compressed image data is never read
+ */
+int PNG::probe() {
+	int result = 0;
+	FILE * fs = NULL;
+	unsigned char buf[13];
+	const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	bool done = false;
+	bool haveHeader = false;
+	bool foundXMP = false;
+
+	if ((fs = this->openInput()) == NULL) {
+		BFErrorPrint("Could not open '%s'", this->path());
+		result = 1;
+	} else if ((fread(buf, 1, 8, fs) != 8) || memcmp(buf, signature, 8)) {
+		BFErrorPrint("'%s' does not have a PNG signature", this->path());
+		result = 2;
+	}
+
+	while (!result && !done) {
+		unsigned long length;
+		char type[5] = {0};
+
+		// Every chunk is length (4), type (4), data (length), crc (4)
+		if (fread(buf, 1, 8, fs) != 8) {
+			result = 3;
 			break;
+		}
+
+		length = ((unsigned long) buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+		memcpy(type, buf + 4, 4);
+
+		if (!strcmp(type, "IHDR")) {
+			if ((length != 13) || (fread(buf, 1, 13, fs) != 13)) {
+				result = 4;
+			} else {
+				this->_probeInfo.width = ((unsigned long) buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+				this->_probeInfo.height = ((unsigned long) buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+				this->_probeInfo.bitsPerComponent = buf[8];
+				this->_probeInfo.colorspace = PNGColorTypeToColorSpace(buf[9]);
+				this->_probeInfo.frameCount = 1;
+
+				switch (buf[9]) {
+					case PNG_COLOR_TYPE_GRAY:
+					case PNG_COLOR_TYPE_PALETTE:
+						this->_probeInfo.components = 1;
+						break;
+					case PNG_COLOR_TYPE_GRAY_ALPHA:
+						this->_probeInfo.components = 2;
+						break;
+					case PNG_COLOR_TYPE_RGB:
+						this->_probeInfo.components = 3;
+						break;
+					case PNG_COLOR_TYPE_RGBA:
+						this->_probeInfo.components = 4;
+						break;
+				}
+
+				haveHeader = true;
+				length = 0;
+			}
+		} else if (!strcmp(type, "IDAT") || !strcmp(type, "IEND")) {
+			done = true;
+		} else if (!strcmp(type, "eXIf") && (length < PNG_PROBE_MAX_TEXT_SIZE)) {
+			// Raw TIFF structure, same as libpng hands back in load()
+			unsigned char * chunk = (unsigned char *) malloc(length);
+
+			if (!chunk) {
+				result = 9;
+			} else if (fread(chunk, 1, length, fs) != length) {
+				BFFree(chunk);
+				result = 10;
+			} else {
+				this->setMetadataBlock(kImagineMetadataEXIF, chunk, length, true);
+			}
+
+			length = 0;
+		} else if (!strcmp(type, "iTXt") && !foundXMP && (length < PNG_PROBE_MAX_TEXT_SIZE)) {
+			char * chunk = (char *) malloc(length + 1);
+			size_t keyLength = strlen(XMP_PNG_KEYWORD) + 1;
+
+			if (!chunk) {
+				result = 5;
+			} else if (fread(chunk, 1, length, fs) != length) {
+				BFFree(chunk);
+				result = 6;
+
+			// keyword\0, compression flag, method, language\0, translated keyword\0, text
+			} else if ((length > keyLength + 2) && !memcmp(chunk, XMP_PNG_KEYWORD, keyLength) && (chunk[keyLength] == 0)) {
+				char * end = chunk + length;
+				char * text = chunk + keyLength + 2;
+				text = (char *) memchr(text, '\0', end - text);
+				if (text) text = (char *) memchr(text + 1, '\0', end - (text + 1));
+
+				if (text) {
+					text++;
+					memmove(chunk, text, end - text);
+					this->setMetadataBlock(kImagineMetadataXMP, chunk, end - text, true);
+					foundXMP = true;
+				} else {
+					BFFree(chunk);
+				}
+			} else {
+				BFFree(chunk);
+			}
+
+			length = 0;
+		}
+
+		// Skip whatever is left plus the crc
+		if (!result && !done && StreamSkip(fs, length + 4)) {
+			result = 7;
+		}
 	}
+
+	if (!result && !haveHeader) {
+		BFErrorPrint("'%s' has no IHDR chunk", this->path());
+		result = 8;
+	}
+
+	if (fs) fclose(fs);
+
+	return result;
+}
+
+int PNG::writePalette(FILE * file, const unsigned char * indexes, ImaginePixels width, ImaginePixels height, const unsigned char (* colors)[3], int count, MemoryAccount * account) {
+	int result = 0;
+	png_structp png = NULL;
+	png_infop info = NULL;
+	png_color plte[256];
+	int bitDepth = 8;
+	CountersScope stage(kCountersStageEncode);
+
+	if (!file || !indexes || !colors || (count < 1) || (count > 256)) {
+		return 1;
+	}
+
+	if (count <= 2) bitDepth = 1;
+	else if (count <= 4) bitDepth = 2;
+	else if (count <= 16) bitDepth = 4;
+
+	for (int i = 0; i < count; i++) {
+		plte[i].red = colors[i][0];
+		plte[i].green = colors[i][1];
+		plte[i].blue = colors[i][2];
+	}
+
+	if ((png = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, account, MemoryPNGAllocate, MemoryPNGFree)) == NULL) {
+		result = 3;
+	} else if ((info = png_create_info_struct(png)) == NULL) {
+		result = 3;
+	} else if (setjmp(png_jmpbuf(png))) {
+		result = 4;
+	} else {
+		png_init_io(png, file);
+		png_set_IHDR(png, info, width, height, bitDepth, PNG_COLOR_TYPE_PALETTE,
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+		png_set_PLTE(png, info, plte, count);
+		png_write_info(png, info);
+
+		// One index per byte in, packed to bitDepth on the way out
+		png_set_packing(png);
+
+		for (ImaginePixels y = 0; y < height; y++) {
+			png_write_row(png, (png_const_bytep) (indexes + y * width));
+		}
+
+		png_write_end(png, NULL);
+	}
+
+	png_destroy_write_struct(&png, &info);
+
+	return result;
+}
+
+int PNG::toPNG() {
+	BFErrorPrint("Path %s is already a PNG file!", this->path());
+	return 1;
 }
 
 int PNG::toJPEG() {
 	int result = 0;
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
+	CodecJPEGCompress * volatile codec = NULL;
 	FILE * outfile = NULL;		/* target file */
 	char filename[PATH_MAX];
-	ImagineColorSpace imagineColorSpace = this->colorspace();
-	png_bytep * row_pointers = NULL;
-	
-	strcpy(filename, this->conversionOutputPath());
-	sprintf(filename, "%s/%s.png", filename, this->name());
 
-	if ((outfile = fopen(filename, "wb")) == NULL) {
-		BFErrorPrint("Could not open file %s", filename);
-		result = 1;
+	// Libpng and libjpeg longjmp back here on errors
+	png_bytep * volatile row_pointers = NULL;
+	volatile int allocated = 0;
+	Resizer * resizer = NULL;
+	ReduceInfo reduce;
+	Compositor compositor;
+	bool flatten = false;
+	ImaginePixels width = this->width(), height = this->height();
+	ImaginePixels tw = 0, th = 0;
+	int srcHeight = 0;
+	int components = 0;
+	int passes = 1;
+
+	memset(&compositor, 0, sizeof(compositor));
+
+	if (result == 0) {
+		if ((outfile = this->openConversionOutput(kImageTypeJPEG, filename, sizeof(filename))) == NULL) {
+			BFErrorPrint("Could not open file %s", filename);
+			result = 1;
+		}
+	}
+
+	if ((result == 0) && setjmp(png_jmpbuf((png_structp) this->_pngStruct))) {
+		BFErrorPrint("Could not read '%s'", this->path());
+		result = 2;
+	} else if (result == 0) {
+		/* read file */
+		if (png_get_interlace_type((png_structp) this->_pngStruct, (png_infop) this->_pngInfo) == PNG_INTERLACE_ADAM7) {
+			passes = png_set_interlace_handling((png_structp) this->_pngStruct);
+		}
+
+		// JPEG only takes 8 bit gray or RGB. Alpha is kept until each row
+		// is flattened onto the background, which needs gray in color
+		// unless the background is gray too
+		png_set_expand((png_structp) this->_pngStruct);
+		png_set_strip_16((png_structp) this->_pngStruct);
+		if (!(png_get_color_type((png_structp) this->_pngStruct, (png_infop) this->_pngInfo) & PNG_COLOR_MASK_COLOR)
+			&& !CompositeBackgroundIsGray(this->background())) {
+			png_set_gray_to_rgb((png_structp) this->_pngStruct);
+		}
+
+        png_read_update_info((png_structp) this->_pngStruct, (png_infop) this->_pngInfo);
+
+		CountersEnter(kCountersStageDecode);
+		srcHeight = png_get_image_height((png_structp) this->_pngStruct, (png_infop) this->_pngInfo);
+		row_pointers = (png_bytep *) MemoryAllocate(this->memory(), sizeof(png_bytep) * srcHeight);
+		for (; row_pointers && (allocated < srcHeight); allocated++) {
+			row_pointers[allocated] = (png_bytep) MemoryAllocate(this->memory(), png_get_rowbytes((png_structp) this->_pngStruct, (png_infop) this->_pngInfo));
+			if (!row_pointers[allocated]) break;
+		}
+
+		if (!row_pointers || (allocated < srcHeight)) {
+			BFErrorPrint("Could not allocate rows for '%s'", this->path());
+			result = 3;
+		}
+	}
+
+	if (result == 0) {
+		// Reading into the display rows makes libpng fill each pass pixel's
+		// whole Adam7 rectangle, so stopping after a few passes still
+		// gives us a complete (blocky) image
+		if ((this->previewLevel() > 0) && (passes > 1)) {
+			int n = this->previewLevel() < passes ? this->previewLevel() : passes;
+			for (int pass = 0; pass < n; pass++) {
+				png_read_rows((png_structp) this->_pngStruct, NULL, row_pointers, srcHeight);
+			}
+		} else {
+			png_read_image((png_structp) this->_pngStruct, row_pointers);
+		}
+		CountersEnter(kCountersStageConvert);
+
+		// RGB that is really gray is encoded with one component, and alpha
+		// that is never used is dropped
+		components = png_get_channels((png_structp) this->_pngStruct, (png_infop) this->_pngInfo);
+		ReduceBegin(&reduce, components, 8, false);
+		for (int y = 0; (y < srcHeight) && ReduceAddRow(&reduce, row_pointers[y], width); y++);
+		ReduceFinish(&reduce);
+
+		if (((components == 2) || (components == 4)) && !reduce.opaque) {
+			flatten = true;
+			result = CompositeBegin(&compositor, this->background(), components, width);
+			components = ((components == 4) && reduce.gray && CompositeBackgroundIsGray(this->background())) ? 1 : components - 1;
+		} else {
+			components = reduce.outputChannels;
+		}
+	}
+
+	if ((result == 0) && this->targetSizeForSource(width, height, &tw, &th)) {
+		resizer = new Resizer(width, height, tw, th, components, &result);
+
+		if (result) {
+			BFErrorPrint("Could not create resizer: %d", result);
+		} else {
+			width = tw;
+			height = th;
+		}
 	}
 
 	if (result == 0) {
-		cinfo.err = jpeg_std_error(&jerr);
+		CountersEnter(kCountersStageEncode);
 
 		// Init compression tools
-		jpeg_create_compress(&cinfo);
+		if ((codec = CodecsAcquireJPEGCompress(this->memory())) == NULL) {
+			BFErrorPrint("Could not create jpeg compressor");
+			result = 3;
+		}
+	}
+
+	if ((result == 0) && setjmp(codec->jmp)) {
+		BFErrorPrint("Could not write '%s'", filename);
+		result = 4;
+	} else if (result == 0) {
+		struct jpeg_compress_struct * cinfo = &codec->cinfo;
 
 		// Init output file
-		jpeg_stdio_dest(&cinfo, outfile);
+		jpeg_stdio_dest(cinfo, outfile);
 
 		// Params
-		cinfo.image_width = this->width(); 	/* image width and height, in pixels */
-		cinfo.image_height = this->height();
+		cinfo->image_width = width; 	/* image width and height, in pixels */
+		cinfo->image_height = height;
 
 		/* # of color components per pixel */
-		cinfo.input_components = ColorComponentCount(imagineColorSpace);
+		cinfo->input_components = components;
 
 		/* colorspace of input image */
-		cinfo.in_color_space = (J_COLOR_SPACE) JPEG::imagineColorSpaceToJPEGColorSpace(imagineColorSpace);
-		jpeg_set_defaults(&cinfo);
+		cinfo->in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+		jpeg_set_defaults(cinfo);
 
 		// Start the compression
-		jpeg_start_compress(&cinfo, TRUE);
-	
-		/* read file */
-        png_read_update_info((png_structp) this->_pngStruct, (png_infop) this->_pngInfo);
-        if (setjmp(png_jmpbuf((png_structp) this->_pngStruct))) BFErrorPrint("error with png_jmpbuf");
+		jpeg_start_compress(cinfo, TRUE);
 
-		int height = png_get_image_height((png_structp) this->_pngStruct, (png_infop) this->_pngInfo);
-        row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
-        for (int y=0; y<height; y++)
-                row_pointers[y] = (png_byte*) malloc(png_get_rowbytes((png_structp) this->_pngStruct, (png_infop) this->_pngInfo));
+		// Write row by row
+		for (int y = 0; y < srcHeight; y++) {
+			CountersEnter(kCountersStageConvert);
 
-        png_read_image((png_structp) this->_pngStruct, row_pointers);
+			if (flatten) {
+				CompositeRow(&compositor, row_pointers[y], y, row_pointers[y], components);
+			} else if (reduce.reduced) {
+				ReduceRow(&reduce, row_pointers[y], this->width(), row_pointers[y]);
+			}
 
-		// Write row by row
-		while (cinfo.next_scanline < cinfo.image_height) {
-			png_bytep pbyte = row_pointers[cinfo.next_scanline];
-			(void) jpeg_write_scanlines(&cinfo, &pbyte, 1);
+			if (resizer) {
+				bool ready = false;
+				resizer->pushRow(row_pointers[y], &ready);
+				if (ready) {
+					JSAMPROW row = (JSAMPROW) resizer->outputRow();
+					CountersEnter(kCountersStageEncode);
+					(void) jpeg_write_scanlines(cinfo, &row, 1);
+				}
+			} else {
+				png_bytep pbyte = row_pointers[y];
+				CountersEnter(kCountersStageEncode);
+				(void) jpeg_write_scanlines(cinfo, &pbyte, 1);
+			}
 		}
 
 		// Close everything
-		jpeg_finish_compress(&cinfo);
-		fclose(outfile);
-		jpeg_destroy_compress(&cinfo);
-		free(row_pointers);
+		CountersEnter(kCountersStageEncode);
+		jpeg_finish_compress(cinfo);
 	}
 
+	// Aborting a finished compressor only resets it
+	CodecsReleaseJPEGCompress(codec);
+
+	for (int y = 0; row_pointers && (y < allocated); y++) MemoryFree(this->memory(), row_pointers[y]);
+	MemoryFree(this->memory(), row_pointers);
+	if (outfile) fclose(outfile);
+	Delete(resizer);
+	CompositeEnd(&compositor);
+
+	return result;
+}
+
+int PNG::decodeRows(ImagineRowHandler handler, void * context) {
+	int result = 0;
+	TraceScope scope("decodeRows", this->path());
+	CountersScope stage(kCountersStageDecode);
+	png_structp png = (png_structp) this->_pngStruct;
+	png_infop info = (png_infop) this->_pngInfo;
+	ImagineRow row;
+
+	// Libpng longjmps back to the setjmp below on errors, so anything
+	// that has to be freed afterwards must be volatile
+	png_bytep * volatile rows = NULL;
+	png_bytep volatile line = NULL;
+	volatile ImaginePixels allocated = 0;
+
+	if (!png || !info) {
+		return 1;
+	}
+
+	if (setjmp(png_jmpbuf(png))) {
+		result = 2;
+	}
+
+	if (result == 0) {
+		// Palettes, low bit gray and 16 bit samples all come out
+		// as plain 8 bit samples
+		png_set_expand(png);
+		png_set_strip_16(png);
+
+		if (png_get_interlace_type(png, info) == PNG_INTERLACE_ADAM7) {
+			png_set_interlace_handling(png);
+		}
+
+		png_read_update_info(png, info);
+
+		row.width = png_get_image_width(png, info);
+		row.height = png_get_image_height(png, info);
+		row.components = png_get_channels(png, info);
+
+		// Adam7 needs the whole image before any row is final
+		if (png_get_interlace_type(png, info) == PNG_INTERLACE_ADAM7) {
+			if ((rows = (png_bytep *) MemoryAllocate(this->memory(), row.height * sizeof(png_bytep))) == NULL) {
+				result = 3;
+			}
+
+			for (; (result == 0) && (allocated < row.height); allocated++) {
+				if ((rows[allocated] = (png_bytep) MemoryAllocate(this->memory(), png_get_rowbytes(png, info))) == NULL) {
+					result = 3;
+				}
+			}
+		} else if ((line = (png_bytep) MemoryAllocate(this->memory(), png_get_rowbytes(png, info))) == NULL) {
+			result = 3;
+		}
+	}
+
+	if ((result == 0) && rows) {
+		png_read_image(png, rows);
+		CountersEnter(kCountersStageConvert);
+
+		for (row.y = 0; (result == 0) && (row.y < row.height); row.y++) {
+			row.data = rows[row.y];
+			result = handler(&row, context);
+		}
+	} else if (result == 0) {
+		for (row.y = 0; (result == 0) && (row.y < row.height); row.y++) {
+			CountersEnter(kCountersStageDecode);
+			png_read_row(png, line, NULL);
+			row.data = line;
+			CountersEnter(kCountersStageConvert);
+			result = handler(&row, context);
+		}
+	}
+
+	for (ImaginePixels y = 0; rows && (y < allocated); y++) MemoryFree(this->memory(), rows[y]);
+	MemoryFree(this->memory(), rows);
+	MemoryFree(this->memory(), line);
+
 	return result;
 }
 
 int PNG::load() {
 	int result = 0;
+	TraceScope scope("load", this->path());
 	int width = 0, height = 0;
 	png_structp png = 0;
 	png_infop info = 0;
-	char * xmpData = NULL;
+	const char * xmpData = NULL;
 
-	this->_fileHandler = fopen(this->path(), "rb");
+	this->_fileHandler = this->openInput();
 	if (!this->_fileHandler) result = 1;
 
 	if (result == 0) {
-		png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		png = png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL, this->memory(), MemoryPNGAllocate, MemoryPNGFree);
 		if(!png) result = 1;
 	}
 
@@ -193,27 +573,42 @@ int PNG::load() {
 
 		png_read_info(png, info);
 
+		// libpng owns the text until the read struct is destroyed
 		png_textp text = 0;
 		png_uint_32 count = png_get_text(png, info, &text, NULL);
 		for (int i = 0; i < count; i++) {
-			if (!strcmp(text->key, "XML:com.adobe.xmp")) {
-				xmpData = BFStringCopyString(text->text, &result);
+			if (!strcmp(text[i].key, XMP_PNG_KEYWORD)) {
+				xmpData = text[i].text;
+				break;
 			}
-
-			if (result) break;
 		}
 	}
 
 	if (result == 0) {
 		this->_pngStruct = png;
 		this->_pngInfo = info;
-		this->_xmpBuf = xmpData;
+
+		if (xmpData) {
+			this->setMetadataBlock(kImagineMetadataXMP, xmpData, strlen(xmpData), false);
+		}
+
+#ifdef PNG_eXIf_SUPPORTED
+		png_bytep exif = NULL;
+		png_uint_32 exifSize = 0;
+
+		if (png_get_eXIf_1(png, info, &exifSize, &exif) && exif) {
+			this->setMetadataBlock(kImagineMetadataEXIF, exif, exifSize, false);
+		}
+#endif
 	}
 	
 	return result;
 }
 
 int PNG::unload() {
+	// Points into the read struct
+	this->releaseMetadataBlocks();
+
 	if (this->_pngStruct && this->_pngInfo) {
 		png_destroy_read_struct(
 			(png_structp *) &this->_pngStruct,
@@ -225,68 +620,11 @@ int PNG::unload() {
 		this->_pngInfo = NULL;
 	}
 
-	if (this->_xmpBuf) {
-		free(this->_xmpBuf);
-		this->_xmpBuf = NULL;
-	}
-
 	if (this->_fileHandler) fclose(this->_fileHandler);
 
 	return 0;
 }
 
-/*
-int PNG::details() {
-	int result = this->Image::details();
-	
-	if (result == 0) {
-		if (this->_xmpBuf) {
-			printf("XMP Data:\n");
-			result = PNGPrintXMPData(this->_xmpBuf);
-		} else {
-			result = 1;
-		}
-	}
-
-	return result;
-}
-*/
-
-/**
- * Prints the xmpData xml buffer using rapidxml
- */
-int PNGLoadXMPData(char * xmpData, Dictionary<String, String> * metadata) {
-	int result = 0;
-	xml_document<> doc;
-	doc.parse<0>(xmpData);
-	xml_node<> * node = NULL, * valNode = NULL;
-
-	if (!(node = doc.first_node("x:xmpmeta"))) {
-		result = 1;
-	} else if (!(node = node->first_node("rdf:RDF"))) {
-		result = 2;
-	} else if (!(node = node->first_node("rdf:Description"))) {
-		result = 3;
-	} else {
-		if (valNode = node->first_node("exif:GPSLongitude")) {
-			printf("\tLongitude: %s\n", valNode->value());
-			metadata->setValueForKey("Longitude", valNode->value());
-		}
-
-		if (valNode = node->first_node("exif:GPSLatitude")) {
-			printf("\tLatidude: %s\n", valNode->value());
-			metadata->setValueForKey("Latitude", valNode->value());
-		}
-
-		if (valNode = node->first_node("exifEX:LensModel")) {
-			printf("\tLens model: %s\n", valNode->value());
-			metadata->setValueForKey("Lens Model", valNode->value());
-		}
-	}
-
-	return result;
-}
-
 int PNG::compileMetadata(Dictionary<String, String> * metadata) {
 	int result = 0;
 	char buf[0xff];
@@ -296,8 +634,8 @@ int PNG::compileMetadata(Dictionary<String, String> * metadata) {
 	sprintf(buf, "%d", this->height());
 	metadata->setValueForKey("Height", buf);
 
-	if (this->_xmpBuf) {
-		result = PNGLoadXMPData(this->_xmpBuf, metadata);
+	if (result == 0) {
+		result = this->compileEmbeddedMetadata(metadata);
 	}
 
 	return result;
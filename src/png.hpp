@@ -13,6 +13,16 @@
 class PNG : public Image {
 public:
 	static bool isType(const char * path);
+
+	/**
+	 * Writes `width` x `height` palette indexes, one byte each, as a PNG
+	 * with the `count` RGB `colors` to `file`, which the caller closes.
+	 * Fewer colors get fewer bits per pixel
+	 *
+	 * libpng's allocations are charged to `account`, which can be NULL
+	 */
+	static int writePalette(FILE * file, const unsigned char * indexes, ImaginePixels width, ImaginePixels height, const unsigned char (* colors)[3], int count, MemoryAccount * account);
+
 	PNG(const char * path, int * err);
 	virtual ~PNG();
 	ImageType type();
@@ -22,6 +32,8 @@ public:
 	ImaginePixels height();
 	int load();
 	int unload();
+	int probe();
+	int decodeRows(ImagineRowHandler handler, void * context);
 	ImagineColorSpace colorspace();
 	int bitsPerComponent();
 	const char * description();
@@ -30,7 +42,6 @@ public:
 private:
 	void * _pngStruct;
 	void * _pngInfo;
-	char * _xmpBuf;
 };
 
 #endif
@@ -0,0 +1,291 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "reduce.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern "C" {
+#include <string.h>
+}
+
+static bool ReduceHasAlpha(int channels) {
+	return (channels == 2) || (channels == 4);
+}
+
+/**
+ * Packs the high byte of each sample of the pixel at `p`
+ */
+static uint32_t ReduceKey(const ReduceInfo * info, const unsigned char * p) {
+	const int bytes = info->bitDepth / 8;
+	uint32_t key = 0;
+
+	for (int c = 0; c < info->channels; c++) {
+		key = (key << 8) | p[c * bytes];
+	}
+
+	return key;
+}
+
+/**
+ * Slot holding `key`, or the empty one it would go in
+ *
+ * The table never gets more than half full so this always ends
+ */
+static uint32_t ReduceSlot(const ReduceInfo * info, uint32_t key) {
+	uint32_t slot = (key * 2654435761U) >> 23;
+
+	while ((info->indexes[slot] != -1) && (info->keys[slot] != key)) {
+		slot = (slot + 1) & (REDUCE_TABLE_SIZE - 1);
+	}
+
+	return slot;
+}
+
+static void ReduceAddColor(ReduceInfo * info, uint32_t key) {
+	uint32_t slot = ReduceSlot(info, key);
+	uint8_t * rgba = NULL;
+
+	if (info->indexes[slot] != -1) {
+		return;
+	} else if (info->colors == REDUCE_MAX_COLORS) {
+		info->colors++;
+		return;
+	}
+
+	rgba = info->palette[info->colors];
+	info->keys[slot] = key;
+	info->indexes[slot] = info->colors++;
+
+	switch (info->channels) {
+		case 1:
+			rgba[0] = rgba[1] = rgba[2] = key;
+			rgba[3] = 0xff;
+			break;
+		case 2:
+			rgba[0] = rgba[1] = rgba[2] = key >> 8;
+			rgba[3] = key;
+			break;
+		case 3:
+			rgba[0] = key >> 16;
+			rgba[1] = key >> 8;
+			rgba[2] = key;
+			rgba[3] = 0xff;
+			break;
+		default:
+			rgba[0] = key >> 24;
+			rgba[1] = key >> 16;
+			rgba[2] = key >> 8;
+			rgba[3] = key;
+			break;
+	}
+}
+
+/**
+ * Clears opaque, gray and eightBit for whatever the row disproves
+ */
+static void ReduceCheckRow(ReduceInfo * info, const unsigned char * p, ImaginePixels width) {
+	const int bytes = info->bitDepth / 8;
+	const int stride = info->channels * bytes;
+	const int alphaChannel = ReduceHasAlpha(info->channels) ? info->channels - 1 : -1;
+	const size_t length = width * stride;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// Every test is a byte compared with one a fixed distance on: alpha
+	// against 0xff, R against G and B, the high byte against the low
+	// one. The masks say which bytes of each 16 take part, which moves
+	// with the pixel the 16 start in
+	unsigned char masks[8][3][16];
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi8(-1);
+	__m128i alphaMiss = zero, grayMiss = zero, pairMiss = zero;
+
+	for (int phase = 0; phase < stride; phase++) {
+		for (int j = 0; j < 16; j++) {
+			int position = (phase + j) % stride;
+			int channel = position / bytes;
+
+			masks[phase][0][j] = (channel == alphaChannel) ? 0xff : 0;
+			masks[phase][1][j] = ((info->channels >= 3) && (channel == 0)) ? 0xff : 0;
+			masks[phase][2][j] = ((bytes == 2) && !(position & 1)) ? 0xff : 0;
+		}
+	}
+
+	for (; i + 16 + 2 * bytes <= length; i += 16) {
+		int phase = i % stride;
+		__m128i a = _mm_loadu_si128((const __m128i *) (p + i));
+		__m128i g = _mm_loadu_si128((const __m128i *) (p + i + bytes));
+		__m128i b = _mm_loadu_si128((const __m128i *) (p + i + 2 * bytes));
+		__m128i low = _mm_loadu_si128((const __m128i *) (p + i + 1));
+
+		alphaMiss = _mm_or_si128(alphaMiss, _mm_andnot_si128(_mm_cmpeq_epi8(a, ones),
+			_mm_loadu_si128((const __m128i *) masks[phase][0])));
+		grayMiss = _mm_or_si128(grayMiss, _mm_andnot_si128(_mm_and_si128(_mm_cmpeq_epi8(a, g), _mm_cmpeq_epi8(a, b)),
+			_mm_loadu_si128((const __m128i *) masks[phase][1])));
+		pairMiss = _mm_or_si128(pairMiss, _mm_andnot_si128(_mm_cmpeq_epi8(a, low),
+			_mm_loadu_si128((const __m128i *) masks[phase][2])));
+	}
+
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(alphaMiss, zero)) != 0xffff) info->opaque = false;
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(grayMiss, zero)) != 0xffff) info->gray = false;
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(pairMiss, zero)) != 0xffff) info->eightBit = false;
+#endif
+
+	// Whatever is left, starting from the pixel we stopped in
+	for (ImaginePixels x = i / stride; x < width; x++) {
+		const unsigned char * q = p + x * stride;
+
+		for (int k = 0; k < bytes; k++) {
+			if ((alphaChannel != -1) && (q[alphaChannel * bytes + k] != 0xff)) info->opaque = false;
+			if ((info->channels >= 3) && ((q[k] != q[bytes + k]) || (q[k] != q[2 * bytes + k]))) info->gray = false;
+		}
+
+		for (int c = 0; (bytes == 2) && (c < info->channels); c++) {
+			if (q[2 * c] != q[2 * c + 1]) info->eightBit = false;
+		}
+	}
+}
+
+int ReduceBegin(ReduceInfo * info, int channels, int bitDepth, bool palette) {
+	if (!info) {
+		return 1;
+	} else if ((channels < 1) || (channels > 4) || ((bitDepth != 8) && (bitDepth != 16))) {
+		return 2;
+	}
+
+	memset(info, 0, sizeof(ReduceInfo));
+	memset(info->indexes, 0xff, sizeof(info->indexes));
+
+	info->channels = channels;
+	info->bitDepth = bitDepth;
+	info->opaque = true;
+	info->gray = true;
+	info->eightBit = true;
+
+	// A single channel is never wider than an index
+	info->countColors = palette && (channels > 1);
+
+	return 0;
+}
+
+bool ReducePending(const ReduceInfo * info) {
+	if ((info->channels >= 3) && info->gray) return true;
+	else if (ReduceHasAlpha(info->channels) && info->opaque) return true;
+	else if ((info->bitDepth == 16) && info->eightBit) return true;
+	else if (info->countColors && info->eightBit && (info->colors <= REDUCE_MAX_COLORS)) return true;
+	else return false;
+}
+
+bool ReduceAddRow(ReduceInfo * info, const unsigned char * row, ImaginePixels width) {
+	const int stride = info->channels * info->bitDepth / 8;
+
+	if ((info->gray && (info->channels >= 3))
+		|| (info->opaque && ReduceHasAlpha(info->channels))
+		|| (info->eightBit && (info->bitDepth == 16))) {
+		ReduceCheckRow(info, row, width);
+	}
+
+	if (info->countColors && info->eightBit && (info->colors <= REDUCE_MAX_COLORS)) {
+		uint32_t last = 0;
+
+		// Runs of the same color only need one lookup
+		for (ImaginePixels x = 0; (x < width) && (info->colors <= REDUCE_MAX_COLORS); x++) {
+			uint32_t key = ReduceKey(info, row + x * stride);
+
+			if ((x == 0) || (key != last)) {
+				ReduceAddColor(info, key);
+				last = key;
+			}
+		}
+	}
+
+	return ReducePending(info);
+}
+
+void ReduceFinish(ReduceInfo * info) {
+	const bool keepAlpha = ReduceHasAlpha(info->channels) && !info->opaque;
+	const int plain = (((info->channels >= 3) && !info->gray) ? 3 : 1) + (keepAlpha ? 1 : 0);
+
+	info->outputPalette = false;
+	info->outputChannels = plain;
+	info->outputBitDepth = ((info->bitDepth == 16) && !info->eightBit) ? 16 : 8;
+
+	if (info->countColors && info->eightBit && (info->colors <= REDUCE_MAX_COLORS) && (plain > 1)) {
+		uint8_t sorted[REDUCE_MAX_COLORS][4];
+		int16_t remap[REDUCE_MAX_COLORS];
+		int n = 0;
+
+		// Transparent entries first so the tRNS chunk can stop early
+		for (int pass = 0; pass < 2; pass++) {
+			for (int i = 0; i < info->colors; i++) {
+				if ((info->palette[i][3] != 0xff) == (pass == 0)) {
+					remap[i] = n;
+					memcpy(sorted[n++], info->palette[i], 4);
+				}
+			}
+
+			if (pass == 0) info->transparent = n;
+		}
+
+		memcpy(info->palette, sorted, info->colors * 4);
+		for (int slot = 0; slot < REDUCE_TABLE_SIZE; slot++) {
+			if (info->indexes[slot] != -1) info->indexes[slot] = remap[info->indexes[slot]];
+		}
+
+		info->outputPalette = true;
+		info->outputChannels = 1;
+		if (info->colors <= 2) info->outputBitDepth = 1;
+		else if (info->colors <= 4) info->outputBitDepth = 2;
+		else if (info->colors <= 16) info->outputBitDepth = 4;
+		else info->outputBitDepth = 8;
+	}
+
+	info->reduced = info->outputPalette
+		|| (info->outputChannels != info->channels)
+		|| (info->outputBitDepth != info->bitDepth);
+}
+
+void ReduceRow(const ReduceInfo * info, const unsigned char * in, ImaginePixels width, unsigned char * out) {
+	const int bytes = info->bitDepth / 8;
+	const int stride = info->channels * bytes;
+
+	if (info->outputPalette) {
+		uint32_t last = 0;
+		int16_t index = 0;
+
+		for (ImaginePixels x = 0; x < width; x++) {
+			uint32_t key = ReduceKey(info, in + x * stride);
+
+			if ((x == 0) || (key != last)) {
+				index = info->indexes[ReduceSlot(info, key)];
+				last = key;
+			}
+
+			out[x] = index;
+		}
+	} else {
+		const int outBytes = info->outputBitDepth / 8;
+		const bool keepAlpha = ReduceHasAlpha(info->outputChannels);
+		const int colorChannels = info->outputChannels - (keepAlpha ? 1 : 0);
+
+		// Samples only ever move towards the start of the row, so
+		// writing over `in` is safe
+		for (ImaginePixels x = 0; x < width; x++) {
+			const unsigned char * q = in + x * stride;
+
+			for (int c = 0; c < colorChannels; c++) {
+				for (int k = 0; k < outBytes; k++) *out++ = q[c * bytes + k];
+			}
+
+			for (int k = 0; keepAlpha && (k < outBytes); k++) {
+				*out++ = q[(info->channels - 1) * bytes + k];
+			}
+		}
+	}
+}
+
@@ -0,0 +1,104 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef REDUCE_HPP
+#define REDUCE_HPP
+
+#include "image.hpp"
+
+extern "C" {
+#include <stdint.h>
+}
+
+/// Most colors a palette can hold
+#define REDUCE_MAX_COLORS 256
+
+/// Slots in the color lookup table, twice the colors to keep probes short
+#define REDUCE_TABLE_SIZE 512
+
+/**
+ * Finds the narrowest layout pixels can be written in without losing
+ * anything
+ *
+ * Rows go through ReduceAddRow() before the encoder is set up, then
+ * ReduceFinish() picks the layout and ReduceRow() converts each row to
+ * it. Input rows are gray, gray and alpha, RGB or RGBA with 8 or 16 bit
+ * samples, 16 bit ones high byte first.
+ */
+typedef struct {
+	int channels;
+	int bitDepth;
+
+	/// Whether to count colors for a palette
+	bool countColors;
+
+	/// Every alpha sample is at its maximum
+	bool opaque;
+
+	/// R, G and B are the same in every pixel
+	bool gray;
+
+	/// Both bytes of every 16 bit sample are the same, so it is an 8 bit
+	/// sample times 257
+	bool eightBit;
+
+	/// Distinct colors seen, REDUCE_MAX_COLORS + 1 once there are too many
+	int colors;
+
+	/// RGBA of each color. After ReduceFinish() the ones that are not
+	/// opaque come first
+	uint8_t palette[REDUCE_MAX_COLORS][4];
+
+	/// Palette entries whose alpha is not at its maximum
+	int transparent;
+
+	/// Packed colors and their palette index, -1 for empty slots
+	uint32_t keys[REDUCE_TABLE_SIZE];
+	int16_t indexes[REDUCE_TABLE_SIZE];
+
+	/// Filled in by ReduceFinish(). A palette layout has one channel of
+	/// 1, 2, 4 or 8 bit indexes
+	int outputChannels;
+	int outputBitDepth;
+	bool outputPalette;
+
+	/// The output layout differs from the input one
+	bool reduced;
+} ReduceInfo;
+
+/**
+ * Starts an analysis of `channels` channel pixels with `bitDepth` (8 or
+ * 16) bit samples
+ *
+ * `palette` allows ReduceFinish() to pick a palette layout
+ */
+int ReduceBegin(ReduceInfo * info, int channels, int bitDepth, bool palette);
+
+/**
+ * Looks at the next row
+ *
+ * Returns false once nothing more can be learned, and the remaining rows
+ * can be skipped
+ */
+bool ReduceAddRow(ReduceInfo * info, const unsigned char * row, ImaginePixels width);
+
+/**
+ * Whether further rows could still change the outcome
+ */
+bool ReducePending(const ReduceInfo * info);
+
+/**
+ * Picks the output layout from what the rows showed
+ */
+void ReduceFinish(ReduceInfo * info);
+
+/**
+ * Writes `in` in the output layout, one byte per palette index or 8 bit
+ * sample. `out` can be `in`
+ */
+void ReduceRow(const ReduceInfo * info, const unsigned char * in, ImaginePixels width, unsigned char * out);
+
+#endif // REDUCE_HPP
+
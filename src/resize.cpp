@@ -0,0 +1,112 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "resize.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+}
+
+Resizer::Resizer(int srcWidth, int srcHeight, int dstWidth, int dstHeight, int components, int * err) {
+	int error = 0;
+
+	this->_srcWidth = srcWidth;
+	this->_srcHeight = srcHeight;
+	this->_dstWidth = dstWidth;
+	this->_dstHeight = dstHeight;
+	this->_components = components;
+	this->_srcRow = 0;
+	this->_dstRow = 0;
+	this->_rowsAccumulated = 0;
+	this->_colStart = NULL;
+	this->_sums = NULL;
+	this->_output = NULL;
+
+	if ((dstWidth <= 0) || (dstHeight <= 0) || (dstWidth > srcWidth) || (dstHeight > srcHeight)) {
+		BFErrorPrint("Cannot resize %dx%d to %dx%d", srcWidth, srcHeight, dstWidth, dstHeight);
+		error = 1;
+	} else if ((this->_colStart = (int *) malloc(sizeof(int) * (dstWidth + 1))) == NULL) {
+		error = 2;
+	} else if ((this->_sums = (unsigned long *) calloc(dstWidth * components, sizeof(unsigned long))) == NULL) {
+		error = 3;
+	} else if ((this->_output = (unsigned char *) malloc(dstWidth * components)) == NULL) {
+		error = 4;
+	} else {
+		for (int x = 0; x <= dstWidth; x++) {
+			this->_colStart[x] = (int) (((long) x * srcWidth) / dstWidth);
+		}
+	}
+
+	if (err) *err = error;
+}
+
+Resizer::~Resizer() {
+	BFFree(this->_colStart);
+	BFFree(this->_sums);
+	BFFree(this->_output);
+}
+
+int Resizer::outputWidth() {
+	return this->_dstWidth;
+}
+
+int Resizer::outputHeight() {
+	return this->_dstHeight;
+}
+
+const unsigned char * Resizer::outputRow() {
+	return this->_output;
+}
+
+int Resizer::pushRow(const unsigned char * row, bool * rowReady) {
+	if (rowReady) *rowReady = false;
+
+	if (!row || (this->_srcRow >= this->_srcHeight)) {
+		return 1;
+	}
+
+	const int comps = this->_components;
+
+	// Accumulate this source row into the output columns it covers
+	for (int x = 0; x < this->_dstWidth; x++) {
+		unsigned long * sum = this->_sums + (x * comps);
+		const unsigned char * src = row + (this->_colStart[x] * comps);
+		const unsigned char * end = row + (this->_colStart[x + 1] * comps);
+
+		for (; src < end; src += comps) {
+			for (int c = 0; c < comps; c++) {
+				sum[c] += src[c];
+			}
+		}
+	}
+
+	this->_srcRow++;
+	this->_rowsAccumulated++;
+
+	// Last source row that belongs to the output row we are building
+	long rowEnd = (((long) this->_dstRow + 1) * this->_srcHeight) / this->_dstHeight;
+	if (this->_srcRow >= rowEnd) {
+		for (int x = 0; x < this->_dstWidth; x++) {
+			unsigned long count = (unsigned long) (this->_colStart[x + 1] - this->_colStart[x]) * this->_rowsAccumulated;
+			unsigned long * sum = this->_sums + (x * comps);
+			unsigned char * dst = this->_output + (x * comps);
+
+			for (int c = 0; c < comps; c++) {
+				dst[c] = (unsigned char) ((sum[c] + (count / 2)) / count);
+			}
+		}
+
+		memset(this->_sums, 0, sizeof(unsigned long) * this->_dstWidth * comps);
+		this->_rowsAccumulated = 0;
+		this->_dstRow++;
+
+		if (rowReady) *rowReady = true;
+	}
+
+	return 0;
+}
+
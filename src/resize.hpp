@@ -0,0 +1,67 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef RESIZE_HPP
+#define RESIZE_HPP
+
+/**
+ * Streaming area-average downscaler
+ *
+ * Source rows are pushed in order and output rows become
+ * available once every source row that covers them has been
+ * seen. Only one output row of accumulators is held in memory
+ * so this can sit between a decoder and an encoder.
+ *
+ * Only downscaling is supported
+ */
+class Resizer {
+public:
+	Resizer(int srcWidth, int srcHeight, int dstWidth, int dstHeight, int components, int * err);
+	virtual ~Resizer();
+
+	/**
+	 * Adds the next source row
+	 *
+	 * `rowReady` is set to true when outputRow() holds a
+	 * completed output row
+	 */
+	int pushRow(const unsigned char * row, bool * rowReady);
+
+	/**
+	 * The last completed output row. Valid until the next
+	 * call to pushRow()
+	 */
+	const unsigned char * outputRow();
+
+	int outputWidth();
+	int outputHeight();
+
+private:
+	int _srcWidth;
+	int _srcHeight;
+	int _dstWidth;
+	int _dstHeight;
+	int _components;
+
+	/// Source row we expect next
+	int _srcRow;
+
+	/// Output row we are accumulating
+	int _dstRow;
+
+	/// Number of source rows accumulated into _sums
+	int _rowsAccumulated;
+
+	/// First source column that maps to each output column (size _dstWidth + 1)
+	int * _colStart;
+
+	/// Per output sample sums
+	unsigned long * _sums;
+
+	unsigned char * _output;
+};
+
+#endif // RESIZE_HPP
+
@@ -0,0 +1,324 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "scan.hpp"
+#include "image.hpp"
+#include "png.hpp"
+#include "jpeg.hpp"
+#include "gif.hpp"
+#include "tiff.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+}
+
+using namespace BF;
+
+/// Stands in for records that were skipped
+static char SCAN_RECORD_EMPTY[1] = {0};
+
+ScanFormat ScanFormatFromString(const char * name) {
+	if (!name) return kScanFormatUnknown;
+	else if (!strcmp(name, "jsonl")) return kScanFormatJSONL;
+	else if (!strcmp(name, "csv")) return kScanFormatCSV;
+	else return kScanFormatUnknown;
+}
+
+const char * ScanFormatHeader(ScanFormat format) {
+	switch (format) {
+		case kScanFormatCSV:
+			return "path,type,width,height,colorspace,bits_per_component,frames,metadata,error\n";
+		default:
+			return NULL;
+	}
+}
+
+bool ScanPathFilter(const char * path) {
+	return PNG::isType(path) || JPEG::isType(path) || GIF::isType(path) || Tiff::isType(path);
+}
+
+void ScanBufferAppendBytes(ScanBuffer * b, const char * bytes, size_t size) {
+	if (b->error) return;
+
+	if (b->length + size + 1 > b->capacity) {
+		size_t capacity = b->capacity ? b->capacity : 256;
+		while (b->length + size + 1 > capacity) capacity *= 2;
+
+		char * buf = (char *) realloc(b->buf, capacity);
+		if (!buf) {
+			b->error = 1;
+			return;
+		}
+
+		b->buf = buf;
+		b->capacity = capacity;
+	}
+
+	memcpy(b->buf + b->length, bytes, size);
+	b->length += size;
+	b->buf[b->length] = '\0';
+}
+
+void ScanBufferAppend(ScanBuffer * b, const char * format, ...) {
+	char tmp[128];
+	va_list args;
+
+	va_start(args, format);
+	int size = vsnprintf(tmp, sizeof(tmp), format, args);
+	va_end(args);
+
+	if ((size < 0) || ((size_t) size >= sizeof(tmp))) b->error = 2;
+	else ScanBufferAppendBytes(b, tmp, size);
+}
+
+void ScanBufferAppendJSONString(ScanBuffer * b, const char * str) {
+	const char * run = str;
+
+	ScanBufferAppendBytes(b, "\"", 1);
+
+	// Copy runs of plain characters at once
+	for (const char * c = str; *c; c++) {
+		unsigned char ch = (unsigned char) *c;
+
+		if ((ch >= 0x20) && (ch != '"') && (ch != '\\')) continue;
+
+		ScanBufferAppendBytes(b, run, c - run);
+		run = c + 1;
+
+		switch (ch) {
+			case '"': ScanBufferAppendBytes(b, "\\\"", 2); break;
+			case '\\': ScanBufferAppendBytes(b, "\\\\", 2); break;
+			case '\n': ScanBufferAppendBytes(b, "\\n", 2); break;
+			case '\r': ScanBufferAppendBytes(b, "\\r", 2); break;
+			case '\t': ScanBufferAppendBytes(b, "\\t", 2); break;
+			default: ScanBufferAppend(b, "\\u%04x", ch); break;
+		}
+	}
+
+	ScanBufferAppendBytes(b, run, strlen(run));
+	ScanBufferAppendBytes(b, "\"", 1);
+}
+
+/**
+ * Appends `str` as a CSV field, quoting only when needed
+ */
+static void ScanBufferAppendCSVField(ScanBuffer * b, const char * str) {
+	if (!strpbrk(str, ",\"\r\n")) {
+		ScanBufferAppendBytes(b, str, strlen(str));
+		return;
+	}
+
+	ScanBufferAppendBytes(b, "\"", 1);
+	for (const char * c = str; *c; c++) {
+		if (*c == '"') ScanBufferAppendBytes(b, "\"\"", 2);
+		else ScanBufferAppendBytes(b, c, 1);
+	}
+	ScanBufferAppendBytes(b, "\"", 1);
+}
+
+static void ScanRecordJSONL(ScanBuffer * b, const char * path, const IndexEntry * info, int error, Dictionary<String, String> * metadata) {
+	ScanBufferAppendBytes(b, "{\"path\":", 8);
+	ScanBufferAppendJSONString(b, path);
+
+	if (error) {
+		ScanBufferAppend(b, ",\"error\":%d}\n", error);
+		return;
+	}
+
+	ScanBufferAppendBytes(b, ",\"type\":", 8);
+	ScanBufferAppendJSONString(b, info->description);
+	ScanBufferAppend(b, ",\"width\":%lu,\"height\":%lu,\"colorspace\":",
+		(unsigned long) info->width, (unsigned long) info->height);
+	ScanBufferAppendJSONString(b, info->colorspace);
+	ScanBufferAppend(b, ",\"bitsPerComponent\":%d,\"frames\":%d,\"metadata\":{",
+		info->bitsPerComponent, info->frameCount);
+
+	Dictionary<String, String>::Iterator * itr = 0;
+	if (!metadata->createIterator(&itr)) {
+		for (bool first = true; !itr->finished(); first = false) {
+			Dictionary<String, String>::Entry * e = itr->current();
+
+			if (!first) ScanBufferAppendBytes(b, ",", 1);
+			ScanBufferAppendJSONString(b, e->key().cString());
+			ScanBufferAppendBytes(b, ":", 1);
+			ScanBufferAppendJSONString(b, e->value().cString());
+
+			if (itr->next()) break;
+		}
+	}
+	Delete(itr);
+
+	ScanBufferAppendBytes(b, "}}\n", 3);
+}
+
+static void ScanRecordCSV(ScanBuffer * b, const char * path, const IndexEntry * info, int error, Dictionary<String, String> * metadata) {
+	ScanBufferAppendCSVField(b, path);
+
+	if (error) {
+		ScanBufferAppend(b, ",,,,,,,,%d\n", error);
+		return;
+	}
+
+	ScanBufferAppendBytes(b, ",", 1);
+	ScanBufferAppendCSVField(b, info->description);
+	ScanBufferAppend(b, ",%lu,%lu,", (unsigned long) info->width, (unsigned long) info->height);
+	ScanBufferAppendCSVField(b, info->colorspace);
+	ScanBufferAppend(b, ",%d,%d,", info->bitsPerComponent, info->frameCount);
+
+	// Keys differ per type so they share one column
+	ScanBuffer pairs = {0};
+	Dictionary<String, String>::Iterator * itr = 0;
+	if (!metadata->createIterator(&itr)) {
+		for (bool first = true; !itr->finished(); first = false) {
+			Dictionary<String, String>::Entry * e = itr->current();
+
+			if (!first) ScanBufferAppendBytes(&pairs, ";", 1);
+			ScanBufferAppend(&pairs, "%s=", e->key().cString());
+			ScanBufferAppendBytes(&pairs, e->value().cString(), strlen(e->value().cString()));
+
+			if (itr->next()) break;
+		}
+	}
+	Delete(itr);
+
+	if (pairs.error) b->error = pairs.error;
+	else if (pairs.buf) ScanBufferAppendCSVField(b, pairs.buf);
+	BFFree(pairs.buf);
+
+	ScanBufferAppendBytes(b, ",\n", 2);
+}
+
+/**
+ * Shared by both ways of creating a record. `info` and `metadata`
+ * are only read when there is no error
+ */
+static int ScanRecordFormat(ScanFormat format, const char * path, const IndexEntry * info, int error, Dictionary<String, String> * metadata, char ** record) {
+	int result = 0;
+	ScanBuffer b = {0};
+
+	switch (format) {
+		case kScanFormatJSONL:
+			ScanRecordJSONL(&b, path, info, error, metadata);
+			break;
+		case kScanFormatCSV:
+			ScanRecordCSV(&b, path, info, error, metadata);
+			break;
+		default:
+			b.error = 3;
+	}
+
+	if (b.error) {
+		BFFree(b.buf);
+		result = b.error;
+	} else {
+		*record = b.buf;
+	}
+
+	return result;
+}
+
+int ScanRecordCreate(ScanFormat format, const char * path, Image * img, Dictionary<String, String> * metadata, int error, char ** record) {
+	IndexEntry info;
+
+	memset(&info, 0, sizeof(info));
+
+	if (!error) {
+		info.description = img->description();
+		info.colorspace = img->colorspaceString();
+		info.width = img->width();
+		info.height = img->height();
+		info.bitsPerComponent = img->bitsPerComponent();
+		info.frameCount = img->frameCount();
+	}
+
+	return ScanRecordFormat(format, path, &info, error, metadata, record);
+}
+
+int ScanRecordCreateFromEntry(ScanFormat format, const char * path, const IndexEntry * entry, char ** record) {
+	Dictionary<String, String> metadata;
+
+	IndexEntryCompileMetadata(entry, &metadata);
+
+	return ScanRecordFormat(format, path, entry, 0, &metadata, record);
+}
+
+ScanWriter::ScanWriter(FILE * out, size_t count, int * err) {
+	this->_out = out;
+	this->_count = count;
+	this->_next = 0;
+	this->_flushing = false;
+	this->_written = 0;
+
+	this->_slots = new std::atomic<char *>[count ? count : 1];
+	for (size_t i = 0; i < count; i++) this->_slots[i] = NULL;
+
+	if (err) *err = 0;
+}
+
+ScanWriter::~ScanWriter() {
+	// Anything left was never reached because an earlier index is missing
+	for (size_t i = this->_next; i < this->_count; i++) {
+		char * record = this->_slots[i];
+		if (record != SCAN_RECORD_EMPTY) BFFree(record);
+	}
+
+	delete[] this->_slots;
+}
+
+int ScanWriter::submit(size_t index, char * record) {
+	if (index >= this->_count) return 1;
+
+	// Sequentially consistent so that either we see our index is
+	// next or the worker that is flushing sees our record
+	this->_slots[index].store(record ? record : SCAN_RECORD_EMPTY);
+
+	if (index == this->_next.load()) {
+		this->flush();
+	}
+
+	return 0;
+}
+
+void ScanWriter::flush() {
+	// Every step of the handoff is sequentially consistent. Releasing the
+	// flag and then looking at the next slot is a store followed by a
+	// load, which weaker orderings let the CPU swap. We would then miss
+	// a record whose worker still saw the flag held
+	while (!this->_flushing.exchange(true)) {
+		size_t next = this->_next.load(std::memory_order_relaxed);
+		char * record = NULL;
+
+		while ((next < this->_count)
+				&& ((record = this->_slots[next].load(std::memory_order_acquire)) != NULL)) {
+			if (record != SCAN_RECORD_EMPTY) {
+				fputs(record, this->_out);
+				free(record);
+				this->_written++;
+			}
+
+			this->_slots[next].store(NULL, std::memory_order_relaxed);
+			next++;
+		}
+
+		this->_next.store(next);
+		this->_flushing.store(false);
+
+		// A record for `next` may have landed after we looked but
+		// while we still held the flag. Its worker saw us busy and
+		// left, so it is on us to go again
+		if ((next >= this->_count)
+				|| (this->_slots[next].load() == NULL)) {
+			break;
+		}
+	}
+}
+
+size_t ScanWriter::written() {
+	return this->_written;
+}
+
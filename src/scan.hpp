@@ -0,0 +1,132 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <atomic>
+#include <bflibcpp/dictionary.hpp>
+#include <bflibcpp/string.hpp>
+#include "index.hpp"
+
+extern "C" {
+#include <stdio.h>
+#include <stddef.h>
+}
+
+class Image;
+
+typedef enum {
+	kScanFormatUnknown = -1,
+
+	/// One JSON object per line
+	kScanFormatJSONL = 0,
+
+	/// RFC 4180 with a header row. Metadata is a single `key=value;...` column
+	kScanFormatCSV = 1,
+} ScanFormat;
+
+/**
+ * Growable string records are built in
+ *
+ * Appending never fails outright. The first failure is kept in
+ * `error` and later appends do nothing
+ */
+typedef struct {
+	char * buf;
+	size_t length;
+	size_t capacity;
+	int error;
+} ScanBuffer;
+
+void ScanBufferAppendBytes(ScanBuffer * b, const char * bytes, size_t size);
+
+/**
+ * printf() style. Single appends are limited to 127 characters
+ */
+void ScanBufferAppend(ScanBuffer * b, const char * format, ...);
+
+/**
+ * Appends `str` as a quoted JSON string
+ */
+void ScanBufferAppendJSONString(ScanBuffer * b, const char * str);
+
+/**
+ * Returns the format named by `name` ("jsonl" or "csv")
+ */
+ScanFormat ScanFormatFromString(const char * name);
+
+/**
+ * Header row for the format, or NULL if it has none
+ */
+const char * ScanFormatHeader(ScanFormat format);
+
+/**
+ * True for files Image::createImage knows how to open
+ */
+bool ScanPathFilter(const char * path);
+
+/**
+ * Formats a newline terminated record for `path`
+ *
+ * `img` must have been probed and `metadata` is what its
+ * compileMetadata() gave. If `error` is non zero only the path and
+ * the error are written and `img` and `metadata` can be NULL. The
+ * caller owns `record` and frees it with free()
+ */
+int ScanRecordCreate(ScanFormat format, const char * path, Image * img, BF::Dictionary<BF::String, BF::String> * metadata, int error, char ** record);
+
+/**
+ * Same as ScanRecordCreate() but for a file answered by the index
+ */
+int ScanRecordCreateFromEntry(ScanFormat format, const char * path, const IndexEntry * entry, char ** record);
+
+/**
+ * Writes records in index order no matter which order they finish in
+ *
+ * Workers hand over finished records with submit(). Whichever worker
+ * fills the next slot in line writes every consecutive record that is
+ * ready; everyone else returns right away. There are no locks, so a
+ * slow write only holds up the one worker doing it
+ */
+class ScanWriter {
+public:
+	ScanWriter(FILE * out, size_t count, int * err);
+	virtual ~ScanWriter();
+
+	/**
+	 * Takes ownership of `record` for `index`. Pass NULL to skip an index.
+	 * Each index must be submitted exactly once
+	 */
+	int submit(size_t index, char * record);
+
+	/**
+	 * Number of records written so far
+	 */
+	size_t written();
+
+private:
+	/**
+	 * Writes ready records if no one else is
+	 */
+	void flush();
+
+	FILE * _out;
+	size_t _count;
+
+	/// Finished records waiting on earlier ones
+	std::atomic<char *> * _slots;
+
+	/// Next index to write
+	std::atomic<size_t> _next;
+
+	/// Set while a worker is writing
+	std::atomic<bool> _flushing;
+
+	size_t _written;
+};
+
+#endif // SCAN_HPP
+
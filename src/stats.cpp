@@ -0,0 +1,318 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "stats.hpp"
+#include "scan.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+}
+
+/**
+ * Pixels take turns between this many copies of each histogram
+ *
+ * Neighbouring pixels are often the same value, and with one copy each
+ * increment would have to wait for the one before it to land
+ */
+#define STATS_LANES 4
+
+typedef struct {
+	uint64_t lanes[STATS_LANES][STATS_CHANNEL_MAX][256];
+	int channels;
+	ImaginePixels width;
+	ImaginePixels rows;
+	int maxChannelDifference;
+} StatsAccumulator;
+
+const char * StatsChannelName(int channels, int index) {
+	static const char * const gray[] = {"Gray", "Alpha"};
+	static const char * const color[] = {"Red", "Green", "Blue", "Alpha"};
+
+	if ((index < 0) || (index >= channels)) return NULL;
+	else if (channels < 3) return gray[index];
+	else return color[index];
+}
+
+/**
+ * Largest difference between color channels of any pixel in a row of
+ * RGB or RGBA
+ */
+static int StatsRowChannelDifference(const unsigned char * p, ImaginePixels width, int channels) {
+	size_t bytes = width * channels;
+	size_t i = 0;
+	int result = 0;
+
+#ifdef __SSE2__
+	// Comparing the row against itself one and two bytes on gives every
+	// R-G, G-B and R-B difference. The masks pick those out of each
+	// 16 bytes, which start at a different channel each time for RGB
+	unsigned char masks[STATS_CHANNEL_MAX][2][16];
+	__m128i max = _mm_setzero_si128();
+	unsigned char lanes[16];
+
+	for (int phase = 0; phase < channels; phase++) {
+		for (int j = 0; j < 16; j++) {
+			int channel = (phase + j) % channels;
+			masks[phase][0][j] = (channel < 2) ? 0xff : 0;
+			masks[phase][1][j] = (channel == 0) ? 0xff : 0;
+		}
+	}
+
+	for (; i + 18 <= bytes; i += 16) {
+		int phase = i % channels;
+		__m128i a = _mm_loadu_si128((const __m128i *) (p + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (p + i + 1));
+		__m128i c = _mm_loadu_si128((const __m128i *) (p + i + 2));
+		__m128i ab = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+		__m128i ac = _mm_or_si128(_mm_subs_epu8(a, c), _mm_subs_epu8(c, a));
+
+		ab = _mm_and_si128(ab, _mm_loadu_si128((const __m128i *) masks[phase][0]));
+		ac = _mm_and_si128(ac, _mm_loadu_si128((const __m128i *) masks[phase][1]));
+		max = _mm_max_epu8(max, _mm_max_epu8(ab, ac));
+	}
+
+	_mm_storeu_si128((__m128i *) lanes, max);
+	for (int j = 0; j < 16; j++) {
+		if (lanes[j] > result) result = lanes[j];
+	}
+#endif
+
+	// Whatever is left, starting from the pixel we stopped in
+	for (ImaginePixels x = i / channels; x < width; x++) {
+		const unsigned char * q = p + x * channels;
+		int rg = abs(q[0] - q[1]), gb = abs(q[1] - q[2]), rb = abs(q[0] - q[2]);
+
+		if (rg > result) result = rg;
+		if (gb > result) result = gb;
+		if (rb > result) result = rb;
+	}
+
+	return result;
+}
+
+static int StatsAddRow(const ImagineRow * row, void * context) {
+	StatsAccumulator * acc = (StatsAccumulator *) context;
+	const unsigned char * p = row->data;
+
+	if (acc->rows == 0) {
+		if ((row->components < 1) || (row->components > STATS_CHANNEL_MAX)) return 1;
+
+		acc->channels = row->components;
+		acc->width = row->width;
+	} else if ((row->components != acc->channels) || (row->width != acc->width)) {
+		return 2;
+	}
+
+	for (ImaginePixels x = 0; x < row->width; x++, p += acc->channels) {
+		uint64_t (* lane)[256] = acc->lanes[x % STATS_LANES];
+
+		for (int c = 0; c < acc->channels; c++) {
+			lane[c][p[c]]++;
+		}
+	}
+
+	if (acc->channels >= 3) {
+		int difference = StatsRowChannelDifference(row->data, row->width, acc->channels);
+		if (difference > acc->maxChannelDifference) acc->maxChannelDifference = difference;
+	}
+
+	acc->rows++;
+
+	return 0;
+}
+
+static void StatsFinish(const StatsAccumulator * acc, ImageStats * stats) {
+	uint64_t pixels = (uint64_t) acc->width * acc->rows;
+	bool alpha = (acc->channels == 2) || (acc->channels == 4);
+
+	memset(stats, 0, sizeof(ImageStats));
+	stats->width = acc->width;
+	stats->height = acc->rows;
+	stats->channels = acc->channels;
+	stats->maxChannelDifference = acc->maxChannelDifference;
+	stats->grayscale = acc->maxChannelDifference <= STATS_GRAY_TOLERANCE;
+	stats->alphaCoverage = 1;
+	stats->opaqueFraction = 1;
+
+	for (int c = 0; c < acc->channels; c++) {
+		StatsChannel * channel = &stats->channel[c];
+		uint64_t sum = 0, squares = 0;
+
+		channel->min = -1;
+
+		// Everything else falls out of the merged histogram
+		for (int v = 0; v < 256; v++) {
+			uint64_t n = 0;
+			for (int lane = 0; lane < STATS_LANES; lane++) n += acc->lanes[lane][c][v];
+
+			channel->histogram[v] = n;
+			if (n && (channel->min == -1)) channel->min = v;
+			if (n) channel->max = v;
+
+			sum += n * v;
+			squares += n * v * v;
+		}
+
+		if (pixels) {
+			double mean = (double) sum / pixels;
+			double variance = ((double) squares / pixels) - (mean * mean);
+
+			channel->mean = mean;
+			channel->stddev = variance > 0 ? sqrt(variance) : 0;
+		}
+
+		if (channel->min == -1) channel->min = 0;
+	}
+
+	if (alpha && pixels) {
+		const StatsChannel * channel = &stats->channel[acc->channels - 1];
+		stats->alphaCoverage = channel->mean / 255;
+		stats->opaqueFraction = (double) channel->histogram[255] / pixels;
+	}
+}
+
+int StatsCompute(Image * img, ImageStats * stats) {
+	int result = 0;
+	StatsAccumulator * acc = NULL;
+
+	if (!img || !stats) {
+		return 1;
+	} else if ((acc = (StatsAccumulator *) calloc(1, sizeof(StatsAccumulator))) == NULL) {
+		return 2;
+	}
+
+	if ((result = img->load()) == 0) {
+		result = img->decodeRows(StatsAddRow, acc);
+		img->unload();
+	}
+
+	if (result == 0) {
+		StatsFinish(acc, stats);
+	}
+
+	BFFree(acc);
+
+	return result;
+}
+
+int StatsComputeBuffer(const unsigned char * pixels, ImaginePixels width, ImaginePixels height, int channels, ImageStats * stats) {
+	int result = 0;
+	StatsAccumulator * acc = NULL;
+	ImagineRow row;
+
+	if (!pixels || !stats || (width < 1) || (height < 1)) {
+		return 1;
+	} else if ((acc = (StatsAccumulator *) calloc(1, sizeof(StatsAccumulator))) == NULL) {
+		return 2;
+	}
+
+	row.width = width;
+	row.height = height;
+	row.components = channels;
+
+	for (row.y = 0; (result == 0) && (row.y < height); row.y++) {
+		row.data = pixels + row.y * width * channels;
+		result = StatsAddRow(&row, acc);
+	}
+
+	if (result == 0) {
+		StatsFinish(acc, stats);
+	}
+
+	BFFree(acc);
+
+	return result;
+}
+
+static void StatsRecordText(ScanBuffer * b, const char * path, const ImageStats * stats, bool histogram) {
+	bool alpha = (stats->channels == 2) || (stats->channels == 4);
+
+	ScanBufferAppend(b, "Path : ");
+	ScanBufferAppendBytes(b, path, strlen(path));
+	ScanBufferAppend(b, "\nDimensions : %ldx%ld\n", stats->width, stats->height);
+
+	for (int c = 0; c < stats->channels; c++) {
+		const StatsChannel * channel = &stats->channel[c];
+		ScanBufferAppend(b, "%s : min %d, max %d, mean %.2f, stddev %.2f\n",
+			StatsChannelName(stats->channels, c), channel->min, channel->max, channel->mean, channel->stddev);
+	}
+
+	ScanBufferAppend(b, "Grayscale : %s", stats->grayscale ? "yes" : "no");
+	if (stats->channels >= 3) {
+		ScanBufferAppend(b, " (channels differ by up to %d)", stats->maxChannelDifference);
+	}
+	ScanBufferAppend(b, "\n");
+
+	if (alpha) {
+		ScanBufferAppend(b, "Alpha coverage : %.1f%%\n", stats->alphaCoverage * 100);
+		ScanBufferAppend(b, "Opaque pixels : %.1f%%\n", stats->opaqueFraction * 100);
+	}
+
+	for (int c = 0; histogram && (c < stats->channels); c++) {
+		ScanBufferAppend(b, "%s histogram :", StatsChannelName(stats->channels, c));
+		for (int v = 0; v < 256; v++) {
+			ScanBufferAppend(b, " %llu", (unsigned long long) stats->channel[c].histogram[v]);
+		}
+		ScanBufferAppend(b, "\n");
+	}
+
+	// Records are blank line separated
+	ScanBufferAppend(b, "\n");
+}
+
+static void StatsRecordJSON(ScanBuffer * b, const char * path, const ImageStats * stats, bool histogram) {
+	ScanBufferAppend(b, "{\"path\":");
+	ScanBufferAppendJSONString(b, path);
+	ScanBufferAppend(b, ",\"width\":%ld,\"height\":%ld,\"channels\":[", stats->width, stats->height);
+
+	for (int c = 0; c < stats->channels; c++) {
+		const StatsChannel * channel = &stats->channel[c];
+
+		ScanBufferAppend(b, "%s{\"name\":\"%s\",\"min\":%d,\"max\":%d,\"mean\":%.4f,\"stddev\":%.4f",
+			c ? "," : "", StatsChannelName(stats->channels, c), channel->min, channel->max, channel->mean, channel->stddev);
+
+		if (histogram) {
+			ScanBufferAppend(b, ",\"histogram\":[");
+			for (int v = 0; v < 256; v++) {
+				ScanBufferAppend(b, "%s%llu", v ? "," : "", (unsigned long long) channel->histogram[v]);
+			}
+			ScanBufferAppend(b, "]");
+		}
+
+		ScanBufferAppend(b, "}");
+	}
+
+	ScanBufferAppend(b, "],\"grayscale\":%s,\"maxChannelDifference\":%d,\"alphaCoverage\":%.4f,\"opaqueFraction\":%.4f}\n",
+		stats->grayscale ? "true" : "false", stats->maxChannelDifference, stats->alphaCoverage, stats->opaqueFraction);
+}
+
+int StatsRecordCreate(const char * path, const ImageStats * stats, bool json, bool histogram, char ** record) {
+	ScanBuffer b = {0};
+
+	if (!path || !stats || !record) {
+		return 1;
+	} else if (json) {
+		StatsRecordJSON(&b, path, stats, histogram);
+	} else {
+		StatsRecordText(&b, path, stats, histogram);
+	}
+
+	if (b.error) {
+		BFFree(b.buf);
+		return b.error;
+	}
+
+	*record = b.buf;
+
+	return 0;
+}
+
@@ -0,0 +1,83 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include "image.hpp"
+
+extern "C" {
+#include <stdint.h>
+}
+
+/// Most channels a decoded row can have (RGBA)
+#define STATS_CHANNEL_MAX 4
+
+/// Pixels whose color channels are at most this far apart count as gray
+#define STATS_GRAY_TOLERANCE 3
+
+typedef struct {
+	uint64_t histogram[256];
+	int min;
+	int max;
+	double mean;
+	double stddev;
+} StatsChannel;
+
+/**
+ * What StatsCompute() found out about an image's pixels
+ *
+ * Channels are in the order the decoder hands them out: gray, gray and
+ * alpha, RGB or RGBA
+ */
+typedef struct {
+	ImaginePixels width;
+	ImaginePixels height;
+	int channels;
+	StatsChannel channel[STATS_CHANNEL_MAX];
+
+	/// Largest difference between two color channels of any pixel.
+	/// 0 for gray images
+	int maxChannelDifference;
+
+	/// Every pixel is within STATS_GRAY_TOLERANCE of gray
+	bool grayscale;
+
+	/// Mean alpha as a fraction, 1 for images without alpha
+	double alphaCoverage;
+
+	/// Share of pixels that are fully opaque
+	double opaqueFraction;
+} ImageStats;
+
+/**
+ * Name of channel `index` of an image with `channels` channels
+ */
+const char * StatsChannelName(int channels, int index);
+
+/**
+ * Decodes `img` at full resolution and fills `stats`
+ *
+ * `img` must not be loaded yet and is unloaded before returning
+ */
+int StatsCompute(Image * img, ImageStats * stats);
+
+/**
+ * Same as StatsCompute() for pixels in memory, rows `width * channels`
+ * bytes apart
+ */
+int StatsComputeBuffer(const unsigned char * pixels, ImaginePixels width, ImaginePixels height, int channels, ImageStats * stats);
+
+/**
+ * Formats a newline terminated record for `path`
+ *
+ * `json` picks a single JSON object over `Key : value` lines. The
+ * histograms are only included if `histogram` is set. The caller frees
+ * `record` with free()
+ */
+int StatsRecordCreate(const char * path, const ImageStats * stats, bool json, bool histogram, char ** record);
+
+#endif // STATS_HPP
+
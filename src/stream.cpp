@@ -0,0 +1,265 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "stream.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+}
+
+/**
+ * What we know about standard input. It can only be read once, so the
+ * bytes peeked at for the format are kept and read again from here
+ */
+static struct {
+	unsigned char peek[STREAM_PEEK_SIZE];
+	size_t length;
+
+	/// How much of `peek` StreamOpenInput()'s stream handed out
+	size_t replayed;
+
+	bool peeked;
+	bool seekable;
+	bool opened;
+} STREAM_STDIN;
+
+bool StreamIsStdio(const char * path) {
+	return path && !strcmp(path, STREAM_STDIO_PATH);
+}
+
+/**
+ * Reads the first bytes of standard input. When it is a file that
+ * starts at its beginning nothing is used up, everything else is
+ * seen as a pipe
+ */
+static int StreamPeekStdin() {
+	ssize_t n = 0;
+
+	if (STREAM_STDIN.peeked) return 0;
+
+	STREAM_STDIN.peeked = true;
+	STREAM_STDIN.seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) == 0;
+
+	if (STREAM_STDIN.seekable) {
+		if ((n = pread(STDIN_FILENO, STREAM_STDIN.peek, STREAM_PEEK_SIZE, 0)) < 0) return 1;
+		STREAM_STDIN.length = n;
+		return 0;
+	}
+
+	// Pipes hand out whatever has been written so far
+	while (STREAM_STDIN.length < STREAM_PEEK_SIZE) {
+		n = read(STDIN_FILENO, STREAM_STDIN.peek + STREAM_STDIN.length, STREAM_PEEK_SIZE - STREAM_STDIN.length);
+
+		if ((n < 0) && (errno == EINTR)) continue;
+		else if (n < 0) return 1;
+		else if (n == 0) break;
+
+		STREAM_STDIN.length += n;
+	}
+
+	return 0;
+}
+
+bool StreamIsSeekable(const char * path) {
+	if (!StreamIsStdio(path)) return true;
+	else if (StreamPeekStdin()) return false;
+	return STREAM_STDIN.seekable;
+}
+
+int StreamPeek(const char * path, unsigned char * buffer, size_t size, size_t * length) {
+	int result = 0;
+	int fd = -1;
+	ssize_t n = 0;
+
+	if (!path || !buffer || !length) {
+		result = 1;
+	} else if (StreamIsStdio(path)) {
+		if ((result = StreamPeekStdin()) == 0) {
+			*length = size < STREAM_STDIN.length ? size : STREAM_STDIN.length;
+			memcpy(buffer, STREAM_STDIN.peek, *length);
+		}
+	} else if ((fd = open(path, O_RDONLY)) == -1) {
+		result = 2;
+	} else if ((n = read(fd, buffer, size)) < 0) {
+		result = 3;
+	} else {
+		*length = n;
+	}
+
+	if (fd != -1) close(fd);
+
+	return result;
+}
+
+ImageType StreamTypeForSignature(const unsigned char * buffer, size_t length) {
+	const unsigned char png[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+	if ((length >= 8) && !memcmp(buffer, png, 8)) {
+		return kImageTypePNG;
+	} else if ((length >= 3) && (buffer[0] == 0xFF) && (buffer[1] == 0xD8) && (buffer[2] == 0xFF)) {
+		return kImageTypeJPEG;
+	} else if ((length >= 6) && (!memcmp(buffer, "GIF87a", 6) || !memcmp(buffer, "GIF89a", 6))) {
+		return kImageTypeGIF;
+	} else if ((length >= 4) && (!memcmp(buffer, "II*\0", 4) || !memcmp(buffer, "MM\0*", 4)
+		|| !memcmp(buffer, "II+\0", 4) || !memcmp(buffer, "MM\0+", 4))) {
+		return kImageTypeTIFF;
+	} else {
+		return kImageTypeUnknown;
+	}
+}
+
+/**
+ * Hands out the peeked bytes before reading any further
+ */
+static ssize_t StreamStdinRead(void * cookie, char * buffer, size_t size) {
+	size_t n = 0;
+	ssize_t r = 0;
+
+	if (STREAM_STDIN.replayed < STREAM_STDIN.length) {
+		n = STREAM_STDIN.length - STREAM_STDIN.replayed;
+		if (n > size) n = size;
+
+		memcpy(buffer, STREAM_STDIN.peek + STREAM_STDIN.replayed, n);
+		STREAM_STDIN.replayed += n;
+
+		return n;
+	}
+
+	while (((r = read(STDIN_FILENO, buffer, size)) < 0) && (errno == EINTR));
+
+	return r;
+}
+
+FILE * StreamOpenInput(const char * path) {
+	cookie_io_functions_t functions;
+	int fd = -1;
+	FILE * file = NULL;
+
+	if (!StreamIsStdio(path)) {
+		return fopen(path, "rb");
+	} else if (STREAM_STDIN.opened) {
+		BFErrorPrint("Standard input can only be read once");
+		return NULL;
+	} else if (StreamPeekStdin()) {
+		BFErrorPrint("Could not read standard input");
+		return NULL;
+	}
+
+	STREAM_STDIN.opened = true;
+
+	// Nothing was used up so the file can be read as is
+	if (STREAM_STDIN.seekable) {
+		if ((fd = dup(STDIN_FILENO)) == -1) {
+			return NULL;
+		} else if ((file = fdopen(fd, "rb")) == NULL) {
+			close(fd);
+		}
+
+		return file;
+	}
+
+	memset(&functions, 0, sizeof(functions));
+	functions.read = StreamStdinRead;
+
+	return fopencookie(NULL, "rb", functions);
+}
+
+FILE * StreamOpenOutput(const char * path) {
+	int fd = -1;
+	FILE * file = NULL;
+
+	if (!StreamIsStdio(path)) {
+		return fopen(path, "wb");
+	}
+
+	// Our own descriptor so fclose() leaves standard output open
+	fflush(stdout);
+	if ((fd = dup(STDOUT_FILENO)) == -1) {
+		return NULL;
+	} else if ((file = fdopen(fd, "wb")) == NULL) {
+		close(fd);
+	}
+
+	return file;
+}
+
+FILE * StreamOpenMemoryInput(const void * data, size_t size) {
+	// Nothing of ours is written with "rb"
+	if (!data || (size == 0)) return NULL;
+	return fmemopen((void *) data, size, "rb");
+}
+
+FILE * StreamOpenMemoryOutput(char ** data, size_t * size) {
+	if (!data || !size) return NULL;
+	return open_memstream(data, size);
+}
+
+int StreamSkip(FILE * file, long size) {
+	char buffer[4096];
+
+	if (size <= 0) {
+		return size < 0 ? 1 : 0;
+	} else if (fseek(file, size, SEEK_CUR) == 0) {
+		return 0;
+	}
+
+	while (size > 0) {
+		size_t n = size < (long) sizeof(buffer) ? size : sizeof(buffer);
+
+		if (fread(buffer, 1, n, file) != n) return 2;
+		size -= n;
+	}
+
+	return 0;
+}
+
+int StreamReadAll(FILE * file, MemoryAccount * account, unsigned char ** data, size_t * size) {
+	int result = 0;
+	unsigned char * buffer = NULL;
+	size_t capacity = 0, length = 0;
+
+	// Doubles as it fills, so every byte is copied at most about once
+	while (result == 0) {
+		size_t n = 0;
+
+		if (length == capacity) {
+			unsigned char * larger = NULL;
+			size_t grown = capacity ? capacity * 2 : 64 * 1024;
+
+			if ((larger = (unsigned char *) MemoryAllocate(account, grown)) == NULL) {
+				result = 1;
+				break;
+			}
+
+			if (buffer) memcpy(larger, buffer, length);
+			MemoryFree(account, buffer);
+			buffer = larger;
+			capacity = grown;
+		}
+
+		if ((n = fread(buffer + length, 1, capacity - length, file)) == 0) {
+			if (ferror(file)) result = 2;
+			break;
+		}
+
+		length += n;
+	}
+
+	if (result == 0) {
+		*data = buffer;
+		*size = length;
+	} else {
+		MemoryFree(account, buffer);
+	}
+
+	return result;
+}
+
@@ -0,0 +1,85 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
+#include "imagetypes.h"
+#include "memory.hpp"
+
+extern "C" {
+#include <stdio.h>
+#include <stddef.h>
+}
+
+/// Input path for standard input, and output path for standard output
+#define STREAM_STDIO_PATH "-"
+
+/// Enough of the start of a file to tell every format we read apart
+#define STREAM_PEEK_SIZE 16
+
+/**
+ * Whether `path` means standard input or output
+ */
+bool StreamIsStdio(const char * path);
+
+/**
+ * Whether the decoders can seek around `path`. Files can, pipes and
+ * terminals on standard input cannot
+ */
+bool StreamIsSeekable(const char * path);
+
+/**
+ * Reads up to `size` bytes from the start of `path` into `buffer`
+ * without using them up. `length` gets how many there were
+ *
+ * Standard input is only read once. The bytes are kept and handed out
+ * again in front of the rest by StreamOpenInput()
+ */
+int StreamPeek(const char * path, unsigned char * buffer, size_t size, size_t * length);
+
+/**
+ * The format the first bytes of a file belong to, or kImageTypeUnknown
+ */
+ImageType StreamTypeForSignature(const unsigned char * buffer, size_t length);
+
+/**
+ * Opens `path` for reading like fopen(). STREAM_STDIO_PATH gives
+ * standard input, which can only be opened once. Close with fclose()
+ */
+FILE * StreamOpenInput(const char * path);
+
+/**
+ * Opens `path` for writing like fopen(). STREAM_STDIO_PATH gives
+ * standard output, which stays open after fclose()
+ */
+FILE * StreamOpenOutput(const char * path);
+
+/**
+ * Reads the `size` bytes at `data`, which have to stay put until the
+ * stream is closed. Close with fclose()
+ */
+FILE * StreamOpenMemoryInput(const void * data, size_t size);
+
+/**
+ * Writes to memory. `data` and `size` are brought up to date by
+ * fflush() and fclose(). `data` comes from malloc() and is the caller's
+ * to free, even when nothing was written
+ */
+FILE * StreamOpenMemoryOutput(char ** data, size_t * size);
+
+/**
+ * Moves `size` bytes forward. Streams that cannot seek are read
+ */
+int StreamSkip(FILE * file, long size);
+
+/**
+ * Reads the rest of `file` into one buffer charged to `account`. Free
+ * it with MemoryFree()
+ */
+int StreamReadAll(FILE * file, MemoryAccount * account, unsigned char ** data, size_t * size);
+
+#endif // STREAM_HPP
+
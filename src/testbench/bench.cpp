@@ -0,0 +1,811 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ *
+ * Generates a corpus of synthetic images and times what imagine does with
+ * them. Results are printed as JSON, one case per line, and can be
+ * compared against a saved run with --baseline
+ */
+
+#include <image.hpp>
+#include <bflibcpp/bflibcpp.hpp>
+#include <algorithm>
+
+extern "C" {
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <png.h>
+#include <jpeglib.h>
+#include <tiffio.h>
+}
+
+using namespace BF;
+
+/// Slowdowns smaller than this are noise no matter the percentage
+#define BENCH_NOISE_MS 0.5
+
+/// Names and values that can be in a baseline
+#define BENCH_NAME_SIZE 128
+#define BENCH_MAX_CASES 1024
+
+/**
+ * One kind of file in the corpus
+ */
+typedef struct {
+	const char * name;
+	ImageType type;
+
+	/// Samples per pixel (1 for palettes) and bits per sample
+	int channels;
+	int bitDepth;
+	bool palette;
+
+	/// Interlaced PNG, progressive JPEG or tiled TIFF
+	bool layout;
+
+	/// GIF frames or TIFF pages
+	int frames;
+
+	/// What 'convert' converts to. Unknown skips it
+	ImageType convertTo;
+} BenchFormat;
+
+static const BenchFormat BENCH_FORMATS[] = {
+	{"png-gray8", kImageTypePNG, 1, 8, false, false, 1, kImageTypeJPEG},
+	{"png-gray16", kImageTypePNG, 1, 16, false, false, 1, kImageTypeJPEG},
+	{"png-graya8", kImageTypePNG, 2, 8, false, false, 1, kImageTypeJPEG},
+	{"png-rgb8", kImageTypePNG, 3, 8, false, false, 1, kImageTypeJPEG},
+	{"png-rgb16", kImageTypePNG, 3, 16, false, false, 1, kImageTypeJPEG},
+	{"png-rgba8", kImageTypePNG, 4, 8, false, false, 1, kImageTypeJPEG},
+	{"png-palette8", kImageTypePNG, 1, 8, true, false, 1, kImageTypeJPEG},
+	{"png-rgb8-interlaced", kImageTypePNG, 3, 8, false, true, 1, kImageTypeJPEG},
+	{"jpeg-rgb-baseline", kImageTypeJPEG, 3, 8, false, false, 1, kImageTypePNG},
+	{"jpeg-rgb-progressive", kImageTypeJPEG, 3, 8, false, true, 1, kImageTypePNG},
+	{"jpeg-gray-baseline", kImageTypeJPEG, 1, 8, false, false, 1, kImageTypePNG},
+	{"gif-single", kImageTypeGIF, 1, 8, true, false, 1, kImageTypeUnknown},
+	{"gif-animated", kImageTypeGIF, 1, 8, true, false, 4, kImageTypeUnknown},
+	{"tiff-rgb-stripped", kImageTypeTIFF, 3, 8, false, false, 1, kImageTypePNG},
+	{"tiff-rgb-tiled", kImageTypeTIFF, 3, 8, false, true, 1, kImageTypePNG},
+	{"tiff-rgb-pages", kImageTypeTIFF, 3, 8, false, false, 3, kImageTypePNG},
+};
+
+static const struct {
+	ImaginePixels width;
+	ImaginePixels height;
+} BENCH_SIZES[] = {
+	{64, 64},
+	{1024, 768},
+	{4000, 3000},
+	{10000, 10000},
+};
+
+typedef enum {
+	kBenchOperationLoad = 0,
+	kBenchOperationDecode = 1,
+	kBenchOperationDetails = 2,
+	kBenchOperationConvert = 3,
+	kBenchOperationCount,
+} BenchOperation;
+
+static const char * const BENCH_OPERATION_NAMES[kBenchOperationCount] = {
+	"load", "decode", "details", "convert"
+};
+
+/**
+ * Saved p50 of each case from an earlier run
+ */
+typedef struct {
+	char names[BENCH_MAX_CASES][BENCH_NAME_SIZE];
+	double p50[BENCH_MAX_CASES];
+	int count;
+} BenchBaseline;
+
+/**
+ * Sample `c` of pixel x, y on `page`
+ *
+ * Gradients with a little noise so encoders have something realistic
+ * to compress. Always the same for the same arguments
+ */
+static unsigned int BenchSample(ImaginePixels x, ImaginePixels y, int c, ImaginePixels width, ImaginePixels height, int page) {
+	uint32_t n = (uint32_t) x * 73856093U ^ (uint32_t) y * 19349663U ^ (uint32_t) (c + page * 4) * 83492791U;
+	n ^= n >> 13;
+	n *= 0x5bd1e995U;
+	n ^= n >> 15;
+
+	switch (c) {
+		case 0:
+			return ((x * 65535 / width) + (n & 0x3ff)) & 0xffff;
+		case 1:
+			return ((y * 65535 / height) + (n & 0x3ff) + page * 8192) & 0xffff;
+		case 2:
+			return (((x + y) * 65535 / (width + height)) + (n & 0x3ff)) & 0xffff;
+		default:
+			// Alpha from clear on the left to opaque on the right
+			return x * 65535 / width;
+	}
+}
+
+/**
+ * Fills a row of `format` samples, high byte first for 16 bit ones
+ */
+static void BenchFillRow(const BenchFormat * format, unsigned char * row, ImaginePixels y, ImaginePixels width, ImaginePixels height, int page) {
+	const int bytes = format->bitDepth / 8;
+
+	for (ImaginePixels x = 0; x < width; x++) {
+		for (int c = 0; c < format->channels; c++) {
+			// Gray takes the first color channel and its alpha the last
+			int channel = ((format->channels == 2) && (c == 1)) ? 3 : c;
+			unsigned int v = BenchSample(x, y, channel, width, height, page);
+			unsigned char * p = row + (x * format->channels + c) * bytes;
+
+			if (format->palette) {
+				p[0] = (v >> 8) ^ (BenchSample(x, y, 1, width, height, page) >> 13);
+			} else if (bytes == 2) {
+				p[0] = v >> 8;
+				p[1] = v;
+			} else {
+				p[0] = v >> 8;
+			}
+		}
+	}
+}
+
+/**
+ * Color of each palette index
+ */
+static void BenchPaletteColor(int index, unsigned char * rgb) {
+	rgb[0] = (index & 0x07) * 36;
+	rgb[1] = ((index >> 3) & 0x07) * 36;
+	rgb[2] = (index >> 6) * 85;
+}
+
+static int BenchWritePNG(const BenchFormat * format, const char * path, ImaginePixels width, ImaginePixels height) {
+	int result = 0;
+	FILE * file = NULL;
+	png_structp png = NULL;
+	png_infop info = NULL;
+	unsigned char * row = (unsigned char *) malloc(width * format->channels * 2);
+	int colorType = PNG_COLOR_TYPE_GRAY;
+	png_color plte[256];
+
+	switch (format->channels) {
+		case 2: colorType = PNG_COLOR_TYPE_GRAY_ALPHA; break;
+		case 3: colorType = PNG_COLOR_TYPE_RGB; break;
+		case 4: colorType = PNG_COLOR_TYPE_RGB_ALPHA; break;
+		default: colorType = format->palette ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_GRAY; break;
+	}
+
+	if (!row) {
+		result = 1;
+	} else if ((file = fopen(path, "wb")) == NULL) {
+		result = 2;
+	} else if ((png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL)) == NULL) {
+		result = 3;
+	} else if ((info = png_create_info_struct(png)) == NULL) {
+		result = 3;
+	} else if (setjmp(png_jmpbuf(png))) {
+		result = 4;
+	} else {
+		png_init_io(png, file);
+		png_set_IHDR(png, info, width, height, format->bitDepth, colorType,
+			format->layout ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+			PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+		if (format->palette) {
+			for (int i = 0; i < 256; i++) BenchPaletteColor(i, &plte[i].red);
+			png_set_PLTE(png, info, plte, 256);
+		}
+
+		png_write_info(png, info);
+
+		// Each Adam7 pass takes every row again and picks its pixels out
+		for (int pass = format->layout ? png_set_interlace_handling(png) : 1; pass > 0; pass--) {
+			for (ImaginePixels y = 0; y < height; y++) {
+				BenchFillRow(format, row, y, width, height, 0);
+				png_write_row(png, row);
+			}
+		}
+
+		png_write_end(png, NULL);
+	}
+
+	if (png) png_destroy_write_struct(&png, &info);
+	if (file) fclose(file);
+	BFFree(row);
+
+	return result;
+}
+
+static int BenchWriteJPEG(const BenchFormat * format, const char * path, ImaginePixels width, ImaginePixels height) {
+	int result = 0;
+	FILE * file = NULL;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned char * row = (unsigned char *) malloc(width * format->channels);
+
+	if (!row) {
+		result = 1;
+	} else if ((file = fopen(path, "wb")) == NULL) {
+		result = 2;
+	} else {
+		cinfo.err = jpeg_std_error(&jerr);
+		jpeg_create_compress(&cinfo);
+		jpeg_stdio_dest(&cinfo, file);
+
+		cinfo.image_width = width;
+		cinfo.image_height = height;
+		cinfo.input_components = format->channels;
+		cinfo.in_color_space = format->channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_quality(&cinfo, 90, TRUE);
+		if (format->layout) jpeg_simple_progression(&cinfo);
+
+		jpeg_start_compress(&cinfo, TRUE);
+		for (ImaginePixels y = 0; y < height; y++) {
+			JSAMPROW rows[1] = {row};
+			BenchFillRow(format, row, y, width, height, 0);
+			jpeg_write_scanlines(&cinfo, rows, 1);
+		}
+
+		jpeg_finish_compress(&cinfo);
+		jpeg_destroy_compress(&cinfo);
+	}
+
+	if (file) fclose(file);
+	BFFree(row);
+
+	return result;
+}
+
+/**
+ * Writes GIF image data without compressing it
+ *
+ * Every index goes out as its own 9 bit code, with a clear code often
+ * enough that decoders never widen the codes. Big files, but valid and
+ * quick to make
+ */
+static void BenchWriteGIFData(FILE * file, const BenchFormat * format, unsigned char * row, ImaginePixels width, ImaginePixels height, int frame) {
+	unsigned char block[256];
+	uint32_t bits = 0;
+	int bitCount = 0, literals = 0;
+	size_t blockSize = 0;
+
+	auto flush = [&](void) {
+		block[0] = blockSize;
+		fwrite(block, 1, blockSize + 1, file);
+		blockSize = 0;
+	};
+
+	auto put = [&](unsigned int code) {
+		bits |= code << bitCount;
+		bitCount += 9;
+
+		while (bitCount >= 8) {
+			block[1 + blockSize++] = bits;
+			bits >>= 8;
+			bitCount -= 8;
+
+			if (blockSize == 255) flush();
+		}
+	};
+
+	fputc(8, file);
+	put(256);
+
+	for (ImaginePixels y = 0; y < height; y++) {
+		BenchFillRow(format, row, y, width, height, frame);
+
+		for (ImaginePixels x = 0; x < width; x++) {
+			if (literals == 254) {
+				put(256);
+				literals = 0;
+			}
+
+			put(row[x]);
+			literals++;
+		}
+	}
+
+	put(257);
+
+	if (bitCount > 0) {
+		block[1 + blockSize++] = bits;
+		if (blockSize == 255) flush();
+	}
+
+	if (blockSize > 0) flush();
+
+	fputc(0, file);
+}
+
+static int BenchWriteGIF(const BenchFormat * format, const char * path, ImaginePixels width, ImaginePixels height) {
+	FILE * file = NULL;
+	unsigned char * row = (unsigned char *) malloc(width);
+	unsigned char rgb[3];
+
+	if (!row) {
+		return 1;
+	} else if ((width > 0xffff) || (height > 0xffff)) {
+		BFFree(row);
+		return 2;
+	} else if ((file = fopen(path, "wb")) == NULL) {
+		BFFree(row);
+		return 3;
+	}
+
+	// Header, logical screen with a 256 color global table
+	fwrite("GIF89a", 1, 6, file);
+	fputc(width & 0xff, file); fputc(width >> 8, file);
+	fputc(height & 0xff, file); fputc(height >> 8, file);
+	fputc(0xf7, file); fputc(0, file); fputc(0, file);
+
+	for (int i = 0; i < 256; i++) {
+		BenchPaletteColor(i, rgb);
+		fwrite(rgb, 1, 3, file);
+	}
+
+	if (format->frames > 1) {
+		const unsigned char loop[] = {0x21, 0xff, 0x0b, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00};
+		fwrite(loop, 1, sizeof(loop), file);
+	}
+
+	for (int frame = 0; frame < format->frames; frame++) {
+		// 100 ms per frame, then a full frame image descriptor
+		const unsigned char control[] = {0x21, 0xf9, 0x04, 0x00, 0x0a, 0x00, 0x00, 0x00};
+		fwrite(control, 1, sizeof(control), file);
+
+		fputc(0x2c, file);
+		fputc(0, file); fputc(0, file); fputc(0, file); fputc(0, file);
+		fputc(width & 0xff, file); fputc(width >> 8, file);
+		fputc(height & 0xff, file); fputc(height >> 8, file);
+		fputc(0, file);
+
+		BenchWriteGIFData(file, format, row, width, height, frame);
+	}
+
+	fputc(0x3b, file);
+	fclose(file);
+	BFFree(row);
+
+	return 0;
+}
+
+static int BenchWriteTIFF(const BenchFormat * format, const char * path, ImaginePixels width, ImaginePixels height) {
+	int result = 0;
+	TIFF * tif = NULL;
+	const uint32_t tileSize = 256;
+	const size_t rowBytes = (format->layout ? ((width + tileSize - 1) / tileSize) * tileSize : width) * format->channels;
+	unsigned char * row = (unsigned char *) calloc(rowBytes, 1);
+	unsigned char * tile = format->layout ? (unsigned char *) calloc(tileSize * tileSize, format->channels) : NULL;
+
+	if (!row || (format->layout && !tile)) {
+		result = 1;
+	} else if ((tif = TIFFOpen(path, "w")) == NULL) {
+		result = 2;
+	}
+
+	for (int page = 0; (result == 0) && (page < format->frames); page++) {
+		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, (uint32_t) width);
+		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, (uint32_t) height);
+		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, format->channels);
+		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, format->channels >= 3 ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
+		TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+
+		if (format->frames > 1) {
+			TIFFSetField(tif, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+			TIFFSetField(tif, TIFFTAG_PAGENUMBER, page, format->frames);
+		}
+
+		if (format->layout) {
+			// Tiles are read out of whole rows, padded to the tile size
+			TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+			TIFFSetField(tif, TIFFTAG_TILEWIDTH, tileSize);
+			TIFFSetField(tif, TIFFTAG_TILELENGTH, tileSize);
+
+			for (ImaginePixels ty = 0; (result == 0) && (ty < height); ty += tileSize) {
+				unsigned char * band = (unsigned char *) calloc(tileSize, rowBytes);
+
+				if (!band) {
+					result = 1;
+					break;
+				}
+
+				for (ImaginePixels y = ty; (y < ty + tileSize) && (y < height); y++) {
+					BenchFillRow(format, band + (y - ty) * rowBytes, y, width, height, page);
+				}
+
+				for (ImaginePixels tx = 0; (result == 0) && (tx < width); tx += tileSize) {
+					for (uint32_t y = 0; y < tileSize; y++) {
+						memcpy(tile + y * tileSize * format->channels, band + y * rowBytes + tx * format->channels, tileSize * format->channels);
+					}
+
+					if (TIFFWriteTile(tif, tile, tx, ty, 0, 0) < 0) result = 3;
+				}
+
+				BFFree(band);
+			}
+		} else {
+			TIFFSetField(tif, TIFFTAG_COMPRESSION, format->frames > 1 ? COMPRESSION_NONE : COMPRESSION_LZW);
+			TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, 16);
+
+			for (ImaginePixels y = 0; (result == 0) && (y < height); y++) {
+				BenchFillRow(format, row, y, width, height, page);
+				if (TIFFWriteScanline(tif, row, y, 0) < 0) result = 3;
+			}
+		}
+
+		if ((result == 0) && !TIFFWriteDirectory(tif)) {
+			result = 4;
+		}
+	}
+
+	if (tif) TIFFClose(tif);
+	BFFree(row);
+	BFFree(tile);
+
+	return result;
+}
+
+static const char * BenchExtension(ImageType type) {
+	switch (type) {
+		case kImageTypePNG: return "png";
+		case kImageTypeJPEG: return "jpg";
+		case kImageTypeGIF: return "gif";
+		default: return "tif";
+	}
+}
+
+/**
+ * Writes the corpus file for `format` at a size unless it is already there
+ */
+static int BenchCorpusFile(const BenchFormat * format, const char * corpus, ImaginePixels width, ImaginePixels height, char * path, size_t size) {
+	struct stat st;
+
+	snprintf(path, size, "%s/%s-%ldx%ld.%s", corpus, format->name, width, height, BenchExtension(format->type));
+
+	if (!stat(path, &st) && (st.st_size > 0)) {
+		return 0;
+	}
+
+	fprintf(stderr, "Generating %s\n", path);
+
+	switch (format->type) {
+		case kImageTypePNG: return BenchWritePNG(format, path, width, height);
+		case kImageTypeJPEG: return BenchWriteJPEG(format, path, width, height);
+		case kImageTypeGIF: return BenchWriteGIF(format, path, width, height);
+		default: return BenchWriteTIFF(format, path, width, height);
+	}
+}
+
+static int BenchCountRow(const ImagineRow * row, void * context) {
+	(*(ImaginePixels *) context)++;
+	return 0;
+}
+
+/**
+ * Does `operation` on the image at `path` once
+ */
+static int BenchOperationRun(BenchOperation operation, const BenchFormat * format, const char * path, const char * output) {
+	int result = 0;
+	Image * img = Image::createImage(path, &result);
+	Dictionary<String, String> metadata;
+	ImaginePixels rows = 0;
+
+	if (result || !img) {
+		result = result ? result : 1;
+	} else if (operation == kBenchOperationLoad) {
+		if ((result = img->load()) == 0) result = img->unload();
+	} else if (operation == kBenchOperationDecode) {
+		if ((result = img->load()) == 0) {
+			result = img->decodeRows(BenchCountRow, &rows);
+			img->unload();
+		}
+	} else if (operation == kBenchOperationDetails) {
+		if ((result = img->probe()) == 0) result = img->compileMetadata(&metadata);
+	} else if (format->convertTo == kImageTypeUnknown) {
+		result = 2;
+	} else {
+		result = img->convert(format->convertTo, output, NULL);
+	}
+
+	if (img) delete img;
+
+	return result;
+}
+
+static double BenchNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Times `iterations` runs of an operation in a child process, so the
+ * child's peak resident size belongs to this case alone
+ *
+ * Returns non zero if the operation is not supported for the file, and
+ * sets `crash` to the signal if it crashed
+ */
+static int BenchTime(BenchOperation operation, const BenchFormat * format, const char * path, const char * output, int iterations, bool verbose, double * latencies, long * peakKB, int * crash) {
+	int result = 0;
+	int fds[2];
+	pid_t pid = 0;
+	int status = 0;
+	struct rusage usage;
+	size_t got = 0;
+
+	if (pipe(fds)) {
+		return 1;
+	} else if ((pid = fork()) < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return 1;
+	} else if (pid == 0) {
+		close(fds[0]);
+
+		// Unsupported operations say so on every try
+		if (!verbose) {
+			int null = open("/dev/null", O_WRONLY);
+			if (null >= 0) dup2(null, STDERR_FILENO);
+		}
+
+		// One untimed run warms the page cache and checks the operation works
+		if (BenchOperationRun(operation, format, path, output)) {
+			_exit(2);
+		}
+
+		for (int i = 0; i < iterations; i++) {
+			double start = BenchNow();
+			int error = BenchOperationRun(operation, format, path, output);
+			double elapsed = BenchNow() - start;
+
+			if (error || (write(fds[1], &elapsed, sizeof(elapsed)) != sizeof(elapsed))) {
+				_exit(3);
+			}
+		}
+
+		_exit(0);
+	}
+
+	close(fds[1]);
+	while (got < iterations * sizeof(double)) {
+		ssize_t n = read(fds[0], (char *) latencies + got, iterations * sizeof(double) - got);
+		if (n <= 0) break;
+		got += n;
+	}
+	close(fds[0]);
+
+	if (wait4(pid, &status, 0, &usage) < 0) {
+		result = 1;
+	} else if (WIFSIGNALED(status)) {
+		*crash = WTERMSIG(status);
+		result = 3;
+	} else if (!WIFEXITED(status) || WEXITSTATUS(status) || (got != iterations * sizeof(double))) {
+		result = 2;
+	} else {
+		*peakKB = usage.ru_maxrss;
+	}
+
+	return result;
+}
+
+/**
+ * Nearest rank percentile of sorted values
+ */
+static double BenchPercentile(const double * sorted, int count, double percent) {
+	int rank = (int) ceil(percent / 100 * count);
+	return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+/**
+ * Reads the cases of an earlier run's output
+ */
+static int BenchBaselineLoad(const char * path, BenchBaseline * baseline) {
+	FILE * file = fopen(path, "r");
+	char line[1024];
+
+	if (!file) {
+		BFErrorPrint("Could not open baseline %s", path);
+		return 1;
+	}
+
+	baseline->count = 0;
+	while (fgets(line, sizeof(line), file) && (baseline->count < BENCH_MAX_CASES)) {
+		const char * name = strstr(line, "\"name\": \"");
+		const char * p50 = strstr(line, "\"p50_ms\": ");
+		const char * end = name ? strchr(name + 9, '"') : NULL;
+
+		if (name && p50 && end && (end - name - 9 < BENCH_NAME_SIZE)) {
+			int i = baseline->count++;
+			memcpy(baseline->names[i], name + 9, end - name - 9);
+			baseline->names[i][end - name - 9] = '\0';
+			baseline->p50[i] = atof(p50 + 10);
+		}
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+static double BenchBaselineLookup(const BenchBaseline * baseline, const char * name) {
+	for (int i = 0; baseline && (i < baseline->count); i++) {
+		if (!strcmp(baseline->names[i], name)) return baseline->p50[i];
+	}
+
+	return -1;
+}
+
+static void BenchUsage(const char * name) {
+	printf("usage: %s [ --corpus <dir> ] [ --iterations <n> ] [ --max-megapixels <n> ] [ --filter <text> ]\n", name);
+	printf("\t[ --output <file> ] [ --baseline <file> [ --threshold <percent> ] ] [ --verbose ]\n");
+	printf("\n");
+	printf("\t--corpus <dir>: Where generated images are kept between runs (default bench-corpus)\n");
+	printf("\t--iterations <n>: Timed runs of each case (default 5)\n");
+	printf("\t--max-megapixels <n>: Largest corpus images, up to 100 (default 12)\n");
+	printf("\t--filter <text>: Only runs cases whose name contains <text>\n");
+	printf("\t--output <file>: Writes the JSON results to <file> instead of stdout\n");
+	printf("\t--baseline <file>: Flags cases whose p50 grew by more than --threshold (default 10%%) since <file>\n");
+	printf("\n");
+}
+
+int main(int argc, char * argv[]) {
+	int result = 0;
+	const char * corpus = "bench-corpus";
+	const char * filter = NULL;
+	const char * outputPath = NULL;
+	const char * baselinePath = NULL;
+	int iterations = 5;
+	double maxMegapixels = 12;
+	double threshold = 10;
+	bool verbose = false;
+	BenchBaseline * baseline = NULL;
+	FILE * out = stdout;
+	char output[PATH_MAX];
+	char directory[PATH_MAX];
+	int regressions = 0, cases = 0;
+
+	for (int i = 1; (result == 0) && (i < argc); i++) {
+		const char * value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (!strcmp(argv[i], "--verbose")) {
+			verbose = true;
+		} else if (!value) {
+			BenchUsage(argv[0]);
+			result = 1;
+		} else if (!strcmp(argv[i], "--corpus")) {
+			corpus = argv[++i];
+		} else if (!strcmp(argv[i], "--iterations")) {
+			iterations = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--max-megapixels")) {
+			maxMegapixels = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--filter")) {
+			filter = argv[++i];
+		} else if (!strcmp(argv[i], "--output")) {
+			outputPath = argv[++i];
+		} else if (!strcmp(argv[i], "--baseline")) {
+			baselinePath = argv[++i];
+		} else if (!strcmp(argv[i], "--threshold")) {
+			threshold = atof(argv[++i]);
+		} else {
+			BenchUsage(argv[0]);
+			result = 1;
+		}
+	}
+
+	if ((result == 0) && (iterations < 1)) {
+		BFErrorPrint("Iterations should be at least 1");
+		result = 2;
+	}
+
+	if (result == 0) {
+		snprintf(directory, sizeof(directory), "%s/out", corpus);
+		mkdir(corpus, 0755);
+		mkdir(directory, 0755);
+
+		// Conversions are written here
+		if (!realpath(directory, output)) {
+			BFErrorPrint("Could not create %s", directory);
+			result = 3;
+		}
+	}
+
+	if ((result == 0) && baselinePath) {
+		if ((baseline = (BenchBaseline *) malloc(sizeof(BenchBaseline))) == NULL) {
+			result = 4;
+		} else {
+			result = BenchBaselineLoad(baselinePath, baseline);
+		}
+	}
+
+	if ((result == 0) && outputPath && ((out = fopen(outputPath, "w")) == NULL)) {
+		BFErrorPrint("Could not open %s", outputPath);
+		result = 5;
+	}
+
+	if (result == 0) {
+		fprintf(out, "{\n\"iterations\": %d,\n\"cases\": [\n", iterations);
+	}
+
+	for (size_t s = 0; (result == 0) && (s < sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0])); s++) {
+		const ImaginePixels width = BENCH_SIZES[s].width, height = BENCH_SIZES[s].height;
+
+		if (width * height > maxMegapixels * 1000000) continue;
+
+		for (size_t f = 0; (result == 0) && (f < sizeof(BENCH_FORMATS) / sizeof(BENCH_FORMATS[0])); f++) {
+			const BenchFormat * format = &BENCH_FORMATS[f];
+			char path[PATH_MAX];
+			struct stat st;
+
+			for (int op = 0; (result == 0) && (op < kBenchOperationCount); op++) {
+				char name[BENCH_NAME_SIZE];
+				double latencies[iterations];
+				long peakKB = 0;
+				int crash = 0;
+
+				snprintf(name, sizeof(name), "%s %ldx%ld %s", format->name, width, height, BENCH_OPERATION_NAMES[op]);
+				if (filter && !strstr(name, filter)) continue;
+
+				if ((result = BenchCorpusFile(format, corpus, width, height, path, sizeof(path)))) {
+					BFErrorPrint("Could not generate %s: %d", path, result);
+				} else if (stat(path, &st)) {
+					result = 6;
+				} else if (BenchTime((BenchOperation) op, format, path, output, iterations, verbose, latencies, &peakKB, &crash)) {
+					if (crash) fprintf(stderr, "Skipping %s: crashed with signal %d\n", name, crash);
+					else fprintf(stderr, "Skipping %s: not supported\n", name);
+				} else {
+					double total = 0, base = BenchBaselineLookup(baseline, name);
+					double p50 = 0, p99 = 0;
+
+					std::sort(latencies, latencies + iterations);
+					for (int i = 0; i < iterations; i++) total += latencies[i];
+					p50 = BenchPercentile(latencies, iterations, 50);
+					p99 = BenchPercentile(latencies, iterations, 99);
+
+					fprintf(out, "%s{\"name\": \"%s\", \"format\": \"%s\", \"operation\": \"%s\", \"width\": %ld, \"height\": %ld, \"bytes\": %lld, "
+						"\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"mb_per_s\": %.2f, \"images_per_s\": %.2f, \"peak_rss_kb\": %ld",
+						cases++ ? ",\n" : "", name, format->name, BENCH_OPERATION_NAMES[op], width, height, (long long) st.st_size,
+						p50, p99, st.st_size / 1000.0 / p50, iterations * 1000.0 / total, peakKB);
+
+					if (base >= 0) {
+						bool regressed = (p50 > base * (1 + threshold / 100)) && (p50 - base > BENCH_NOISE_MS);
+
+						fprintf(out, ", \"baseline_p50_ms\": %.3f, \"regression\": %s", base, regressed ? "true" : "false");
+
+						if (regressed) {
+							fprintf(stderr, "Regression %s: %.3f ms -> %.3f ms (+%.0f%%)\n", name, base, p50, (p50 / base - 1) * 100);
+							regressions++;
+						}
+					}
+
+					fprintf(out, "}");
+					fflush(out);
+				}
+			}
+		}
+	}
+
+	if (result == 0) {
+		fprintf(out, "\n]\n}\n");
+
+		if (baseline) {
+			fprintf(stderr, "%d of %d cases regressed by more than %.0f%%\n", regressions, cases, threshold);
+		}
+	}
+
+	if (out && (out != stdout)) fclose(out);
+	BFFree(baseline);
+
+	return result ? result : (regressions ? 1 : 0);
+}
+
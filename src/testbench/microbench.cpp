@@ -0,0 +1,571 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ *
+ * Times the parsing and pixel loops on their own, in memory, so a change
+ * to one of them is not lost in libpng or libjpeg time
+ */
+
+#include <gif.hpp>
+#include <tiff2png.hpp>
+#include <resize.hpp>
+#include <reduce.hpp>
+#include <composite.hpp>
+#include <dither.hpp>
+#include <stats.hpp>
+#include <hash.hpp>
+#include <phash.hpp>
+#include <bflibcpp/bflibcpp.hpp>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MICROBENCH_TSC 1
+#endif
+
+extern "C" {
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+}
+
+/// Pixel kernels work on images this big, about 1 MB of RGBA
+#define MICROBENCH_WIDTH 1024
+#define MICROBENCH_HEIGHT 256
+
+/// 256 color tables read per run
+#define MICROBENCH_COLOR_TABLES 64
+
+/**
+ * Buffers one benchmark works on
+ */
+typedef struct {
+	unsigned char * input;
+	unsigned char * output;
+	size_t inputSize;
+
+	/// Bytes one run goes through, for cycles per byte
+	size_t bytes;
+
+	FILE * stream;
+	DitherPalette palette;
+	ImagineBackground background;
+	Compositor compositor;
+} MicrobenchContext;
+
+typedef struct {
+	const char * name;
+	int (* setup)(MicrobenchContext * ctx);
+
+	/// Returns something that depends on the work so it is not optimized
+	/// away
+	uint64_t (* run)(MicrobenchContext * ctx);
+} Microbench;
+
+/**
+ * Reaches the GIF block readers, which are private
+ */
+class GIFMicrobench {
+public:
+	/// Reads `count` back to back 256 color tables
+	static uint64_t colorTables(FILE * fs, int count) {
+		uint64_t sum = 0;
+
+		rewind(fs);
+		for (int i = 0; i < count; i++) {
+			GIF::ColorTable table;
+
+			memset(&table, 0, sizeof(table));
+			if (GIF::colorTableRead(fs, &table, 256) == 0) {
+				sum += table.red[255] + table.blue[0];
+			}
+
+			BFFree(table.red);
+			BFFree(table.green);
+			BFFree(table.blue);
+		}
+
+		return sum;
+	}
+
+	/// Reads sub blocks one at a time up to the terminator
+	static uint64_t subBlocks(FILE * fs) {
+		uint64_t sum = 0;
+
+		rewind(fs);
+		for (;;) {
+			GIF::DataBlock block;
+
+			if (GIF::readSubBlocks(fs, &block) || (block.size == 0)) break;
+			sum += block.buf[block.size - 1];
+			BFFree(block.buf);
+		}
+
+		return sum;
+	}
+
+	/// Reads the whole sequence into one buffer
+	static uint64_t subBlockSequence(FILE * fs) {
+		GIF::DataBlock sequence;
+		uint64_t sum = 0;
+
+		rewind(fs);
+		if (GIF::readSubBlockSequence(fs, &sequence) == 0) {
+			sum = sequence.size;
+		}
+
+		BFFree(sequence.buf);
+
+		return sum;
+	}
+};
+
+/**
+ * Bytes that look like image data, the same every run
+ */
+static void MicrobenchFill(unsigned char * data, size_t size) {
+	uint32_t n = 0x9e3779b9U;
+
+	for (size_t i = 0; i < size; i++) {
+		n ^= n << 13;
+		n ^= n >> 17;
+		n ^= n << 5;
+		data[i] = ((i / 3) & 0xff) ^ (n & 0x0f);
+	}
+}
+
+static int MicrobenchAllocate(MicrobenchContext * ctx, size_t input, size_t output) {
+	ctx->input = (unsigned char *) malloc(input);
+	ctx->output = (unsigned char *) calloc(output ? output : 1, 1);
+	ctx->inputSize = input;
+	ctx->bytes = input;
+
+	if (!ctx->input || !ctx->output) return 1;
+
+	MicrobenchFill(ctx->input, input);
+
+	return 0;
+}
+
+static int MicrobenchColorTableSetup(MicrobenchContext * ctx) {
+	if (MicrobenchAllocate(ctx, MICROBENCH_COLOR_TABLES * 256 * 3, 0)) return 1;
+	return (ctx->stream = fmemopen(ctx->input, ctx->inputSize, "r")) ? 0 : 2;
+}
+
+static uint64_t MicrobenchColorTableRun(MicrobenchContext * ctx) {
+	return GIFMicrobench::colorTables(ctx->stream, MICROBENCH_COLOR_TABLES);
+}
+
+/**
+ * Full 255 byte sub blocks then a terminator
+ */
+static int MicrobenchSubBlocksSetup(MicrobenchContext * ctx) {
+	const size_t blocks = 4096;
+
+	if (MicrobenchAllocate(ctx, blocks * 256 + 1, 0)) return 1;
+
+	for (size_t i = 0; i < blocks; i++) ctx->input[i * 256] = 255;
+	ctx->input[blocks * 256] = 0;
+
+	return (ctx->stream = fmemopen(ctx->input, ctx->inputSize, "r")) ? 0 : 2;
+}
+
+static uint64_t MicrobenchSubBlocksRun(MicrobenchContext * ctx) {
+	return GIFMicrobench::subBlocks(ctx->stream);
+}
+
+static uint64_t MicrobenchSubBlockSequenceRun(MicrobenchContext * ctx) {
+	return GIFMicrobench::subBlockSequence(ctx->stream);
+}
+
+/**
+ * Unpacks every sample of the input with GET_LINE_SAMPLE into a byte,
+ * the way tiff2png walks a gray line. Samples of 8 bits and up are
+ * always taken a byte at a time
+ */
+static uint64_t MicrobenchGetLine(MicrobenchContext * ctx, ush bps) {
+	uch * p_line = ctx->input;
+	uch * p_png = ctx->output;
+	uch sample = 0;
+	int bitsleft = 8;
+	const int maxval = bps >= 8 ? 255 : (1 << bps) - 1;
+	const int invert = 0;
+	const size_t samples = bps >= 8 ? ctx->inputSize : ctx->inputSize * 8 / bps;
+
+	for (size_t i = 0; i < samples; i++) {
+		GET_LINE_SAMPLE
+		*p_png++ = sample;
+	}
+
+	return ctx->output[samples - 1];
+}
+
+static int MicrobenchGetLine1Setup(MicrobenchContext * ctx) {
+	return MicrobenchAllocate(ctx, 128 * 1024, 128 * 1024 * 8);
+}
+
+static uint64_t MicrobenchGetLine1Run(MicrobenchContext * ctx) {
+	return MicrobenchGetLine(ctx, 1);
+}
+
+static int MicrobenchGetLine8Setup(MicrobenchContext * ctx) {
+	return MicrobenchAllocate(ctx, 1024 * 1024, 1024 * 1024);
+}
+
+static uint64_t MicrobenchGetLine8Run(MicrobenchContext * ctx) {
+	return MicrobenchGetLine(ctx, 8);
+}
+
+static uint64_t MicrobenchGetLine4Run(MicrobenchContext * ctx) {
+	return MicrobenchGetLine(ctx, 4);
+}
+
+/**
+ * Packs one byte samples into 4 bits with PUT_LINE_SAMPLE
+ */
+static int MicrobenchPutLine4Setup(MicrobenchContext * ctx) {
+	return MicrobenchAllocate(ctx, 1024 * 1024, 512 * 1024);
+}
+
+static uint64_t MicrobenchPutLine4Run(MicrobenchContext * ctx) {
+	uch * p_line = ctx->output;
+	uch sample = 0;
+	int putbitsleft = 8;
+	const ush bps = 4;
+	const int maxval = 15;
+	const int invert = 0;
+
+	memset(ctx->output, 0, ctx->inputSize / 2);
+	for (size_t i = 0; i < ctx->inputSize; i++) {
+		sample = ctx->input[i];
+		PUT_LINE_SAMPLE
+	}
+
+	return ctx->output[0];
+}
+
+/**
+ * Interleaves one separated 8 bit plane into RGB, the way tiff2png does
+ * with GET_STRIP_SAMPLE and PUT_LINE_SAMPLE
+ */
+static int MicrobenchStripToLineSetup(MicrobenchContext * ctx) {
+	return MicrobenchAllocate(ctx, 1024 * 1024, 3 * 1024 * 1024);
+}
+
+static uint64_t MicrobenchStripToLineRun(MicrobenchContext * ctx) {
+	uch * p_strip = ctx->input;
+	uch * p_line = ctx->output;
+	uch sample = 0;
+	int getbitsleft = 8, putbitsleft = 8;
+	const ush bps = 8, spp = 3;
+	const int maxval = 255;
+	const int invert = 0;
+
+	memset(ctx->output, 0, ctx->inputSize * spp);
+	for (size_t n = 0; n < ctx->inputSize; n++) {
+		GET_STRIP_SAMPLE
+		PUT_LINE_SAMPLE
+		sample = '\0';
+		for (int i = 0; i < spp - 1; i++)
+			PUT_LINE_SAMPLE
+	}
+
+	return ctx->output[3];
+}
+
+static int MicrobenchImageSetup(MicrobenchContext * ctx, int channels) {
+	return MicrobenchAllocate(ctx, MICROBENCH_WIDTH * MICROBENCH_HEIGHT * channels, MICROBENCH_WIDTH * 4);
+}
+
+static int MicrobenchRGBSetup(MicrobenchContext * ctx) {
+	return MicrobenchImageSetup(ctx, 3);
+}
+
+static int MicrobenchRGBASetup(MicrobenchContext * ctx) {
+	return MicrobenchImageSetup(ctx, 4);
+}
+
+static int MicrobenchGraySetup(MicrobenchContext * ctx) {
+	return MicrobenchImageSetup(ctx, 1);
+}
+
+static uint64_t MicrobenchResizeRun(MicrobenchContext * ctx) {
+	int error = 0;
+	uint64_t sum = 0;
+	Resizer resizer(MICROBENCH_WIDTH, MICROBENCH_HEIGHT, MICROBENCH_WIDTH / 4, MICROBENCH_HEIGHT / 4, 3, &error);
+
+	for (int y = 0; (error == 0) && (y < MICROBENCH_HEIGHT); y++) {
+		bool ready = false;
+
+		error = resizer.pushRow(ctx->input + y * MICROBENCH_WIDTH * 3, &ready);
+		if (ready) sum += resizer.outputRow()[0];
+	}
+
+	return sum;
+}
+
+/**
+ * Opaque gray RGBA keeps every check of ReduceAddRow() going to the end
+ */
+static int MicrobenchGrayRGBASetup(MicrobenchContext * ctx) {
+	if (MicrobenchRGBASetup(ctx)) return 1;
+
+	for (size_t i = 0; i < ctx->inputSize; i += 4) {
+		ctx->input[i + 1] = ctx->input[i + 2] = ctx->input[i];
+		ctx->input[i + 3] = 0xff;
+	}
+
+	return 0;
+}
+
+static uint64_t MicrobenchReduceAddRowRun(MicrobenchContext * ctx) {
+	ReduceInfo info;
+
+	ReduceBegin(&info, 4, 8, false);
+	for (int y = 0; y < MICROBENCH_HEIGHT; y++) {
+		ReduceAddRow(&info, ctx->input + y * MICROBENCH_WIDTH * 4, MICROBENCH_WIDTH);
+	}
+
+	return info.gray + info.opaque;
+}
+
+static uint64_t MicrobenchReduceRowRun(MicrobenchContext * ctx) {
+	ReduceInfo info;
+	uint64_t sum = 0;
+
+	ReduceBegin(&info, 4, 8, false);
+	ReduceAddRow(&info, ctx->input, MICROBENCH_WIDTH);
+	ReduceFinish(&info);
+
+	for (int y = 0; y < MICROBENCH_HEIGHT; y++) {
+		ReduceRow(&info, ctx->input + y * MICROBENCH_WIDTH * 4, MICROBENCH_WIDTH, ctx->output);
+		sum += ctx->output[0];
+	}
+
+	return sum;
+}
+
+static int MicrobenchCompositeSetup(MicrobenchContext * ctx) {
+	if (MicrobenchRGBASetup(ctx)) return 1;
+	else if (CompositeParseBackground("checker", &ctx->background)) return 2;
+	else return CompositeBegin(&ctx->compositor, &ctx->background, 4, MICROBENCH_WIDTH);
+}
+
+static uint64_t MicrobenchCompositeRun(MicrobenchContext * ctx) {
+	uint64_t sum = 0;
+
+	for (int y = 0; y < MICROBENCH_HEIGHT; y++) {
+		CompositeRow(&ctx->compositor, ctx->input + y * MICROBENCH_WIDTH * 4, y, ctx->output, 3);
+		sum += ctx->output[0];
+	}
+
+	return sum;
+}
+
+static int MicrobenchDitherSetup(MicrobenchContext * ctx) {
+	if (MicrobenchAllocate(ctx, MICROBENCH_WIDTH * MICROBENCH_HEIGHT * 3, MICROBENCH_WIDTH * MICROBENCH_HEIGHT)) return 1;
+	return DitherPaletteCreate(ctx->input, MICROBENCH_WIDTH, MICROBENCH_HEIGHT, 16, &ctx->palette);
+}
+
+static uint64_t MicrobenchDither(MicrobenchContext * ctx, ImagineDither mode) {
+	DitherImage(ctx->input, MICROBENCH_WIDTH, MICROBENCH_HEIGHT, &ctx->palette, mode, 1, ctx->output);
+	return ctx->output[MICROBENCH_WIDTH * MICROBENCH_HEIGHT - 1];
+}
+
+static uint64_t MicrobenchDitherOrderedRun(MicrobenchContext * ctx) {
+	return MicrobenchDither(ctx, kImagineDitherOrdered);
+}
+
+static uint64_t MicrobenchDitherFSRun(MicrobenchContext * ctx) {
+	return MicrobenchDither(ctx, kImagineDitherFloydSteinberg);
+}
+
+static uint64_t MicrobenchStatsRun(MicrobenchContext * ctx) {
+	ImageStats stats;
+
+	StatsComputeBuffer(ctx->input, MICROBENCH_WIDTH, MICROBENCH_HEIGHT, 3, &stats);
+	return stats.width;
+}
+
+static uint64_t MicrobenchHashRun(MicrobenchContext * ctx) {
+	return HashXXH64(ctx->input, ctx->inputSize, 0);
+}
+
+static uint64_t MicrobenchPerceptualHashRun(MicrobenchContext * ctx) {
+	PerceptualHashes hashes;
+
+	PerceptualHashGray(ctx->input, MICROBENCH_WIDTH, MICROBENCH_HEIGHT, &hashes);
+	return hashes.perceptual;
+}
+
+static const Microbench MICROBENCHES[] = {
+	{"gif-color-table", MicrobenchColorTableSetup, MicrobenchColorTableRun},
+	{"gif-sub-blocks", MicrobenchSubBlocksSetup, MicrobenchSubBlocksRun},
+	{"gif-sub-block-sequence", MicrobenchSubBlocksSetup, MicrobenchSubBlockSequenceRun},
+	{"tiff2png-get-line-1", MicrobenchGetLine1Setup, MicrobenchGetLine1Run},
+	{"tiff2png-get-line-8", MicrobenchGetLine8Setup, MicrobenchGetLine8Run},
+	{"tiff2png-get-line-4", MicrobenchGetLine1Setup, MicrobenchGetLine4Run},
+	{"tiff2png-put-line-4", MicrobenchPutLine4Setup, MicrobenchPutLine4Run},
+	{"tiff2png-strip-to-line-8", MicrobenchStripToLineSetup, MicrobenchStripToLineRun},
+	{"resize-area-rgb", MicrobenchRGBSetup, MicrobenchResizeRun},
+	{"reduce-add-row-rgba", MicrobenchGrayRGBASetup, MicrobenchReduceAddRowRun},
+	{"reduce-row-rgba-to-gray", MicrobenchGrayRGBASetup, MicrobenchReduceRowRun},
+	{"composite-rgba-checker", MicrobenchCompositeSetup, MicrobenchCompositeRun},
+	{"dither-ordered-16", MicrobenchDitherSetup, MicrobenchDitherOrderedRun},
+	{"dither-fs-16", MicrobenchDitherSetup, MicrobenchDitherFSRun},
+	{"stats-rgb", MicrobenchRGBSetup, MicrobenchStatsRun},
+	{"hash-xxh64", MicrobenchRGBASetup, MicrobenchHashRun},
+	{"phash-gray", MicrobenchGraySetup, MicrobenchPerceptualHashRun},
+};
+
+static void MicrobenchContextFree(MicrobenchContext * ctx) {
+	if (ctx->stream) fclose(ctx->stream);
+	DitherPaletteFree(&ctx->palette);
+	CompositeEnd(&ctx->compositor);
+	BFFree(ctx->input);
+	BFFree(ctx->output);
+	memset(ctx, 0, sizeof(MicrobenchContext));
+}
+
+/**
+ * Time stamp counter, or 0 where there is none
+ */
+static uint64_t MicrobenchCycles(void) {
+#ifdef MICROBENCH_TSC
+	_mm_lfence();
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static double MicrobenchNanoseconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void MicrobenchUsage(const char * name) {
+	printf("usage: %s [ --cpu <n> ] [ --warmup <n> ] [ --repetitions <n> ] [ --filter <text> ] [ --format <text|jsonl> ]\n", name);
+	printf("\n");
+	printf("\t--cpu <n>: CPU to pin to (default the one we start on)\n");
+	printf("\t--warmup <n>: Untimed runs before measuring (default 3)\n");
+	printf("\t--repetitions <n>: Timed runs (default 25)\n");
+	printf("\t--filter <text>: Only runs benchmarks whose name contains <text>\n");
+	printf("\n");
+	printf("Cycles come from the time stamp counter, which ticks at a fixed rate\n");
+	printf("rather than the core clock, so only compare runs on the same machine\n");
+	printf("\n");
+}
+
+int main(int argc, char * argv[]) {
+	int result = 0;
+	int cpu = sched_getcpu();
+	int warmup = 3, repetitions = 25;
+	const char * filter = NULL;
+	bool json = false;
+	cpu_set_t set;
+	volatile uint64_t sink = 0;
+
+	for (int i = 1; (result == 0) && (i < argc); i++) {
+		const char * value = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (!value) {
+			MicrobenchUsage(argv[0]);
+			result = 1;
+		} else if (!strcmp(argv[i], "--cpu")) {
+			cpu = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--warmup")) {
+			warmup = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--repetitions")) {
+			repetitions = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--filter")) {
+			filter = argv[++i];
+		} else if (!strcmp(argv[i], "--format") && (!strcmp(value, "text") || !strcmp(value, "jsonl"))) {
+			json = !strcmp(argv[++i], "jsonl");
+		} else {
+			MicrobenchUsage(argv[0]);
+			result = 1;
+		}
+	}
+
+	if ((result == 0) && (repetitions < 1)) {
+		BFErrorPrint("Repetitions should be at least 1");
+		result = 2;
+	}
+
+	// Moving between cores mid run would mix up caches and counters
+	if (result == 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu < 0 ? 0 : cpu, &set);
+
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			BFErrorPrint("Could not pin to CPU %d", cpu);
+			result = 3;
+		}
+	}
+
+	if ((result == 0) && !json) {
+		printf("%-26s %10s %10s %10s %10s %9s %9s %10s\n", "name", "bytes",
+			"cyc/B min", "cyc/B p50", "cyc/B mean", "stddev", "ns/B p50", "MB/s p50");
+	}
+
+	for (size_t b = 0; (result == 0) && (b < sizeof(MICROBENCHES) / sizeof(MICROBENCHES[0])); b++) {
+		const Microbench * bench = &MICROBENCHES[b];
+		MicrobenchContext ctx;
+		double cycles[repetitions], nanoseconds[repetitions];
+		double mean = 0, variance = 0;
+
+		if (filter && !strstr(bench->name, filter)) continue;
+
+		memset(&ctx, 0, sizeof(ctx));
+		if (bench->setup(&ctx)) {
+			BFErrorPrint("Could not set up %s", bench->name);
+			MicrobenchContextFree(&ctx);
+			result = 4;
+			break;
+		}
+
+		for (int i = 0; i < warmup; i++) sink += bench->run(&ctx);
+
+		for (int i = 0; i < repetitions; i++) {
+			double start = MicrobenchNanoseconds();
+			uint64_t startCycles = MicrobenchCycles();
+
+			sink += bench->run(&ctx);
+
+			cycles[i] = (double) (MicrobenchCycles() - startCycles) / ctx.bytes;
+			nanoseconds[i] = (MicrobenchNanoseconds() - start) / ctx.bytes;
+		}
+
+		std::sort(cycles, cycles + repetitions);
+		std::sort(nanoseconds, nanoseconds + repetitions);
+
+		for (int i = 0; i < repetitions; i++) mean += cycles[i];
+		mean /= repetitions;
+		for (int i = 0; i < repetitions; i++) variance += (cycles[i] - mean) * (cycles[i] - mean);
+
+		const double p50 = cycles[repetitions / 2];
+		const double stddev = sqrt(variance / repetitions);
+		const double ns = nanoseconds[repetitions / 2];
+
+		if (json) {
+			printf("{\"name\": \"%s\", \"bytes\": %zu, \"cpu\": %d, \"repetitions\": %d, \"cycles_per_byte_min\": %.4f, "
+				"\"cycles_per_byte_p50\": %.4f, \"cycles_per_byte_mean\": %.4f, \"cycles_per_byte_stddev\": %.4f, "
+				"\"ns_per_byte_p50\": %.4f, \"mb_per_s_p50\": %.1f}\n",
+				bench->name, ctx.bytes, cpu, repetitions, cycles[0], p50, mean, stddev, ns, 1000 / ns);
+		} else {
+			printf("%-26s %10zu %10.3f %10.3f %10.3f %9.3f %9.3f %10.1f\n",
+				bench->name, ctx.bytes, cycles[0], p50, mean, stddev, ns, 1000 / ns);
+		}
+
+		fflush(stdout);
+		MicrobenchContextFree(&ctx);
+	}
+
+	return result;
+}
+
@@ -8,11 +8,36 @@
 #include <jpeg.hpp>
 #include <image.hpp>
 #include <appdriver.hpp>
+#include <scan.hpp>
+#include <xmp.hpp>
+#include <exif.hpp>
+#include <hash.hpp>
+#include <phash.hpp>
+#include <dupes.hpp>
+#include <stats.hpp>
+#include <reduce.hpp>
+#include <dither.hpp>
+#include <composite.hpp>
+#include <trace.hpp>
+#include <batch.hpp>
+#include <memory.hpp>
+#include <codecs.hpp>
+#include <stream.hpp>
+#include <cache.hpp>
+#include <index.hpp>
+#include <version.h>
+#include <libimagine.hpp>
 #include <bflibcpp/bflibcpp.hpp>
+#include <tiffio.h>
 #include <cpplib_tests.hpp>
 
 extern "C" {
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 }
 
 int test_PNGIsType(void);
@@ -35,6 +60,7 @@ int test_PNG(int * p, int * f) {
 
 int test_JPEGIsType(void);
 int test_JPEGPath(void);
+int test_JPEGScaleDenominator(void);
 int test_JPEG(int * p, int * f) {
 	int pass = 0, fail = 0;
 	INTRO_TEST_FUNCTION;
@@ -45,6 +71,9 @@ int test_JPEG(int * p, int * f) {
 	if (!(test_JPEGPath())) pass++;
 	else fail++;
 
+	if (!(test_JPEGScaleDenominator())) pass++;
+	else fail++;
+
 	if (p) *p = pass;
 	if (f) *f = fail;
 
@@ -61,20 +90,120 @@ int test_GIF(int * p, int * f) {
 	return 0;
 }
 
+int test_XMPExtract(void);
+int test_EXIFParse(void);
+int test_HashXXH64(void);
+int test_PerceptualHashGray(void);
+int test_DupesFindClusters(void);
+int test_StatsComputeBuffer(void);
+int test_ReduceRow(void);
+int test_DitherImage(void);
+int test_CompositeRow(void);
+int test_TraceScope(void);
+int test_MemoryAccount(void);
+int test_CodecsReuse(void);
+int test_StreamPipe(void);
+int test_ImageBuffer(void);
+int test_LibImagine(void);
+int test_ImageProbe(void);
+int test_JPEGTransformRoundTrip(void);
+int test_ConversionCacheKey(void);
+int test_ConversionCacheStore(void);
+int test_ConversionCacheEvict(void);
+int test_MetadataIndexLookup(void);
+int test_MetadataIndexTruncated(void);
+int test_MetadataIndexCompact(void);
 int test_Image(int * p, int * f) {
 	int pass = 0, fail = 0;
 	INTRO_TEST_FUNCTION;
 
+	if (!test_XMPExtract()) pass++;
+	else fail++;
+
+	if (!test_EXIFParse()) pass++;
+	else fail++;
+
+	if (!test_HashXXH64()) pass++;
+	else fail++;
+
+	if (!test_PerceptualHashGray()) pass++;
+	else fail++;
+
+	if (!test_DupesFindClusters()) pass++;
+	else fail++;
+
+	if (!test_StatsComputeBuffer()) pass++;
+	else fail++;
+
+	if (!test_ReduceRow()) pass++;
+	else fail++;
+
+	if (!test_DitherImage()) pass++;
+	else fail++;
+
+	if (!test_CompositeRow()) pass++;
+	else fail++;
+
+	if (!test_TraceScope()) pass++;
+	else fail++;
+
+	if (!test_MemoryAccount()) pass++;
+	else fail++;
+
+	if (!test_CodecsReuse()) pass++;
+	else fail++;
+
+	if (!test_StreamPipe()) pass++;
+	else fail++;
+
+	if (!test_ImageBuffer()) pass++;
+	else fail++;
+
+	if (!test_LibImagine()) pass++;
+	else fail++;
+
+	if (!test_ImageProbe()) pass++;
+	else fail++;
+
+	if (!test_JPEGTransformRoundTrip()) pass++;
+	else fail++;
+
+	if (!test_ConversionCacheKey()) pass++;
+	else fail++;
+
+	if (!test_ConversionCacheStore()) pass++;
+	else fail++;
+
+	if (!test_ConversionCacheEvict()) pass++;
+	else fail++;
+
+	if (!test_MetadataIndexLookup()) pass++;
+	else fail++;
+
+	if (!test_MetadataIndexTruncated()) pass++;
+	else fail++;
+
+	if (!test_MetadataIndexCompact()) pass++;
+	else fail++;
+
 	if (p) *p = pass;
 	if (f) *f = fail;
 
 	return 0;
 }
 
+int test_ScanWriterOrder(void);
+int test_ScanWriterStress(void);
 int test_AppDriver(int * p, int * f) {
 	int pass = 0, fail = 0;
 	INTRO_TEST_FUNCTION;
 
+	if (!test_ScanWriterOrder()) pass++;
+	else fail++;
+
+	if (!test_ScanWriterStress()) pass++;
+	else fail++;
+
 	if (p) *p = pass;
 	if (f) *f = fail;
 
@@ -200,3 +329,1723 @@ int test_JPEGPath(void) {
 	return result;
 }
 
+int test_JPEGScaleDenominator(void) {
+	int result = 0;
+
+	// 1/8 of 4000x3000 is 500x375
+	if (JPEG::scaleDenominatorForTarget(4000, 3000, 300, 225) != 8) {
+		result = 1;
+	} else if (JPEG::scaleDenominatorForTarget(4000, 3000, 600, 450) != 4) {
+		result = 2;
+
+	// Scaled size is rounded up so 1/8 of 100 (13) still covers 13
+	} else if (JPEG::scaleDenominatorForTarget(100, 100, 13, 13) != 8) {
+		result = 3;
+	} else if (JPEG::scaleDenominatorForTarget(100, 100, 14, 14) != 4) {
+		result = 4;
+	} else if (JPEG::scaleDenominatorForTarget(4000, 3000, 3000, 2000) != 1) {
+		result = 5;
+	} else if (JPEG::scaleDenominatorForTarget(4000, 3000, 0, 0) != 1) {
+		result = 6;
+	}
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_ScanWriterOrder(void) {
+	int result = 0;
+	FILE * out = tmpfile();
+	char buf[32] = {0};
+	ScanWriter * writer = NULL;
+
+	if (!out) {
+		result = 1;
+	} else if ((writer = new ScanWriter(out, 4, &result)) == NULL) {
+		result = 2;
+	}
+
+	// Nothing can be written until index 0 shows up, and
+	// skipped indexes must not hold up the ones after them
+	if (result == 0) {
+		writer->submit(2, strdup("c"));
+		writer->submit(1, NULL);
+		if (writer->written() != 0) result = 3;
+	}
+
+	if (result == 0) {
+		writer->submit(0, strdup("a"));
+		writer->submit(3, strdup("d"));
+		if (writer->written() != 3) result = 4;
+	}
+
+	if (result == 0) {
+		rewind(out);
+		if (!fgets(buf, sizeof(buf), out) || strcmp(buf, "acd")) result = 5;
+	}
+
+	if (writer) delete writer;
+	if (out) fclose(out);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_XMPExtract(void) {
+	int result = 0;
+	BF::Dictionary<BF::String, BF::String> metadata;
+	const XMPProperty properties[] = {
+		{"exif:GPSLatitude", "Latitude"},
+		{"tiff:Model", "Model"},
+		{"xmp:CreatorTool", "Creator Tool"},
+		{"tiff:Make", "Make"},
+	};
+	const char * packet =
+		"<x:xmpmeta><rdf:RDF>"
+		"<!-- <tiff:Model>Wrong</tiff:Model> -->"
+		"<rdf:Description exif:GPSLatitude='37,30.1N'>"
+		"<tiff:Model> A &amp; B &#x; &#; &#66; </tiff:Model>"
+		"<xmp:CreatorTool><rdf:Alt><rdf:li>Tool</rdf:li></rdf:Alt></xmp:CreatorTool>"
+		"<tiff:Make>Cut off</tiff:Make>"
+		"</rdf:Description></rdf:RDF></x:xmpmeta>";
+
+	// The packet does not need to be null terminated
+	size_t size = strstr(packet, "<tiff:Make>") - packet;
+
+	if (XMPExtract(packet, size, properties, 4, &metadata)) {
+		result = 1;
+	} else if (strcmp(metadata.valueForKey("Latitude").cString(), "37,30.1N")) {
+		result = 2;
+	} else if (strcmp(metadata.valueForKey("Model").cString(), "A & B &#x; &#; B")) {
+		result = 3;
+	} else if (strcmp(metadata.valueForKey("Creator Tool").cString(), "Tool")) {
+		result = 4;
+	}
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_EXIFParse(void) {
+	int result = 0;
+	EXIFInfo info;
+
+	// Little endian IFD0 with Make, Orientation and a Model whose
+	// offset points past the end of the block
+	unsigned char block[] = {
+		'I', 'I', 42, 0, 8, 0, 0, 0,
+		3, 0,
+		0x0F, 0x01, 2, 0, 4, 0, 0, 0, 'A', 'B', 'C', 0,
+		0x10, 0x01, 2, 0, 16, 0, 0, 0, 0xFF, 0, 0, 0,
+		0x12, 0x01, 3, 0, 1, 0, 0, 0, 6, 0, 0, 0,
+		0, 0, 0, 0
+	};
+
+	if (EXIFParse(block, sizeof(block), &info)) {
+		result = 1;
+	} else if (info.orientation != 6) {
+		result = 2;
+	} else if ((info.make.size < 3) || memcmp(info.make.value, "ABC", 3)) {
+		result = 3;
+	} else if (info.model.value) {
+		result = 4;
+	} else if (EXIFSetOrientation(block, sizeof(block), &info, 1)) {
+		result = 5;
+	} else if (EXIFParse(block, sizeof(block), &info) || (info.orientation != 1)) {
+		result = 6;
+	} else if (!EXIFParse(block, 6, &info)) {
+		// Too short for a header
+		result = 7;
+	}
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_HashXXH64(void) {
+	int result = 0;
+
+	// Reference values from xxhsum. The last input takes the 32 byte stripe path
+	const char * fox = "The quick brown fox jumps over the lazy dog";
+
+	if (HashXXH64("", 0, 0) != 0xEF46DB3751D8E999ULL) {
+		result = 1;
+	} else if (HashXXH64("abc", 3, 0) != 0x44BC2CF5AD770999ULL) {
+		result = 2;
+	} else if (HashXXH64(fox, strlen(fox), 0) != 0x0B242D361FDA71BCULL) {
+		result = 3;
+	}
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_PerceptualHashGray(void) {
+	int result = 0;
+	const ImaginePixels width = 100, height = 70;
+	unsigned char pixels[width * height];
+	PerceptualHashes hashes;
+
+	for (ImaginePixels y = 0; y < height; y++) {
+		for (ImaginePixels x = 0; x < width; x++) {
+			pixels[y * width + x] = (x * y * 7 + x * x + 3 * y) % 256;
+		}
+	}
+
+	// Reference values from a straightforward float implementation
+	if (PerceptualHashGray(pixels, width, height, &hashes)) {
+		result = 1;
+	} else if (hashes.average != 0x5847766bfbf3ea25ULL) {
+		result = 2;
+	} else if (hashes.difference != 0x929d6edb462ba3e5ULL) {
+		result = 3;
+	} else if (hashes.perceptual != 0xc5901e79c8492fdeULL) {
+		result = 4;
+	}
+
+	// Smaller than the grids
+	if (result == 0) {
+		if (PerceptualHashGray(pixels, 5, 3, &hashes)) {
+			result = 5;
+		} else if (hashes.average == hashes.perceptual) {
+			result = 6;
+		}
+	}
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_DupesFindClusters(void) {
+	int result = 0;
+	const uint64_t base = 0x0123456789abcdefULL;
+
+	// 1 and 3 are near 0, 3 only through 1. 2 is on its own and
+	// 4 would join 0 if it were valid
+	uint64_t hashes[5] = {base, base ^ 0x7, ~base, base ^ 0x7 ^ (0x3ULL << 40), base};
+	bool valid[5] = {true, true, true, true, false};
+	size_t clusters[5];
+	const size_t expected[5] = {0, 0, 2, 0, 4};
+
+	if (DupesFindClusters(hashes, valid, 5, 3, 2, clusters)) {
+		result = 1;
+	}
+
+	for (int i = 0; (result == 0) && (i < 5); i++) {
+		if (clusters[i] != expected[i]) result = 2;
+	}
+
+	if ((result == 0) && (DupesFindClusters(hashes, valid, 5, DUPES_MAX_DISTANCE + 1, 1, clusters) == 0)) {
+		result = 3;
+	}
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_StatsComputeBuffer(void) {
+	int result = 0;
+	unsigned char rgb[2][8][3];
+	const unsigned char rgba[2][2][4] = {
+		{{10, 20, 30, 255}, {10, 20, 30, 255}},
+		{{10, 20, 30, 0}, {10, 20, 30, 128}}
+	};
+	ImageStats stats;
+
+	// Gray ramps, 0 to 70 and 100 to 170
+	for (int y = 0; y < 2; y++) {
+		for (int x = 0; x < 8; x++) {
+			memset(rgb[y][x], 10 * x + 100 * y, 3);
+		}
+	}
+
+	if (StatsComputeBuffer(&rgb[0][0][0], 8, 2, 3, &stats)) {
+		result = 1;
+	} else if ((stats.channel[0].min != 0) || (stats.channel[1].max != 170) || (stats.channel[2].mean != 85)) {
+		result = 2;
+	} else if (!stats.grayscale || (stats.maxChannelDifference != 0) || (stats.alphaCoverage != 1)) {
+		result = 3;
+	}
+
+	// One pixel the vector loop sees and one it leaves for the tail
+	rgb[0][2][2] += 40;
+	rgb[1][6][0] += 30;
+
+	if (result == 0) {
+		if (StatsComputeBuffer(&rgb[0][0][0], 8, 2, 3, &stats)) {
+			result = 4;
+		} else if (stats.grayscale || (stats.maxChannelDifference != 40)) {
+			result = 5;
+		}
+	}
+
+	if (result == 0) {
+		if (StatsComputeBuffer(&rgba[0][0][0], 2, 2, 4, &stats)) {
+			result = 6;
+		} else if ((stats.opaqueFraction != 0.5) || (stats.alphaCoverage != (638.0 / 4) / 255)) {
+			result = 7;
+		} else if ((stats.channel[3].histogram[255] != 2) || (stats.channel[1].stddev != 0)) {
+			result = 8;
+		}
+	}
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_ReduceRow(void) {
+	int result = 0;
+	ReduceInfo info;
+	unsigned char rgba[9][4];
+	unsigned short rgb16[9][3];
+	const unsigned char colors[3][4] = {{255, 0, 0, 255}, {0, 0, 255, 0}, {0, 255, 0, 255}};
+
+	// Opaque gray, long enough for the vector loop and a tail
+	for (int x = 0; x < 9; x++) {
+		memset(rgba[x], x * 20, 3);
+		rgba[x][3] = 0xff;
+	}
+
+	if (ReduceBegin(&info, 4, 8, true)) {
+		result = 1;
+	} else {
+		ReduceAddRow(&info, &rgba[0][0], 9);
+		ReduceFinish(&info);
+		ReduceRow(&info, &rgba[0][0], 9, &rgba[0][0]);
+
+		if (info.outputPalette || (info.outputChannels != 1) || (info.outputBitDepth != 8)) {
+			result = 2;
+		} else if ((rgba[0][0] != 0) || (rgba[0][1] != 20) || (rgba[2][0] != 160)) {
+			result = 3;
+		}
+	}
+
+	// Three colors, one of them transparent
+	for (int x = 0; x < 9; x++) {
+		memcpy(rgba[x], colors[x % 3], 4);
+	}
+
+	if ((result == 0) && ReduceBegin(&info, 4, 8, true)) {
+		result = 4;
+	} else if (result == 0) {
+		ReduceAddRow(&info, &rgba[0][0], 9);
+		ReduceFinish(&info);
+		ReduceRow(&info, &rgba[0][0], 9, &rgba[0][0]);
+
+		if (!info.outputPalette || (info.colors != 3) || (info.outputBitDepth != 2) || (info.transparent != 1)) {
+			result = 5;
+		} else if ((rgba[0][1] != 0) || (info.palette[0][2] != 255) || (rgba[0][0] != rgba[0][3])) {
+			result = 6;
+		}
+	}
+
+	// 16 bit samples that are 8 bit ones times 257, except the last pixel
+	for (int x = 0; x < 9; x++) {
+		rgb16[x][0] = x * 257;
+		rgb16[x][1] = 0x1111;
+		rgb16[x][2] = 0xffff;
+	}
+
+	if ((result == 0) && ReduceBegin(&info, 3, 16, false)) {
+		result = 7;
+	} else if (result == 0) {
+		ReduceAddRow(&info, (unsigned char *) rgb16, 8);
+		ReduceFinish(&info);
+
+		if (info.outputBitDepth != 8) result = 8;
+
+		rgb16[8][2] = 0x1234;
+		ReduceBegin(&info, 3, 16, false);
+		ReduceAddRow(&info, (unsigned char *) rgb16, 9);
+		ReduceFinish(&info);
+
+		if ((result == 0) && ((info.outputBitDepth != 16) || info.reduced)) result = 9;
+	}
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_DitherImage(void) {
+	int result = 0;
+	const ImaginePixels width = 72, height = 40;
+	unsigned char * rgb = (unsigned char *) malloc(width * height * 3);
+	unsigned char * single = (unsigned char *) malloc(width * height);
+	unsigned char * threaded = (unsigned char *) malloc(width * height);
+	DitherPalette palette;
+	int white = 0;
+
+	// Mid gray between black and white
+	memset(rgb, 128, width * height * 3);
+	memset(&palette, 0, sizeof(palette));
+	palette.count = 2;
+	memset(palette.colors[1], 255, 3);
+
+	if (!rgb || !single || !threaded) {
+		result = 1;
+	} else if (DitherPaletteInit(&palette)) {
+		result = 2;
+	} else if (DitherImage(rgb, width, height, &palette, kImagineDitherFloydSteinberg, 1, single)
+		|| DitherImage(rgb, width, height, &palette, kImagineDitherFloydSteinberg, 3, threaded)) {
+		result = 3;
+	} else if (memcmp(single, threaded, width * height)) {
+		result = 4;
+	}
+
+	for (ImaginePixels i = 0; (result == 0) && (i < width * height); i++) white += single[i];
+
+	if ((result == 0) && ((white < width * height * 45 / 100) || (white > width * height * 55 / 100))) {
+		result = 5;
+	}
+
+	// Half of the Bayer thresholds push 128 up and half push it down
+	if ((result == 0) && DitherImage(rgb, width, height, &palette, kImagineDitherOrdered, 2, threaded)) {
+		result = 6;
+	}
+
+	white = 0;
+	for (ImaginePixels i = 0; (result == 0) && (i < width * height); i++) white += threaded[i];
+
+	if ((result == 0) && (white != width * height / 2)) {
+		result = 7;
+	}
+
+	DitherPaletteFree(&palette);
+
+	// Two distinct colors never make more than two palette entries
+	for (ImaginePixels i = 0; (result == 0) && (i < width * height); i++) {
+		memset(rgb + i * 3, (i % 3) ? 10 : 200, 3);
+	}
+
+	if ((result == 0) && DitherPaletteCreate(rgb, width, height, 16, &palette)) {
+		result = 8;
+	} else if ((result == 0) && ((palette.count != 2) || (palette.colors[0][0] + palette.colors[1][0] != 210))) {
+		result = 9;
+	}
+
+	DitherPaletteFree(&palette);
+	free(rgb);
+	free(single);
+	free(threaded);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_CompositeRow(void) {
+	int result = 0;
+	ImagineBackground background;
+	Compositor compositor;
+	unsigned char rgba[9][4];
+	unsigned char ga[20][2];
+	const unsigned char alphas[3] = {0, 255, 128};
+
+	memset(&compositor, 0, sizeof(compositor));
+
+	// Blue at no, full and half alpha over red, long enough for the vector
+	// loop and a tail
+	for (int x = 0; x < 9; x++) {
+		rgba[x][0] = rgba[x][1] = 0;
+		rgba[x][2] = 255;
+		rgba[x][3] = alphas[x % 3];
+	}
+
+	if (CompositeParseBackground("#ff0000", &background) || background.checker || (background.color[0] != 255)) {
+		result = 1;
+	} else if (!CompositeParseBackground("ff0000", &background) || !CompositeParseBackground("#ff00", &background)) {
+		result = 2;
+	} else if (CompositeParseBackground("#ff0000", &background) || CompositeBegin(&compositor, &background, 4, 9)) {
+		result = 3;
+	} else {
+		CompositeRow(&compositor, &rgba[0][0], 0, &rgba[0][0], 3);
+
+		for (int x = 0; (result == 0) && (x < 9); x++) {
+			const unsigned char * p = &rgba[0][0] + x * 3;
+			const int expected[3][3] = {{255, 0, 0}, {0, 0, 255}, {127, 0, 128}};
+
+			if ((p[0] != expected[x % 3][0]) || (p[1] != expected[x % 3][1]) || (p[2] != expected[x % 3][2])) {
+				result = 4;
+			}
+		}
+	}
+
+	CompositeEnd(&compositor);
+
+	// Clear gray over a checkerboard shows the squares, which swap every
+	// COMPOSITE_CHECKER_SIZE rows
+	memset(ga, 0, sizeof(ga));
+
+	if ((result == 0) && (CompositeParseBackground("checker", &background) || !CompositeBackgroundIsGray(&background))) {
+		result = 5;
+	} else if ((result == 0) && CompositeBegin(&compositor, &background, 2, 20)) {
+		result = 6;
+	} else if (result == 0) {
+		unsigned char out[2][20];
+
+		CompositeRow(&compositor, &ga[0][0], 0, out[0], 1);
+		CompositeRow(&compositor, &ga[0][0], COMPOSITE_CHECKER_SIZE, out[1], 1);
+
+		if ((out[0][0] != background.color[0]) || (out[0][COMPOSITE_CHECKER_SIZE] != background.second[0])) {
+			result = 7;
+		} else if ((out[1][0] != out[0][COMPOSITE_CHECKER_SIZE]) || (out[1][COMPOSITE_CHECKER_SIZE] != out[0][0])) {
+			result = 8;
+		}
+	}
+
+	CompositeEnd(&compositor);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+static int test_TraceScopeJob(size_t index, int worker, void * context) {
+	TraceScope scope("test job", "worker");
+	return 0;
+}
+
+int test_TraceScope(void) {
+	int result = 0;
+	char path[] = "/tmp/imagine-trace-XXXXXX";
+	char json[4096];
+	size_t size = 0;
+	FILE * file = NULL;
+	int fd = mkstemp(path);
+
+	if (fd == -1) {
+		result = 1;
+	} else if (close(fd) || TraceStart(path) || !TraceEnabled()) {
+		result = 2;
+	} else {
+		{
+			TraceScope scope("test span", "a \"quoted\" path", 7);
+		}
+
+		if (BatchRun(4, 2, test_TraceScopeJob, NULL, NULL)) {
+			result = 3;
+		}
+
+		TraceFlush();
+	}
+
+	if ((result == 0) && TraceEnabled()) {
+		result = 4;
+	} else if ((result == 0) && ((file = fopen(path, "r")) == NULL)) {
+		result = 5;
+	} else if (result == 0) {
+		size = fread(json, 1, sizeof(json) - 1, file);
+		json[size] = '\0';
+
+		if (!strstr(json, "\"traceEvents\":[") || !strstr(json, "\n]}")) {
+			result = 6;
+		} else if (!strstr(json, "{\"name\":\"test span\",\"cat\":\"imagine\",\"ph\":\"X\"")) {
+			result = 7;
+		} else if (!strstr(json, "\"detail\":\"a \\\"quoted\\\" path\",\"index\":7")) {
+			result = 8;
+		} else if (!strstr(json, "\"batch worker 1\"") || !strstr(json, "\"test job\"")) {
+			result = 9;
+		}
+	}
+
+	if (file) fclose(file);
+	if (fd != -1) unlink(path);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_MemoryAccount(void) {
+	int result = 0;
+	MemoryAccount account;
+	void * a = NULL, * b = NULL;
+	size_t size = 0;
+
+	MemoryAccountInit(&account);
+	account.limit = 1000;
+
+	if ((a = MemoryAllocate(&account, 600)) == NULL) {
+		result = 1;
+	} else if ((account.current != 600) || (account.peak != 600) || (account.allocations != 1)) {
+		result = 2;
+
+	// Goes over the limit so nothing is counted
+	} else if ((b = MemoryAllocate(&account, 500)) != NULL) {
+		result = 3;
+	} else if ((account.current != 600) || (account.refusals != 1)) {
+		result = 4;
+	}
+
+	if (result == 0) {
+		MemoryFree(&account, a);
+		a = NULL;
+
+		if ((b = MemoryAllocate(&account, 500)) == NULL) {
+			result = 5;
+		} else if ((account.current != 500) || (account.peak != 600) || (account.allocations != 2)) {
+			result = 6;
+		}
+	}
+
+	if (result == 0) {
+		MemoryFree(&account, b);
+		b = NULL;
+
+		if (account.current != 0) {
+			result = 7;
+		} else if (MemoryParseSize("64K", &size) || (size != 64 * 1024)) {
+			result = 8;
+		} else if (MemoryParseSize("2g", &size) || (size != 2ul * 1024 * 1024 * 1024)) {
+			result = 9;
+		} else if (!MemoryParseSize("12X", &size) || !MemoryParseSize("big", &size)) {
+			result = 10;
+		} else if (!MemoryParseSize("64Mxyz", &size) || !MemoryParseSize("-1", &size) || !MemoryParseSize("", &size)) {
+			result = 11;
+		} else if (!MemoryParseSize("99999999999G", &size) || !MemoryParseSize("99999999999999999999", &size)) {
+			result = 12;
+		}
+	}
+
+	MemoryFree(&account, a);
+	MemoryFree(&account, b);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_CodecsReuse(void) {
+	int result = 0;
+	MemoryAccount first, second;
+	CodecJPEGDecompress * decompressor = NULL, * reused = NULL;
+	CodecJPEGCompress * compressor = NULL;
+	CodecsStatistics before, after;
+
+	MemoryAccountInit(&first);
+	MemoryAccountInit(&second);
+	CodecsStatisticsGet(&before);
+
+	if ((decompressor = CodecsAcquireJPEGDecompress(&first)) == NULL) {
+		result = 1;
+	} else if (setjmp(decompressor->jmp)) {
+		result = 2;
+	} else {
+		(void) decompressor->cinfo.mem->alloc_small((j_common_ptr) &decompressor->cinfo, JPOOL_IMAGE, 1000);
+
+		if (first.current < 1000) {
+			result = 3;
+		}
+	}
+
+	// Released memory goes back to the first image, the next one pays
+	// for its own
+	if (result == 0) {
+		CodecsReleaseJPEGDecompress(decompressor);
+
+		if (first.current != 0) {
+			result = 4;
+		} else if ((reused = CodecsAcquireJPEGDecompress(&second)) != decompressor) {
+			result = 5;
+		} else if (setjmp(reused->jmp)) {
+			result = 6;
+		} else {
+			(void) reused->cinfo.mem->alloc_small((j_common_ptr) &reused->cinfo, JPOOL_IMAGE, 500);
+
+			if ((first.current != 0) || (second.current < 500)) {
+				result = 7;
+			}
+		}
+
+		CodecsReleaseJPEGDecompress(reused);
+	}
+
+	// Tables from the first use are filled in again
+	for (int i = 0; (result == 0) && (i < 2); i++) {
+		if ((compressor = CodecsAcquireJPEGCompress(&first)) == NULL) {
+			result = 8;
+		} else if (setjmp(compressor->jmp)) {
+			result = 9;
+		} else {
+			compressor->cinfo.in_color_space = JCS_RGB;
+			compressor->cinfo.input_components = 3;
+			jpeg_set_defaults(&compressor->cinfo);
+
+			if (!compressor->cinfo.quant_tbl_ptrs[0]) {
+				result = 10;
+			}
+		}
+
+		CodecsReleaseJPEGCompress(compressor);
+	}
+
+	CodecsStatisticsGet(&after);
+	if (result == 0) {
+		if ((after.acquired - before.acquired != 4) || (after.reused - before.reused < 2)) {
+			result = 11;
+		} else if ((first.current != 0) || (second.current != 0)) {
+			result = 12;
+		}
+	}
+
+	CodecsTrim();
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_StreamPipe(void) {
+	int result = 0;
+	const unsigned char png[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	const unsigned char jpeg[] = {0xFF, 0xD8, 0xFF, 0xE0};
+	const unsigned char tiff[] = {'M', 'M', 0, '*'};
+	const unsigned char bytes[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+	unsigned char * data = NULL;
+	size_t size = 0;
+	MemoryAccount account;
+	FILE * file = NULL;
+	int fds[2] = {-1, -1};
+
+	MemoryAccountInit(&account);
+
+	if (StreamTypeForSignature(png, sizeof(png)) != kImageTypePNG) {
+		result = 1;
+	} else if (StreamTypeForSignature(jpeg, sizeof(jpeg)) != kImageTypeJPEG) {
+		result = 2;
+	} else if (StreamTypeForSignature((const unsigned char *) "GIF89a", 6) != kImageTypeGIF) {
+		result = 3;
+	} else if (StreamTypeForSignature(tiff, sizeof(tiff)) != kImageTypeTIFF) {
+		result = 4;
+	} else if (StreamTypeForSignature(png, 4) != kImageTypeUnknown) {
+		result = 5;
+	} else if (!StreamIsStdio("-") || StreamIsStdio("./-")) {
+		result = 6;
+	}
+
+	// Pipes cannot seek, so skipping has to read
+	if (result == 0) {
+		if (pipe(fds)) {
+			result = 7;
+		} else if (write(fds[1], bytes, sizeof(bytes)) != sizeof(bytes)) {
+			result = 8;
+		} else if ((file = fdopen(fds[0], "rb")) == NULL) {
+			result = 9;
+		} else {
+			close(fds[1]);
+			fds[1] = -1;
+
+			if (StreamSkip(file, 4)) {
+				result = 10;
+			} else if (fgetc(file) != 4) {
+				result = 11;
+			} else if (StreamReadAll(file, &account, &data, &size)) {
+				result = 12;
+			} else if ((size != 5) || memcmp(data, bytes + 5, 5) || (account.current < 5)) {
+				result = 13;
+			}
+		}
+	}
+
+	MemoryFree(&account, data);
+	if (file) fclose(file);
+	else if (fds[0] != -1) close(fds[0]);
+	if (fds[1] != -1) close(fds[1]);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_ImageBuffer(void) {
+	int result = 0;
+	const unsigned char colors[2][3] = {{0, 0, 0}, {255, 255, 255}};
+	unsigned char indexes[8 * 6];
+	char * png = NULL;
+	size_t pngSize = 0;
+	void * jpeg = NULL, * small = NULL;
+	size_t jpegSize = 0, smallSize = 0;
+	FILE * file = NULL;
+	Image * img = NULL, * converted = NULL, * resized = NULL;
+	ImagineConvertOptions options;
+	int error = 0;
+
+	memset(&options, 0, sizeof(options));
+	for (int i = 0; i < (int) sizeof(indexes); i++) indexes[i] = i % 2;
+
+	if ((file = StreamOpenMemoryOutput(&png, &pngSize)) == NULL) {
+		result = 1;
+	} else if (PNG::writePalette(file, indexes, 8, 6, colors, 2, NULL)) {
+		result = 2;
+	} else if (fclose(file) || (pngSize < 8)) {
+		result = 3;
+	}
+
+	if ((result == 0) && ((img = Image::createImageFromBuffer(png, pngSize, &error)) == NULL || error)) {
+		result = 4;
+	} else if ((result == 0) && (img->type() != kImageTypePNG)) {
+		result = 5;
+	} else if ((result == 0) && img->convertToBuffer(kImageTypeJPEG, NULL, &jpeg, &jpegSize)) {
+		result = 6;
+	}
+
+	// What came out is a JPEG of the same size
+	if ((result == 0) && ((converted = Image::createImageFromBuffer(jpeg, jpegSize, &error)) == NULL || error)) {
+		result = 7;
+	} else if ((result == 0) && ((converted->type() != kImageTypeJPEG) || converted->probe())) {
+		result = 8;
+	} else if ((result == 0) && ((converted->width() != 8) || (converted->height() != 6))) {
+		result = 9;
+	}
+
+	// Options are applied before converting back
+	if (result == 0) {
+		options.width = 4;
+
+		if (converted->convertToBuffer(kImageTypePNG, &options, &small, &smallSize)) {
+			result = 10;
+		} else if ((resized = Image::createImageFromBuffer(small, smallSize, &error)) == NULL || error) {
+			result = 11;
+		} else if (resized->probe() || (resized->width() != 4) || (resized->height() != 3)) {
+			result = 12;
+		}
+	}
+
+	if ((result == 0) && (Image::createImageFromBuffer("not an image", 12, &error) || !error)) {
+		result = 13;
+	}
+
+	Delete(resized);
+	Delete(converted);
+	Delete(img);
+	free(small);
+	free(jpeg);
+	free(png);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+/**
+ * Shared by the threads in test_LibImagine()
+ */
+typedef struct {
+	const char * png;
+	size_t size;
+	void * jpeg;
+	size_t jpegSize;
+	int result;
+} LibImagineThread;
+
+static void * LibImagineConvert(void * arg) {
+	LibImagineThread * t = (LibImagineThread *) arg;
+	ImagineImage * image = NULL;
+	int error = 0;
+
+	if ((image = ImagineCreateFromBuffer(t->png, t->size, &error)) == NULL) {
+		t->result = 1;
+	} else if (ImagineConvertToBuffer(image, kImageTypeJPEG, NULL, &t->jpeg, &t->jpegSize)) {
+		t->result = 2;
+	}
+
+	ImagineFree(image);
+	ImagineTrimThread();
+
+	return NULL;
+}
+
+int test_LibImagine(void) {
+	int result = 0;
+	const unsigned char colors[2][3] = {{0, 0, 0}, {255, 0, 0}};
+	unsigned char indexes[8 * 6];
+	unsigned char pixels[8 * 6 * 4];
+	char * png = NULL;
+	size_t pngSize = 0, current = 1, peak = 0;
+	FILE * file = NULL;
+	ImagineImage * image = NULL;
+	ImagineProbeInfo info;
+	ImaginePixels width = 0, height = 0;
+	LibImagineThread threads[4];
+	pthread_t ids[4];
+	int created = 0;
+	int error = 0;
+
+	memset(threads, 0, sizeof(threads));
+	for (int i = 0; i < (int) sizeof(indexes); i++) indexes[i] = i % 2;
+
+	if ((file = StreamOpenMemoryOutput(&png, &pngSize)) == NULL) {
+		result = 1;
+	} else if (PNG::writePalette(file, indexes, 8, 6, colors, 2, NULL) || fclose(file)) {
+		result = 2;
+	} else if (ImagineAPIVersion() != IMAGINE_API_VERSION) {
+		result = 3;
+	}
+
+	// Pixels come out as RGBA whatever the file has
+	if ((result == 0) && ((image = ImagineCreateFromBuffer(png, pngSize, &error)) == NULL)) {
+		result = 4;
+	} else if ((result == 0) && ((ImagineGetType(image) != kImageTypePNG) || ImagineProbe(image, &info))) {
+		result = 5;
+	} else if ((result == 0) && ((info.width != 8) || (info.height != 6))) {
+		result = 6;
+	} else if ((result == 0) && ImagineDecode(image, pixels, 8 * 4, sizeof(pixels), &width, &height)) {
+		result = 7;
+	} else if ((result == 0) && ((width != 8) || (height != 6) || (pixels[4] != 255) || (pixels[5] != 0) || (pixels[7] != 255))) {
+		result = 8;
+	} else if ((result == 0) && (ImagineDecode(image, pixels, 8 * 4, sizeof(pixels) - 1, NULL, NULL) == 0)) {
+		result = 9;
+	} else if ((result == 0) && (ImagineMemoryUsage(image, &current, &peak) || (current != 0) || (peak == 0))) {
+		result = 10;
+	} else if ((result == 0) && (ImagineConvertToPath(image, kImageTypeJPEG, NULL, "-") == 0)) {
+		result = 14;
+	}
+
+	ImagineFree(image);
+
+	// The host process's standard input is not ours to read
+	if ((result == 0) && (ImagineCreateFromPath("-", &error) || !error)) {
+		result = 15;
+	}
+
+	// Handles on other threads do not get in each other's way
+	for (; (result == 0) && (created < 4); created++) {
+		threads[created].png = png;
+		threads[created].size = pngSize;
+
+		if (pthread_create(&ids[created], NULL, LibImagineConvert, &threads[created])) {
+			result = 11;
+			break;
+		}
+	}
+
+	for (int i = 0; i < created; i++) pthread_join(ids[i], NULL);
+
+	for (int i = 0; (result == 0) && (i < 4); i++) {
+		if (threads[i].result || !threads[i].jpeg) {
+			result = 12;
+		} else if ((threads[i].jpegSize != threads[0].jpegSize) || memcmp(threads[i].jpeg, threads[0].jpeg, threads[0].jpegSize)) {
+			result = 13;
+		}
+	}
+
+	for (int i = 0; i < 4; i++) ImagineFreeBuffer(threads[i].jpeg);
+	free(png);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+#define SCAN_WRITER_STRESS_RECORDS 200000
+#define SCAN_WRITER_STRESS_THREADS 8
+
+/**
+ * Shared by the threads in test_ScanWriterStress()
+ */
+typedef struct {
+	ScanWriter * writer;
+	std::atomic<size_t> next;
+} ScanWriterStress;
+
+static void * ScanWriterStressWork(void * arg) {
+	ScanWriterStress * s = (ScanWriterStress *) arg;
+	size_t index = 0;
+	char record[2] = {0};
+
+	// Jobs this small keep every worker racing for the flush
+	while ((index = s->next.fetch_add(1)) < SCAN_WRITER_STRESS_RECORDS) {
+		record[0] = '0' + (index % 10);
+		s->writer->submit(index, strdup(record));
+	}
+
+	return NULL;
+}
+
+int test_ScanWriterStress(void) {
+	int result = 0;
+	FILE * out = tmpfile();
+	ScanWriterStress s;
+	pthread_t ids[SCAN_WRITER_STRESS_THREADS];
+	int created = 0;
+	int c = 0;
+
+	s.writer = NULL;
+	s.next = 0;
+
+	if (!out) {
+		result = 1;
+	} else if ((s.writer = new ScanWriter(out, SCAN_WRITER_STRESS_RECORDS, &result)) == NULL) {
+		result = 2;
+	}
+
+	for (; (result == 0) && (created < SCAN_WRITER_STRESS_THREADS); created++) {
+		if (pthread_create(&ids[created], NULL, ScanWriterStressWork, &s)) {
+			result = 3;
+			break;
+		}
+	}
+
+	for (int i = 0; i < created; i++) pthread_join(ids[i], NULL);
+
+	// Every record made it out, in order
+	if ((result == 0) && (s.writer->written() != SCAN_WRITER_STRESS_RECORDS)) {
+		result = 4;
+	}
+
+	if (result == 0) {
+		rewind(out);
+
+		for (size_t i = 0; (result == 0) && (i < SCAN_WRITER_STRESS_RECORDS); i++) {
+			if ((c = fgetc(out)) != (int) ('0' + (i % 10))) result = 5;
+		}
+
+		if ((result == 0) && (fgetc(out) != EOF)) result = 6;
+	}
+
+	if (s.writer) delete s.writer;
+	if (out) fclose(out);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+/**
+ * Writes a `width` x `height` JPEG with `components` samples per pixel
+ * into a malloc'd buffer
+ */
+static int ImageProbeWriteJPEG(int components, int width, int height, unsigned char ** data, unsigned long * size) {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr err;
+	unsigned char row[64 * 3];
+
+	if (width * components > (int) sizeof(row)) return 1;
+
+	for (int i = 0; i < (int) sizeof(row); i++) row[i] = i * 4;
+
+	cinfo.err = jpeg_std_error(&err);
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, data, size);
+
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = components;
+	cinfo.in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	while (cinfo.next_scanline < cinfo.image_height) {
+		JSAMPROW rows[1] = {row};
+		jpeg_write_scanlines(&cinfo, rows, 1);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	return 0;
+}
+
+/**
+ * Writes a `width` x `height` 8 bit gray TIFF to `path`
+ */
+static int ImageProbeWriteTIFF(const char * path, int width, int height) {
+	int result = 0;
+	unsigned char row[64] = {0};
+	TIFF * tif = NULL;
+
+	if (width > (int) sizeof(row)) return 1;
+	else if ((tif = TIFFOpen(path, "w")) == NULL) return 2;
+
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, (uint32) width);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, (uint32) height);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, height);
+
+	for (int y = 0; (result == 0) && (y < height); y++) {
+		if (TIFFWriteScanline(tif, row, y, 0) < 0) result = 3;
+	}
+
+	TIFFClose(tif);
+
+	return result;
+}
+
+/**
+ * Probes `bytes` and loads them again with a second image. Both have to
+ * describe the same image, and the one we expect
+ */
+static int ImageProbeCompare(const void * bytes, size_t size, ImageType type, ImaginePixels width, ImaginePixels height, ImagineColorSpace colorspace) {
+	int result = 0;
+	int error = 0;
+	Image * probed = Image::createImageFromBuffer(bytes, size, &error);
+	Image * loaded = error ? NULL : Image::createImageFromBuffer(bytes, size, &error);
+
+	if (error || !probed || !loaded) {
+		result = 1;
+	} else if ((probed->type() != type) || probed->probe()) {
+		result = 2;
+	} else if ((probed->width() != width) || (probed->height() != height) || (probed->colorspace() != colorspace)) {
+		result = 3;
+	} else if (loaded->load()) {
+		result = 4;
+	} else {
+		if ((loaded->width() != probed->width()) || (loaded->height() != probed->height())) {
+			result = 5;
+		} else if (loaded->colorspace() != probed->colorspace()) {
+			result = 6;
+		} else if (loaded->bitsPerComponent() != probed->bitsPerComponent()) {
+			result = 7;
+		} else if (loaded->frameCount() != probed->frameCount()) {
+			result = 8;
+		}
+
+		if (loaded->unload() && (result == 0)) {
+			result = 9;
+		}
+	}
+
+	Delete(loaded);
+	Delete(probed);
+
+	return result;
+}
+
+int test_ImageProbe(void) {
+	int result = 0;
+	const unsigned char colors[2][3] = {{0, 0, 0}, {255, 255, 255}};
+	unsigned char indexes[8 * 6];
+	// 1 x 1 with a two color global table
+	const unsigned char gif[] = {
+		'G', 'I', 'F', '8', '9', 'a', 1, 0, 1, 0, 0x80, 0, 0,
+		0, 0, 0, 0xff, 0xff, 0xff,
+		0x2c, 0, 0, 0, 0, 1, 0, 1, 0, 0,
+		2, 2, 0x44, 0x01, 0,
+		0x3b
+	};
+	char tiffPath[] = "/tmp/imagine-probe-XXXXXX.tif";
+	char * png = NULL;
+	size_t pngSize = 0;
+	unsigned char * gray = NULL, * rgb = NULL, * tiff = NULL;
+	unsigned long graySize = 0, rgbSize = 0;
+	size_t tiffSize = 0;
+	MemoryAccount account;
+	FILE * file = NULL;
+	int fd = -1;
+
+	MemoryAccountInit(&account);
+	for (int i = 0; i < (int) sizeof(indexes); i++) indexes[i] = i % 2;
+
+	if ((file = StreamOpenMemoryOutput(&png, &pngSize)) == NULL) {
+		result = 1;
+	} else if (PNG::writePalette(file, indexes, 8, 6, colors, 2, NULL) || fclose(file)) {
+		result = 2;
+	} else if (ImageProbeWriteJPEG(1, 8, 6, &gray, &graySize) || ImageProbeWriteJPEG(3, 8, 6, &rgb, &rgbSize)) {
+		result = 3;
+	} else if ((fd = mkstemps(tiffPath, 4)) == -1) {
+		result = 4;
+	} else if (ImageProbeWriteTIFF(tiffPath, 5, 4)) {
+		result = 5;
+	} else if ((file = fdopen(fd, "rb")) == NULL) {
+		result = 6;
+	} else if (StreamReadAll(file, &account, &tiff, &tiffSize)) {
+		result = 7;
+	}
+
+	if (file) fclose(file);
+	else if (fd != -1) close(fd);
+	if (fd != -1) unlink(tiffPath);
+
+	// Palettes are not one of the color spaces we name
+	if ((result == 0) && ImageProbeCompare(png, pngSize, kImageTypePNG, 8, 6, kImagineColorSpaceUnknown)) {
+		result = 8;
+
+	// Gray JPEGs are gray whether they were probed or loaded
+	} else if ((result == 0) && ImageProbeCompare(gray, graySize, kImageTypeJPEG, 8, 6, kImagineColorSpaceGray)) {
+		result = 9;
+	} else if ((result == 0) && ImageProbeCompare(rgb, rgbSize, kImageTypeJPEG, 8, 6, kImagineColorSpaceRGB)) {
+		result = 10;
+	} else if ((result == 0) && ImageProbeCompare(gif, sizeof(gif), kImageTypeGIF, 1, 1, kImagineColorSpaceUnknown)) {
+		result = 11;
+	} else if ((result == 0) && ImageProbeCompare(tiff, tiffSize, kImageTypeTIFF, 5, 4, kImagineColorSpaceGray)) {
+		result = 12;
+	}
+
+	MemoryFree(&account, tiff);
+	free(gray);
+	free(rgb);
+	free(png);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+/**
+ * Decodes the JPEG at `path` as RGB into `pixels`
+ */
+static int JPEGTransformDecode(const char * path, unsigned char * pixels, size_t size, int * width, int * height) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr err;
+	FILE * file = fopen(path, "rb");
+
+	if (!file) return 1;
+
+	cinfo.err = jpeg_std_error(&err);
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, file);
+	(void) jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&cinfo);
+
+	*width = cinfo.output_width;
+	*height = cinfo.output_height;
+
+	if ((size_t) *width * *height * 3 > size) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(file);
+		return 2;
+	}
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW rows[1] = {pixels + (size_t) cinfo.output_scanline * *width * 3};
+		jpeg_read_scanlines(&cinfo, rows, 1);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(file);
+
+	return 0;
+}
+
+int test_JPEGTransformRoundTrip(void) {
+	int result = 0;
+	char dir[] = "/tmp/imagine-transform-XXXXXX";
+	char path[PATH_MAX];
+	char name[64] = "r";
+	unsigned char original[32 * 16 * 3], rotated[32 * 16 * 3];
+	unsigned char * jpeg = NULL;
+	unsigned long jpegSize = 0;
+	int width = 0, height = 0, w = 0, h = 0;
+	FILE * file = NULL;
+
+	// Whole MCUs on both axes, so nothing gets trimmed
+	if (mkdtemp(dir) == NULL) {
+		result = 1;
+	} else if (ImageProbeWriteJPEG(3, 32, 16, &jpeg, &jpegSize)) {
+		result = 2;
+	} else if (snprintf(path, sizeof(path), "%s/%s.jpg", dir, name) && ((file = fopen(path, "wb")) == NULL)) {
+		result = 3;
+	} else if (fwrite(jpeg, 1, jpegSize, file) != jpegSize) {
+		fclose(file);
+		result = 4;
+	} else if (fclose(file)) {
+		result = 4;
+	} else if (JPEGTransformDecode(path, original, sizeof(original), &width, &height)) {
+		result = 5;
+	}
+
+	// Four quarter turns, each read back from the last one's output
+	for (int turn = 0; (result == 0) && (turn < 4); turn++) {
+		int error = 0;
+		Image * img = Image::createImage(path, &error);
+
+		if (error || !img || (img->type() != kImageTypeJPEG)) {
+			result = 6;
+		} else if (((JPEG *) img)->transform(kJPEGTransformRotate90, NULL, dir)) {
+			result = 7;
+		}
+
+		Delete(img);
+
+		// transform() names its output after the input
+		if (result == 0) unlink(path);
+		strcat(name, "-rotate90");
+		snprintf(path, sizeof(path), "%s/%s.jpg", dir, name);
+
+		if ((result == 0) && JPEGTransformDecode(path, rotated, sizeof(rotated), &w, &h)) {
+			result = 8;
+		} else if ((result == 0) && (turn % 2 == 0) && ((w != height) || (h != width))) {
+			result = 9;
+		}
+	}
+
+	if ((result == 0) && ((w != width) || (h != height) || memcmp(original, rotated, sizeof(original)))) {
+		result = 10;
+	}
+
+	unlink(path);
+	rmdir(dir);
+	free(jpeg);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+/**
+ * Writes `size` bytes of `value` to dir/name, and the path to `path`
+ */
+static int ConversionCacheWrite(const char * dir, const char * name, unsigned char value, size_t size, char * path) {
+	unsigned char buf[1024];
+	FILE * file = NULL;
+	int result = 0;
+
+	if (size > sizeof(buf)) return 1;
+
+	memset(buf, value, size);
+	snprintf(path, PATH_MAX, "%s/%s", dir, name);
+
+	if ((file = fopen(path, "wb")) == NULL) {
+		result = 2;
+	} else if (fwrite(buf, 1, size, file) != size) {
+		result = 3;
+	}
+
+	if (file && fclose(file) && (result == 0)) {
+		result = 4;
+	}
+
+	return result;
+}
+
+/**
+ * Removes every file in `dir`, then `dir`
+ */
+static void ConversionCacheRemove(const char * dir) {
+	char path[PATH_MAX];
+	DIR * d = opendir(dir);
+	struct dirent * ent = NULL;
+
+	while (d && ((ent = readdir(d)) != NULL)) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		unlink(path);
+	}
+
+	if (d) closedir(d);
+	rmdir(dir);
+}
+
+int test_ConversionCacheKey(void) {
+	int result = 0;
+	char dir[] = "/tmp/imagine-cache-key-XXXXXX";
+	char input[PATH_MAX], other[PATH_MAX];
+	char key[CACHE_KEY_SIZE], same[CACHE_KEY_SIZE], sized[CACHE_KEY_SIZE], changed[CACHE_KEY_SIZE];
+	char salt[64], expected[32];
+	uint64_t hash = 0;
+
+	if (mkdtemp(dir) == NULL) {
+		result = 1;
+	} else if (ConversionCacheWrite(dir, "in", 'a', 100, input) || ConversionCacheWrite(dir, "other", 'b', 100, other)) {
+		result = 2;
+	} else if (ConversionCache::keyForInput(input, "png", key, sizeof(key))
+			|| ConversionCache::keyForInput(input, "png", same, sizeof(same))
+			|| ConversionCache::keyForInput(input, "png 4x", sized, sizeof(sized))
+			|| ConversionCache::keyForInput(other, "png", changed, sizeof(changed))) {
+		result = 3;
+	} else if (strcmp(key, same)) {
+		result = 4;
+
+	// Options and input bytes both change the key
+	} else if (!strcmp(key, sized) || !strcmp(key, changed)) {
+		result = 5;
+	} else if (HashFile(input, &hash)) {
+		result = 6;
+	}
+
+	// So does IMAGINE_VERSION, which salts the options
+	if (result == 0) {
+		snprintf(salt, sizeof(salt), "%s\npng", IMAGINE_VERSION);
+		snprintf(expected, sizeof(expected), "-%016llx", (unsigned long long) HashXXH64(salt, strlen(salt), hash));
+
+		if (strcmp(key + strlen(key) - strlen(expected), expected)) {
+			result = 7;
+		} else {
+			snprintf(salt, sizeof(salt), "%s.1\npng", IMAGINE_VERSION);
+			snprintf(expected, sizeof(expected), "-%016llx", (unsigned long long) HashXXH64(salt, strlen(salt), hash));
+
+			if (!strcmp(key + strlen(key) - strlen(expected), expected)) {
+				result = 8;
+			}
+		}
+	}
+
+	if ((result == 0) && (ConversionCache::keyForInput(input, "png", key, 8) == 0)) {
+		result = 9;
+	}
+
+	ConversionCacheRemove(dir);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_ConversionCacheStore(void) {
+	int result = 0;
+	char dir[] = "/tmp/imagine-cache-store-XXXXXX";
+	char cachePath[PATH_MAX], input[PATH_MAX], output[PATH_MAX];
+	char key[CACHE_KEY_SIZE];
+	unsigned char buf[1024];
+	ConversionCache * cache = NULL;
+	FILE * file = NULL;
+	int error = 0;
+
+	if (mkdtemp(dir) == NULL) {
+		result = 1;
+	} else if (ConversionCacheWrite(dir, "converted", 'c', 700, input)) {
+		result = 2;
+	} else if (snprintf(cachePath, sizeof(cachePath), "%s/cache", dir)
+			&& (((cache = new ConversionCache(cachePath, CACHE_DEFAULT_MAX_SIZE, &error)) == NULL) || error)) {
+		result = 3;
+	} else if (ConversionCache::keyForInput(input, "png", key, sizeof(key))) {
+		result = 4;
+	} else if (snprintf(output, sizeof(output), "%s/fetched", dir) && cache->fetch(key, output)) {
+		result = 5;
+	} else if (cache->store(key, input)) {
+		result = 6;
+	} else if (!cache->fetch(key, output)) {
+		result = 7;
+	} else if ((file = fopen(output, "rb")) == NULL) {
+		result = 8;
+	} else if ((fread(buf, 1, sizeof(buf), file) != 700) || (buf[0] != 'c') || (buf[699] != 'c')) {
+		result = 9;
+	}
+
+	if (file) fclose(file);
+	Delete(cache);
+
+	unlink(output);
+	ConversionCacheRemove(cachePath);
+	ConversionCacheRemove(dir);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+/**
+ * Bytes held by entries in the cache at `path`
+ */
+static uint64_t ConversionCacheEntryBytes(const char * path, size_t * count) {
+	uint64_t total = 0;
+	char entry[PATH_MAX];
+	DIR * d = opendir(path);
+	struct dirent * ent = NULL;
+	struct stat st;
+
+	*count = 0;
+
+	while (d && ((ent = readdir(d)) != NULL)) {
+		if ((ent->d_name[0] == '.') || !strcmp(ent->d_name, "lock") || !strcmp(ent->d_name, "usage")) continue;
+
+		snprintf(entry, sizeof(entry), "%s/%s", path, ent->d_name);
+		if (stat(entry, &st) == 0) {
+			total += st.st_size;
+			(*count)++;
+		}
+	}
+
+	if (d) closedir(d);
+
+	return total;
+}
+
+int test_ConversionCacheEvict(void) {
+	int result = 0;
+	char dir[] = "/tmp/imagine-cache-evict-XXXXXX";
+	char cachePath[PATH_MAX], path[PATH_MAX], output[PATH_MAX], stale[PATH_MAX], fresh[PATH_MAX];
+	char keys[4][CACHE_KEY_SIZE];
+	const char * names[4] = {"a", "b", "c", "d"};
+	struct timespec old[2] = {{0, 0}, {0, 0}};
+	ConversionCache * cache = NULL;
+	size_t count = 0;
+	int error = 0;
+
+	if (mkdtemp(dir) == NULL) {
+		result = 1;
+	} else if (snprintf(cachePath, sizeof(cachePath), "%s/cache", dir)
+			&& (((cache = new ConversionCache(cachePath, 1000, &error)) == NULL) || error)) {
+		result = 2;
+	}
+
+	for (int i = 0; (result == 0) && (i < 4); i++) {
+		if (ConversionCacheWrite(dir, names[i], 'a' + i, 300, path)) {
+			result = 3;
+		} else if (ConversionCache::keyForInput(path, "png", keys[i], sizeof(keys[i]))) {
+			result = 4;
+		}
+	}
+
+	// A crash left one temporary file long ago, a store in flight has
+	// another
+	if ((result == 0) && (ConversionCacheWrite(cachePath, ".tmp-stale", 's', 10, stale) || ConversionCacheWrite(cachePath, ".tmp-fresh", 'f', 10, fresh))) {
+		result = 5;
+	} else if ((result == 0) && utimensat(AT_FDCWD, stale, old, 0)) {
+		result = 6;
+	}
+
+	// Stored a while ago, a before b. Timestamps are too coarse to
+	// tell apart stores made back to back
+	for (int i = 0; (result == 0) && (i < 2); i++) {
+		struct timespec stored[2] = {{0, UTIME_OMIT}, {time(NULL) - 200 + (i * 100), 0}};
+
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+
+		if (cache->store(keys[i], path)) {
+			result = 7;
+		} else if (snprintf(path, sizeof(path), "%s/%s", cachePath, keys[i]) && utimensat(AT_FDCWD, path, stored, 0)) {
+			result = 8;
+		}
+	}
+
+	// b is the least recently used once a is fetched again, and
+	// storing d goes over the cap
+	snprintf(output, sizeof(output), "%s/fetched", dir);
+	if ((result == 0) && !cache->fetch(keys[0], output)) {
+		result = 8;
+	}
+
+	for (int i = 2; (result == 0) && (i < 4); i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+
+		if (cache->store(keys[i], path)) {
+			result = 7;
+		}
+	}
+
+	if ((result == 0) && (ConversionCacheEntryBytes(cachePath, &count) > 1000)) {
+		result = 9;
+	} else if ((result == 0) && (count != 3)) {
+		result = 10;
+	}
+
+	for (int i = 0; (result == 0) && (i < 4); i++) {
+		snprintf(path, sizeof(path), "%s/%s", cachePath, keys[i]);
+
+		if ((access(path, F_OK) == 0) != (i != 1)) {
+			result = 11;
+		}
+	}
+
+	if ((result == 0) && ((access(stale, F_OK) == 0) || (access(fresh, F_OK) != 0))) {
+		result = 12;
+	}
+
+	Delete(cache);
+
+	ConversionCacheRemove(cachePath);
+	ConversionCacheRemove(dir);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+/**
+ * Probes each of `paths` and adds them to the index at `indexPath` in
+ * one session, so they all land in the same segment
+ */
+static int MetadataIndexAdd(const char * indexPath, const char ** paths, int count) {
+	int result = 0;
+	MetadataIndex * index = new MetadataIndex(indexPath, false, &result);
+
+	for (int i = 0; (result == 0) && (i < count); i++) {
+		Image * img = Image::createImage(paths[i], &result);
+		BF::Dictionary<BF::String, BF::String> metadata;
+		struct stat st;
+
+		if (result || !img) {
+			result = 1;
+		} else if (img->probe() || img->compileMetadata(&metadata)) {
+			result = 2;
+		} else if (stat(paths[i], &st)) {
+			result = 3;
+		} else if (index->add(paths[i], &st, img, &metadata)) {
+			result = 4;
+		}
+
+		delete img;
+	}
+
+	delete index;
+
+	return result;
+}
+
+/**
+ * Reopens the index and looks `path` up as it is on disk now. Hits
+ * only count if they remember the right width
+ */
+static bool MetadataIndexHit(const char * indexPath, const char * path, bool hashContents, int64_t width) {
+	int err = 0;
+	bool hit = false;
+	struct stat st;
+	IndexEntry entry;
+	MetadataIndex * index = new MetadataIndex(indexPath, hashContents, &err);
+
+	if ((err == 0) && !stat(path, &st) && index->lookup(path, &st, &entry)) {
+		hit = entry.width == width;
+	}
+
+	delete index;
+
+	return hit;
+}
+
+/**
+ * Number of segments in the index at `indexPath`. `last` gets the
+ * path of one of them
+ */
+static int MetadataIndexSegments(const char * indexPath, char * last) {
+	int count = 0;
+	size_t length = 0;
+	DIR * d = opendir(indexPath);
+	struct dirent * ent = NULL;
+
+	while (d && ((ent = readdir(d)) != NULL)) {
+		length = strlen(ent->d_name);
+		if ((length < 4) || strcmp(ent->d_name + length - 4, ".seg")) continue;
+
+		if (last) snprintf(last, PATH_MAX, "%s/%s", indexPath, ent->d_name);
+		count++;
+	}
+
+	if (d) closedir(d);
+
+	return count;
+}
+
+int test_MetadataIndexLookup(void) {
+	int result = 0;
+	char dir[] = "/tmp/imagine-index-lookup-XXXXXX";
+	char indexPath[PATH_MAX], touched[PATH_MAX], resized[PATH_MAX];
+	const char * paths[2] = {touched, resized};
+	struct timespec times[2] = {{0, UTIME_OMIT}, {1000000, 0}};
+	struct stat st;
+
+	if (mkdtemp(dir) == NULL) {
+		result = 1;
+	} else {
+		snprintf(indexPath, sizeof(indexPath), "%s/index", dir);
+		snprintf(touched, sizeof(touched), "%s/touched.tif", dir);
+		snprintf(resized, sizeof(resized), "%s/resized.tif", dir);
+	}
+
+	if (result) {
+		// Nothing to set up
+	} else if (ImageProbeWriteTIFF(touched, 5, 4) || ImageProbeWriteTIFF(resized, 7, 4)) {
+		result = 2;
+	} else if (MetadataIndexAdd(indexPath, paths, 2)) {
+		result = 3;
+
+	// Both are visible once the index is opened again
+	} else if (!MetadataIndexHit(indexPath, touched, false, 5) || !MetadataIndexHit(indexPath, resized, false, 7)) {
+		result = 4;
+	} else if (utimensat(AT_FDCWD, touched, times, 0)) {
+		result = 5;
+	} else if (MetadataIndexHit(indexPath, touched, false, 5)) {
+		result = 6;
+
+	// Same size so content hashing could save it, but nothing was hashed
+	// when it was added
+	} else if (MetadataIndexHit(indexPath, touched, true, 5)) {
+		result = 7;
+	} else if (stat(resized, &st) || truncate(resized, st.st_size + 1)) {
+		result = 8;
+	} else if (MetadataIndexHit(indexPath, resized, false, 7)) {
+		result = 9;
+
+	// Lookups with nothing to add leave no segment behind
+	} else if (MetadataIndexSegments(indexPath, NULL) != 1) {
+		result = 10;
+	}
+
+	ConversionCacheRemove(indexPath);
+	ConversionCacheRemove(dir);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_MetadataIndexTruncated(void) {
+	int result = 0;
+	char dir[] = "/tmp/imagine-index-truncated-XXXXXX";
+	char indexPath[PATH_MAX], first[PATH_MAX], last[PATH_MAX], segment[PATH_MAX];
+	const char * paths[2] = {first, last};
+	struct stat st;
+
+	if (mkdtemp(dir) == NULL) {
+		result = 1;
+	} else {
+		snprintf(indexPath, sizeof(indexPath), "%s/index", dir);
+		snprintf(first, sizeof(first), "%s/first.tif", dir);
+		snprintf(last, sizeof(last), "%s/last.tif", dir);
+	}
+
+	if (result) {
+		// Nothing to set up
+	} else if (ImageProbeWriteTIFF(first, 5, 4) || ImageProbeWriteTIFF(last, 7, 4)) {
+		result = 2;
+	} else if (MetadataIndexAdd(indexPath, paths, 2)) {
+		result = 3;
+	} else if (MetadataIndexSegments(indexPath, segment) != 1) {
+		result = 4;
+
+	// As if we died halfway through writing the last record
+	} else if (stat(segment, &st) || truncate(segment, st.st_size - 8)) {
+		result = 5;
+	} else if (!MetadataIndexHit(indexPath, first, false, 5)) {
+		result = 6;
+	} else if (MetadataIndexHit(indexPath, last, false, 7)) {
+		result = 7;
+
+	// Adding it again goes to a new segment and is found
+	} else if (MetadataIndexAdd(indexPath, &paths[1], 1)) {
+		result = 8;
+	} else if (!MetadataIndexHit(indexPath, last, false, 7) || !MetadataIndexHit(indexPath, first, false, 5)) {
+		result = 9;
+	}
+
+	ConversionCacheRemove(indexPath);
+	ConversionCacheRemove(dir);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
+
+int test_MetadataIndexCompact(void) {
+	int result = 0;
+	char dir[] = "/tmp/imagine-index-compact-XXXXXX";
+	char indexPath[PATH_MAX];
+	char files[10][PATH_MAX];
+	const char * path = NULL;
+	int segments = 0;
+
+	if (mkdtemp(dir) == NULL) {
+		result = 1;
+	} else {
+		snprintf(indexPath, sizeof(indexPath), "%s/index", dir);
+	}
+
+	// One segment per session. Closing the eighth compacts them
+	for (int i = 0; (result == 0) && (i < 10); i++) {
+		snprintf(files[i], PATH_MAX, "%s/%d.tif", dir, i);
+		path = files[i];
+
+		if (ImageProbeWriteTIFF(path, i + 1, 4)) {
+			result = 2;
+		} else if (MetadataIndexAdd(indexPath, &path, 1)) {
+			result = 3;
+		} else if ((segments = MetadataIndexSegments(indexPath, NULL)) > 8) {
+			result = 4;
+		}
+	}
+
+	// The compacted segment plus the two added after it
+	if ((result == 0) && (segments != 3)) {
+		result = 5;
+	}
+
+	for (int i = 0; (result == 0) && (i < 10); i++) {
+		if (!MetadataIndexHit(indexPath, files[i], false, i + 1)) result = 6;
+	}
+
+	ConversionCacheRemove(indexPath);
+	ConversionCacheRemove(dir);
+
+	PRINT_TEST_RESULTS(!result);
+	return result;
+}
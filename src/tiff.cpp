@@ -4,6 +4,11 @@
  */
 
 #include "tiff.hpp"
+#include "xmp.hpp"
+#include "trace.hpp"
+#include "counters.hpp"
+#include "memory.hpp"
+#include "stream.hpp"
 #include <fcntl.h>
 #include <unistd.h>
 #include <bflibcpp/bflibcpp.hpp>
@@ -23,61 +28,628 @@ bool Tiff::isType(const char * path) {
 }
 
 Tiff::Tiff(const char * path, int * err) : Image(path, err) {
-
+	this->_tiff = NULL;
+	this->_version = 0;
+	this->_magNum = 0;
 }
 
 Tiff::~Tiff() {
 }
 
 ImaginePixels Tiff::width() {
-	uint32 w;
+	uint32 w = 0;
+	if (!this->_tiff) return this->_probeInfo.width;
 	TIFFGetField(this->_tiff, TIFFTAG_IMAGEWIDTH, &w);
 	return w;
 }
 
 ImaginePixels Tiff::height() {
-	uint32 h;
+	uint32 h = 0;
+	if (!this->_tiff) return this->_probeInfo.height;
 	TIFFGetField(this->_tiff, TIFFTAG_IMAGELENGTH, &h);
 	return h;
 }
 
 int Tiff::bitsPerComponent() {
-	uint32 b;
+	uint16 b = 0;
+	if (!this->_tiff) return this->_probeInfo.bitsPerComponent;
 	TIFFGetField(this->_tiff, TIFFTAG_BITSPERSAMPLE, &b);
 	return b;
 }
 
+/**
+ * Maps photometric interpretation and samples per pixel to our color space
+ */
+static ImagineColorSpace TiffColorSpace(int photometric, int samplesPerPixel) {
+	switch (photometric) {
+		case PHOTOMETRIC_MINISWHITE:
+		case PHOTOMETRIC_MINISBLACK:
+			return kImagineColorSpaceGray;
+		case PHOTOMETRIC_RGB:
+			return samplesPerPixel >= 4 ? kImagineColorSpaceRGBA : kImagineColorSpaceRGB;
+		default:
+			return kImagineColorSpaceUnknown;
+	}
+}
+
 ImagineColorSpace Tiff::colorspace() {
-	return kImagineColorSpaceUnknown;
+	uint16 photometric = 0;
+	uint16 spp = 1;
+
+	if (!this->_tiff) return this->_probeInfo.colorspace;
+
+	TIFFGetField(this->_tiff, TIFFTAG_PHOTOMETRIC, &photometric);
+	TIFFGetFieldDefaulted(this->_tiff, TIFFTAG_SAMPLESPERPIXEL, &spp);
+	return TiffColorSpace(photometric, spp);
 }
 
-int Tiff::load() {
+int Tiff::frameCount() {
+	if (!this->_tiff) return this->_probeInfo.frameCount;
+	return TIFFNumberOfDirectories(this->_tiff);
+}
+
+/// Stop following the IFD chain after this many pages
+const int TIFF_PROBE_MAX_PAGES = 0xffff;
+
+/// Larger directories are treated as corrupt
+const uint64_t TIFF_PROBE_MAX_ENTRIES = 0x1000;
+
+/// We won't hold XMP packets larger than this in memory
+const uint64_t TIFF_PROBE_MAX_XMP_SIZE = 16 * 1024 * 1024;
+
+/**
+ * Minimal reader state for walking IFDs without libtiff
+ */
+typedef struct {
+	int fd;
+	bool bigEndian;
+	bool bigTiff;
+} TiffProbeReader;
+
+static uint64_t TiffProbeValue(const TiffProbeReader * r, const unsigned char * b, int size) {
+	uint64_t v = 0;
+	for (int i = 0; i < size; i++) {
+		int shift = r->bigEndian ? (size - 1 - i) * 8 : i * 8;
+		v |= (uint64_t) b[i] << shift;
+	}
+	return v;
+}
+
+static int TiffProbeRead(const TiffProbeReader * r, uint64_t offset, void * buf, size_t size) {
+	return pread(r->fd, buf, size, offset) == (ssize_t) size ? 0 : 1;
+}
+
+/**
+ * Reads the first value of an IFD entry. Values that do not fit in
+ * the entry are read from the offset it holds
+ */
+static int TiffProbeEntryValue(const TiffProbeReader * r, const unsigned char * entry, uint64_t * value) {
+	unsigned char b[8];
+	int typeSize;
+	int fieldSize = r->bigTiff ? 8 : 4;
+	uint16_t type = TiffProbeValue(r, entry + 2, 2);
+	uint64_t count = TiffProbeValue(r, entry + 4, r->bigTiff ? 8 : 4);
+	const unsigned char * field = entry + (r->bigTiff ? 12 : 8);
+
+	switch (type) {
+		case TIFF_BYTE: typeSize = 1; break;
+		case TIFF_SHORT: typeSize = 2; break;
+		case TIFF_LONG: typeSize = 4; break;
+		case TIFF_LONG8: typeSize = 8; break;
+		default: return 1;
+	}
+
+	if (count * typeSize > (uint64_t) fieldSize) {
+		if (TiffProbeRead(r, TiffProbeValue(r, field, fieldSize), b, typeSize)) return 2;
+		field = b;
+	}
+
+	*value = TiffProbeValue(r, field, typeSize);
+
+	return 0;
+}
+
+/**
+ * Reads the byte array an XMLPacket entry points at into an owned buffer
+ */
+static char * TiffProbeReadPacket(const TiffProbeReader * r, const unsigned char * entry, size_t * size) {
+	int fieldSize = r->bigTiff ? 8 : 4;
+	uint64_t count = TiffProbeValue(r, entry + 4, r->bigTiff ? 8 : 4);
+	const unsigned char * field = entry + (r->bigTiff ? 12 : 8);
+	char * packet = NULL;
+
+	if ((count == 0) || (count > TIFF_PROBE_MAX_XMP_SIZE)) return NULL;
+	else if ((packet = (char *) malloc(count)) == NULL) return NULL;
+
+	// Small enough to sit in the entry itself
+	if (count <= (uint64_t) fieldSize) {
+		memcpy(packet, field, count);
+	} else if (TiffProbeRead(r, TiffProbeValue(r, field, fieldSize), packet, count)) {
+		BFFree(packet);
+		return NULL;
+	}
+
+	*size = count;
+	return packet;
+}
+
+/**
+ * Reads the header and the first IFD by hand, then follows the IFD
+ * chain reading only the entry count and next offset of each page
+ */
+int Tiff::probe() {
 	int result = 0;
-	TIFFHeaderCommon header;
-	int fd = open(this->path(), O_RDONLY);
+	TiffProbeReader r = {-1, false, false};
+	unsigned char header[16];
+	unsigned char * entries = NULL;
+	uint64_t offset = 0;
+	uint64_t photometric = 0;
+	uint64_t spp = 1;
+	int pages = 0;
+
+	// Standard input can only be read once and buffers are already in
+	// memory. load() knows how to read both whole
+	if (StreamIsStdio(this->path()) || this->inputBuffer(NULL)) {
+		return this->Image::probe();
+	}
 
-	if (fd == -1) {
+	if ((r.fd = open(this->path(), O_RDONLY)) == -1) {
+		BFErrorPrint("Could not open '%s'", this->path());
 		result = 1;
-	} else if (read(fd, &header, sizeof(header)) == -1) {
+	} else if (TiffProbeRead(&r, 0, header, 8)) {
 		result = 2;
+	} else if ((header[0] == 'M') && (header[1] == 'M')) {
+		r.bigEndian = true;
+	} else if ((header[0] != 'I') || (header[1] != 'I')) {
+		BFErrorPrint("'%s' does not have a tiff byte order mark", this->path());
+		result = 3;
+	}
+
+	// Same raw values load() stores
+	if (result == 0) {
+		memcpy(&this->_magNum, header, 2);
+		memcpy(&this->_version, header + 2, 2);
+
+		switch (TiffProbeValue(&r, header + 2, 2)) {
+			case TIFF_VERSION_CLASSIC:
+				offset = TiffProbeValue(&r, header + 4, 4);
+				break;
+			case TIFF_VERSION_BIG:
+				r.bigTiff = true;
+				if (TiffProbeRead(&r, 0, header, 16)) result = 4;
+				else offset = TiffProbeValue(&r, header + 8, 8);
+				break;
+			default:
+				BFErrorPrint("Unknown tiff version in '%s'", this->path());
+				result = 5;
+		}
+	}
+
+	while (!result && offset && (pages < TIFF_PROBE_MAX_PAGES)) {
+		unsigned char b[8];
+		int countSize = r.bigTiff ? 8 : 2;
+		int entrySize = r.bigTiff ? 20 : 12;
+		int nextSize = r.bigTiff ? 8 : 4;
+		uint64_t count;
+
+		if (TiffProbeRead(&r, offset, b, countSize)) {
+			result = 6;
+			break;
+		}
+
+		count = TiffProbeValue(&r, b, countSize);
+		if (count > TIFF_PROBE_MAX_ENTRIES) {
+			BFErrorPrint("Tiff directory in '%s' has %lu entries", this->path(), (unsigned long) count);
+			result = 7;
+			break;
+		}
+
+		// Only the first page's entries are of interest
+		if (pages == 0) {
+			if ((entries = (unsigned char *) malloc(count * entrySize)) == NULL) {
+				result = 8;
+			} else if (TiffProbeRead(&r, offset + countSize, entries, count * entrySize)) {
+				result = 9;
+			} else {
+				for (uint64_t i = 0; (result == 0) && (i < count); i++) {
+					const unsigned char * entry = entries + i * entrySize;
+					uint64_t value = 0;
+
+					if (TiffProbeValue(&r, entry, 2) == TIFFTAG_XMLPACKET) {
+						size_t size = 0;
+						char * packet = TiffProbeReadPacket(&r, entry, &size);
+						if (packet) this->setMetadataBlock(kImagineMetadataXMP, packet, size, true);
+						continue;
+					}
+
+					if (TiffProbeEntryValue(&r, entry, &value)) continue;
+
+					switch (TiffProbeValue(&r, entry, 2)) {
+						case TIFFTAG_IMAGEWIDTH:
+							this->_probeInfo.width = value;
+							break;
+						case TIFFTAG_IMAGELENGTH:
+							this->_probeInfo.height = value;
+							break;
+						case TIFFTAG_BITSPERSAMPLE:
+							this->_probeInfo.bitsPerComponent = value;
+							break;
+						case TIFFTAG_SAMPLESPERPIXEL:
+							spp = value;
+							break;
+						case TIFFTAG_PHOTOMETRIC:
+							photometric = value;
+							break;
+					}
+				}
+			}
+
+			BFFree(entries);
+			entries = NULL;
+		}
+
+		if (result == 0) {
+			uint64_t next = offset + countSize + count * entrySize;
+			pages++;
+
+			if (TiffProbeRead(&r, next, b, nextSize)) {
+				result = 10;
+			} else {
+				uint64_t nextOffset = TiffProbeValue(&r, b, nextSize);
+
+				// Offsets only move forward in well formed files, which
+				// also keeps a looping chain from running away
+				offset = nextOffset > offset ? nextOffset : 0;
+			}
+		}
+	}
+
+	if ((result == 0) && (pages == 0)) {
+		BFErrorPrint("'%s' has no tiff directories", this->path());
+		result = 11;
+	}
+
+	if (result == 0) {
+		this->_probeInfo.components = spp;
+		this->_probeInfo.colorspace = TiffColorSpace(photometric, spp);
+		this->_probeInfo.frameCount = pages;
+	}
+
+	if (r.fd != -1) close(r.fd);
+
+	return result;
+}
+
+/**
+ * A whole file in memory that libtiff reads through TIFFClientOpen()
+ */
+typedef struct {
+	const unsigned char * data;
+	toff_t size;
+	toff_t offset;
+
+	/// Set when `data` is ours to free when libtiff closes the file
+	MemoryAccount * account;
+	bool owned;
+} TiffMemoryFile;
+
+static tmsize_t TiffMemoryRead(thandle_t handle, void * buffer, tmsize_t size) {
+	TiffMemoryFile * file = (TiffMemoryFile *) handle;
+	toff_t left = file->offset < file->size ? file->size - file->offset : 0;
+
+	if ((toff_t) size > left) size = left;
+	memcpy(buffer, file->data + file->offset, size);
+	file->offset += size;
+
+	return size;
+}
+
+static tmsize_t TiffMemoryWrite(thandle_t handle, void * buffer, tmsize_t size) {
+	return -1;
+}
+
+static toff_t TiffMemorySeek(thandle_t handle, toff_t offset, int whence) {
+	TiffMemoryFile * file = (TiffMemoryFile *) handle;
+
+	switch (whence) {
+		case SEEK_SET: file->offset = offset; break;
+		case SEEK_CUR: file->offset += offset; break;
+		case SEEK_END: file->offset = file->size + offset; break;
+		default: return (toff_t) -1;
+	}
+
+	return file->offset;
+}
+
+static int TiffMemoryClose(thandle_t handle) {
+	TiffMemoryFile * file = (TiffMemoryFile *) handle;
+
+	if (file->owned) MemoryFree(file->account, (void *) file->data);
+	free(file);
+
+	return 0;
+}
+
+static toff_t TiffMemorySize(thandle_t handle) {
+	return ((TiffMemoryFile *) handle)->size;
+}
+
+/**
+ * Strips are read straight out of the buffer instead of being copied
+ */
+static int TiffMemoryMap(thandle_t handle, void ** base, toff_t * size) {
+	TiffMemoryFile * file = (TiffMemoryFile *) handle;
+
+	*base = (void *) file->data;
+	*size = file->size;
+
+	return 1;
+}
+
+static void TiffMemoryUnmap(thandle_t handle, void * base, toff_t size) {
+
+}
+
+/**
+ * Opens `size` bytes at `data` with libtiff. When `owned` the bytes came
+ * from MemoryAllocate() on `account` and go when the TIFF is closed,
+ * even if opening it fails
+ */
+static TIFF * TiffOpenMemory(const char * name, const unsigned char * data, size_t size, MemoryAccount * account, bool owned) {
+	TiffMemoryFile * file = NULL;
+	TIFF * tif = NULL;
+
+	if ((file = (TiffMemoryFile *) malloc(sizeof(TiffMemoryFile))) == NULL) {
+		if (owned) MemoryFree(account, (void *) data);
+		return NULL;
+	}
+
+	file->data = data;
+	file->size = size;
+	file->offset = 0;
+	file->account = account;
+	file->owned = owned;
+
+	tif = TIFFClientOpen(name, "r", (thandle_t) file,
+		TiffMemoryRead, TiffMemoryWrite, TiffMemorySeek, TiffMemoryClose,
+		TiffMemorySize, TiffMemoryMap, TiffMemoryUnmap);
+
+	// libtiff does not close what it failed to open
+	if (!tif) TiffMemoryClose((thandle_t) file);
+
+	return tif;
+}
+
+/**
+ * libtiff seeks all over the file. Standard input is opened in place
+ * when it is a file and only spooled into memory when it is a pipe.
+ * Buffers are read where they are
+ */
+TIFF * Tiff::openTIFF() {
+	TIFF * tif = NULL;
+	FILE * file = NULL;
+	unsigned char * data = NULL;
+	size_t size = 0;
+	int fd = -1;
+
+	if (this->inputBuffer(&size)) {
+		return TiffOpenMemory(this->path(), this->inputBuffer(NULL), size, this->memory(), false);
+	} else if (!StreamIsStdio(this->path())) {
+		return TIFFOpen(this->path(), "r");
+	} else if ((file = StreamOpenInput(this->path())) == NULL) {
+		return NULL;
+	}
+
+	if (StreamIsSeekable(this->path())) {
+		// libtiff closes the descriptor it is given
+		if ((fd = dup(fileno(file))) != -1) {
+			if ((tif = TIFFFdOpen(fd, this->path(), "r")) == NULL) close(fd);
+		}
+	} else if (StreamReadAll(file, this->memory(), &data, &size)) {
+		BFErrorPrint("Could not read '%s' into memory", this->path());
 	} else {
-		this->_version = header.tiff_version;
-		this->_magNum = header.tiff_magic;
-		close(fd);
+		TraceScope scope("spool", this->path());
+		tif = TiffOpenMemory(this->path(), data, size, this->memory(), true);
+	}
+
+	fclose(file);
+
+	return tif;
+}
+
+int Tiff::load() {
+	int result = 0;
+	TraceScope scope("load", this->path());
+	unsigned char header[STREAM_PEEK_SIZE];
+	size_t length = 0;
+
+	// Magic number then version, same raw values probe() keeps
+	if (this->inputBuffer(&length)) {
+		memcpy(header, this->inputBuffer(NULL), length < sizeof(header) ? length : sizeof(header));
+	} else if (StreamPeek(this->path(), header, sizeof(header), &length)) {
+		result = 1;
+	}
+
+	if ((result == 0) && (length < 4)) {
+		result = 2;
+	} else if (result == 0) {
+		memcpy(&this->_magNum, header, 2);
+		memcpy(&this->_version, header + 2, 2);
 	}
 
 	if (result == 0) {
-		this->_tiff = TIFFOpen(this->path(), "r");
+		this->_tiff = this->openTIFF();
 		if (this->_tiff == NULL) {
 			result = 3;
 		}
 	}
 
+	if (result == 0) {
+		this->borrowMetadataBlocks();
+	}
+
+	return result;
+}
+
+void Tiff::borrowMetadataBlocks() {
+	uint32 size = 0;
+	void * packet = NULL;
+
+	// libtiff owns the packet until TIFFClose or until we
+	// switch directories
+	this->releaseMetadataBlocks();
+	if (TIFFGetField(this->_tiff, TIFFTAG_XMLPACKET, &size, &packet) && packet) {
+		this->setMetadataBlock(kImagineMetadataXMP, (const char *) packet, size, false);
+	}
+}
+
+/**
+ * Returns the area of the current directory if it covers width x height
+ * and 0 if it does not
+ */
+static uint64_t TiffPageArea(TIFF * tif, ImaginePixels width, ImaginePixels height) {
+	uint32 w = 0, h = 0;
+
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+
+	return ((w >= width) && (h >= height)) ? (uint64_t) w * h : 0;
+}
+
+/**
+ * Moves to the smallest reduced resolution copy of the first page that
+ * still covers width x height, or stays on the first page
+ *
+ * Copies are either SubIFDs of the first page (pyramids, DNG previews)
+ * or the directories right after it flagged FILETYPE_REDUCEDIMAGE
+ */
+static int TiffSelectReducedPage(TIFF * tif, ImaginePixels width, ImaginePixels height) {
+	uint64_t best = TiffPageArea(tif, 0, 0);
+	uint16_t bestDirectory = 0;
+	uint64_t bestSubIFD = 0;
+	uint16_t subCount = 0;
+	uint64_t * subIFDs = NULL;
+	uint64_t * offsets = NULL;
+
+	// The offsets belong to the directory we are about to leave
+	if (TIFFGetField(tif, TIFFTAG_SUBIFD, &subCount, &offsets) && subCount) {
+		if ((subIFDs = (uint64_t *) malloc(subCount * sizeof(uint64_t))) == NULL) {
+			return 1;
+		}
+
+		memcpy(subIFDs, offsets, subCount * sizeof(uint64_t));
+	}
+
+	for (uint16_t i = 0; i < subCount; i++) {
+		uint64_t area = 0;
+
+		if (!TIFFSetSubDirectory(tif, subIFDs[i])) {
+			continue;
+		} else if ((area = TiffPageArea(tif, width, height)) && (area < best)) {
+			best = area;
+			bestSubIFD = subIFDs[i];
+		}
+	}
+
+	// Any other page ends the run of reduced copies
+	for (uint16_t d = 1; TIFFSetDirectory(tif, d); d++) {
+		uint32 type = 0;
+		uint64_t area = 0;
+
+		if (!TIFFGetField(tif, TIFFTAG_SUBFILETYPE, &type) || !(type & FILETYPE_REDUCEDIMAGE)) {
+			break;
+		} else if ((area = TiffPageArea(tif, width, height)) && (area < best)) {
+			best = area;
+			bestDirectory = d;
+			bestSubIFD = 0;
+		}
+	}
+
+	free(subIFDs);
+
+	if (bestSubIFD) {
+		return TIFFSetSubDirectory(tif, bestSubIFD) ? 0 : 2;
+	} else {
+		return TIFFSetDirectory(tif, bestDirectory) ? 0 : 2;
+	}
+}
+
+int Tiff::decodeRows(ImagineRowHandler handler, void * context) {
+	int result = 0;
+	TraceScope scope("decodeRows", this->path());
+	ImaginePixels tw = 0, th = 0;
+	bool reduced = false;
+	uint32 width = 0, height = 0;
+	uint32 * raster = NULL;
+	unsigned char * line = NULL;
+	ImagineRow row;
+
+	if (!this->_tiff) {
+		return 1;
+	}
+
+	if (this->targetSizeForSource(this->width(), this->height(), &tw, &th)) {
+		reduced = true;
+		result = TiffSelectReducedPage(this->_tiff, tw, th);
+	}
+
+	if (result == 0) {
+		TIFFGetField(this->_tiff, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(this->_tiff, TIFFTAG_IMAGELENGTH, &height);
+
+		// libtiff handles every photometric and layout for us. With a
+		// reduced page this is small, without one it is the full page.
+		// Only our buffers are charged, libtiff's own are not
+		raster = (uint32 *) MemoryAllocate(this->memory(), (size_t) width * height * sizeof(uint32));
+		line = (unsigned char *) MemoryAllocate(this->memory(), (size_t) width * 4);
+
+		if (!raster || !line) {
+			result = 3;
+		} else {
+			TraceScope scope("TIFFReadRGBAImage", this->path());
+			CountersScope stage(kCountersStageDecode);
+
+			if (!TIFFReadRGBAImageOriented(this->_tiff, width, height, raster, ORIENTATION_TOPLEFT, 0)) {
+				BFErrorPrint("Could not read pixels of '%s'", this->path());
+				result = 4;
+			}
+		}
+	}
+
+	row.data = line;
+	row.width = width;
+	row.height = height;
+	row.components = 4;
+
+	for (row.y = 0; (result == 0) && (row.y < row.height); row.y++) {
+		const uint32 * pixels = raster + (size_t) row.y * width;
+
+		for (uint32 x = 0; x < width; x++) {
+			line[x * 4 + 0] = TIFFGetR(pixels[x]);
+			line[x * 4 + 1] = TIFFGetG(pixels[x]);
+			line[x * 4 + 2] = TIFFGetB(pixels[x]);
+			line[x * 4 + 3] = TIFFGetA(pixels[x]);
+		}
+
+		result = handler(&row, context);
+	}
+
+	MemoryFree(this->memory(), raster);
+	MemoryFree(this->memory(), line);
+
+	// Back on the first page so width() and friends describe it again
+	if (reduced) {
+		TIFFSetDirectory(this->_tiff, 0);
+		this->borrowMetadataBlocks();
+	}
+
 	return result;
 }
 
 int Tiff::unload() {
-	TIFFClose(this->_tiff);
+	this->releaseMetadataBlocks();
+	if (this->_tiff) TIFFClose(this->_tiff);
+	this->_tiff = NULL;
 	return 0;
 }
 
@@ -92,12 +664,17 @@ int Tiff::compileMetadata(Dictionary<String, String> * metadata) {
 	metadata->setValueForKey("Height", buf);
 	sprintf(buf, "%d", this->bitsPerComponent());
 	metadata->setValueForKey("Bits per component", buf);
+	metadata->setValueForKey("Color space", this->colorspaceString());
+	sprintf(buf, "%d", this->frameCount());
+	metadata->setValueForKey("Page Count", buf);
 	sprintf(buf, "%04x", this->_version);
 	metadata->setValueForKey("Version", buf);
 	sprintf(buf, "%04x", this->_magNum);
 	metadata->setValueForKey("Magic Number", buf);
 
-	
+	if (result == 0) {
+		result = this->compileEmbeddedMetadata(metadata);
+	}
 
 	return result;
 }
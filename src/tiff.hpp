@@ -23,6 +23,9 @@ PUBLIC:
 	ImagineColorSpace colorspace();
 	int load();
 	int unload();
+	int probe();
+	int decodeRows(ImagineRowHandler handler, void * context);
+	int frameCount();
 	int compileMetadata(BF::Dictionary<BF::String, BF::String> * metadata);
 	ImageType type();
 	const char * description();
@@ -32,6 +35,16 @@ PUBLIC:
 
 PRIVATE:
 
+	/**
+	 * Opens our path with libtiff, which also takes standard input
+	 */
+	TIFF * openTIFF();
+
+	/**
+	 * Points the XMP block at the current directory's packet
+	 */
+	void borrowMetadataBlocks();
+
 	/**
 	 * Holds the tiff object
 	 */
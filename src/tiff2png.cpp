@@ -4,6 +4,11 @@
  */
 
 #include "tiff.hpp"
+#include "reduce.hpp"
+#include "tiff2png.hpp"
+#include "trace.hpp"
+#include "counters.hpp"
+#include "memory.hpp"
 #include <fcntl.h>
 #include <unistd.h>
 #include <bflibcpp/bflibcpp.hpp>
@@ -13,18 +18,25 @@ extern "C" {
 #include <tiff.h>
 }
 
-int tiff2png (TIFF * tif, const char *tiffname, char *pngname, int verbose, int force,
+int tiff2png (TIFF * tif, const char *tiffname, FILE * png, const char *pngname, int verbose, int force,
               int interlace_type, int png_compression_level, int invert,
               int faxpect_option,
-              double gamma);
+              double gamma, MemoryAccount * account);
 
 int Tiff::toPNG() {
+	int result = 0;
 	char filename[PATH_MAX];
-	
-	strcpy(filename, this->conversionOutputPath());
-	sprintf(filename, "%s/%s.png", filename, this->name());
+	FILE * file = NULL;
+
+	if ((file = this->openConversionOutput(kImageTypePNG, filename, sizeof(filename))) == NULL) {
+		BFErrorPrint("Could not open file %s", filename);
+		return 1;
+	}
+
+	result = tiff2png(this->_tiff, this->path(), file, filename, 0, 0, PNG_INTERLACE_NONE, -1, 0, 0, -1, this->memory());
+	fclose(file);
 
-	return tiff2png(this->_tiff, this->path(), filename, 0, 0, PNG_INTERLACE_NONE, -1, 0, 0, -1);
+	return result;
 }
 
 /// These are sources I got from tiff2png
@@ -51,58 +63,12 @@ int Tiff::toPNG() {
 
 #define DIR_SEP '/'		/* SJT: Unix-specific */
 
-typedef unsigned char  uch;
-typedef unsigned short ush;
-typedef unsigned long  ulg;
-
 typedef struct _jmpbuf_wrapper {
   jmp_buf jmpbuf;
 } jmpbuf_wrapper;
 
-static jmpbuf_wrapper tiff2png_jmpbuf_struct;
-
-
-/* macros to get and put bits out of the bytes */
-
-#define GET_LINE_SAMPLE \
-  { \
-    if (bitsleft == 0) \
-    { \
-      p_line++; \
-      bitsleft = 8; \
-    } \
-    bitsleft -= (bps >= 8) ? 8 : bps; \
-    sample = (*p_line >> bitsleft) & maxval; \
-    if (invert) \
-      sample = ~sample & maxval; \
-  }
-#define GET_STRIP_SAMPLE \
-  { \
-    if (getbitsleft == 0) \
-    { \
-      p_strip++; \
-      getbitsleft = 8; \
-    } \
-    getbitsleft -= (bps >= 8) ? 8 : bps; \
-    sample = (*p_strip >> getbitsleft) & maxval; \
-    if (invert) \
-      sample = ~sample & maxval; \
-  }
-#define PUT_LINE_SAMPLE \
-  { \
-    if (putbitsleft == 0) \
-    { \
-      p_line++; \
-      putbitsleft = 8; \
-    } \
-    putbitsleft -= (bps >= 8) ? 8 : bps; \
-    if (invert) \
-      sample = ~sample; \
-    *p_line |= ((sample & maxval) << putbitsleft); \
-  }
-
 void tiff2png_error_handler (png_structp png_ptr, png_const_charp msg) {
-	jmpbuf_wrapper  *jmpbuf_ptr;
+	jmpbuf_wrapper  *jmpbuf_ptr = (jmpbuf_wrapper *) png_get_error_ptr(png_ptr);
 	BFDLog("tiff2png:  fatal libpng error: %s\n", msg);
 	longjmp (jmpbuf_ptr->jmpbuf, 1);
 }
@@ -110,34 +76,42 @@ void tiff2png_error_handler (png_structp png_ptr, png_const_charp msg) {
 int tiff2png(
 	TIFF * tif,
 	const char * tiffname,
-	char * pngname,
+	FILE * png,
+	const char * pngname,
 	int verbose,
 	int force,
 	int interlace_type,
 	int png_compression_level,
 	int _invert,
 	int faxpect_option,
-	double gamma
+	double gamma,
+	MemoryAccount * account
 ) {
 	int result = 0;
+
+	/* per call so conversions can run on several threads */
+	jmpbuf_wrapper tiff2png_jmpbuf_struct;
 	ush bps, spp, planar;
 	ush photometric, tiff_compression_method;
 	int bigendian;
 	int maxval;
-	static int colors = 0;
-	static int halfcols = 0;
+	int colors = 0;
+	int halfcols = 0;
 	int cols, rows;
 	int row;
 	register int col;
-	static uch *tiffstrip = NULL;
-	uch *tiffline;
+	uch * volatile tiffstrip = NULL; /* volatile: freed after libpng longjmps */
+	uch *tiffline = NULL;
+
+	/* owns tiffline for strips. Tiled images point tiffline into tiffstrip */
+	uch * volatile tiffbuffer = NULL;
 
 	size_t stripsz;
-	static size_t tilesz = 0L;
-	uch *tifftile; /* FAP 20020610 - Add variables to support tiled images */
+	size_t tilesz = 0L;
+	uch * volatile tifftile = NULL; /* FAP 20020610 - Add variables to support tiled images */
 	ush tiled;
 	uint32 tile_width, tile_height;   /* typedef'd in tiff.h */
-	static int num_tilesX = 0;
+	int num_tilesX = 0;
 
 	register uch *p_strip, *p_line;
 	register uch sample;
@@ -154,25 +128,30 @@ int tiff2png(
 	int s16_max, s16_min;
 #endif
 
-	static FILE *png = NULL;				/* PNG */
 	png_struct *png_ptr;
 	png_info *info_ptr;
-	png_byte *pngline;
+	png_byte * volatile pngline = NULL;
 	png_byte *p_png;
 	png_color palette[MAXCOLORS];
-	static png_uint_32 width;
+	png_byte trans[MAXCOLORS];
+	png_uint_32 width = 0;
 	int bit_depth = 0;
 	int color_type = -1;
 	int tiff_color_type;
 	int pass;
-	static png_uint_32 res_x_half=0L, res_x=0L, res_y=0L;
-	static int unit_type = 0;
+	int passes = 1;
+	int stage;
+	int channels;
+	bool reducing;
+	ReduceInfo reduce;
+	png_uint_32 res_x_half=0L, res_x=0L, res_y=0L;
+	int unit_type = 0;
 
 	unsigned short *redcolormap;
 	unsigned short *greencolormap;
 	unsigned short *bluecolormap;
-	static int have_res = FALSE;
-	static int invert;
+	int have_res = FALSE;
+	int invert;
 	int faxpect;
 	long i, n;
 
@@ -187,19 +166,12 @@ int tiff2png(
 
 	invert = _invert;
 
-	if (result == 0) {
-		png = fopen (pngname, "wb");
-		if (png == NULL) {
-			BFDLog("tiff2png error:  PNG file %s cannot be created", pngname);
-			result = 1;
-		}
-	}
-
 	/* start PNG preparation */
 
 	if (result == 0) {
-		png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING,
-		&tiff2png_jmpbuf_struct, tiff2png_error_handler, NULL);
+		png_ptr = png_create_write_struct_2 (PNG_LIBPNG_VER_STRING,
+		&tiff2png_jmpbuf_struct, tiff2png_error_handler, NULL,
+		account, MemoryPNGAllocate, MemoryPNGFree);
 		if (!png_ptr) {
 			BFDLog("tiff2png error:  cannot allocate libpng main struct (%s)\n", pngname);
 			result = 4;
@@ -501,40 +473,14 @@ int tiff2png(
 			res_x = res_x_half;
 		}
 
-		/* put parameter info in png-chunks */
-
-		png_set_IHDR(png_ptr, info_ptr, width, rows, bit_depth, color_type,
-		interlace_type, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-		if (png_compression_level != -1)
-			png_set_compression_level(png_ptr, png_compression_level);
-
-		if (color_type == PNG_COLOR_TYPE_PALETTE) 
-			png_set_PLTE(png_ptr, info_ptr, palette, colors);
-
-		/* gAMA chunk */
-		if (gamma != -1.0) {
-			png_set_gAMA(png_ptr, info_ptr, gamma);
-		}
-
-		/* pHYs chunk */
-		if (have_res)
-			png_set_pHYs(png_ptr, info_ptr, res_x, res_y, unit_type);
-
-		png_write_info(png_ptr, info_ptr);
-		png_set_packing(png_ptr);
-
 		/* allocate space for one line (or row of tiles) of TIFF image */
 
-		tiffline = NULL;
-		tifftile = NULL;
-		tiffstrip = NULL;
-
 		if (!tiled) /* strip-based TIFF */ {
 			if (planar == 1) /* contiguous picture */
-				tiffline = (uch*) malloc(TIFFScanlineSize(tif));
+				tiffbuffer = (uch*) MemoryAllocate(account, TIFFScanlineSize(tif));
 			else /* separated planes */
-				tiffline = (uch*) malloc(TIFFScanlineSize(tif) * spp);
+				tiffbuffer = (uch*) MemoryAllocate(account, TIFFScanlineSize(tif) * spp);
+			tiffline = tiffbuffer;
 		} else {
 			/* FAP 20020610 - tiled support - allocate space for one "row" of tiles */
 
@@ -545,7 +491,7 @@ int tiff2png(
 
 			if (planar == 1) {
 				tilesz = TIFFTileSize(tif);
-				tifftile = (uch*) malloc(tilesz);
+				tifftile = (uch*) MemoryAllocate(account, tilesz);
 				if (tifftile == NULL) {
 					BFDLog(
 					"tiff2png error:  can't allocate memory for TIFF tile buffer (%s)\n",
@@ -553,7 +499,7 @@ int tiff2png(
 					result = 4;
 				} else {
 					stripsz = (tile_width*num_tilesX) * tile_height * spp;
-					tiffstrip = (uch*) malloc(stripsz);
+					tiffstrip = (uch*) MemoryAllocate(account, stripsz);
 					tiffline = tiffstrip; /* just set the line to the top of the strip.
 							 * we'll move it through below. */
 				}
@@ -571,19 +517,17 @@ int tiff2png(
 			BFDLog(
 			"tiff2png error:  can't allocate memory for TIFF scanline buffer (%s)\n",
 			tiffname);
-			if (tiled && planar == 1) free(tifftile);
 			result = 4;
 		}
 	}
 
 	if (result == 0) {
 		if (planar != 1) /* in case we must combine more planes into one */ {
-			tiffstrip = (uch*) malloc(TIFFScanlineSize(tif));
+			tiffstrip = (uch*) MemoryAllocate(account, TIFFScanlineSize(tif));
 			if (tiffstrip == NULL) {
 				BFDLog(
 				"tiff2png error:  can't allocate memory for TIFF strip buffer (%s)\n",
 				tiffname);
-				free(tiffline);
 				result = 4;
 			}
 		}
@@ -593,14 +537,11 @@ int tiff2png(
 	/* max: 3 color channels plus one alpha channel, 16 bit => 8 bytes/pixel */
 
 	if (result == 0) {
-		pngline = (uch *) malloc (cols * 8);
+		pngline = (uch *) MemoryAllocate(account, cols * 8);
 		if (pngline == NULL) {
 			BFDLog(
 			"tiff2png error:  can't allocate memory for PNG row buffer (%s)\n",
 			tiffname);
-			free(tiffline);
-			if (tiled && planar == 1) free(tifftile);
-			else if (planar != 1) free(tiffstrip);
 			result = 4;
 		}
 	}
@@ -613,357 +554,437 @@ int tiff2png(
 		s16_min = 65535;
 #endif
 
-		for (pass = 0 ; pass < png_set_interlace_handling (png_ptr) ; pass++) {
-			for (row = 0; row < rows; row++) {
-				if (result == 0) {
-					if (planar == 1) /* contiguous picture */ {
-						if (!tiled) {
-							if (TIFFReadScanline (tif, tiffline, row, 0) < 0) {
-								BFDLog("tiff2png error:  bad data read on line %d (%s)\n",
-								row, tiffname);
-								free(tiffline);
-								result = 1;
-							}
-						} else /* tiled */ {
-							int col, ok=1, r;
-							int tileno;
-							/* FAP 20020610 - Read in one row of tiles and hand out the data one
-									scanline at a time so the code below doesn't need
-									to change */
-							/* Is it time for a new strip? */
-							if ((row % tile_height) == 0) {
-								for (col = 0; ok && col < num_tilesX; col += 1) {
-									tileno = col+(row/tile_height)*num_tilesX;
-									/* read the tile into an RGB array */
-									if (!TIFFReadEncodedTile(tif, tileno, tifftile, tilesz)) {
-										ok = 0;
-										break;
-									}
+		// Whatever narrower layout we write has to be known before the
+		// header, so images that might have one are read twice. The first
+		// read stops as soon as the layout is settled
+		switch (color_type) {
+			case PNG_COLOR_TYPE_GRAY: channels = 1; break;
+			case PNG_COLOR_TYPE_GRAY_ALPHA: channels = 2; break;
+			case PNG_COLOR_TYPE_RGB: channels = 3; break;
+			case PNG_COLOR_TYPE_RGB_ALPHA: channels = 4; break;
+			default: channels = 0; break;
+		}
 
-									/* copy this tile into the row buffer */
-									for (r = 0; r < (int) tile_height; r++) {
-										void* dest;
-										void* src;
+		reducing = !faxpect && (channels == spp) && ((bit_depth == 8) || (bit_depth == 16))
+			&& (ReduceBegin(&reduce, channels, bit_depth, true) == 0) && ReducePending(&reduce);
 
-										dest = tiffstrip + (r * tile_width * num_tilesX * spp)
-													 + (col * tile_width * spp);
-										src  = tifftile + (r * tile_width * spp);
-										memcpy(dest, src, (tile_width * spp));
-									}
+		for (stage = reducing ? 0 : 1; (result == 0) && (stage < 2); stage++) {
+			if (stage == 1) {
+				if (reducing) {
+					ReduceFinish(&reduce);
+					reducing = reduce.reduced;
+				}
+
+				if (reducing && reduce.outputPalette) {
+					color_type = PNG_COLOR_TYPE_PALETTE;
+					colors = reduce.colors;
+					for (i = 0; i < colors; i++) {
+						palette[i].red = reduce.palette[i][0];
+						palette[i].green = reduce.palette[i][1];
+						palette[i].blue = reduce.palette[i][2];
+						trans[i] = reduce.palette[i][3];
+					}
+				} else if (reducing) {
+					const int types[] = {PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA};
+					color_type = types[reduce.outputChannels - 1];
+				}
+
+				if (reducing) bit_depth = reduce.outputBitDepth;
+
+				/* put parameter info in png-chunks */
+
+				png_set_IHDR(png_ptr, info_ptr, width, rows, bit_depth, color_type,
+				interlace_type, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+				if (png_compression_level != -1)
+					png_set_compression_level(png_ptr, png_compression_level);
+
+				if (color_type == PNG_COLOR_TYPE_PALETTE) 
+					png_set_PLTE(png_ptr, info_ptr, palette, colors);
+
+				if (reducing && reduce.transparent)
+					png_set_tRNS(png_ptr, info_ptr, trans, reduce.transparent, NULL);
+
+				/* gAMA chunk */
+				if (gamma != -1.0) {
+					png_set_gAMA(png_ptr, info_ptr, gamma);
+				}
+
+				/* pHYs chunk */
+				if (have_res)
+					png_set_pHYs(png_ptr, info_ptr, res_x, res_y, unit_type);
+
+				png_write_info(png_ptr, info_ptr);
+				png_set_packing(png_ptr);
+
+				passes = png_set_interlace_handling(png_ptr);
+			}
+
+			for (pass = 0 ; pass < passes ; pass++) {
+				for (row = 0; row < rows; row++) {
+					if (result == 0) {
+						CountersEnter(kCountersStageDecode);
+
+						if (planar == 1) /* contiguous picture */ {
+							if (!tiled) {
+								if (TIFFReadScanline (tif, tiffline, row, 0) < 0) {
+									BFDLog("tiff2png error:  bad data read on line %d (%s)\n",
+									row, tiffname);
+									result = 1;
 								}
-								tiffline = tiffstrip; /* set tileline to top of strip */
-							} else {
-								tiffline = tiffstrip + ((row % tile_height) * ((tile_width * num_tilesX) * spp));
-							}
-						} /* end if (tiled) */
-					} else /* separated planes, then combine more strips into one line */ {
-						ush s;
+							} else /* tiled */ {
+								int col, ok=1, r;
+								int tileno;
+								/* FAP 20020610 - Read in one row of tiles and hand out the data one
+										scanline at a time so the code below doesn't need
+										to change */
+								/* Is it time for a new strip? */
+								if ((row % tile_height) == 0) {
+									TraceScope scope("tile row", tiffname, row / tile_height);
+
+									for (col = 0; ok && col < num_tilesX; col += 1) {
+										tileno = col+(row/tile_height)*num_tilesX;
+										/* read the tile into an RGB array */
+										if (!TIFFReadEncodedTile(tif, tileno, tifftile, tilesz)) {
+											ok = 0;
+											break;
+										}
 
-						/* XXX:  this assumes strips; are separated-plane tiles possible? */
+										/* copy this tile into the row buffer */
+										for (r = 0; r < (int) tile_height; r++) {
+											void* dest;
+											void* src;
 
-						p_line = tiffline;
-						for (n = 0; n < (cols/8 * bps*spp); n++)
-							*p_line++ = '\0';
+											dest = tiffstrip + (r * tile_width * num_tilesX * spp)
+														 + (col * tile_width * spp);
+											src  = tifftile + (r * tile_width * spp);
+											memcpy(dest, src, (tile_width * spp));
+										}
+									}
+									tiffline = tiffstrip; /* set tileline to top of strip */
+								} else {
+									tiffline = tiffstrip + ((row % tile_height) * ((tile_width * num_tilesX) * spp));
+								}
+							} /* end if (tiled) */
+						} else /* separated planes, then combine more strips into one line */ {
+							ush s;
+
+							/* XXX:  this assumes strips; are separated-plane tiles possible? */
 
-						for (s = 0; s < spp; s++) {
-							p_strip = tiffstrip;
-							getbitsleft = 8;
 							p_line = tiffline;
-							putbitsleft = 8;
-
-							if (TIFFReadScanline(tif, tiffstrip, row, s) < 0) {
-								BFDLog("tiff2png error:  bad data read on line %d (%s)\n",
-								row, tiffname);
-								free(tiffline);
-								free(tiffstrip);
-								result = 1;
-							}
+							for (n = 0; n < (cols/8 * bps*spp); n++)
+								*p_line++ = '\0';
+
+							for (s = 0; s < spp; s++) {
+								p_strip = tiffstrip;
+								getbitsleft = 8;
+								p_line = tiffline;
+								putbitsleft = 8;
+
+								CountersEnter(kCountersStageDecode);
+
+								if (TIFFReadScanline(tif, tiffstrip, row, s) < 0) {
+									BFDLog("tiff2png error:  bad data read on line %d (%s)\n",
+									row, tiffname);
+									result = 1;
+								}
+
+								CountersEnter(kCountersStageConvert);
 
-							if (result == 0) {
-								p_strip = (uch *) tiffstrip;
-								sample = '\0';
-								for (i = 0 ; i < s ; i++)
-									PUT_LINE_SAMPLE
-								for (n = 0; n < cols; n++) {
-									GET_STRIP_SAMPLE
-									PUT_LINE_SAMPLE
+								if (result == 0) {
+									p_strip = (uch *) tiffstrip;
 									sample = '\0';
-									for (i = 0 ; i < (spp-1) ; i++)
+									for (i = 0 ; i < s ; i++)
 										PUT_LINE_SAMPLE
+									for (n = 0; n < cols; n++) {
+										GET_STRIP_SAMPLE
+										PUT_LINE_SAMPLE
+										sample = '\0';
+										for (i = 0 ; i < (spp-1) ; i++)
+											PUT_LINE_SAMPLE
+									}
 								}
-							}
-						} /* end for-loop (s) */
-					} /* end if (planar/contiguous) */
-				}
+							} /* end for-loop (s) */
+						} /* end if (planar/contiguous) */
+
+						CountersEnter(kCountersStageConvert);
+					}
 
-				if (result == 0) {
-					p_line = tiffline;
-					bitsleft = 8;
-					p_png = pngline;
-
-					/* convert from tiff-line to png-line */
-					switch (tiff_color_type) {
-					case PNG_COLOR_TYPE_GRAY:		/* we know spp == 1 */
-						for (col = cols; col > 0; --col) {
-							switch (bps) {
-							case 16:
+					if (result == 0) {
+						p_line = tiffline;
+						bitsleft = 8;
+						p_png = pngline;
+
+						/* convert from tiff-line to png-line */
+						switch (tiff_color_type) {
+						case PNG_COLOR_TYPE_GRAY:		/* we know spp == 1 */
+							for (col = cols; col > 0; --col) {
+								switch (bps) {
+								case 16:
 #ifdef INVERT_MINISWHITE
-								if (photometric == PHOTOMETRIC_MINISWHITE) {
-								if (bigendian) /* same as PNG order */ {
-									GET_LINE_SAMPLE
-									sample16 = sample;
-									sample16 <<= 8;
-									GET_LINE_SAMPLE
-									sample16 |= sample;
-								} else /* reverse of PNG */ {
-									GET_LINE_SAMPLE
-									sample16 = sample;
+									if (photometric == PHOTOMETRIC_MINISWHITE) {
+									if (bigendian) /* same as PNG order */ {
+										GET_LINE_SAMPLE
+										sample16 = sample;
+										sample16 <<= 8;
+										GET_LINE_SAMPLE
+										sample16 |= sample;
+									} else /* reverse of PNG */ {
+										GET_LINE_SAMPLE
+										sample16 = sample;
 #ifdef GRR_16BIT_DEBUG
-									if (msb_max < sample)
-										msb_max = sample;
-									if (msb_min > sample)
-										msb_min = sample;
+										if (msb_max < sample)
+											msb_max = sample;
+										if (msb_min > sample)
+											msb_min = sample;
 #endif
-									GET_LINE_SAMPLE
-									sample16 |= (((int)sample) << 8);
+										GET_LINE_SAMPLE
+										sample16 |= (((int)sample) << 8);
 #ifdef GRR_16BIT_DEBUG
-									if (lsb_max < sample)
-										lsb_max = sample;
-									if (lsb_min > sample)
-										lsb_min = sample;
+										if (lsb_max < sample)
+											lsb_max = sample;
+										if (lsb_min > sample)
+											lsb_min = sample;
 #endif
-								}
-								sample16 = maxval - sample16;
+									}
+									sample16 = maxval - sample16;
 #ifdef GRR_16BIT_DEBUG
-								if (s16_max < sample16)
-									s16_max = sample16;
-								if (s16_min > sample16)
-									s16_min = sample16;
+									if (s16_max < sample16)
+										s16_max = sample16;
+									if (s16_min > sample16)
+										s16_min = sample16;
 #endif
-								*p_png++ = (uch)((sample16 >> 8) & 0xff);
-								*p_png++ = (uch)(sample16 & 0xff);
-								} else /* not PHOTOMETRIC_MINISWHITE */
+									*p_png++ = (uch)((sample16 >> 8) & 0xff);
+									*p_png++ = (uch)(sample16 & 0xff);
+									} else /* not PHOTOMETRIC_MINISWHITE */
 #endif /* INVERT_MINISWHITE */
-								{
-								if (bigendian) {
-									GET_LINE_SAMPLE
-									*p_png++ = sample;
-									GET_LINE_SAMPLE
-									*p_png++ = sample;
-								} else {
-									GET_LINE_SAMPLE
-									p_png[1] = sample;
-									GET_LINE_SAMPLE
-									*p_png = sample;
-									p_png += 2;
-								}
-								} /* ? PHOTOMETRIC_MINISWHITE */
-								break;
+									{
+									if (bigendian) {
+										GET_LINE_SAMPLE
+										*p_png++ = sample;
+										GET_LINE_SAMPLE
+										*p_png++ = sample;
+									} else {
+										GET_LINE_SAMPLE
+										p_png[1] = sample;
+										GET_LINE_SAMPLE
+										*p_png = sample;
+										p_png += 2;
+									}
+									} /* ? PHOTOMETRIC_MINISWHITE */
+									break;
 
-							case 8:
-							case 4:
-							case 2:
-							case 1:
-								GET_LINE_SAMPLE
+								case 8:
+								case 4:
+								case 2:
+								case 1:
+									GET_LINE_SAMPLE
 #ifdef INVERT_MINISWHITE
-								if (photometric == PHOTOMETRIC_MINISWHITE)
-								sample = maxval - sample;
+									if (photometric == PHOTOMETRIC_MINISWHITE)
+									sample = maxval - sample;
 #endif
-								*p_png++ = sample;
-								break;
+									*p_png++ = sample;
+									break;
 
-							} /* end switch (bps) */
-						}
+								} /* end switch (bps) */
+							}
 
-						/* note that this actually converts 1-bit grayscale to 2-bit indexed
-						* data, where 0 = black, 1 = half-gray (127), and 2 = white */
-						if (faxpect) {
-							png_byte *p_png2;
+							/* note that this actually converts 1-bit grayscale to 2-bit indexed
+							* data, where 0 = black, 1 = half-gray (127), and 2 = white */
+							if (faxpect) {
+								png_byte *p_png2;
 
-							p_png = pngline;
-							p_png2 = pngline;
-							for (col = halfcols; col > 0; --col) {
-								*p_png++ = p_png2[0] + p_png2[1];
-								p_png2 += 2;
+								p_png = pngline;
+								p_png2 = pngline;
+								for (col = halfcols; col > 0; --col) {
+									*p_png++ = p_png2[0] + p_png2[1];
+									p_png2 += 2;
+								}
 							}
-						}
-						break;
+							break;
 
-					case PNG_COLOR_TYPE_GRAY_ALPHA:
-						for (col = 0; col < cols; col++) {
-							for (i = 0 ; i < spp ; i++) {
-								switch (bps) {
-								case 16:
+						case PNG_COLOR_TYPE_GRAY_ALPHA:
+							for (col = 0; col < cols; col++) {
+								for (i = 0 ; i < spp ; i++) {
+									switch (bps) {
+									case 16:
 #ifdef INVERT_MINISWHITE	/* GRR 20000122:  XXX 16-bit case not tested */
-									if (photometric == PHOTOMETRIC_MINISWHITE && i == 0) {
-										if (bigendian) {
-											GET_LINE_SAMPLE
-											sample16 = (sample << 8);
-											GET_LINE_SAMPLE
-											sample16 |= sample;
-										} else {
-											GET_LINE_SAMPLE
-											sample16 = sample;
-											GET_LINE_SAMPLE
-											sample16 |= (((int)sample) << 8);
-										}
-										sample16 = maxval - sample16;
-										*p_png++ = (uch)((sample16 >> 8) & 0xff);
-										*p_png++ = (uch)(sample16 & 0xff);
-									} else
+										if (photometric == PHOTOMETRIC_MINISWHITE && i == 0) {
+											if (bigendian) {
+												GET_LINE_SAMPLE
+												sample16 = (sample << 8);
+												GET_LINE_SAMPLE
+												sample16 |= sample;
+											} else {
+												GET_LINE_SAMPLE
+												sample16 = sample;
+												GET_LINE_SAMPLE
+												sample16 |= (((int)sample) << 8);
+											}
+											sample16 = maxval - sample16;
+											*p_png++ = (uch)((sample16 >> 8) & 0xff);
+											*p_png++ = (uch)(sample16 & 0xff);
+										} else
 #endif
-									{
-										if (bigendian) {
-											GET_LINE_SAMPLE
-											*p_png++ = sample;
-											GET_LINE_SAMPLE
-											*p_png++ = sample;
-										} else {
-										  GET_LINE_SAMPLE
-										  p_png[1] = sample;
-										  GET_LINE_SAMPLE
-										  *p_png = sample;
-										  p_png += 2;
+										{
+											if (bigendian) {
+												GET_LINE_SAMPLE
+												*p_png++ = sample;
+												GET_LINE_SAMPLE
+												*p_png++ = sample;
+											} else {
+											  GET_LINE_SAMPLE
+											  p_png[1] = sample;
+											  GET_LINE_SAMPLE
+											  *p_png = sample;
+											  p_png += 2;
+											}
 										}
-									}
-									break;
+										break;
 
-								case 8:
-									GET_LINE_SAMPLE
+									case 8:
+										GET_LINE_SAMPLE
 #ifdef INVERT_MINISWHITE
-									if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
-									sample = maxval - sample;
+										if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
+										sample = maxval - sample;
 #endif
-									*p_png++ = sample;
-									break;
+										*p_png++ = sample;
+										break;
 
-								case 4:
-									GET_LINE_SAMPLE
+									case 4:
+										GET_LINE_SAMPLE
 #ifdef INVERT_MINISWHITE
-									if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
-										sample = maxval - sample;
+										if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
+											sample = maxval - sample;
 #endif
-									*p_png++ = sample * 17;	/* was 16 */
-									break;
+										*p_png++ = sample * 17;	/* was 16 */
+										break;
 
-								case 2:
-									GET_LINE_SAMPLE
+									case 2:
+										GET_LINE_SAMPLE
 #ifdef INVERT_MINISWHITE
-									if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
-										sample = maxval - sample;
+										if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
+											sample = maxval - sample;
 #endif
-									*p_png++ = sample * 85;	/* was 64 */
-									break;
+										*p_png++ = sample * 85;	/* was 64 */
+										break;
 
-								case 1:
-									GET_LINE_SAMPLE
+									case 1:
+										GET_LINE_SAMPLE
 #ifdef INVERT_MINISWHITE
-									if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
-										sample = maxval - sample;
+										if (photometric == PHOTOMETRIC_MINISWHITE && i == 0)
+											sample = maxval - sample;
 #endif
-									*p_png++ = sample * 255;	/* was 128...oops */
-									break;
+										*p_png++ = sample * 255;	/* was 128...oops */
+										break;
 
-								} /* end switch */
+									} /* end switch */
+								}
 							}
-						}
-						break;
+							break;
+
+						case PNG_COLOR_TYPE_RGB:
+						case PNG_COLOR_TYPE_RGB_ALPHA:
+							for (col = 0; col < cols; col++) {
+								/* process for red, green and blue (and when applicable alpha) */
+								for (i = 0 ; i < spp ; i++) {
+									switch (bps) {
+									case 16:
+										/* XXX:  do we need INVERT_MINISWHITE support here, too, or
+										*       is that only for grayscale? */
+										if (bigendian) {
+											GET_LINE_SAMPLE
+											*p_png++ = sample;
+											GET_LINE_SAMPLE
+											*p_png++ = sample;
+										} else {
+											GET_LINE_SAMPLE
+											p_png[1] = sample;
+											GET_LINE_SAMPLE
+											*p_png = sample;
+											p_png += 2;
+										}
+									break;
 
-					case PNG_COLOR_TYPE_RGB:
-					case PNG_COLOR_TYPE_RGB_ALPHA:
-						for (col = 0; col < cols; col++) {
-							/* process for red, green and blue (and when applicable alpha) */
-							for (i = 0 ; i < spp ; i++) {
-								switch (bps) {
-								case 16:
-									/* XXX:  do we need INVERT_MINISWHITE support here, too, or
-									*       is that only for grayscale? */
-									if (bigendian) {
-										GET_LINE_SAMPLE
-										*p_png++ = sample;
+									case 8:
 										GET_LINE_SAMPLE
 										*p_png++ = sample;
-									} else {
-										GET_LINE_SAMPLE
-										p_png[1] = sample;
-										GET_LINE_SAMPLE
-										*p_png = sample;
-										p_png += 2;
-									}
-								break;
-
-								case 8:
-									GET_LINE_SAMPLE
-									*p_png++ = sample;
-									break;
+										break;
 
-								/* XXX:  how common are these three cases? */
+									/* XXX:  how common are these three cases? */
 
-								case 4:
-									GET_LINE_SAMPLE
-									*p_png++ = sample * 17;	/* was 16 */
-									break;
+									case 4:
+										GET_LINE_SAMPLE
+										*p_png++ = sample * 17;	/* was 16 */
+										break;
 
-								case 2:
-									GET_LINE_SAMPLE
-									*p_png++ = sample * 85;	/* was 64 */
-									break;
+									case 2:
+										GET_LINE_SAMPLE
+										*p_png++ = sample * 85;	/* was 64 */
+										break;
 
-								case 1:
-									GET_LINE_SAMPLE
-									*p_png++ = sample * 255;	/* was 128 */
-									break;
+									case 1:
+										GET_LINE_SAMPLE
+										*p_png++ = sample * 255;	/* was 128 */
+										break;
 
-								} /* end switch */
+									} /* end switch */
+								}
 							}
-						}
-						break;
+							break;
 
-					case PNG_COLOR_TYPE_PALETTE:
-						for (col = 0; col < cols; col++) {
-							GET_LINE_SAMPLE
-							*p_png++ = sample;
-						}
-						break;
+						case PNG_COLOR_TYPE_PALETTE:
+							for (col = 0; col < cols; col++) {
+								GET_LINE_SAMPLE
+								*p_png++ = sample;
+							}
+							break;
 
-					default:
-						BFDLog("tiff2png error:  unknown photometric (%d) (%s)\n",
-						photometric, tiffname);
-						free(tiffline);
-						if (tiled && planar == 1)
-							free(tifftile);
-						else if (planar != 1) free(tiffstrip);
-						result = 1;
-					} /* end switch (tiff_color_type) */
-				}
+						default:
+							BFDLog("tiff2png error:  unknown photometric (%d) (%s)\n",
+							photometric, tiffname);
+							result = 1;
+						} /* end switch (tiff_color_type) */
+					}
 
-				if (result == 0) {
+					if (result == 0) {
+						if (stage == 0) {
+							// The rest of the rows can wait for the real pass once
+							// they cannot change the layout
+							if (!ReduceAddRow(&reduce, pngline, cols)) break;
+						} else {
 #ifdef GRR_16BIT_DEBUG
-					if (bps == 16 && row == 0) {
-						BFDLog("DEBUG:  hex contents of first row sent to libpng:\n");
-						p_png = pngline;
-						for (col = cols; col > 0; --col, p_png += 2)
-							BFDLog("   %02x %02x", p_png[0], p_png[1]);
-						BFDLog("\n");
-						BFDLog("DEBUG:  end of first row sent to libpng\n");
-					}
+							if (bps == 16 && row == 0) {
+								BFDLog("DEBUG:  hex contents of first row sent to libpng:\n");
+								p_png = pngline;
+								for (col = cols; col > 0; --col, p_png += 2)
+									BFDLog("   %02x %02x", p_png[0], p_png[1]);
+								BFDLog("\n");
+								BFDLog("DEBUG:  end of first row sent to libpng\n");
+							}
 #endif
-					png_write_row(png_ptr, pngline);
+							if (reducing) ReduceRow(&reduce, pngline, cols, pngline);
+
+							CountersEnter(kCountersStageEncode);
+							png_write_row(png_ptr, pngline);
+						}
+					}
 				}
-			}
-		} /* end for-loop (row) */
-	} /* end for-loop (pass) */
+			} /* end for-loop (row) */
+		} /* end for-loop (pass) */
+	} /* end for-loop (stage) */
 
-	png_write_end(png_ptr, info_ptr);
-	fclose(png); // keep
+	// libpng errors jump back to the setjmp above, so ending the
+	// file after one would only jump there again
+	CountersEnter(kCountersStageEncode);
+	if (result == 0) png_write_end(png_ptr, info_ptr);
 
 	png_destroy_write_struct(&png_ptr, &info_ptr);
 
-	free(tiffline);
-	if (tiled && planar == 1)
-		free(tifftile);
-	else if (planar != 1)
-		free(tiffstrip);
+	MemoryFree(account, tiffbuffer);
+	MemoryFree(account, tifftile);
+	MemoryFree(account, tiffstrip);
+	MemoryFree(account, pngline);
 
 #ifdef GRR_16BIT_DEBUG
 	if (bps == 16) {
@@ -8,5 +8,53 @@
 
 // Sources in tiff2png.cpp comes from https://github.com/rillian/tiff2png
 
+typedef unsigned char  uch;
+typedef unsigned short ush;
+typedef unsigned long  ulg;
+
+/**
+ * Macros to get and put `bps` bit samples out of the bytes
+ *
+ * They work on the caller's locals: `p_line`/`p_strip` walk the bytes,
+ * `bitsleft`/`getbitsleft`/`putbitsleft` count the bits left in the
+ * current one, and `sample`, `maxval` and `invert` hold the sample
+ */
+#define GET_LINE_SAMPLE \
+  { \
+    if (bitsleft == 0) \
+    { \
+      p_line++; \
+      bitsleft = 8; \
+    } \
+    bitsleft -= (bps >= 8) ? 8 : bps; \
+    sample = (*p_line >> bitsleft) & maxval; \
+    if (invert) \
+      sample = ~sample & maxval; \
+  }
+#define GET_STRIP_SAMPLE \
+  { \
+    if (getbitsleft == 0) \
+    { \
+      p_strip++; \
+      getbitsleft = 8; \
+    } \
+    getbitsleft -= (bps >= 8) ? 8 : bps; \
+    sample = (*p_strip >> getbitsleft) & maxval; \
+    if (invert) \
+      sample = ~sample & maxval; \
+  }
+#define PUT_LINE_SAMPLE \
+  { \
+    if (putbitsleft == 0) \
+    { \
+      p_line++; \
+      putbitsleft = 8; \
+    } \
+    putbitsleft -= (bps >= 8) ? 8 : bps; \
+    if (invert) \
+      sample = ~sample; \
+    *p_line |= ((sample & maxval) << putbitsleft); \
+  }
+
 #endif // TIFF2PNG_HPP
 
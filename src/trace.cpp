@@ -0,0 +1,238 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "trace.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+#include <atomic>
+
+extern "C" {
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+}
+
+/// Bytes of a span's detail we keep. Long paths keep their end
+#define TRACE_DETAIL_SIZE 40
+
+typedef struct {
+	const char * name;
+	uint64_t start;
+	uint64_t duration;
+	long index;
+	char detail[TRACE_DETAIL_SIZE];
+} TraceEvent;
+
+/**
+ * One per thread that recorded a span. They are never freed before the
+ * trace is written so threads can exit while tracing
+ */
+typedef struct TraceBuffer {
+	long tid;
+	char name[32];
+
+	/// Spans ever recorded. Only the last TRACE_BUFFER_EVENTS are kept
+	uint64_t count;
+	TraceEvent * events;
+
+	struct TraceBuffer * next;
+} TraceBuffer;
+
+static std::atomic<bool> TRACE_ENABLED(false);
+static char TRACE_PATH[PATH_MAX];
+static uint64_t TRACE_EPOCH = 0;
+
+/// Guards TRACE_BUFFERS, which is only touched when a thread records its first span
+static pthread_mutex_t TRACE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer * TRACE_BUFFERS = NULL;
+
+static thread_local TraceBuffer * TRACE_THREAD_BUFFER = NULL;
+
+static uint64_t TraceNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * The calling thread's buffer, created on first use. NULL if we are out
+ * of memory, in which case the thread's spans are dropped
+ */
+static TraceBuffer * TraceThreadBuffer() {
+	TraceBuffer * buffer = TRACE_THREAD_BUFFER;
+
+	if (buffer) return buffer;
+
+	if ((buffer = (TraceBuffer *) calloc(1, sizeof(TraceBuffer))) == NULL) {
+		return NULL;
+	} else if ((buffer->events = (TraceEvent *) malloc(sizeof(TraceEvent) * TRACE_BUFFER_EVENTS)) == NULL) {
+		free(buffer);
+		return NULL;
+	}
+
+	buffer->tid = syscall(SYS_gettid);
+	snprintf(buffer->name, sizeof(buffer->name), buffer->tid == getpid() ? "main" : "thread %ld", buffer->tid);
+
+	pthread_mutex_lock(&TRACE_LOCK);
+	buffer->next = TRACE_BUFFERS;
+	TRACE_BUFFERS = buffer;
+	pthread_mutex_unlock(&TRACE_LOCK);
+
+	return TRACE_THREAD_BUFFER = buffer;
+}
+
+int TraceStart(const char * path) {
+	FILE * file = NULL;
+
+	if (!path || !path[0]) {
+		return 1;
+	} else if (strlen(path) >= sizeof(TRACE_PATH)) {
+		BFErrorPrint("Trace path is too long");
+		return 2;
+	} else if (TRACE_ENABLED) {
+		return 0;
+	}
+
+	// Finding out the file can't be written after all the work is done
+	// would be a waste
+	if ((file = fopen(path, "w")) == NULL) {
+		BFErrorPrint("Could not open trace file %s", path);
+		return 3;
+	}
+
+	fclose(file);
+	strcpy(TRACE_PATH, path);
+	TRACE_EPOCH = TraceNow();
+	TRACE_ENABLED = true;
+	atexit(TraceFlush);
+
+	return 0;
+}
+
+bool TraceEnabled() {
+	return TRACE_ENABLED.load(std::memory_order_relaxed);
+}
+
+void TraceNameThread(const char * name) {
+	TraceBuffer * buffer = NULL;
+
+	if (TraceEnabled() && name && ((buffer = TraceThreadBuffer()) != NULL)) {
+		snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+	}
+}
+
+/**
+ * Writes `string` as the inside of a JSON string
+ */
+static void TraceWriteString(FILE * file, const char * string) {
+	for (const unsigned char * c = (const unsigned char *) string; *c; c++) {
+		if ((*c == '"') || (*c == '\\')) fprintf(file, "\\%c", *c);
+		else if (*c < 0x20) fprintf(file, "\\u%04x", *c);
+		else fputc(*c, file);
+	}
+}
+
+void TraceFlush() {
+	FILE * file = NULL;
+	const long pid = getpid();
+	bool first = true;
+
+	if (!TRACE_ENABLED.exchange(false)) {
+		return;
+	} else if ((file = fopen(TRACE_PATH, "w")) == NULL) {
+		BFErrorPrint("Could not open trace file %s", TRACE_PATH);
+		return;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	pthread_mutex_lock(&TRACE_LOCK);
+	for (TraceBuffer * buffer = TRACE_BUFFERS; buffer; buffer = buffer->next) {
+		const uint64_t count = buffer->count < TRACE_BUFFER_EVENTS ? buffer->count : TRACE_BUFFER_EVENTS;
+
+		fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":\"",
+			first ? "" : ",", pid, buffer->tid);
+		TraceWriteString(file, buffer->name);
+		fprintf(file, "\"}}");
+		first = false;
+
+		// Oldest first
+		for (uint64_t i = buffer->count - count; i < buffer->count; i++) {
+			const TraceEvent * e = &buffer->events[i % TRACE_BUFFER_EVENTS];
+
+			fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"imagine\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+				e->name, pid, buffer->tid, (e->start - TRACE_EPOCH) / 1000.0, e->duration / 1000.0);
+
+			if (e->detail[0]) {
+				fprintf(file, "\"detail\":\"");
+				TraceWriteString(file, e->detail);
+				fprintf(file, "\"%s", e->index >= 0 ? "," : "");
+			}
+
+			if (e->index >= 0) fprintf(file, "\"index\":%ld", e->index);
+
+			fprintf(file, "}}");
+		}
+
+		if (buffer->count > count) {
+			BFErrorPrint("Trace dropped the first %lu spans of thread %ld", buffer->count - count, buffer->tid);
+		}
+	}
+
+	while (TRACE_BUFFERS) {
+		TraceBuffer * buffer = TRACE_BUFFERS;
+		TRACE_BUFFERS = buffer->next;
+		BFFree(buffer->events);
+		BFFree(buffer);
+	}
+
+	TRACE_THREAD_BUFFER = NULL;
+	pthread_mutex_unlock(&TRACE_LOCK);
+
+	fprintf(file, "\n]}\n");
+
+	if (fclose(file)) {
+		BFErrorPrint("Could not write trace file %s", TRACE_PATH);
+	}
+}
+
+TraceScope::TraceScope(const char * name, const char * detail, long index) {
+	this->_name = name;
+	this->_detail = detail;
+	this->_index = index;
+	this->_start = TraceEnabled() ? TraceNow() : 0;
+}
+
+TraceScope::~TraceScope() {
+	TraceBuffer * buffer = NULL;
+	TraceEvent * e = NULL;
+
+	if (!this->_start || !TraceEnabled() || ((buffer = TraceThreadBuffer()) == NULL)) {
+		return;
+	}
+
+	e = &buffer->events[buffer->count++ % TRACE_BUFFER_EVENTS];
+	e->name = this->_name;
+	e->start = this->_start;
+	e->duration = TraceNow() - this->_start;
+	e->index = this->_index;
+	e->detail[0] = '\0';
+
+	if (this->_detail) {
+		size_t length = strlen(this->_detail);
+		const char * tail = this->_detail;
+
+		if (length >= TRACE_DETAIL_SIZE) tail += length - (TRACE_DETAIL_SIZE - 1);
+
+		// Not starting inside a UTF-8 sequence
+		while ((*tail & 0xc0) == 0x80) tail++;
+		memcpy(e->detail, tail, strlen(tail) + 1);
+	}
+}
+
@@ -0,0 +1,60 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+extern "C" {
+#include <stdint.h>
+}
+
+/// Environment variable naming a trace file when --trace is not given
+#define TRACE_ENVIRONMENT_VARIABLE "IMAGINE_TRACE"
+
+/// Spans each thread keeps. Older ones are written over once it is full
+#define TRACE_BUFFER_EVENTS (1 << 15)
+
+/**
+ * Starts recording spans and writes them to `path` as Chrome trace event
+ * JSON (chrome://tracing, ui.perfetto.dev) when the process exits
+ *
+ * Call before any threads are started
+ */
+int TraceStart(const char * path);
+
+/**
+ * Writes every thread's spans to the trace file and stops recording.
+ * Registered with atexit() by TraceStart(), so threads must be done
+ */
+void TraceFlush();
+
+bool TraceEnabled();
+
+/**
+ * Name shown for the calling thread
+ */
+void TraceNameThread(const char * name);
+
+/**
+ * Records the time between its construction and destruction as a span
+ *
+ * `name` has to be a string literal. `detail` (usually a path) is read
+ * when the span ends and is kept in the args with `index`, if it is
+ * not negative. Costs a branch when tracing is off
+ */
+class TraceScope {
+public:
+	TraceScope(const char * name, const char * detail = 0, long index = -1);
+	~TraceScope();
+
+private:
+	const char * _name;
+	const char * _detail;
+	long _index;
+	uint64_t _start;
+};
+
+#endif // TRACE_HPP
+
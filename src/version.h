@@ -0,0 +1,16 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef IMAGINE_VERSION_H
+#define IMAGINE_VERSION_H
+
+/**
+ * Bump whenever an encoder's output can change. Cached conversions
+ * made by other versions are not reused
+ */
+#define IMAGINE_VERSION "0.3.0"
+
+#endif
+
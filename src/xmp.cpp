@@ -0,0 +1,286 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#include "xmp.hpp"
+#include <bflibcpp/bflibcpp.hpp>
+
+extern "C" {
+#include <string.h>
+#include <stdlib.h>
+}
+
+using namespace BF;
+
+const XMPProperty XMP_DEFAULT_PROPERTIES[] = {
+	{"exif:GPSLongitude", "Longitude"},
+	{"exif:GPSLatitude", "Latitude"},
+	{"exifEX:LensModel", "Lens Model"},
+	{"tiff:Make", "Make"},
+	{"tiff:Model", "Model"},
+	{"xmp:CreateDate", "Create Date"},
+	{"xmp:CreatorTool", "Creator Tool"},
+};
+
+const size_t XMP_DEFAULT_PROPERTIES_COUNT = sizeof(XMP_DEFAULT_PROPERTIES) / sizeof(XMPProperty);
+
+/// Most properties we can look for in one pass
+const size_t XMP_MAX_PROPERTIES = 64;
+
+/// Longer values are truncated
+const size_t XMP_MAX_VALUE_SIZE = 1024;
+
+static bool XMPIsSpace(char c) {
+	return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+/**
+ * Returns the first byte after `token` or end if it never shows up
+ */
+static const char * XMPSkipPast(const char * p, const char * end, const char * token) {
+	size_t size = strlen(token);
+
+	while ((p = (const char *) memchr(p, token[0], end - p)) != NULL) {
+		if (((size_t) (end - p) >= size) && !memcmp(p, token, size)) return p + size;
+		p++;
+	}
+
+	return end;
+}
+
+static bool XMPStartsWith(const char * p, const char * end, const char * token) {
+	size_t size = strlen(token);
+	return ((size_t) (end - p) >= size) && !memcmp(p, token, size);
+}
+
+/**
+ * Index of the property called [name, name + size) or -1
+ */
+static int XMPFindProperty(const XMPProperty * properties, size_t count, const char * name, size_t size) {
+	for (size_t i = 0; i < count; i++) {
+		if (!strncmp(properties[i].name, name, size) && (properties[i].name[size] == '\0')) {
+			return (int) i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Writes `code` to out as UTF-8. Returns the bytes written
+ */
+static size_t XMPEncodeUTF8(unsigned long code, char * out) {
+	if (code < 0x80) {
+		out[0] = code;
+		return 1;
+	} else if (code < 0x800) {
+		out[0] = 0xC0 | (code >> 6);
+		out[1] = 0x80 | (code & 0x3F);
+		return 2;
+	} else if (code < 0x10000) {
+		out[0] = 0xE0 | (code >> 12);
+		out[1] = 0x80 | ((code >> 6) & 0x3F);
+		out[2] = 0x80 | (code & 0x3F);
+		return 3;
+	} else if (code < 0x110000) {
+		out[0] = 0xF0 | (code >> 18);
+		out[1] = 0x80 | ((code >> 12) & 0x3F);
+		out[2] = 0x80 | ((code >> 6) & 0x3F);
+		out[3] = 0x80 | (code & 0x3F);
+		return 4;
+	}
+
+	return 0;
+}
+
+/**
+ * Adds [value, end) to metadata under key with leading and trailing
+ * whitespace trimmed and entities decoded
+ *
+ * This is the only copy made of anything in the packet
+ */
+static int XMPSetValue(const char * key, const char * value, const char * end, Dictionary<String, String> * metadata) {
+	char buf[XMP_MAX_VALUE_SIZE];
+	size_t size = 0;
+
+	while ((value < end) && XMPIsSpace(*value)) value++;
+	while ((end > value) && XMPIsSpace(end[-1])) end--;
+
+	// Leave room for the longest utf-8 sequence and the null
+	while ((value < end) && (size < sizeof(buf) - 5)) {
+		const char * semicolon = NULL;
+
+		if ((*value == '&') && ((semicolon = (const char *) memchr(value, ';', end - value)) != NULL)) {
+			const char * entity = value + 1;
+			size_t entitySize = semicolon - entity;
+
+			if ((entitySize == 3) && !memcmp(entity, "amp", 3)) buf[size++] = '&';
+			else if ((entitySize == 2) && !memcmp(entity, "lt", 2)) buf[size++] = '<';
+			else if ((entitySize == 2) && !memcmp(entity, "gt", 2)) buf[size++] = '>';
+			else if ((entitySize == 4) && !memcmp(entity, "quot", 4)) buf[size++] = '"';
+			else if ((entitySize == 4) && !memcmp(entity, "apos", 4)) buf[size++] = '\'';
+			else if ((entitySize > 1) && (entity[0] == '#')) {
+				char num[16] = {0};
+				char * numEnd = num;
+				bool hex = (entity[1] == 'x') || (entity[1] == 'X');
+				size_t digits = entitySize - (hex ? 2 : 1);
+				unsigned long code = 0;
+
+				if ((digits > 0) && (digits < sizeof(num))) {
+					memcpy(num, entity + (hex ? 2 : 1), digits);
+					code = strtoul(num, &numEnd, hex ? 16 : 10);
+				}
+
+				// &#; or &#x; would decode to a null and cut the value short,
+				// references without a usable number are kept as text
+				if (code && (*numEnd == '\0')) {
+					size += XMPEncodeUTF8(code, buf + size);
+				} else {
+					semicolon = NULL;
+				}
+			} else {
+				// Not an entity we know, keep it as is
+				semicolon = NULL;
+			}
+
+			if (semicolon) {
+				value = semicolon + 1;
+				continue;
+			}
+		}
+
+		buf[size++] = *value++;
+	}
+
+	buf[size] = '\0';
+
+	return metadata->setValueForKey(key, buf);
+}
+
+/**
+ * Finds the text of the element whose content starts at p
+ *
+ * Child elements are stepped over so the first item of an rdf:Seq,
+ * rdf:Bag or rdf:Alt is found. Gives up at the first closing tag,
+ * which is either ours (the element is empty) or a child's that had
+ * no text
+ */
+static const char * XMPElementText(const char * p, const char * end, const char ** textEnd) {
+	while (p < end) {
+		const char * lt = (const char *) memchr(p, '<', end - p);
+		const char * stop = lt ? lt : end;
+
+		for (const char * c = p; c < stop; c++) {
+			if (!XMPIsSpace(*c)) {
+				*textEnd = stop;
+				return c;
+			}
+		}
+
+		if (!lt || XMPStartsWith(lt, end, "</")) break;
+
+		p = XMPSkipPast(lt, end, ">");
+	}
+
+	return NULL;
+}
+
+int XMPExtract(
+	const char * packet,
+	size_t size,
+	const XMPProperty * properties,
+	size_t count,
+	Dictionary<String, String> * metadata
+) {
+	int result = 0;
+	const char * p = packet;
+	const char * end = packet + size;
+	bool found[XMP_MAX_PROPERTIES] = {0};
+	size_t remaining = count;
+
+	if (!packet || !properties || !metadata) return 1;
+	else if (count > XMP_MAX_PROPERTIES) return 2;
+
+	while (!result && remaining && (p < end)) {
+		if ((p = (const char *) memchr(p, '<', end - p)) == NULL) break;
+		p++;
+
+		// Nothing we want lives in these
+		if (XMPStartsWith(p, end, "?")) {
+			p = XMPSkipPast(p, end, "?>");
+			continue;
+		} else if (XMPStartsWith(p, end, "!--")) {
+			p = XMPSkipPast(p, end, "-->");
+			continue;
+		} else if (XMPStartsWith(p, end, "![CDATA[")) {
+			p = XMPSkipPast(p, end, "]]>");
+			continue;
+		} else if (XMPStartsWith(p, end, "!") || XMPStartsWith(p, end, "/")) {
+			p = XMPSkipPast(p, end, ">");
+			continue;
+		}
+
+		// Element name
+		const char * name = p;
+		while ((p < end) && !XMPIsSpace(*p) && (*p != '>') && (*p != '/')) p++;
+		int element = XMPFindProperty(properties, count, name, p - name);
+		bool selfClosing = false;
+
+		// Attributes
+		while (p < end) {
+			while ((p < end) && XMPIsSpace(*p)) p++;
+
+			if (p >= end) {
+				break;
+			} else if (*p == '>') {
+				p++;
+				break;
+			} else if (*p == '/') {
+				selfClosing = true;
+				p++;
+				continue;
+			}
+
+			const char * attr = p;
+			while ((p < end) && (*p != '=') && !XMPIsSpace(*p) && (*p != '>')) p++;
+			size_t attrSize = p - attr;
+
+			while ((p < end) && XMPIsSpace(*p)) p++;
+			if ((p >= end) || (*p != '=')) continue;
+			p++;
+			while ((p < end) && XMPIsSpace(*p)) p++;
+			if ((p >= end) || ((*p != '"') && (*p != '\''))) continue;
+
+			const char * value = p + 1;
+			const char * valueEnd = (const char *) memchr(value, *p, end - value);
+			if (!valueEnd) {
+				p = end;
+				break;
+			}
+
+			int i = XMPFindProperty(properties, count, attr, attrSize);
+			if ((i >= 0) && !found[i]) {
+				result = XMPSetValue(properties[i].key, value, valueEnd, metadata);
+				found[i] = true;
+				remaining--;
+			}
+
+			p = valueEnd + 1;
+		}
+
+		if (!result && (element >= 0) && !selfClosing && !found[element]) {
+			const char * textEnd = NULL;
+			const char * text = XMPElementText(p, end, &textEnd);
+
+			if (text) {
+				result = XMPSetValue(properties[element].key, text, textEnd, metadata);
+				found[element] = true;
+				remaining--;
+			}
+		}
+	}
+
+	return result;
+}
+
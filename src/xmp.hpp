@@ -0,0 +1,64 @@
+/**
+ * author: Brando
+ * date: 10/19/26
+ */
+
+#ifndef XMP_HPP
+#define XMP_HPP
+
+#include <bflibcpp/dictionary.hpp>
+#include <bflibcpp/string.hpp>
+
+extern "C" {
+#include <stddef.h>
+}
+
+/**
+ * Namespace header that starts a JPEG APP1 segment holding XMP.
+ * The packet follows the terminating null
+ */
+#define XMP_JPEG_APP1_SIGNATURE "http://ns.adobe.com/xap/1.0/"
+#define XMP_JPEG_APP1_SIGNATURE_SIZE (sizeof(XMP_JPEG_APP1_SIGNATURE))
+
+/// Keyword of the PNG iTXt chunk that holds XMP
+#define XMP_PNG_KEYWORD "XML:com.adobe.xmp"
+
+/**
+ * Maps a qualified XMP property name to the key we report it under
+ */
+typedef struct {
+	/// Prefixed name as it appears in the packet, e.g. "exif:GPSLatitude"
+	const char * name;
+
+	/// Key used in the metadata dictionary
+	const char * key;
+} XMPProperty;
+
+/**
+ * Properties compileMetadata() reports for every format
+ */
+extern const XMPProperty XMP_DEFAULT_PROPERTIES[];
+extern const size_t XMP_DEFAULT_PROPERTIES_COUNT;
+
+/**
+ * Finds `properties` in an XMP packet and adds them to metadata
+ *
+ * The packet is scanned in place. Nothing is written to it and no
+ * tree is built, so the cost is one pass over the bytes. Properties
+ * can be elements (<exif:GPSLatitude>..</exif:GPSLatitude>) or
+ * attributes on rdf:Description (exif:GPSLatitude=".."). For rdf:Seq,
+ * rdf:Bag and rdf:Alt values the first item is used. The first
+ * occurrence of each property wins.
+ *
+ * `packet` does not need to be null terminated
+ */
+int XMPExtract(
+	const char * packet,
+	size_t size,
+	const XMPProperty * properties,
+	size_t count,
+	BF::Dictionary<BF::String, BF::String> * metadata
+);
+
+#endif // XMP_HPP
+